@@ -0,0 +1,512 @@
+#include "batch.h"
+#include "memoization.h"
+#include "object.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "stack_evaluator.h"
+#include "statement.h"
+#include "type_inference.h"
+
+#include <algorithm>
+#include <iterator>
+#include <optional>
+#include <typeinfo>
+#include <unordered_map>
+
+namespace Ast {
+
+namespace
+{
+    using IType = Runtime::IObject::Type;
+    using Column = std::vector<ObjectHolder>;
+    using Lanes = std::vector<size_t>;
+
+    template <typename T>
+    bool Is(const Statement& st)
+    {
+        return typeid(st) == typeid(T);
+    }
+
+    template <typename... Ts>
+    bool IsAny(const Statement& st)
+    {
+        return (Is<Ts>(st) || ...);
+    }
+
+    // Nodes which compute the same values as their generic base
+    std::optional<ArithmeticOp> GetArithmeticOp(const Statement& st)
+    {
+        if (IsAny<Add, NumericAdd, StringConcat, GuardedAdd>(st))
+            return ArithmeticOp::Add;
+        if (IsAny<Sub, NumericSub>(st))
+            return ArithmeticOp::Sub;
+        if (IsAny<Mult, NumericMult>(st))
+            return ArithmeticOp::Mult;
+        if (IsAny<Div, NumericDiv>(st))
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    bool IsConstant(const Statement& st)
+    {
+        return IsAny<NumericConst, StringConst, BoolConst>(st);
+    }
+
+    bool IsComparison(const Statement& st)
+    {
+        return IsAny<Comparison, NumericComparison, StringComparison, GuardedComparison>(st);
+    }
+
+    const std::vector<std::string>* PathOf(Statement& st)
+    {
+        if (Is<VariableValue>(st))
+            return &static_cast<VariableValue&>(st).dotted_ids;
+        if (Is<CachedFieldRead>(st))
+            return &static_cast<CachedFieldRead&>(st).Variable().dotted_ids;
+        return nullptr;
+    }
+
+    // A name, or a field of self: nothing another receiver may write
+    bool IsLocalPath(const std::vector<std::string>& ids)
+    {
+        return ids.size() == 1 || (ids.size() == 2 && ids[0] == "self");
+    }
+
+    // Thrown when a receiver meets what the batch does not run
+    struct Diverged
+    {
+    };
+
+    // Where the body keeps its names: the parameters, the locals and the
+    // fields of self it assigns. Each has a column of values in the batch
+    struct Layout
+    {
+        std::unordered_map<std::string, size_t> locals;
+        std::unordered_map<std::string, size_t> fields;
+        std::vector<std::string> field_names;
+
+        void Local(const std::string& name)
+        {
+            locals.emplace(name, locals.size());
+        }
+
+        void Field(const std::string& name)
+        {
+            if (fields.emplace(name, fields.size()).second)
+                field_names.push_back(name);
+        }
+    };
+
+    // True for the nodes the batch runs, the rest may call user code, print or
+    // reach objects other receivers write. Collects the names on the way
+    bool Scan(Statement& st, Layout& layout)
+    {
+        if (IsConstant(st) || Is<None>(st))
+            return true;
+        if (auto path = PathOf(st))
+        {
+            if (path->size() == 1 && path->front() != "self")
+                layout.Local(path->front());
+            return IsLocalPath(*path);
+        }
+        if (Is<Assignment>(st))
+        {
+            auto& p = static_cast<Assignment&>(st);
+            layout.Local(p.var);
+            return p.var != "self" && Scan(*p.rv, layout);
+        }
+        if (Is<FieldAssignment>(st))
+        {
+            auto& p = static_cast<FieldAssignment&>(st);
+            layout.Field(p.field_name);
+            return p.object.dotted_ids == std::vector<std::string>{"self"} && Scan(*p.right_value, layout);
+        }
+        if (GetArithmeticOp(st) || IsAny<Or, BoolOr, And, BoolAnd>(st))
+        {
+            auto& p = static_cast<BinaryOperation&>(st);
+            return Scan(*p.Lhs(), layout) && Scan(*p.Rhs(), layout);
+        }
+        if (IsComparison(st))
+        {
+            auto& p = static_cast<Comparison&>(st);
+            return Scan(*p.Lhs(), layout) && Scan(*p.Rhs(), layout);
+        }
+        if (IsAny<Negate, NumericNegate, Not, BoolNot, Stringify>(st))
+            return Scan(*static_cast<UnaryOperation&>(st).Argument(), layout);
+        if (Is<Compound>(st))
+        {
+            auto& statements = static_cast<Compound&>(st).Statements();
+            return std::all_of(statements.begin(), statements.end(), [&layout](auto& statement) {
+                return Scan(*statement, layout);
+            });
+        }
+        if (Is<Return>(st))
+            return Scan(*static_cast<Return&>(st).Value(), layout);
+        if (IsAny<IfElse, TypedIfElse>(st))
+        {
+            auto& p = static_cast<IfElse&>(st);
+            return p.Condition() && p.IfBody() && Scan(*p.Condition(), layout) && Scan(*p.IfBody(), layout)
+                && (!p.ElseBody() || Scan(*p.ElseBody(), layout));
+        }
+        return false;
+    }
+
+    // Operands the batch computes with: anything else calls user code or fails
+    const ObjectHolder& Plain(const ObjectHolder& value)
+    {
+        if (!value || value.GetType() == IType::Instance)
+            throw Diverged();
+        return value;
+    }
+
+    // Receivers run together, few enough for their columns to stay in cache
+    constexpr size_t CHUNK = 256;
+
+    // The values of a name for every receiver of a chunk, and whether it is set
+    struct Slots
+    {
+        std::vector<ObjectHolder> values;
+        std::vector<char> set;
+
+        Slots(size_t names, size_t lanes)
+            : values(names * lanes), set(names * lanes)
+        {
+        }
+    };
+
+    // Runs the body over a chunk of receivers. The fields are read as they
+    // were when the chunk started, as from the copy ClassInstance::Invoke
+    // makes for the body; the assigned ones are kept in slots until Commit
+    class Batch
+    {
+    public:
+        Batch(const Layout& layout, const ObjectHolder* receivers, size_t size, BatchStats* stats)
+            : layout(layout), receivers(receivers), size(size), stats(stats),
+              locals(layout.locals.size(), size), fields(layout.fields.size(), size), results(size)
+        {
+        }
+
+        void SetLocal(const std::string& name, const ObjectHolder& value)
+        {
+            size_t base = layout.locals.at(name) * size;
+            for (size_t lane = 0; lane < size; ++lane)
+            {
+                locals.values[base + lane] = value;
+                locals.set[base + lane] = 1;
+            }
+        }
+
+        // Runs the statement for the lanes, those which return leave them
+        void Execute(Statement& st, Lanes& active)
+        {
+            if (Is<Compound>(st))
+            {
+                for (auto& statement : static_cast<Compound&>(st).Statements())
+                {
+                    if (active.empty())
+                        return;
+                    Execute(*statement, active);
+                }
+            }
+            else if (IsAny<IfElse, TypedIfElse>(st))
+            {
+                auto& p = static_cast<IfElse&>(st);
+                auto condition = Evaluate(*p.Condition(), active);
+                Lanes taken, other;
+                for (size_t i = 0; i < active.size(); ++i)
+                    (Plain(condition[i])->IsTrue() ? taken : other).push_back(active[i]);
+                if (!taken.empty() && !other.empty() && stats)
+                    ++stats->divergent_branches;
+
+                if (!taken.empty())
+                    Execute(*p.IfBody(), taken);
+                if (!other.empty() && p.ElseBody())
+                    Execute(*p.ElseBody(), other);
+                taken.insert(taken.end(), other.begin(), other.end());
+                std::sort(taken.begin(), taken.end());
+                active = std::move(taken);
+            }
+            else if (Is<Return>(st))
+            {
+                auto values = Evaluate(*static_cast<Return&>(st).Value(), active);
+                for (size_t i = 0; i < active.size(); ++i)
+                    results[active[i]] = std::move(values[i]);
+                active.clear();
+            }
+            else if (Is<Assignment>(st))
+            {
+                auto& p = static_cast<Assignment&>(st);
+                Store(locals, layout.locals.at(p.var), Evaluate(*p.rv, active), active);
+            }
+            else if (Is<FieldAssignment>(st))
+            {
+                auto& p = static_cast<FieldAssignment&>(st);
+                Store(fields, layout.fields.at(p.field_name), Evaluate(*p.right_value, active), active);
+            }
+            else
+            {
+                Evaluate(st, active);
+            }
+        }
+
+        Column Evaluate(Statement& st, const Lanes& active)
+        {
+            Column res;
+            res.reserve(active.size());
+
+            if (IsConstant(st))
+            {
+                Runtime::Closure unused;
+                res.assign(active.size(), st.Execute(unused));
+            }
+            else if (Is<None>(st))
+            {
+                res.resize(active.size());
+            }
+            else if (auto path = PathOf(st))
+            {
+                Read(*path, active, res);
+            }
+            else if (auto op = GetArithmeticOp(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                auto left = Evaluate(*p.Lhs(), active), right = Evaluate(*p.Rhs(), active);
+                for (size_t i = 0; i < active.size(); ++i)
+                    res.push_back(CallOperator(Plain(left[i]), Plain(right[i]), *op));
+            }
+            else if (IsAny<Or, BoolOr, And, BoolAnd>(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                bool is_or = IsAny<Or, BoolOr>(st);
+                auto left = Evaluate(*p.Lhs(), active), right = Evaluate(*p.Rhs(), active);
+                for (size_t i = 0; i < active.size(); ++i)
+                {
+                    bool lhs = Plain(left[i])->IsTrue(), rhs = Plain(right[i])->IsTrue();
+                    res.push_back(ObjectHolder::Own(Runtime::Bool(is_or ? lhs || rhs : lhs && rhs)));
+                }
+            }
+            else if (IsComparison(st))
+            {
+                auto& p = static_cast<Comparison&>(st);
+                auto left = Evaluate(*p.Lhs(), active), right = Evaluate(*p.Rhs(), active);
+                for (size_t i = 0; i < active.size(); ++i)
+                    res.push_back(ObjectHolder::Own(Runtime::Bool(p.GetComparator()(Plain(left[i]), Plain(right[i])))));
+            }
+            else if (IsAny<Negate, NumericNegate>(st))
+            {
+                for (auto& value : Evaluate(*static_cast<UnaryOperation&>(st).Argument(), active))
+                {
+                    if (auto number = Plain(value).TryAs<Runtime::Number>())
+                        res.push_back(ObjectHolder::Own(Runtime::Number(-number->GetValue())));
+                    else
+                        res.push_back(CallOperator(value, ObjectHolder::Own(Runtime::Number(-1)), ArithmeticOp::Mult));
+                }
+            }
+            else if (IsAny<Not, BoolNot>(st))
+            {
+                for (auto& value : Evaluate(*static_cast<UnaryOperation&>(st).Argument(), active))
+                    res.push_back(NotValue(Plain(value)));
+            }
+            else if (Is<Stringify>(st))
+            {
+                for (auto& value : Evaluate(*static_cast<UnaryOperation&>(st).Argument(), active))
+                    res.push_back(StringifyValue(Plain(value)));
+            }
+            else
+            {
+                throw Diverged();
+            }
+            return res;
+        }
+
+        // Writes the fields of every receiver, returns whether any was written
+        bool Commit()
+        {
+            bool touched = false;
+            for (size_t lane = 0; lane < size; ++lane)
+            {
+                auto receiver = receivers[lane];
+                auto& own = receiver.TryAs<Runtime::ClassInstance>()->Fields();
+                for (size_t slot = 0; slot < layout.field_names.size(); ++slot)
+                {
+                    if (fields.set[slot * size + lane])
+                    {
+                        own[layout.field_names[slot]] = std::move(fields.values[slot * size + lane]);
+                        touched = true;
+                    }
+                }
+            }
+            return touched;
+        }
+
+        std::vector<ObjectHolder>& Results()
+        {
+            return results;
+        }
+
+    private:
+        void Store(Slots& slots, size_t slot, Column values, const Lanes& active)
+        {
+            size_t base = slot * size;
+            for (size_t i = 0; i < active.size(); ++i)
+            {
+                slots.values[base + active[i]] = std::move(values[i]);
+                slots.set[base + active[i]] = 1;
+            }
+        }
+
+        // As ReadVariable on the closure of ClassInstance::Invoke
+        void Read(const std::vector<std::string>& ids, const Lanes& active, Column& res)
+        {
+            const auto& name = ids.back();
+            if (ids.size() == 1 && name == "self")
+            {
+                for (auto lane : active)
+                    res.push_back(receivers[lane]);
+                return;
+            }
+
+            const Slots& slots = ids.size() == 1 ? locals : fields;
+            const auto& slot_ids = ids.size() == 1 ? layout.locals : layout.fields;
+            auto slot = slot_ids.find(name);
+            size_t base = slot != slot_ids.end() ? slot->second * size : 0;
+            for (auto lane : active)
+            {
+                if (slot != slot_ids.end() && slots.set[base + lane])
+                {
+                    auto& value = slots.values[base + lane];
+                    res.push_back(value ? value : ObjectHolder::Own(Runtime::None()));
+                    continue;
+                }
+
+                auto& own = receivers[lane].TryAs<Runtime::ClassInstance>()->Fields();
+                auto it = own.find(name);
+                if (it == own.end())
+                    throw Diverged();
+                res.push_back(it->second ? it->second : ObjectHolder::Own(Runtime::None()));
+            }
+        }
+
+        const Layout& layout;
+        const ObjectHolder* receivers;
+        size_t size;
+        BatchStats* stats;
+        Slots locals;
+        Slots fields;
+        std::vector<ObjectHolder> results;
+    };
+
+    std::vector<ObjectHolder> CallEach(
+        const ObjectHolder* receivers, size_t size, const std::string& method, const std::vector<ObjectHolder>& args,
+        BatchStats* stats
+    )
+    {
+        std::vector<ObjectHolder> results;
+        results.reserve(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (stats)
+                ++stats->called;
+            auto receiver = receivers[i];
+            results.push_back(ReceiverOf(receiver, method).Call(method, args));
+        }
+        return results;
+    }
+
+    // The method when the receivers are instances of one class whose body
+    // may be batched
+    const Runtime::Method* BatchedMethod(
+        const std::vector<ObjectHolder>& receivers, const std::string& method, size_t arg_count, Layout& layout
+    )
+    {
+        if (receivers.empty() || StackEvaluator::Current())
+            return nullptr;
+
+        const Runtime::Class* cls = nullptr;
+        for (auto& receiver : receivers)
+        {
+            auto instance = receiver.TryAs<Runtime::ClassInstance>();
+            if (!instance || (cls && &instance->GetClass() != cls))
+                return nullptr;
+            cls = &instance->GetClass();
+        }
+
+        auto met = cls->GetMethod(method);
+        if (!met || met->formal_params.size() != arg_count)
+            return nullptr;
+        if (std::count(met->formal_params.begin(), met->formal_params.end(), "self"))
+            return nullptr;
+        // The cache sees every call
+        if (auto memoizer = Memoizer::Current(); memoizer && memoizer->Find(*cls, method))
+            return nullptr;
+
+        for (auto& param : met->formal_params)
+            layout.Local(param);
+        return Scan(*met->body, layout) ? met : nullptr;
+    }
+
+    // The receivers of a chunk may not repeat: one would not see the writes
+    // of the other
+    bool Distinct(const ObjectHolder* receivers, size_t size)
+    {
+        std::vector<const Runtime::IObject*> objects(size);
+        for (size_t i = 0; i < size; ++i)
+            objects[i] = receivers[i].Get();
+        std::sort(objects.begin(), objects.end());
+        return std::adjacent_find(objects.begin(), objects.end()) == objects.end();
+    }
+}
+
+std::vector<ObjectHolder> CallBatch(
+    const std::vector<ObjectHolder>& receivers, const std::string& method, const std::vector<ObjectHolder>& args,
+    BatchStats* stats
+)
+{
+    Layout layout;
+    auto met = BatchedMethod(receivers, method, args.size(), layout);
+    if (!met)
+        return CallEach(receivers.data(), receivers.size(), method, args, stats);
+
+    // Chunks run one after another, as the calls would
+    std::vector<ObjectHolder> results;
+    results.reserve(receivers.size());
+    for (size_t first = 0; first < receivers.size(); first += CHUNK)
+    {
+        const ObjectHolder* chunk = receivers.data() + first;
+        size_t size = std::min(CHUNK, receivers.size() - first);
+
+        std::vector<ObjectHolder> chunk_results;
+        try
+        {
+            if (!Distinct(chunk, size))
+                throw Diverged();
+
+            Batch batch(layout, chunk, size, stats);
+            for (size_t i = 0; i < args.size(); ++i)
+                batch.SetLocal(met->formal_params[i], args[i]);
+            Lanes active(size);
+            for (size_t i = 0; i < size; ++i)
+                active[i] = i;
+            batch.Execute(*met->body, active);
+
+            if (batch.Commit())
+                Runtime::ClassInstance::TouchFields();
+            chunk_results = std::move(batch.Results());
+            if (stats)
+                stats->batched += size;
+        }
+        catch (const Diverged&)
+        {
+            chunk_results = CallEach(chunk, size, method, args, stats);
+        }
+        catch (const std::exception&)
+        {
+            // Thrown again by the calls, after the receivers before
+            chunk_results = CallEach(chunk, size, method, args, stats);
+        }
+        std::move(chunk_results.begin(), chunk_results.end(), std::back_inserter(results));
+    }
+    return results;
+}
+
+} /* namespace Ast */
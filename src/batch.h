@@ -0,0 +1,43 @@
+#pragma once
+
+#include "object_holder.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+struct BatchStats {
+  // Receivers run by the batched body
+  size_t batched = 0;
+  // Receivers called one by one
+  size_t called = 0;
+  // Branches whose condition split the receivers
+  size_t divergent_branches = 0;
+};
+
+// Calls the method on every receiver with the same arguments, returns the
+// results in the order of the receivers. The body runs once for a chunk of
+// receivers: each node is evaluated over all of them before the next one, and the
+// receivers which disagree on a condition go down their branches separately.
+//
+// The results and the effects are those of the calls made one by one. Bodies
+// which only compute, read their fields and assign the fields of self are
+// batched, when the receivers are instances of one class. They run in chunks
+// of distinct receivers, one chunk after another. Field writes are kept aside
+// until the chunk ends, so when a receiver meets anything else (an instance
+// behind an operator, an error) the chunk is dropped and its receivers are
+// called by ClassInstance::Call
+std::vector<ObjectHolder> CallBatch(
+  const std::vector<ObjectHolder>& receivers,
+  const std::string& method,
+  const std::vector<ObjectHolder>& args,
+  BatchStats* stats = nullptr
+);
+
+void RunBatchTests(TestRunner& tr);
+
+} /* namespace Ast */
@@ -0,0 +1,172 @@
+#include "batch.h"
+#include "lexer.h"
+#include "object.h"
+#include "parse.h"
+#include "statement.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+// Runs the program, the closure keeps its variables and the tree its classes
+unique_ptr<Statement> Run(const string& program, Runtime::Closure& closure, ostringstream& output) {
+  istringstream input(program);
+  Parse::Lexer lexer(input);
+  auto tree = ParseProgram(lexer);
+  Print::SetOutputStream(output);
+  tree->Execute(closure);
+  return tree;
+}
+
+vector<ObjectHolder> Receivers(Runtime::Closure& closure, const vector<string>& names) {
+  vector<ObjectHolder> receivers;
+  for (auto& name : names) {
+    receivers.push_back(closure.at(name));
+  }
+  return receivers;
+}
+
+string Field(Runtime::Closure& closure, const string& instance, const string& field) {
+  ostringstream os;
+  PrintValue(os, closure.at(instance).TryAs<Runtime::ClassInstance>()->Fields().at(field));
+  return os.str();
+}
+
+const string PARTICLES = R"(
+class Particle:
+  def __init__(x, v):
+    self.x = x
+    self.v = v
+    self.name = 'p' + str(x)
+
+  def step(dt, limit):
+    x = self.x + self.v * dt
+    self.x = x
+    if x > limit:
+      self.x = x - limit
+      return self.name + ' wrapped'
+    self.v = v + 1
+    return x
+
+a = Particle(1, 2)
+b = Particle(5, 3)
+c = Particle(9, -1)
+)";
+
+}
+
+void TestBatchRunsBodiesOverAllReceivers() {
+  Runtime::Closure closure;
+  ostringstream output;
+  auto tree = Run(PARTICLES, closure, output);
+
+  BatchStats stats;
+  auto results = CallBatch(Receivers(closure, {"a", "b", "c"}), "step", {
+    ObjectHolder::Own(Runtime::Number(2)), ObjectHolder::Own(Runtime::Number(10))
+  }, &stats);
+
+  ASSERT_EQUAL(results.size(), 3u);
+  ASSERT_EQUAL(results[0].TryAs<Runtime::Number>()->GetValue(), 5);
+  ASSERT_EQUAL(results[1].TryAs<Runtime::String>()->GetValue(), "p5 wrapped");
+  ASSERT_EQUAL(results[2].TryAs<Runtime::Number>()->GetValue(), 7);
+  ASSERT_EQUAL(stats.batched, 3u);
+  ASSERT_EQUAL(stats.called, 0u);
+  ASSERT_EQUAL(stats.divergent_branches, 1u);
+
+  // The bare v is the field as the call started
+  ASSERT_EQUAL(Field(closure, "a", "x"), "5");
+  ASSERT_EQUAL(Field(closure, "a", "v"), "3");
+  ASSERT_EQUAL(Field(closure, "b", "x"), "1");
+  ASSERT_EQUAL(Field(closure, "b", "v"), "3");
+  ASSERT_EQUAL(Field(closure, "c", "v"), "0");
+}
+
+void TestBatchFallsBackToCalls() {
+  Runtime::Closure closure;
+  ostringstream output;
+  auto tree = Run(PARTICLES + R"(
+class Loud:
+  def __init__(n):
+    self.n = n
+
+  def shout():
+    print 'shout', self.n
+    return self.n
+
+  def __add__(other):
+    print 'add', self.n
+    return self.n + other
+
+class Holder:
+  def __init__(v):
+    self.v = v
+
+  def next():
+    return self.v + 1
+
+l1 = Loud(1)
+l2 = Loud(2)
+h1 = Holder(10)
+h2 = Holder(l1)
+h3 = Holder(l2)
+)", closure, output);
+  output.str("");
+
+  // Prints are made in the order of the calls
+  BatchStats stats;
+  auto results = CallBatch(Receivers(closure, {"l1", "l2"}), "shout", {}, &stats);
+  ASSERT_EQUAL(output.str(), "shout 1\nshout 2\n");
+  ASSERT_EQUAL(stats.called, 2u);
+
+  // A user operator is met on the way
+  output.str("");
+  stats = {};
+  results = CallBatch(Receivers(closure, {"h1", "h2", "h3"}), "next", {}, &stats);
+  ASSERT_EQUAL(output.str(), "add 1\nadd 2\n");
+  ASSERT_EQUAL(results[0].TryAs<Runtime::Number>()->GetValue(), 11);
+  ASSERT_EQUAL(results[2].TryAs<Runtime::Number>()->GetValue(), 3);
+  ASSERT_EQUAL(stats.batched, 0u);
+  ASSERT_EQUAL(stats.called, 3u);
+
+  // The same receiver twice sees its own writes
+  stats = {};
+  auto twice = Receivers(closure, {"a", "a"});
+  results = CallBatch(twice, "step", {ObjectHolder::Own(Runtime::Number(1)), ObjectHolder::Own(Runtime::Number(100))}, &stats);
+  ASSERT_EQUAL(results[0].TryAs<Runtime::Number>()->GetValue(), 3);
+  ASSERT_EQUAL(results[1].TryAs<Runtime::Number>()->GetValue(), 6);
+  ASSERT_EQUAL(stats.called, 2u);
+}
+
+void TestBatchErrorsAreThoseOfTheCalls() {
+  Runtime::Closure closure;
+  ostringstream output;
+  auto tree = Run(PARTICLES + R"(
+d = Particle(1, 'fast')
+)", closure, output);
+
+  // a is stepped before d fails, c is not
+  auto receivers = Receivers(closure, {"a", "d", "c"});
+  vector<ObjectHolder> args = {ObjectHolder::Own(Runtime::Number(1)), ObjectHolder::Own(Runtime::Number(100))};
+  ASSERT_THROWS(CallBatch(receivers, "step", args), std::runtime_error);
+  ASSERT_EQUAL(Field(closure, "a", "x"), "3");
+  ASSERT_EQUAL(Field(closure, "c", "x"), "9");
+
+  ASSERT_THROWS(CallBatch(Receivers(closure, {"c"}), "jump", {}), std::runtime_error);
+  ASSERT_THROWS(CallBatch({ObjectHolder::Own(Runtime::Number(1))}, "step", args), std::runtime_error);
+  ASSERT(CallBatch({}, "step", args).empty());
+}
+
+void RunBatchTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestBatchRunsBodiesOverAllReceivers);
+  RUN_TEST(tr, Ast::TestBatchFallsBackToCalls);
+  RUN_TEST(tr, Ast::TestBatchErrorsAreThoseOfTheCalls);
+}
+
+} /* namespace Ast */
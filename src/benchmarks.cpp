@@ -0,0 +1,530 @@
+#include "benchmarks.h"
+#include "batch.h"
+#include "char_scan.h"
+#include "flat_tree.h"
+#include "instrumentation.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "object.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "profile.h"
+#include "program_cache.h"
+#include "statement.h"
+#include "superinstructions.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+    double MeasureMs(const std::function<void()>& func)
+    {
+        auto start = chrono::steady_clock::now();
+        func();
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Runs after the first one see warm allocators and caches
+    double BestOfMs(const std::function<void()>& func, int runs = 5)
+    {
+        func();
+        double best = MeasureMs(func);
+        for (int i = 1; i < runs; ++i)
+            best = min(best, MeasureMs(func));
+        return best;
+    }
+
+    unique_ptr<Ast::Statement> Parse(const string& program)
+    {
+        istringstream input(program);
+        Parse::Lexer lexer(input);
+        return ParseProgram(lexer);
+    }
+
+    const string IDIOMS_PROGRAM = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add(step):
+    self.value = self.value + step
+
+  def get():
+    return self.value
+
+  def run(n):
+    if n > 0:
+      self.add(1)
+      x = n
+      x = x - 1
+      return self.run(x)
+    return self.get()
+
+c = Counter()
+)";
+
+    string IdiomsProgram(int runs)
+    {
+        string program = IDIOMS_PROGRAM;
+        for (int i = 0; i < runs; ++i)
+            program += "print c.run(500)\n";
+        return program;
+    }
+
+    void BenchSuperinstructions(ostream& out)
+    {
+        const string program = IdiomsProgram(200);
+
+        auto run = [&program](bool fuse, Ast::DispatchStats* stats) {
+            auto tree = Parse(program);
+            if (fuse)
+                Ast::FuseSuperinstructions(tree);
+            if (stats)
+                Ast::InstrumentDispatches(tree, *stats);
+
+            ostringstream output;
+            Ast::Print::SetOutputStream(output);
+            Runtime::Closure closure;
+            tree->Execute(closure);
+        };
+
+        Ast::DispatchStats plain, fused;
+        run(false, &plain);
+        run(true, &fused);
+        double plain_ms = MeasureMs([&run] { run(false, nullptr); });
+        double fused_ms = MeasureMs([&run] { run(true, nullptr); });
+
+        out << "superinstructions: "
+            << plain.PerStatement() << " -> " << fused.PerStatement() << " dispatches/statement, "
+            << plain_ms << " -> " << fused_ms << " ms" << endl;
+    }
+
+    void BenchEngines(ostream& out)
+    {
+        const string program = IdiomsProgram(200);
+
+        auto run = [&program](Engine engine) {
+            istringstream input(program);
+            ostringstream output;
+            RunOptions options;
+            options.engine = engine;
+            RunMythonProgram(input, output, options);
+        };
+
+        out << "engines:";
+        for (auto [engine, name] : {pair{Engine::Tree, "tree"}, {Engine::Stack, "stack"}, {Engine::Closures, "closures"}})
+            out << " " << name << " " << MeasureMs([&run, engine = engine] { run(engine); }) << " ms";
+        out << endl;
+    }
+
+    // A method too large for the tree of its body to stay in cache
+    string LargeProgram(int statements, int calls)
+    {
+        string program = "class Big:\n  def run(a, b, c):\n";
+        for (int i = 0; i < statements; ++i)
+            program += "    t" + to_string(i % 50) + " = a * " + to_string(i % 7 + 1) + " + b - c / 2\n";
+        program += "    return t0\n\nbig = Big()\n";
+        for (int i = 0; i < calls; ++i)
+            program += "big.run(" + to_string(i) + ", 2, 3)\n";
+        return program;
+    }
+
+    void BenchFlatTree(ostream& out)
+    {
+        const string program = LargeProgram(5000, 20);
+
+        auto run = [](Ast::Statement& tree) {
+            ostringstream output;
+            Ast::Print::SetOutputStream(output);
+            Runtime::Closure closure;
+            tree.Execute(closure);
+        };
+
+        auto tree = Parse(program);
+        auto flat = Parse(program);
+        auto stats = Ast::FlattenProgram(flat);
+
+        out << "flat tree: " << stats.nodes << " nodes, " << stats.bytes / stats.nodes << " bytes/node, "
+            << BestOfMs([&] { run(*tree); }) << " -> " << BestOfMs([&] { run(*flat); }) << " ms" << endl;
+    }
+
+    // Tokens of a large script read from a stream and in place
+    void BenchLexer(ostream& out)
+    {
+        const string program = LargeProgram(100000, 1);
+
+        auto lex = [](Parse::Lexer& lexer) {
+            while (!lexer.NextToken().Is<Parse::TokenType::Eof>())
+                ;
+        };
+        auto mb_per_s = [&program](double ms) { return program.size() / 1048.576 / ms; };
+
+        double stream = BestOfMs([&] {
+            istringstream input(program);
+            Parse::Lexer lexer(input);
+            lex(lexer);
+        }, 3);
+        double buffer = BestOfMs([&] {
+            Parse::Lexer lexer{string_view(program)};
+            lex(lexer);
+        }, 3);
+        out << "lexer: " << mb_per_s(stream) << " -> " << mb_per_s(buffer) << " MB/s" << endl;
+
+        auto lex_at = [&](Parse::SimdLevel level) {
+            auto previous = Parse::SetSimdLevel(level);
+            double ms = BestOfMs([&] {
+                Parse::Lexer lexer{string_view(program)};
+                lex(lexer);
+            }, 3);
+            Parse::SetSimdLevel(previous);
+            return ms;
+        };
+        auto lex_with = [&](Parse::LexerKind kind) {
+            return BestOfMs([&] {
+                Parse::Lexer lexer(string_view(program), kind);
+                lex(lexer);
+            }, 3);
+        };
+        out << "lexer handwritten -> table: " << mb_per_s(lex_with(Parse::LexerKind::Handwritten)) << " -> "
+            << mb_per_s(lex_with(Parse::LexerKind::Table)) << " MB/s" << endl;
+        out << "lexer scalar -> simd: " << mb_per_s(lex_at(Parse::SimdLevel::Scalar)) << " -> "
+            << mb_per_s(lex_at(Parse::SupportedSimdLevel())) << " MB/s" << endl;
+    }
+
+    size_t CountNodes(unique_ptr<Ast::Statement>& node)
+    {
+        size_t count = 1;
+        node->ForEachChild([&count](unique_ptr<Ast::Statement>& child) {
+            if (child)
+                count += CountNodes(child);
+        });
+        return count;
+    }
+
+    // Expressions of every precedence level, the tokens are made before the
+    // parse is timed
+    void BenchParser(ostream& out)
+    {
+        string program = "a = 1\nb = 2\nc = 3\nd = 4\ne = False\nf = 5\ng = 6\n";
+        for (int i = 0; i < 50000; ++i)
+            program += "x = a * " + to_string(i % 9 + 1) + " + b - c / 2 < d and not e or (f + -g) * 2 == 3\n";
+
+        auto tree = Parse(program);
+        size_t nodes = CountNodes(tree);
+        double lex = BestOfMs([&program] {
+            Parse::Lexer lexer{string_view(program)};
+            while (!lexer.NextToken().Is<Parse::TokenType::Eof>())
+                ;
+        }, 3);
+        double load = BestOfMs([&program] {
+            Parse::Lexer lexer{string_view(program)};
+            ParseProgram(lexer);
+        }, 3);
+        out << "parser: " << nodes << " nodes, " << nodes / max(load - lex, 1e-3) / 1000 << " M nodes/s" << endl;
+    }
+
+    // The parser takes the tokens of a large script from the lexer in step and
+    // from the lexer running ahead on another thread
+    void BenchPipelinedLexer(ostream& out)
+    {
+        const string program = LargeProgram(100000, 1);
+
+        auto load = [&program](bool run_ahead) {
+            Parse::Lexer lexer{string_view(program)};
+            if (run_ahead)
+                lexer.RunAhead();
+            return ParseProgram(lexer);
+        };
+
+        out << "pipelined lexer: load of " << program.size() / 1024 << " KB " << BestOfMs([&load] { load(false); }, 3)
+            << " -> " << BestOfMs([&load] { load(true); }, 3) << " ms" << endl;
+    }
+
+    // Notes when the first character is written
+    class FirstOutput : public streambuf
+    {
+    public:
+        optional<chrono::steady_clock::time_point> at;
+
+    protected:
+        int overflow(int c) override
+        {
+            Note();
+            return c;
+        }
+
+        streamsize xsputn(const char*, streamsize count) override
+        {
+            Note();
+            return count;
+        }
+
+    private:
+        void Note()
+        {
+            if (!at)
+                at = chrono::steady_clock::now();
+        }
+    };
+
+    // A long script which prints as it starts, run whole and a statement at a time
+    void BenchStreaming(ostream& out)
+    {
+        string program = "a = 1\nb = 2\nc = 3\nprint 'started'\n";
+        for (int i = 0; i < 200000; ++i)
+            program += "t = a * " + to_string(i % 7 + 1) + " + b - c / 2\n";
+
+        auto run = [&program](bool streaming) {
+            RunOptions options;
+            options.streaming = streaming;
+            istringstream input(program);
+            FirstOutput first;
+            ostream output(&first);
+            auto start = chrono::steady_clock::now();
+            RunMythonProgram(input, output, options);
+            auto end = chrono::steady_clock::now();
+            return make_pair(chrono::duration<double, milli>(*first.at - start).count(),
+                chrono::duration<double, milli>(end - start).count());
+        };
+
+        auto whole = run(false);
+        auto streaming = run(true);
+        out << "streaming: first output after " << whole.first << " -> " << streaming.first << " ms, run "
+            << whole.second << " -> " << streaming.second << " ms" << endl;
+    }
+
+    // A machine-generated script is loaded once and run once
+    void BenchSinglePass(ostream& out)
+    {
+        const string program = LargeProgram(100000, 1);
+
+        auto load = [&program](bool single_pass) {
+            istringstream input(program);
+            Parse::Lexer lexer(input);
+            if (single_pass)
+                return ParseFlatProgram(lexer);
+            auto tree = ParseProgram(lexer);
+            Ast::FlattenProgram(tree);
+            return tree;
+        };
+
+        out << "single pass: load of " << program.size() / 1024 << " KB " << BestOfMs([&load] { load(false); }, 3)
+            << " -> " << BestOfMs([&load] { load(true); }, 3) << " ms" << endl;
+    }
+
+    // A machine-generated script is parsed, and loaded from its saved layout
+    void BenchProgramCache(ostream& out)
+    {
+        const string program = LargeProgram(100000, 1);
+        const string path = "mython_bench_program_cache.myc";
+        uint64_t hash = Ast::HashSource(program);
+        {
+            Parse::Lexer lexer{string_view(program)};
+            Ast::SaveProgramFile(*ParseFlatProgram(lexer), hash, path);
+        }
+
+        auto parse = [&program] {
+            Parse::Lexer lexer{string_view(program)};
+            return ParseFlatProgram(lexer);
+        };
+        auto load = [&path, &program] {
+            return Ast::LoadProgramFile(path, Ast::HashSource(program));
+        };
+
+        out << "program cache: load of " << program.size() / 1024 << " KB " << BestOfMs(parse, 3) << " -> "
+            << BestOfMs(load, 3) << " ms" << endl;
+        remove(path.c_str());
+    }
+
+    // A library of many classes of which the script calls one method, run with its bodies parsed at load and on
+    // their first calls
+    void BenchLazyMethods(ostream& out)
+    {
+        string program;
+        for (int c = 0; c < 500; ++c)
+        {
+            program += "class C" + to_string(c) + ":\n";
+            for (int m = 0; m < 20; ++m)
+            {
+                program += "  def m" + to_string(m) + "(a, b):\n";
+                for (int i = 0; i < 8; ++i)
+                    program += "    t" + to_string(i) + " = a * " + to_string(i + 1) + " + b - self.x / 2\n";
+                program += "    return t0\n\n";
+            }
+        }
+        program += "c = C7()\nc.x = 4\nprint c.m3(1, 2)\n";
+
+        auto run = [&program](MethodBodies bodies) {
+            return BestOfMs([&] {
+                ostringstream output;
+                Ast::Print::SetOutputStream(output);
+                Parse::Lexer lexer{string_view(program)};
+                Runtime::Closure closure;
+                ParseProgram(lexer, bodies)->Execute(closure);
+            }, 3);
+        };
+
+        out << "lazy methods: load of " << program.size() / 1024 << " KB " << run(MethodBodies::Eager) << " -> "
+            << run(MethodBodies::Lazy) << " ms, validated " << run(MethodBodies::LazyValidated) << " ms"
+            << endl;
+    }
+
+    // A library of classes loaded and optimized, the method bodies parsed and optimized by one thread and by a pool.
+    // Type inference and the other whole-program passes are left out, they run on one thread either way
+    void BenchParallelMethods(ostream& out)
+    {
+        string program;
+        for (int c = 0; c < 500; ++c)
+        {
+            program += "class C" + to_string(c) + (c > 0 ? "(C" + to_string(c - 1) + ")" : "") + ":\n";
+            for (int m = 0; m < 20; ++m)
+            {
+                program += "  def m" + to_string(m) + "(a, b):\n";
+                for (int i = 0; i < 8; ++i)
+                    program += "    t" + to_string(i) + " = a * " + to_string(i + 1) + " + b - self.x.y / (2 * 3)\n";
+                program += "    return t0\n\n";
+            }
+        }
+
+        auto eager = [&program] {
+            Parse::Lexer lexer{string_view(program)};
+            auto tree = ParseProgram(lexer);
+            Ast::OptimizeProgram(tree);
+        };
+        auto parallel = [&program](size_t threads) {
+            return BestOfMs([&] {
+                Parse::Lexer lexer{string_view(program)};
+                auto tree = ParseProgram(lexer, MethodBodies::Parallel, [](unique_ptr<Ast::Statement>& body) {
+                    Ast::OptimizeMethodBody(body);
+                }, threads);
+                Ast::OptimizeProgram(tree, false);
+            }, 3);
+        };
+
+        const size_t cores = max(thread::hardware_concurrency(), 1u);
+        out << "parallel methods: load of " << program.size() / 1024 << " KB " << BestOfMs(eager, 3) << " -> "
+            << parallel(1) << " ms on 1 thread, " << parallel(cores) << " ms on " << cores << endl;
+    }
+
+    // A line of a method in the middle of a large script edited, the script parsed again as a whole and its edited
+    // statements only
+    void BenchIncremental(ostream& out)
+    {
+        string program;
+        for (int c = 0; c < 2000; ++c)
+        {
+            program += "class C" + to_string(c) + ":\n";
+            for (int m = 0; m < 5; ++m)
+            {
+                program += "  def m" + to_string(m) + "(a, b):\n";
+                for (int i = 0; i < 8; ++i)
+                    program += "    t" + to_string(i) + " = a * " + to_string(i + 1) + " + b - self.x / 2\n";
+                program += "    return t0\n\n";
+            }
+            program += "x" + to_string(c) + " = C" + to_string(c) + "()\n";
+        }
+
+        IncrementalProgram incremental(program);
+        const size_t offset = program.find("t3 = a * 4", program.size() / 2);
+        bool edited = false;
+        auto edit = [&] {
+            incremental.Edit(offset, 10, edited ? "t3 = a * 4" : "t3 = a * 5");
+            edited = !edited;
+        };
+        auto parse = [&program] {
+            Parse::Lexer lexer{string_view(program)};
+            ParseProgram(lexer);
+        };
+
+        out << "incremental parse: edit of " << program.size() / 1024 << " KB " << BestOfMs(parse, 3) << " -> "
+            << BestOfMs(edit) << " ms" << endl;
+    }
+
+    // One method called on every object of a collection
+    void BenchBatch(ostream& out)
+    {
+        auto tree = Parse(R"(
+class Particle:
+  def step(dt, limit):
+    x = self.x + self.v * dt
+    if x > limit:
+      x = x - limit
+    self.x = x
+    return x
+
+p = Particle()
+)");
+        Runtime::Closure closure;
+        tree->Execute(closure);
+        auto& cls = closure.at("p").TryAs<Runtime::ClassInstance>()->GetClass();
+
+        vector<ObjectHolder> particles;
+        for (int i = 0; i < 100000; ++i)
+        {
+            auto particle = ObjectHolder::Own(Runtime::ClassInstance(cls));
+            particle.TryAs<Runtime::ClassInstance>()->Fields()["x"] = ObjectHolder::Own(Runtime::Number(i % 100));
+            particle.TryAs<Runtime::ClassInstance>()->Fields()["v"] = ObjectHolder::Own(Runtime::Number(i % 7));
+            particles.push_back(particle);
+        }
+        const vector<ObjectHolder> args = {ObjectHolder::Own(Runtime::Number(3)), ObjectHolder::Own(Runtime::Number(100))};
+
+        out << "batch: step of " << particles.size() << " objects " << BestOfMs([&] {
+            for (auto& particle : particles)
+                particle.TryAs<Runtime::ClassInstance>()->Call("step", args);
+        }) << " -> " << BestOfMs([&] { Ast::CallBatch(particles, "step", args); }) << " ms" << endl;
+    }
+
+    const string FIB = R"(
+class Fib:
+  def fib(n):
+    if n < 2:
+      return n
+    return self.fib(n - 1) + self.fib(n - 2)
+
+f = Fib()
+print f.fib(22)
+)";
+
+    void BenchJit(ostream& out)
+    {
+        auto run = [](bool jit) {
+            istringstream input(FIB);
+            ostringstream output;
+            RunOptions options;
+            options.jit = jit;
+            RunMythonProgram(input, output, options);
+        };
+
+        out << "jit: fib(22) " << BestOfMs([&run] { run(false); }) << " -> "
+            << BestOfMs([&run] { run(true); }) << " ms" << endl;
+    }
+}
+
+void RunBenchmarks(ostream& out)
+{
+    BenchSuperinstructions(out);
+    BenchEngines(out);
+    BenchFlatTree(out);
+    BenchLexer(out);
+    BenchParser(out);
+    BenchPipelinedLexer(out);
+    BenchStreaming(out);
+    BenchSinglePass(out);
+    BenchProgramCache(out);
+    BenchLazyMethods(out);
+    BenchParallelMethods(out);
+    BenchIncremental(out);
+    BenchBatch(out);
+    BenchJit(out);
+    Ast::Print::SetOutputStream(cout);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <iosfwd>
+
+// Measurements of the interpreter optimizations on generated programs.
+// Run with "mython_interpreter --bench"
+void RunBenchmarks(std::ostream& out);
@@ -0,0 +1,300 @@
+#include "char_scan.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MYTHON_SIMD_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define MYTHON_AVX2 __attribute__((target("avx2")))
+#else
+#define MYTHON_AVX2
+#endif
+
+using namespace std;
+
+namespace Parse {
+
+namespace {
+
+enum class Run {
+  Identifier,
+  Digits,
+  Spaces,
+};
+
+// Scalar
+//
+enum : uint8_t {
+  DIGIT = 1,
+  IDENTIFIER = 2,
+  SPACE = 4,
+};
+
+constexpr array<uint8_t, 256> MakeClasses() {
+  array<uint8_t, 256> classes = {};
+  for (int c = 0; c < 256; ++c) {
+    bool digit = c >= '0' && c <= '9';
+    bool alpha = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    classes[c] = (digit ? DIGIT : 0)
+      | (digit || alpha || c == '_' ? IDENTIFIER : 0)
+      | (c == ' ' || (c >= '\t' && c <= '\r') ? SPACE : 0);
+  }
+  return classes;
+}
+
+constexpr array<uint8_t, 256> CLASSES = MakeClasses();
+
+uint8_t ClassOf(Run run) {
+  switch (run) {
+  case Run::Identifier:
+    return IDENTIFIER;
+  case Run::Digits:
+    return DIGIT;
+  default:
+    return SPACE;
+  }
+}
+
+size_t ScalarRunLength(string_view text, size_t from, Run run) {
+  uint8_t mask = ClassOf(run);
+  size_t i = from;
+  while (i < text.size() && (CLASSES[static_cast<unsigned char>(text[i])] & mask)) {
+    ++i;
+  }
+  return i;
+}
+
+size_t ScalarStringBodyLength(string_view text, size_t from, char quote, bool previous_backslash) {
+  for (size_t i = from; i < text.size(); ++i) {
+    if (text[i] == quote && !previous_backslash) {
+      return i;
+    }
+    previous_backslash = (text[i] == '\\');
+  }
+  return text.size();
+}
+
+#ifdef MYTHON_SIMD_X64
+
+unsigned CountTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+// SSE2
+//
+// Bytes of v within [lo, hi], compared as unsigned
+__m128i InRange(__m128i v, char lo, char hi) {
+  __m128i shifted = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+  return _mm_cmpeq_epi8(_mm_min_epu8(shifted, _mm_set1_epi8(static_cast<char>(hi - lo))), shifted);
+}
+
+// Bits of the bytes which belong to the run
+uint32_t RunMask(__m128i v, Run run) {
+  __m128i in;
+  switch (run) {
+  case Run::Identifier:
+    // A letter in either case is a lower case one with 0x20 set
+    in = _mm_or_si128(
+      _mm_or_si128(InRange(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z'), InRange(v, '0', '9')),
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('_'))
+    );
+    break;
+  case Run::Digits:
+    in = InRange(v, '0', '9');
+    break;
+  default:
+    in = _mm_or_si128(InRange(v, '\t', '\r'), _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+    break;
+  }
+  return static_cast<uint32_t>(_mm_movemask_epi8(in));
+}
+
+size_t Sse2RunLength(string_view text, size_t from, Run run) {
+  size_t i = from;
+  for (; i + 16 <= text.size(); i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+    if (uint32_t outside = ~RunMask(v, run) & 0xFFFF) {
+      return i + CountTrailingZeros(outside);
+    }
+  }
+  return ScalarRunLength(text, i, run);
+}
+
+size_t Sse2StringBodyLength(string_view text, char quote) {
+  size_t i = 0;
+  uint32_t carry = 0;
+  for (; i + 16 <= text.size(); i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text.data() + i));
+    uint32_t quotes = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(quote))));
+    uint32_t backslashes = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))));
+    if (uint32_t closing = quotes & ~((backslashes << 1) | carry)) {
+      return i + CountTrailingZeros(closing);
+    }
+    carry = backslashes >> 15;
+  }
+  return ScalarStringBodyLength(text, i, quote, carry != 0);
+}
+
+// AVX2
+//
+MYTHON_AVX2 __m256i InRange(__m256i v, char lo, char hi) {
+  __m256i shifted = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, _mm256_set1_epi8(static_cast<char>(hi - lo))), shifted);
+}
+
+MYTHON_AVX2 uint32_t RunMask(__m256i v, Run run) {
+  __m256i in;
+  switch (run) {
+  case Run::Identifier:
+    in = _mm256_or_si256(
+      _mm256_or_si256(InRange(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z'), InRange(v, '0', '9')),
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))
+    );
+    break;
+  case Run::Digits:
+    in = InRange(v, '0', '9');
+    break;
+  default:
+    in = _mm256_or_si256(InRange(v, '\t', '\r'), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+    break;
+  }
+  return static_cast<uint32_t>(_mm256_movemask_epi8(in));
+}
+
+MYTHON_AVX2 size_t Avx2RunLength(string_view text, size_t from, Run run) {
+  size_t i = from;
+  for (; i + 32 <= text.size(); i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i));
+    if (uint32_t outside = ~RunMask(v, run)) {
+      return i + CountTrailingZeros(outside);
+    }
+  }
+  return ScalarRunLength(text, i, run);
+}
+
+MYTHON_AVX2 size_t Avx2StringBodyLength(string_view text, char quote) {
+  size_t i = 0;
+  uint32_t carry = 0;
+  for (; i + 32 <= text.size(); i += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text.data() + i));
+    uint32_t quotes = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(quote))));
+    uint32_t backslashes = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))));
+    if (uint32_t closing = quotes & ~((backslashes << 1) | carry)) {
+      return i + CountTrailingZeros(closing);
+    }
+    carry = backslashes >> 31;
+  }
+  return ScalarStringBodyLength(text, i, quote, carry != 0);
+}
+
+#endif
+
+SimdLevel DetectSimdLevel() {
+#ifdef MYTHON_SIMD_X64
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SimdLevel::Avx2;
+  }
+#elif defined(_MSC_VER)
+  // The OS must save the ymm registers as well
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] >= 7) {
+    __cpuidex(info, 7, 0);
+    bool avx2 = info[1] & (1 << 5);
+    __cpuid(info, 1);
+    bool osxsave = info[2] & (1 << 27);
+    if (avx2 && osxsave && (_xgetbv(0) & 6) == 6) {
+      return SimdLevel::Avx2;
+    }
+  }
+#endif
+  // Every x86-64 processor has SSE2
+  return SimdLevel::Sse2;
+#else
+  return SimdLevel::Scalar;
+#endif
+}
+
+const SimdLevel supported_level = DetectSimdLevel();
+SimdLevel active_level = getenv("MYTHON_NO_SIMD") ? SimdLevel::Scalar : supported_level;
+
+// Most runs of a program are a few bytes long, they end before a block is loaded
+constexpr size_t SHORT_RUN = 8;
+
+size_t RunLength(string_view text, Run run) {
+  if (size_t length = ScalarRunLength(text.substr(0, SHORT_RUN), 0, run); length < SHORT_RUN) {
+    return length;
+  }
+  switch (active_level) {
+#ifdef MYTHON_SIMD_X64
+  case SimdLevel::Avx2:
+    return Avx2RunLength(text, SHORT_RUN, run);
+  case SimdLevel::Sse2:
+    return Sse2RunLength(text, SHORT_RUN, run);
+#endif
+  default:
+    return ScalarRunLength(text, SHORT_RUN, run);
+  }
+}
+
+}
+
+SimdLevel SupportedSimdLevel() {
+  return supported_level;
+}
+
+SimdLevel ActiveSimdLevel() {
+  return active_level;
+}
+
+SimdLevel SetSimdLevel(SimdLevel level) {
+  SimdLevel previous = active_level;
+  active_level = static_cast<int>(level) < static_cast<int>(supported_level) ? level : supported_level;
+  return previous;
+}
+
+size_t IdentifierLength(string_view text) {
+  return RunLength(text, Run::Identifier);
+}
+
+size_t DigitsLength(string_view text) {
+  return RunLength(text, Run::Digits);
+}
+
+size_t SpacesLength(string_view text) {
+  return RunLength(text, Run::Spaces);
+}
+
+size_t StringBodyLength(string_view text, char quote) {
+  if (text.size() < SHORT_RUN) {
+    return ScalarStringBodyLength(text, 0, quote, false);
+  }
+  switch (active_level) {
+#ifdef MYTHON_SIMD_X64
+  case SimdLevel::Avx2:
+    return Avx2StringBodyLength(text, quote);
+  case SimdLevel::Sse2:
+    return Sse2StringBodyLength(text, quote);
+#endif
+  default:
+    return ScalarStringBodyLength(text, 0, quote, false);
+  }
+}
+
+} /* namespace Parse */
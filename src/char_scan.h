@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+class TestRunner;
+
+namespace Parse {
+
+// Lengths of the character runs the lexer reads. The classes are those of
+// isalnum and isspace in the "C" locale, bytes above 127 belong to none.
+// Runs are counted 16 (SSE2) or 32 (AVX2) bytes at a time, the widest kernel
+// the processor has is chosen by CPUID at startup. MYTHON_NO_SIMD in the
+// environment keeps the scalar one
+enum class SimdLevel {
+  Scalar,
+  Sse2,
+  Avx2,
+};
+
+// The widest level of the processor
+SimdLevel SupportedSimdLevel();
+SimdLevel ActiveSimdLevel();
+// Kernels of the level, of the supported one if it is wider. Returns the previous
+// level. Meant for the tests and the benchmarks
+SimdLevel SetSimdLevel(SimdLevel level);
+
+// [A-Za-z0-9_]* at the start of the text
+size_t IdentifierLength(std::string_view text);
+// [0-9]* at the start of the text
+size_t DigitsLength(std::string_view text);
+// Spaces, tabs, \n, \v, \f and \r at the start of the text
+size_t SpacesLength(std::string_view text);
+// Position of the first quote not preceded by a backslash, the size of the text
+// when there is none
+size_t StringBodyLength(std::string_view text, char quote);
+
+void RunCharScanTests(TestRunner& tr);
+
+} /* namespace Parse */
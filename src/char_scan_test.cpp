@@ -0,0 +1,133 @@
+#include "char_scan.h"
+#include "lexer.h"
+
+#include <test_runner.h>
+
+#include <cctype>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace Parse {
+
+namespace {
+
+vector<SimdLevel> Levels() {
+  vector<SimdLevel> levels = {SimdLevel::Scalar};
+  if (SupportedSimdLevel() != SimdLevel::Scalar) {
+    levels.push_back(SimdLevel::Sse2);
+  }
+  if (SupportedSimdLevel() == SimdLevel::Avx2) {
+    levels.push_back(SimdLevel::Avx2);
+  }
+  return levels;
+}
+
+size_t Expected(string_view text, int (*is)(int), bool underscore) {
+  size_t i = 0;
+  while (i < text.size() && (is(static_cast<unsigned char>(text[i])) || (underscore && text[i] == '_'))) {
+    ++i;
+  }
+  return i;
+}
+
+size_t ExpectedStringBody(string_view text, char quote) {
+  bool previous_backslash = false;
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (text[i] == quote && !previous_backslash) {
+      return i;
+    }
+    previous_backslash = (text[i] == '\\');
+  }
+  return text.size();
+}
+
+// Runs of one class with a stray character of another, around the block boundaries
+vector<string> Samples() {
+  const string pool = "aZ_09 \t\r\v\f\n'\"\\\\\\x.+@[`{/:\x80\xff\xe1\x01";
+  mt19937 random(42);
+  vector<string> samples;
+  for (size_t length = 0; length < 80; ++length) {
+    for (int variant = 0; variant < 12; ++variant) {
+      string sample;
+      char base = pool[random() % pool.size()];
+      for (size_t i = 0; i < length; ++i) {
+        sample += random() % 8 == 0 ? pool[random() % pool.size()] : base;
+      }
+      samples.push_back(sample);
+    }
+  }
+  return samples;
+}
+
+string Tokens(const string& program) {
+  Lexer lexer{string_view(program)};
+  ostringstream os;
+  for (Token token = lexer.CurrentToken(); !token.Is<TokenType::Eof>(); token = lexer.NextToken()) {
+    os << token << ' ';
+  }
+  return os.str();
+}
+
+}
+
+void TestCharScanMatchesCharacterClasses() {
+  auto previous = ActiveSimdLevel();
+  auto samples = Samples();
+  for (auto level : Levels()) {
+    SetSimdLevel(level);
+    ASSERT(ActiveSimdLevel() == level);
+    for (auto& sample : samples) {
+      for (size_t from = 0; from <= sample.size(); from += 3) {
+        string_view text = string_view(sample).substr(from);
+        ASSERT_EQUAL(IdentifierLength(text), Expected(text, isalnum, true));
+        ASSERT_EQUAL(DigitsLength(text), Expected(text, isdigit, false));
+        ASSERT_EQUAL(SpacesLength(text), Expected(text, isspace, false));
+        ASSERT_EQUAL(StringBodyLength(text, '\''), ExpectedStringBody(text, '\''));
+        ASSERT_EQUAL(StringBodyLength(text, '"'), ExpectedStringBody(text, '"'));
+      }
+    }
+  }
+
+  // A backslash at the end of a block escapes the quote that starts the next one
+  for (size_t at : {15, 31, 47, 63}) {
+    string text(at, 'x');
+    text += "\\'x'";
+    for (auto level : Levels()) {
+      SetSimdLevel(level);
+      ASSERT_EQUAL(StringBodyLength(text, '\''), at + 3);
+    }
+  }
+  SetSimdLevel(previous);
+}
+
+void TestLexerTokensAtEverySimdLevel() {
+  const string program = R"(
+class VeryLongClassNameThatSpansMoreThanThirtyTwoBytes:
+  def method_with_a_long_name_as_well(argument_number_one, argument_number_two):
+    self.field = 1234567 + argument_number_one
+    return 'a string literal which is long enough to cross blocks \' with an escaped quote'
+
+x = VeryLongClassNameThatSpansMoreThanThirtyTwoBytes()
+if x.method_with_a_long_name_as_well(1, 2) != "short":
+                                print "deep", 00000000000000000000000000000000000042
+)";
+  auto previous = ActiveSimdLevel();
+  SetSimdLevel(SimdLevel::Scalar);
+  auto expected = Tokens(program);
+  for (auto level : Levels()) {
+    SetSimdLevel(level);
+    ASSERT_EQUAL(Tokens(program), expected);
+  }
+  SetSimdLevel(previous);
+}
+
+void RunCharScanTests(TestRunner& tr) {
+  RUN_TEST(tr, Parse::TestCharScanMatchesCharacterClasses);
+  RUN_TEST(tr, Parse::TestLexerTokensAtEverySimdLevel);
+}
+
+} /* namespace Parse */
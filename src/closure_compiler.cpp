@@ -0,0 +1,624 @@
+#include "closure_compiler.h"
+#include "object.h"
+#include "optimizer.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+
+#include <functional>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    using NumberCode = std::function<int(Closure&)>;
+    using BoolCode = std::function<bool(Closure&)>;
+    using IType = Runtime::IObject::Type;
+
+    template <typename T>
+    bool Is(const Statement& st)
+    {
+        return typeid(st) == typeid(T);
+    }
+
+    const Runtime::Number* AsNumber(const ObjectHolder& holder)
+    {
+        if (holder && holder.GetType() == IType::Number)
+            return &static_cast<const Runtime::Number&>(*holder);
+        return nullptr;
+    }
+
+    template <ArithmeticOp Op>
+    int Apply(int lhs, int rhs)
+    {
+        if constexpr (Op == ArithmeticOp::Add)
+            return lhs + rhs;
+        else if constexpr (Op == ArithmeticOp::Sub)
+            return lhs - rhs;
+        else if constexpr (Op == ArithmeticOp::Mult)
+            return lhs * rhs;
+        else
+            return lhs / rhs;
+    }
+
+    std::optional<ArithmeticOp> GenericOp(const Statement& st)
+    {
+        if (Is<Add>(st))
+            return ArithmeticOp::Add;
+        if (Is<Sub>(st))
+            return ArithmeticOp::Sub;
+        if (Is<Mult>(st))
+            return ArithmeticOp::Mult;
+        if (Is<Div>(st))
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    std::optional<ArithmeticOp> NumericOp(const Statement& st)
+    {
+        if (Is<NumericAdd>(st))
+            return ArithmeticOp::Add;
+        if (Is<NumericSub>(st))
+            return ArithmeticOp::Sub;
+        if (Is<NumericMult>(st))
+            return ArithmeticOp::Mult;
+        if (Is<NumericDiv>(st))
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    template <typename T>
+    CompiledCode ConstantCode(Statement& st)
+    {
+        return [&value = static_cast<ValueStatement<T>&>(st).value](Closure&) -> Result {
+            return ObjectHolder::Share(value);
+        };
+    }
+
+    class ClosureCompiler
+    {
+    public:
+        // Puts the compiled node into its slot
+        void Wrap(std::unique_ptr<Statement>& slot)
+        {
+            if (slot->TryAs<CompiledTree>())
+                return;
+
+            auto code = Compile(slot);
+            slot = std::make_unique<CompiledTree>(std::move(slot), std::move(code));
+        }
+
+        CompileStats stats;
+
+    private:
+        CompiledCode Compile(std::unique_ptr<Statement>& slot)
+        {
+            if (auto code = CompileKnown(slot))
+            {
+                ++stats.compiled;
+                return code;
+            }
+
+            // Class definitions come here too: their children are the method bodies
+            ++stats.kept;
+            slot->ForEachChild([this](std::unique_ptr<Statement>& child) {
+                Wrap(child);
+            });
+            return [node = slot.get()](Closure& closure) {
+                return node->Execute(closure);
+            };
+        }
+
+        std::vector<CompiledCode> CompileAll(std::vector<std::unique_ptr<Statement>>& nodes)
+        {
+            std::vector<CompiledCode> codes;
+            codes.reserve(nodes.size());
+            for (auto& node : nodes)
+                codes.push_back(Compile(node));
+            return codes;
+        }
+
+        // Empty for the nodes of other kinds
+        CompiledCode CompileKnown(std::unique_ptr<Statement>& slot)
+        {
+            auto& st = *slot;
+            if (Is<NumericConst>(st))
+                return ConstantCode<Runtime::Number>(st);
+            if (Is<StringConst>(st))
+                return ConstantCode<Runtime::String>(st);
+            if (Is<BoolConst>(st))
+                return ConstantCode<Runtime::Bool>(st);
+            if (Is<None>(st))
+            {
+                return [](Closure&) {
+                    return Result();
+                };
+            }
+            if (Is<VariableValue>(st) && static_cast<VariableValue&>(st).dotted_ids.size() == 1)
+            {
+                return [&name = static_cast<VariableValue&>(st).dotted_ids[0]](Closure& closure) -> Result {
+                    auto it = closure.find(name);
+                    if (it == closure.end())
+                        throw std::runtime_error("VariableValue: " + name + " cant be found");
+                    if (!it->second)
+                        return ObjectHolder::Own(Runtime::None());
+                    return it->second;
+                };
+            }
+            if (Is<Assignment>(st))
+            {
+                auto& p = static_cast<Assignment&>(st);
+                return [&var = p.var, rv = Compile(p.rv)](Closure& closure) -> Result {
+                    auto& obj = closure[var];
+                    obj = rv(closure);
+                    return obj;
+                };
+            }
+            if (Is<FieldAssignment>(st))
+            {
+                auto& p = static_cast<FieldAssignment&>(st);
+                return [&p, rv = Compile(p.right_value)](Closure& closure) -> Result {
+                    auto pCls = p.object.Execute(closure);
+                    if (pCls->GetType() != IType::Instance)
+                        throw std::runtime_error("FieldAssignment: ");
+
+                    auto& res = pCls.GetAs<Runtime::ClassInstance>()->Fields()[p.field_name];
+                    res = rv(closure);
+                    Runtime::ClassInstance::TouchFields();
+                    return res;
+                };
+            }
+            if (Is<Print>(st))
+            {
+                return [args = CompileAll(static_cast<Print&>(st).Args())](Closure& closure) {
+                    auto& output = Print::GetOutputStream();
+                    bool first = true;
+                    for (auto& arg : args)
+                    {
+                        if (!first)
+                            output << " ";
+                        first = false;
+
+                        auto res = arg(closure);
+                        if (res)
+                            res->Print(output);
+                        else
+                            Runtime::None{}.Print(output);
+                    }
+                    output << std::endl;
+                    return Result();
+                };
+            }
+            if (Is<MethodCall>(st))
+            {
+                auto& p = static_cast<MethodCall&>(st);
+                return [&p, object = Compile(p.object), args = CompileAll(p.args)](Closure& closure) -> Result {
+                    auto receiver = object(closure);
+                    auto& instance = p.Receiver(receiver);
+
+                    std::vector<ObjectHolder> actual_args;
+                    actual_args.reserve(args.size());
+                    for (auto& arg : args)
+                        actual_args.push_back(arg(closure));
+                    return instance.Call(p.method, actual_args, p.cache.method);
+                };
+            }
+            if (Is<TailCall>(st))
+            {
+                auto& p = static_cast<TailCall&>(st);
+                return [&p, object = Compile(p.Object()), args = CompileAll(p.Args())](Closure& closure) {
+                    auto call = std::make_shared<TailCallRequest>();
+                    call->receiver = object(closure);
+                    call->method = &p.Method();
+                    call->args.reserve(args.size());
+                    for (auto& arg : args)
+                        call->args.push_back(arg(closure));
+
+                    Result res;
+                    res.SetTailCall(std::move(call));
+                    return res;
+                };
+            }
+            if (Is<NewInstance>(st))
+            {
+                auto& p = static_cast<NewInstance&>(st);
+                return [&cls = p.class_, args = CompileAll(p.args)](Closure& closure) -> Result {
+                    auto instance = Runtime::ClassInstance(cls);
+                    std::vector<ObjectHolder> actual_args;
+                    actual_args.reserve(args.size());
+                    for (auto& arg : args)
+                        actual_args.push_back(arg(closure));
+                    if (instance.HasMethod("__init__", actual_args.size()))
+                        instance.Call("__init__", actual_args);
+
+                    return ObjectHolder::Own(std::move(instance));
+                };
+            }
+            if (Is<Stringify>(st))
+            {
+                return [argument = Compile(static_cast<Stringify&>(st).Argument())](Closure& closure) -> Result {
+                    std::ostringstream os;
+                    argument(closure)->Print(os);
+                    return ObjectHolder::Own(Runtime::String(os.str()));
+                };
+            }
+            if (Is<Negate>(st))
+            {
+                return [argument = Compile(static_cast<Negate&>(st).Argument())](Closure& closure) -> Result {
+                    auto value = argument(closure);
+                    if (auto number = AsNumber(value))
+                        return ObjectHolder::Own(Runtime::Number(-number->GetValue()));
+                    return CallOperator(std::move(value), ObjectHolder::Own(Runtime::Number(-1)), ArithmeticOp::Mult);
+                };
+            }
+            if (Is<Not>(st))
+            {
+                return [argument = Compile(static_cast<Not&>(st).Argument())](Closure& closure) -> Result {
+                    auto obj = argument(closure);
+                    if (!obj)
+                        throw std::runtime_error("Not: object is nullptr");
+                    if (obj.GetType() != IType::Instance)
+                        return ObjectHolder::Own(Runtime::Bool(!obj->IsTrue()));
+
+                    auto cls = obj.GetAs<Runtime::ClassInstance>();
+                    if (!cls->HasMethod("__not__", 0))
+                        throw std::runtime_error("Not: cls has no such method");
+                    return cls->Call("__not__", {});
+                };
+            }
+            if (Is<Or>(st) || Is<And>(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                auto lhs = Compile(p.Lhs());
+                auto rhs = Compile(p.Rhs());
+                if (Is<Or>(st))
+                {
+                    return [lhs, rhs](Closure& closure) -> Result {
+                        auto left = lhs(closure), right = rhs(closure);
+                        return ObjectHolder::Own(Runtime::Bool(left->IsTrue() || right->IsTrue()));
+                    };
+                }
+                return [lhs, rhs](Closure& closure) -> Result {
+                    auto left = lhs(closure), right = rhs(closure);
+                    return ObjectHolder::Own(Runtime::Bool(left->IsTrue() && right->IsTrue()));
+                };
+            }
+            if (auto op = GenericOp(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                switch (*op)
+                {
+                    case ArithmeticOp::Add:
+                        return CompileArithmetic<ArithmeticOp::Add>(p);
+                    case ArithmeticOp::Sub:
+                        return CompileArithmetic<ArithmeticOp::Sub>(p);
+                    case ArithmeticOp::Mult:
+                        return CompileArithmetic<ArithmeticOp::Mult>(p);
+                    default:
+                        return CompileArithmetic<ArithmeticOp::Div>(p);
+                }
+            }
+            if (auto value = NumberCodeOf(st))
+            {
+                return [value](Closure& closure) -> Result {
+                    return ObjectHolder::Own(Runtime::Number(value(closure)));
+                };
+            }
+            if (auto value = BoolCodeOf(st))
+            {
+                return [value](Closure& closure) -> Result {
+                    return ObjectHolder::Own(Runtime::Bool(value(closure)));
+                };
+            }
+            if (Is<StringConcat>(st))
+            {
+                auto& p = static_cast<StringConcat&>(st);
+                return [lhs = Compile(p.Lhs()), rhs = Compile(p.Rhs())](Closure& closure) -> Result {
+                    auto left = lhs(closure), right = rhs(closure);
+                    return ObjectHolder::Own(Runtime::String(
+                        static_cast<const Runtime::String&>(*left).GetValue()
+                        + static_cast<const Runtime::String&>(*right).GetValue()
+                    ));
+                };
+            }
+            if (Is<Comparison>(st))
+            {
+                auto& p = static_cast<Comparison&>(st);
+                return [test = CompileComparison(p.GetComparator(), p.Lhs(), p.Rhs())](Closure& closure) -> Result {
+                    return ObjectHolder::Own(Runtime::Bool(test(closure)));
+                };
+            }
+            if (Is<Compound>(st))
+            {
+                return [statements = CompileAll(static_cast<Compound&>(st).Statements())](Closure& closure) {
+                    Result res;
+                    for (auto& statement : statements)
+                    {
+                        res = statement(closure);
+                        if (res.IsNeedToReturn())
+                            return res;
+                    }
+                    return Result();
+                };
+            }
+            if (Is<Return>(st))
+            {
+                return [value = Compile(static_cast<Return&>(st).Value())](Closure& closure) {
+                    Result res(value(closure));
+                    res.SetNeedToReturn();
+                    return res;
+                };
+            }
+            if (Is<IfElse>(st) || Is<TypedIfElse>(st))
+            {
+                // Missing parts are reported by IfElse::Execute
+                auto& p = static_cast<IfElse&>(st);
+                if (!p.Condition() || !p.IfBody())
+                    return {};
+
+                auto test = Is<TypedIfElse>(st) ? CompileBool(p.Condition()) : CompileTruth(p.Condition());
+                return CompileBranch(std::move(test), p.IfBody(), p.ElseBody());
+            }
+            if (Is<IfCompare>(st))
+            {
+                auto& p = static_cast<IfCompare&>(st);
+                auto test = CompileComparison(p.GetComparator(), p.Lhs(), p.Rhs());
+                return CompileBranch(std::move(test), p.IfBody(), p.ElseBody());
+            }
+            return {};
+        }
+
+        template <ArithmeticOp Op>
+        CompiledCode CompileArithmetic(BinaryOperation& node)
+        {
+            auto lhs = Compile(node.Lhs());
+            // x + 1 and the like read the number from the node
+            if (Is<NumericConst>(*node.Rhs()))
+            {
+                ++stats.compiled;
+                auto& value = static_cast<NumericConst&>(*node.Rhs()).value;
+                return [lhs, &value](Closure& closure) -> Result {
+                    auto left = lhs(closure);
+                    if (auto number = AsNumber(left))
+                        return ObjectHolder::Own(Runtime::Number(Apply<Op>(number->GetValue(), value.GetValue())));
+                    return CallOperator(left, ObjectHolder::Share(value), Op);
+                };
+            }
+
+            auto rhs = Compile(node.Rhs());
+            return [lhs, rhs](Closure& closure) -> Result {
+                auto left = lhs(closure), right = rhs(closure);
+                auto l = AsNumber(left), r = AsNumber(right);
+                if (l && r)
+                    return ObjectHolder::Own(Runtime::Number(Apply<Op>(l->GetValue(), r->GetValue())));
+                return CallOperator(left, right, Op);
+            };
+        }
+
+        // Operands of the nodes specialized by type inference are proven to be
+        // numbers or bools. Those of other kinds are unboxed, as in NumericOperand
+        NumberCode CompileNumber(std::unique_ptr<Statement>& slot)
+        {
+            if (auto value = NumberCodeOf(*slot))
+            {
+                ++stats.compiled;
+                return value;
+            }
+
+            return [value = Compile(slot)](Closure& closure) {
+                return static_cast<const Runtime::Number&>(*value(closure)).GetValue();
+            };
+        }
+
+        // Empty for the nodes which do not give unboxed numbers
+        NumberCode NumberCodeOf(Statement& st)
+        {
+            if (Is<NumericConst>(st))
+            {
+                return [value = static_cast<NumericConst&>(st).value.GetValue()](Closure&) {
+                    return value;
+                };
+            }
+            if (Is<NumericNegate>(st))
+            {
+                return [value = CompileNumber(static_cast<NumericNegate&>(st).Argument())](Closure& closure) {
+                    return -value(closure);
+                };
+            }
+            if (auto op = NumericOp(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                switch (*op)
+                {
+                    case ArithmeticOp::Add:
+                        return CompileNumericArithmetic<ArithmeticOp::Add>(p);
+                    case ArithmeticOp::Sub:
+                        return CompileNumericArithmetic<ArithmeticOp::Sub>(p);
+                    case ArithmeticOp::Mult:
+                        return CompileNumericArithmetic<ArithmeticOp::Mult>(p);
+                    default:
+                        return CompileNumericArithmetic<ArithmeticOp::Div>(p);
+                }
+            }
+            return {};
+        }
+
+        template <ArithmeticOp Op>
+        NumberCode CompileNumericArithmetic(BinaryOperation& node)
+        {
+            auto lhs = CompileNumber(node.Lhs());
+            if (Is<NumericConst>(*node.Rhs()))
+            {
+                ++stats.compiled;
+                return [lhs, rhs = static_cast<NumericConst&>(*node.Rhs()).value.GetValue()](Closure& closure) {
+                    return Apply<Op>(lhs(closure), rhs);
+                };
+            }
+
+            auto rhs = CompileNumber(node.Rhs());
+            return [lhs, rhs](Closure& closure) {
+                int left = lhs(closure);
+                return Apply<Op>(left, rhs(closure));
+            };
+        }
+
+        BoolCode CompileBool(std::unique_ptr<Statement>& slot)
+        {
+            if (auto value = BoolCodeOf(*slot))
+            {
+                ++stats.compiled;
+                return value;
+            }
+
+            return [value = Compile(slot)](Closure& closure) {
+                return static_cast<const Runtime::Bool&>(*value(closure)).GetValue();
+            };
+        }
+
+        // Empty for the nodes which do not give unboxed bools
+        BoolCode BoolCodeOf(Statement& st)
+        {
+            if (Is<BoolConst>(st))
+            {
+                return [value = static_cast<BoolConst&>(st).value.GetValue()](Closure&) {
+                    return value;
+                };
+            }
+            if (Is<NumericComparison>(st))
+            {
+                auto& p = static_cast<NumericComparison&>(st);
+                auto lhs = CompileNumber(p.Lhs());
+                auto rhs = CompileNumber(p.Rhs());
+                return [op = p.Op(), lhs, rhs](Closure& closure) {
+                    int left = lhs(closure);
+                    return Compare(op, left, rhs(closure));
+                };
+            }
+            if (Is<StringComparison>(st))
+            {
+                auto& p = static_cast<StringComparison&>(st);
+                return [op = p.Op(), lhs = Compile(p.Lhs()), rhs = Compile(p.Rhs())](Closure& closure) {
+                    auto left = lhs(closure), right = rhs(closure);
+                    return Compare(
+                        op,
+                        static_cast<const Runtime::String&>(*left).GetValue(),
+                        static_cast<const Runtime::String&>(*right).GetValue()
+                    );
+                };
+            }
+            if (Is<BoolNot>(st))
+            {
+                return [value = CompileBool(static_cast<BoolNot&>(st).Argument())](Closure& closure) {
+                    return !value(closure);
+                };
+            }
+            if (Is<BoolOr>(st) || Is<BoolAnd>(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                auto lhs = CompileBool(p.Lhs());
+                auto rhs = CompileBool(p.Rhs());
+                // Both operands are evaluated, as in Or and And
+                if (Is<BoolOr>(st))
+                {
+                    return [lhs, rhs](Closure& closure) {
+                        bool left = lhs(closure), right = rhs(closure);
+                        return left || right;
+                    };
+                }
+                return [lhs, rhs](Closure& closure) {
+                    bool left = lhs(closure), right = rhs(closure);
+                    return left && right;
+                };
+            }
+            return {};
+        }
+
+        BoolCode CompileTruth(std::unique_ptr<Statement>& condition)
+        {
+            return [value = Compile(condition)](Closure& closure) {
+                return value(closure)->IsTrue();
+            };
+        }
+
+        BoolCode CompileComparison(
+            const Comparison::Comparator& comparator, std::unique_ptr<Statement>& lhs, std::unique_ptr<Statement>& rhs
+        )
+        {
+            auto left = Compile(lhs);
+            auto right = Compile(rhs);
+            auto op = GetCompareOp(comparator);
+            if (!op)
+            {
+                return [&comparator, left, right](Closure& closure) {
+                    auto l = left(closure), r = right(closure);
+                    return comparator(l, r);
+                };
+            }
+
+            // Numbers are compared in place, everything else takes the comparator
+            return [&comparator, op = *op, left, right](Closure& closure) {
+                auto l = left(closure), r = right(closure);
+                auto lnum = AsNumber(l), rnum = AsNumber(r);
+                if (lnum && rnum)
+                    return Compare(op, lnum->GetValue(), rnum->GetValue());
+                return comparator(l, r);
+            };
+        }
+
+        CompiledCode CompileBranch(
+            BoolCode test, std::unique_ptr<Statement>& if_body, std::unique_ptr<Statement>& else_body
+        )
+        {
+            auto then_code = Compile(if_body);
+            if (!else_body)
+            {
+                return [test, then_code](Closure& closure) {
+                    if (test(closure))
+                        return then_code(closure);
+                    return Result();
+                };
+            }
+
+            auto else_code = Compile(else_body);
+            return [test, then_code, else_code](Closure& closure) {
+                if (test(closure))
+                    return then_code(closure);
+                return else_code(closure);
+            };
+        }
+    };
+}
+
+// CompiledTree
+//
+CompiledTree::CompiledTree(std::unique_ptr<Statement> tree, CompiledCode code)
+    : tree(std::move(tree)), code(std::move(code))
+{
+}
+
+void CompiledTree::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(tree);
+}
+
+// Free
+//
+CompileStats CompileClosures(std::unique_ptr<Statement>& root)
+{
+    ClosureCompiler compiler;
+    compiler.Wrap(root);
+    return compiler.stats;
+}
+
+} /* namespace Ast */
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+class TestRunner;
+
+namespace Ast {
+
+// A node compiled into a callable. It calls the callables of its children
+// directly, the kinds of the nodes and their operands are resolved once
+using CompiledCode = std::function<Result(Runtime::Closure&)>;
+
+// The root of a compiled tree. The code refers to the constants, names and
+// comparators of the nodes it was made of, so the tree is kept with it
+class CompiledTree : public Statement {
+public:
+  CompiledTree(std::unique_ptr<Statement> tree, CompiledCode code);
+
+  Statement& Tree() {
+    return *tree;
+  }
+
+  Result Execute(Runtime::Closure& closure) override {
+    return code(closure);
+  }
+
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::unique_ptr<Statement> tree;
+  CompiledCode code;
+};
+
+struct CompileStats {
+  // Nodes turned into callables
+  size_t compiled = 0;
+  // Nodes of other kinds, they run their own Execute on compiled children
+  size_t kept = 0;
+};
+
+// Replaces the program and every method body with a CompiledTree.
+// Generic nodes and the nodes specialized by type inference are compiled;
+// the rest keep their Execute, with each of their children compiled
+// separately. Nodes are matched by their exact types, so derived nodes which
+// do more than their base (profile recording, guards) keep their behavior.
+// Goes after every other pass: the code points into the tree
+CompileStats CompileClosures(std::unique_ptr<Statement>& root);
+
+void RunClosureCompilerTests(TestRunner& tr);
+
+} /* namespace Ast */
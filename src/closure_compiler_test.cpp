@@ -0,0 +1,161 @@
+#include "closure_compiler.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Dump(Statement& program) {
+  ostringstream out;
+  DumpTree(program, out);
+  return out.str();
+}
+
+string Run(const string& program, Engine engine) {
+  istringstream input(program);
+  ostringstream output;
+  RunOptions options;
+  options.engine = engine;
+  RunMythonProgram(input, output, options);
+  return output.str();
+}
+
+const string SHAPES = R"(
+class Shape:
+  def __init__(name):
+    self.name = name
+    self.sides = 0
+
+  def __str__():
+    return self.name + '/' + str(self.sides)
+
+  def grow(n):
+    if n > 0:
+      self.sides = self.sides + 1
+      return self.grow(n - 1)
+    return self.sides
+
+class Square(Shape):
+  def __init__():
+    self.name = 'square'
+    self.sides = 4
+
+  def area(a):
+    return a * a
+
+s = Shape('poly')
+q = Square()
+print s.grow(5), q.area(3), s, q
+print s.sides > 4 and not q.sides == 3, -q.area(2) + 1, 'a' < 'b', None
+x = 10
+x = x / 3 - x * 2
+print x, str(x) + '!', s.name
+)";
+
+}
+
+void TestGenericNodesAreCompiled() {
+  auto program = ParseProgramFromString(SHAPES);
+  auto stats = CompileClosures(program);
+
+  // Class definitions and the reads of fields keep Execute
+  ASSERT_EQUAL(stats.kept, 9u);
+  ASSERT(stats.compiled > 50u);
+  ASSERT(program->TryAs<CompiledTree>());
+  ASSERT_EQUAL(Execute(*program), "5 9 poly/5 square/4\nTrue -3 True None\n-17 -17! poly\n");
+}
+
+void TestTypedNodesAreCompiled() {
+  auto program = ParseProgramFromString(R"(
+a = 7
+b = 2
+s = 'x'
+print a * b + a / b - -a, a > b or a == b, not a < b, s + s, s < 'y'
+if a - b > 0:
+  print 'pos'
+else:
+  print 'neg'
+)");
+  ASSERT(SpecializeTypes(program) > 0u);
+  auto expected = Execute(*program);
+  ASSERT_EQUAL(expected, "24 True True xx True\npos\n");
+
+  auto stats = CompileClosures(program);
+  ASSERT_EQUAL(stats.kept, 0u);
+  ASSERT_EQUAL(Execute(*program), expected);
+}
+
+void TestErrorsAreTheSame() {
+  const char* programs[] = {
+    "print y\n",
+    "x = 1\nprint x.f()\n",
+    "x = 'a'\nprint x - 1\n",
+    "class A:\n  def f():\n    return 1\n\na = A()\nprint a.g()\n",
+    "x = 1\nx.y = 2\n",
+  };
+  for (auto text : programs) {
+    auto program = ParseProgramFromString(text);
+    CompileClosures(program);
+    ASSERT_THROWS(Execute(*program), std::runtime_error);
+  }
+}
+
+void TestOutputMatchesTreeEngine() {
+  ASSERT_EQUAL(Run(SHAPES, Engine::Closures), Run(SHAPES, Engine::Tree));
+
+  // Superinstructions and tail calls keep Execute, their children are compiled
+  auto program = ParseProgramFromString(SHAPES);
+  MarkTailCalls(program);
+  FuseSuperinstructions(program);
+  auto expected = Execute(*program);
+  CompileClosures(program);
+  auto dump = Dump(*program);
+  ASSERT_EQUAL(dump.find("CompiledTree\n  Compound\n"), 0u);
+  ASSERT(dump.find("FieldUpdate self.sides") != string::npos);
+  ASSERT_EQUAL(Execute(*program), expected);
+}
+
+void TestCompiledMethodsKeepMemoization() {
+  istringstream input(R"(
+class F:
+  def f(n):
+    return n * n + 1
+
+x = F()
+print x.f(4), x.f(4), x.f(5)
+)");
+  ostringstream output, memo;
+  RunOptions options;
+  options.engine = Engine::Closures;
+  options.inline_methods = false;
+  options.memoize = true;
+  options.memo_report = &memo;
+  RunMythonProgram(input, output, options);
+
+  ASSERT_EQUAL(output.str(), "17 17 26\n");
+  ASSERT(memo.str().find("F.f: 1 hits") != string::npos);
+}
+
+void RunClosureCompilerTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestGenericNodesAreCompiled);
+  RUN_TEST(tr, Ast::TestTypedNodesAreCompiled);
+  RUN_TEST(tr, Ast::TestErrorsAreTheSame);
+  RUN_TEST(tr, Ast::TestOutputMatchesTreeEngine);
+  RUN_TEST(tr, Ast::TestCompiledMethodsKeepMemoization);
+}
+
+} /* namespace Ast */
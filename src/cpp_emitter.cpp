@@ -0,0 +1,385 @@
+#include "cpp_emitter.h"
+#include "type_inference.h"
+
+#include <cstdio>
+#include <map>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Ast {
+
+namespace
+{
+    template <typename T>
+    bool Is(const Statement& st)
+    {
+        return typeid(st) == typeid(T);
+    }
+
+    // A C++ literal of the string
+    std::string Literal(const std::string& value)
+    {
+        std::string res = "\"";
+        for (unsigned char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                res += '\\';
+                res += static_cast<char>(c);
+            }
+            else if (c == '\n')
+                res += "\\n";
+            else if (c == '\t')
+                res += "\\t";
+            else if (c < 0x20 || c >= 0x7F)
+            {
+                // Three digits, so the next character is never taken into the escape
+                char escape[5];
+                std::snprintf(escape, sizeof(escape), "\\%03o", c);
+                res += escape;
+            }
+            else
+                res += static_cast<char>(c);
+        }
+        return res + "\"";
+    }
+
+    const char* ComparatorName(CompareOp op)
+    {
+        switch (op)
+        {
+        case CompareOp::Equal:
+            return "Runtime::Equal";
+        case CompareOp::NotEqual:
+            return "Runtime::NotEqual";
+        case CompareOp::Less:
+            return "Runtime::Less";
+        case CompareOp::Greater:
+            return "Runtime::Greater";
+        case CompareOp::LessOrEqual:
+            return "Runtime::LessOrEqual";
+        default:
+            return "Runtime::GreaterOrEqual";
+        }
+    }
+
+    const char* OperatorName(const Statement& st)
+    {
+        if (Is<Add>(st))
+            return "Ast::ArithmeticOp::Add";
+        if (Is<Sub>(st))
+            return "Ast::ArithmeticOp::Sub";
+        if (Is<Mult>(st))
+            return "Ast::ArithmeticOp::Mult";
+        if (Is<Div>(st))
+            return "Ast::ArithmeticOp::Div";
+        return nullptr;
+    }
+
+    // Operands are evaluated into temporaries, one statement each, so the
+    // C++ keeps the order of evaluation of the nodes
+    class CppEmitter {
+    public:
+        void Emit(Statement& program, std::ostream& out)
+        {
+            CollectClasses(program);
+            for (size_t i = 0; i < classes.size(); ++i)
+            {
+                for (auto& method : classes[i]->Methods())
+                {
+                    std::string name = "method_" + std::to_string(methods++);
+                    declarations << "Ast::Result " << name << "(Runtime::Closure& closure);  // "
+                        << classes[i]->GetName() << "." << method.name << "\n";
+                    EmitFunction(name, *method.body);
+                }
+            }
+            in_method = false;
+            EmitFunction("program", program);
+
+            out << "// Translated from Mython\n"
+                << "#include \"native_program.h\"\n\n"
+                << "#include <ostream>\n#include <string>\n#include <vector>\n\n"
+                << "namespace {\n\n"
+                << constants.str() << "\n";
+            for (size_t i = 0; i < classes.size(); ++i)
+                out << "const Runtime::Class* class_" << i << " = nullptr;  // " << classes[i]->GetName() << "\n";
+            out << "std::vector<ObjectHolder> classes;\n\n"
+                << declarations.str() << "\n"
+                << functions.str();
+            EmitClasses(out);
+            out << "}\n\n"
+                << "int main()\n{\n"
+                << "    DefineClasses();\n"
+                << "    return Ast::RunNativeProgram(&program);\n"
+                << "}\n";
+        }
+
+    private:
+        void CollectClasses(Statement& node)
+        {
+            if (auto definition = node.TryAs<ClassDefinition>())
+            {
+                class_ids[&definition->GetClass()] = classes.size();
+                classes.push_back(&definition->GetClass());
+            }
+            node.ForEachChild([this](std::unique_ptr<Statement>& child) {
+                CollectClasses(*child);
+            });
+        }
+
+        void EmitClasses(std::ostream& out)
+        {
+            out << "void DefineClasses()\n{\n";
+            size_t method_id = 0;
+            for (size_t i = 0; i < classes.size(); ++i)
+            {
+                auto& cls = *classes[i];
+                std::string list = "methods_" + std::to_string(i);
+                out << "    std::vector<Runtime::Method> " << list << ";\n";
+                for (auto& method : cls.Methods())
+                {
+                    out << "    " << list << ".push_back(Ast::NativeMethod(" << Literal(method.name) << ", {";
+                    for (size_t p = 0; p < method.formal_params.size(); ++p)
+                        out << (p ? ", " : "") << Literal(method.formal_params[p]);
+                    out << "}, &method_" << method_id++ << "));\n";
+                }
+                std::string parent = "nullptr";
+                if (cls.GetParent())
+                    parent = "class_" + std::to_string(class_ids.at(cls.GetParent()));
+                out << "    classes.push_back(ObjectHolder::Own(Runtime::Class(" << Literal(cls.GetName())
+                    << ", std::move(" << list << "), " << parent << ")));\n"
+                    << "    class_" << i << " = classes.back().TryAs<Runtime::Class>();\n";
+            }
+            out << "}\n\n";
+        }
+
+        void EmitFunction(const std::string& name, Statement& body)
+        {
+            functions << "Ast::Result " << name << "(Runtime::Closure& closure)\n{\n";
+            indent = 1;
+            EmitStatement(body);
+            Line("return ObjectHolder();");
+            functions << "}\n\n";
+        }
+
+        void Line(const std::string& text)
+        {
+            functions << std::string(4 * indent, ' ') << text << "\n";
+        }
+
+        std::string NewName(const char* prefix)
+        {
+            return prefix + std::to_string(temps++);
+        }
+
+        std::string Temp(const std::string& value)
+        {
+            auto name = NewName("t");
+            Line("ObjectHolder " + name + " = " + value + ";");
+            return name;
+        }
+
+        // Constants, names and dotted ids are made once, at file scope
+        std::string Constant(const std::string& type, const std::string& value)
+        {
+            auto& name = constant_names[type + "(" + value + ")"];
+            if (name.empty())
+            {
+                name = "constant_" + std::to_string(constant_names.size() - 1);
+                constants << type << " " << name << "(" << value << ");\n";
+            }
+            return name;
+        }
+
+        std::string Name(const std::string& value)
+        {
+            return Constant("const std::string", Literal(value));
+        }
+
+        std::string Path(const std::vector<std::string>& ids)
+        {
+            std::string list;
+            for (auto& id : ids)
+                list += (list.empty() ? "" : ", ") + Literal(id);
+            return Constant("const std::vector<std::string>", "{" + list + "}");
+        }
+
+        void Block(Statement& body)
+        {
+            Line("{");
+            ++indent;
+            EmitStatement(body);
+            --indent;
+            Line("}");
+        }
+
+        void EmitStatement(Statement& st)
+        {
+            if (auto p = st.TryAs<Compound>(); p && Is<Compound>(st))
+            {
+                for (auto& statement : p->Statements())
+                    EmitStatement(*statement);
+            }
+            else if (auto p = st.TryAs<Assignment>(); p && Is<Assignment>(st))
+            {
+                // The variable is there before the value is computed
+                auto slot = NewName("v");
+                Line("ObjectHolder& " + slot + " = closure[" + Name(p->var) + "];");
+                auto value = EmitExpression(*p->rv);
+                Line(slot + " = " + value + ";");
+            }
+            else if (auto p = st.TryAs<FieldAssignment>(); p && Is<FieldAssignment>(st))
+            {
+                auto object = EmitExpression(p->object);
+                auto slot = NewName("v");
+                Line("ObjectHolder& " + slot + " = Ast::FieldsOf(" + object + ")[" + Name(p->field_name) + "];");
+                auto value = EmitExpression(*p->right_value);
+                Line(slot + " = " + value + ";");
+                Line("Runtime::ClassInstance::TouchFields();");
+            }
+            else if (auto p = st.TryAs<Print>(); p && Is<Print>(st))
+            {
+                auto out = NewName("out");
+                Line("std::ostream& " + out + " = Ast::Print::GetOutputStream();");
+                bool first = true;
+                for (auto& arg : p->Args())
+                {
+                    if (!first)
+                        Line(out + " << \" \";");
+                    first = false;
+                    auto value = EmitExpression(*arg);
+                    Line("Ast::PrintValue(" + out + ", " + value + ");");
+                }
+                Line(out + " << std::endl;");
+            }
+            else if (auto p = st.TryAs<Return>(); p && Is<Return>(st))
+            {
+                auto call = p->Value()->TryAs<MethodCall>();
+                if (in_method && call && Is<MethodCall>(*call))
+                {
+                    // As after MarkTailCalls, which the interpreter runs by default
+                    auto object = EmitExpression(*call->object);
+                    auto args = EmitArgs(call->args);
+                    Line("return Ast::TailCallTo(" + object + ", " + Name(call->method) + ", {" + args + "});");
+                }
+                else
+                    Line("return " + EmitExpression(*p->Value()) + ";");
+            }
+            else if (auto p = st.TryAs<IfElse>(); p && Is<IfElse>(st))
+            {
+                auto condition = EmitExpression(*p->Condition());
+                Line("if (" + condition + "->IsTrue())");
+                Block(*p->IfBody());
+                if (p->ElseBody())
+                {
+                    Line("else");
+                    Block(*p->ElseBody());
+                }
+            }
+            else if (auto p = st.TryAs<ClassDefinition>(); p && Is<ClassDefinition>(st))
+            {
+                Line("// class " + p->GetClass().GetName());
+            }
+            else
+            {
+                EmitExpression(st);
+            }
+        }
+
+        std::string EmitExpression(Statement& st)
+        {
+            if (auto p = st.TryAs<NumericConst>(); p && Is<NumericConst>(st))
+                return "ObjectHolder::Share(" + Constant("Runtime::Number", std::to_string(p->value.GetValue())) + ")";
+            if (auto p = st.TryAs<StringConst>(); p && Is<StringConst>(st))
+                return "ObjectHolder::Share(" + Constant("Runtime::String", Literal(p->value.GetValue())) + ")";
+            if (auto p = st.TryAs<BoolConst>(); p && Is<BoolConst>(st))
+                return "ObjectHolder::Share(" + Constant("Runtime::Bool", p->value.GetValue() ? "true" : "false") + ")";
+            if (Is<None>(st))
+                return "ObjectHolder()";
+            if (auto p = st.TryAs<VariableValue>(); p && Is<VariableValue>(st))
+                return Temp("Ast::ReadVariable(closure, " + Path(p->dotted_ids) + ")");
+            if (auto p = st.TryAs<MethodCall>(); p && Is<MethodCall>(st))
+            {
+                auto object = EmitExpression(*p->object);
+                if (object[0] != 't')
+                    object = Temp(object);
+                auto receiver = NewName("r");
+                Line("Runtime::ClassInstance& " + receiver + " = Ast::ReceiverOf(" + object + ", " + Name(p->method) + ");");
+                auto args = EmitArgs(p->args);
+                return Temp(receiver + ".Call(" + Name(p->method) + ", {" + args + "})");
+            }
+            if (auto p = st.TryAs<NewInstance>(); p && Is<NewInstance>(st))
+            {
+                auto args = EmitArgs(p->args);
+                auto cls = "class_" + std::to_string(class_ids.at(&p->class_));
+                return Temp("Ast::Instantiate(*" + cls + ", {" + args + "})");
+            }
+            if (auto p = st.TryAs<Stringify>(); p && Is<Stringify>(st))
+                return Temp("Ast::StringifyValue(" + EmitExpression(*p->Argument()) + ")");
+            if (auto p = st.TryAs<Not>(); p && Is<Not>(st))
+                return Temp("Ast::NotValue(" + EmitExpression(*p->Argument()) + ")");
+            if (auto op = OperatorName(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                auto lhs = EmitExpression(*p.Lhs());
+                auto rhs = EmitExpression(*p.Rhs());
+                return Temp("Ast::CallOperator(" + lhs + ", " + rhs + ", " + op + ")");
+            }
+            if (Is<Or>(st) || Is<And>(st))
+            {
+                auto& p = static_cast<BinaryOperation&>(st);
+                auto lhs = EmitExpression(*p.Lhs());
+                auto rhs = EmitExpression(*p.Rhs());
+                auto op = Is<Or>(st) ? " || " : " && ";
+                return Temp("ObjectHolder::Own(Runtime::Bool(" + lhs + "->IsTrue()" + op + rhs + "->IsTrue()))");
+            }
+            if (auto p = st.TryAs<Comparison>(); p && Is<Comparison>(st))
+            {
+                auto op = GetCompareOp(p->GetComparator());
+                if (!op)
+                    throw std::runtime_error("C++ translation: unknown comparator");
+                auto lhs = EmitExpression(*p->Lhs());
+                auto rhs = EmitExpression(*p->Rhs());
+                return Temp("ObjectHolder::Own(Runtime::Bool(" + std::string(ComparatorName(*op)) + "(" + lhs + ", " + rhs + ")))");
+            }
+            throw std::runtime_error(std::string("C++ translation: the node is not made by the parser: ") + typeid(st).name());
+        }
+
+        std::string EmitArgs(std::vector<std::unique_ptr<Statement>>& args)
+        {
+            std::string list;
+            for (auto& arg : args)
+            {
+                auto value = EmitExpression(*arg);
+                list += (list.empty() ? "" : ", ") + value;
+            }
+            return list;
+        }
+
+        std::vector<const Runtime::Class*> classes;
+        std::unordered_map<const Runtime::Class*, size_t> class_ids;
+        size_t methods = 0;
+
+        std::ostringstream constants;
+        std::map<std::string, std::string> constant_names;
+        std::ostringstream declarations;
+        std::ostringstream functions;
+        int indent = 0;
+        size_t temps = 0;
+        bool in_method = true;
+    };
+}
+
+void EmitCpp(Statement& program, std::ostream& out)
+{
+    CppEmitter().Emit(program, out);
+}
+
+} /* namespace Ast */
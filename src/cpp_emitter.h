@@ -0,0 +1,23 @@
+#pragma once
+
+#include "statement.h"
+
+#include <iosfwd>
+
+class TestRunner;
+
+namespace Ast {
+
+// Translates a parsed program into a C++ source file with a main function.
+// Every method and the program become C++ functions which do what the nodes
+// do, through the same operations (see native_program.h); variables stay in
+// closures, and "return obj.method(...)" in methods is a tail call as after
+// MarkTailCalls, so the output is that of the interpreter. Build it with
+//   c++ -std=c++17 -O2 -I<mython>/src program.cpp -L<build> -lmython_runtime -pthread
+// Translates the nodes the parser makes; the nodes of the later passes throw
+// runtime_error
+void EmitCpp(Statement& program, std::ostream& out);
+
+void RunCppEmitterTests(TestRunner& tr);
+
+} /* namespace Ast */
@@ -0,0 +1,140 @@
+#include "cpp_emitter.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "native_program.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Emit(Statement& program) {
+  ostringstream out;
+  EmitCpp(program, out);
+  return out.str();
+}
+
+size_t Count(const string& text, const string& part) {
+  size_t count = 0;
+  for (auto pos = text.find(part); pos != string::npos; pos = text.find(part, pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+const string COUNTERS = R"(
+class Counter:
+  def __init__(start):
+    self.value = start
+
+  def add(n):
+    if n > 0 and not n == 100:
+      self.value = self.value + n
+    else:
+      self.value = self.value - 1
+    return self.value
+
+class Named(Counter):
+  def __str__():
+    return 'named ' + str(self.value)
+
+c = Named(5)
+print c.add(3), c, None
+)";
+
+Result Twice(Runtime::Closure& closure) {
+  return CallOperator(closure.at("n"), closure.at("n"), ArithmeticOp::Add);
+}
+
+}
+
+void TestClassesAndMethodsBecomeFunctions() {
+  auto program = ParseProgramFromString(COUNTERS);
+  auto cpp = Emit(*program);
+
+  ASSERT(cpp.find("Ast::Result method_0(Runtime::Closure& closure);  // Counter.__init__\n") != string::npos);
+  ASSERT(cpp.find("Ast::Result method_2(Runtime::Closure& closure);  // Named.__str__\n") != string::npos);
+  ASSERT(cpp.find("Ast::Result program(Runtime::Closure& closure)\n{\n") != string::npos);
+  ASSERT(cpp.find("methods_0.push_back(Ast::NativeMethod(\"add\", {\"n\"}, &method_1));") != string::npos);
+  ASSERT(cpp.find("Runtime::Class(\"Named\", std::move(methods_1), class_0)") != string::npos);
+  ASSERT(cpp.find("Ast::Instantiate(*class_1, {") != string::npos);
+  ASSERT(cpp.find("Runtime::Bool(Runtime::Equal(") != string::npos);
+  ASSERT(cpp.find("int main()\n") != string::npos);
+}
+
+void TestReturnedCallsOfMethodsAreTailCalls() {
+  auto program = ParseProgramFromString(R"(
+class Loop:
+  def run(n):
+    if n > 0:
+      return self.run(n - 1)
+    return n
+
+loop = Loop()
+print loop.run(3)
+)");
+  auto cpp = Emit(*program);
+
+  ASSERT_EQUAL(Count(cpp, "return Ast::TailCallTo("), 1u);
+  // The call of the program is not in a method
+  ASSERT_EQUAL(Count(cpp, ".Call("), 1u);
+}
+
+void TestConstantsAreSharedAndEscaped() {
+  auto program = ParseProgramFromString("print 'say \"hi\"', 'say \"hi\"', 5, 5, True\nx = 5\nprint x\n");
+  auto cpp = Emit(*program);
+
+  ASSERT_EQUAL(Count(cpp, "Runtime::String constant_"), 1u);
+  ASSERT_EQUAL(Count(cpp, "Runtime::Number constant_"), 1u);
+  ASSERT(cpp.find(R"(("say \"hi\""))") != string::npos);
+  ASSERT(cpp.find("Runtime::Bool constant_") != string::npos);
+  // The variable is in the closure before its value is computed
+  ASSERT(cpp.find("ObjectHolder& v") != string::npos);
+}
+
+void TestNodesOfOtherPassesAreNotTranslated() {
+  auto program = ParseProgramFromString("x = 2\nprint -x\n");
+  OptimizeProgram(program);
+  ASSERT_THROWS(Emit(*program), std::runtime_error);
+}
+
+void TestRunWithEmitCpp() {
+  istringstream input(COUNTERS);
+  ostringstream output, cpp;
+  RunOptions options;
+  options.cpp_output = &cpp;
+  RunMythonProgram(input, output, options);
+
+  ASSERT_EQUAL(output.str(), "");
+  ASSERT(cpp.str().find("Ast::ReadVariable(closure, ") != string::npos);
+}
+
+void TestNativeMethodsRunInTheRuntime() {
+  vector<Runtime::Method> methods;
+  methods.push_back(NativeMethod("twice", {"n"}, &Twice));
+  Runtime::Class cls("Native", std::move(methods), nullptr);
+  Runtime::ClassInstance instance(cls);
+
+  auto result = instance.Call("twice", {ObjectHolder::Own(Runtime::Number(21))});
+  ASSERT_EQUAL(result.TryAs<Runtime::Number>()->GetValue(), 42);
+}
+
+void RunCppEmitterTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestClassesAndMethodsBecomeFunctions);
+  RUN_TEST(tr, Ast::TestReturnedCallsOfMethodsAreTailCalls);
+  RUN_TEST(tr, Ast::TestConstantsAreSharedAndEscaped);
+  RUN_TEST(tr, Ast::TestNodesOfOtherPassesAreNotTranslated);
+  RUN_TEST(tr, Ast::TestRunWithEmitCpp);
+  RUN_TEST(tr, Ast::TestNativeMethodsRunInTheRuntime);
+}
+
+} /* namespace Ast */
@@ -0,0 +1,270 @@
+#include "escape_analysis.h"
+#include "object.h"
+#include "optimizer.h"
+
+#include <algorithm>
+#include <array>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    // A number while object is not set
+    struct ChainValue
+    {
+        int number = 0;
+        ObjectHolder object = {};
+        bool boxed = false;
+    };
+
+    using IType = Runtime::IObject::Type;
+
+    ChainValue Load(ObjectHolder holder)
+    {
+        if (holder && holder.GetType() == IType::Number)
+            return {static_cast<const Runtime::Number&>(*holder).GetValue()};
+        return {0, std::move(holder), true};
+    }
+
+    ObjectHolder Box(ChainValue& value)
+    {
+        if (value.boxed)
+            return std::move(value.object);
+        return ObjectHolder::Own(Runtime::Number(value.number));
+    }
+
+    std::optional<ArithmeticOp> GetArithmeticOp(Statement& st)
+    {
+        if (st.TryAs<Add>())
+            return ArithmeticOp::Add;
+        if (st.TryAs<Sub>())
+            return ArithmeticOp::Sub;
+        if (st.TryAs<Mult>())
+            return ArithmeticOp::Mult;
+        if (st.TryAs<Div>())
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    bool IsOperation(const ChainStep& step)
+    {
+        return step.kind == ChainStep::Arithmetic || step.kind == ChainStep::Negate;
+    }
+
+    bool IsTyped(Statement& st)
+    {
+        return dynamic_cast<NumericExpression*>(&st) || dynamic_cast<BoolExpression*>(&st);
+    }
+
+    // A node of the chain, not a leaf
+    bool IsInner(Statement& st)
+    {
+        return !IsTyped(st) && (GetArithmeticOp(st) || st.TryAs<Negate>());
+    }
+
+    bool IsRoot(Statement& st)
+    {
+        return IsInner(st) || (st.TryAs<Comparison>() && !IsTyped(st));
+    }
+
+    class ChainCompiler
+    {
+    public:
+        void Visit(std::unique_ptr<Statement>& node)
+        {
+            if (!IsRoot(*node))
+            {
+                node->ForEachChild([this](std::unique_ptr<Statement>& child) {
+                    Visit(child);
+                });
+                return;
+            }
+
+            // Leaves are done first, so that the steps point to their final nodes
+            node->ForEachChild([this](std::unique_ptr<Statement>& child) {
+                VisitLeaves(child);
+            });
+
+            std::vector<ChainStep> steps;
+            size_t depth = 0, max_depth = 0;
+            node->ForEachChild([&](std::unique_ptr<Statement>& child) {
+                Compile(*child, steps, depth, max_depth);
+            });
+            if (auto op = GetArithmeticOp(*node))
+                steps.push_back({ChainStep::Arithmetic, nullptr, nullptr, 0, *op});
+            else if (node->TryAs<Negate>())
+                steps.push_back({ChainStep::Negate});
+
+            size_t operations = std::count_if(steps.begin(), steps.end(), IsOperation);
+            // The value of an arithmetic root is put into an object
+            size_t temporaries = node->TryAs<Comparison>() ? operations : operations - 1;
+            if (temporaries == 0 || max_depth > ArithmeticChain::MAX_DEPTH)
+                return;
+
+            auto chain = std::make_unique<ArithmeticChain>(std::move(node), std::move(steps));
+            ++stats.chains;
+            stats.temporaries += chain->Temporaries();
+            node = std::move(chain);
+        }
+
+        EscapeStats stats;
+
+    private:
+        void VisitLeaves(std::unique_ptr<Statement>& node)
+        {
+            if (IsInner(*node))
+            {
+                node->ForEachChild([this](std::unique_ptr<Statement>& child) {
+                    VisitLeaves(child);
+                });
+            }
+            else
+            {
+                Visit(node);
+            }
+        }
+
+        void Push(std::vector<ChainStep>& steps, ChainStep step, size_t& depth, size_t& max_depth)
+        {
+            steps.push_back(step);
+            max_depth = std::max(max_depth, ++depth);
+        }
+
+        void Compile(Statement& node, std::vector<ChainStep>& steps, size_t& depth, size_t& max_depth)
+        {
+            if (auto numeric = dynamic_cast<NumericExpression*>(&node))
+            {
+                Push(steps, {ChainStep::Numeric, &node, numeric}, depth, max_depth);
+            }
+            else if (auto p = node.TryAs<NumericConst>())
+            {
+                Push(steps, {ChainStep::Constant, &node, nullptr, p->value.GetValue()}, depth, max_depth);
+            }
+            else if (auto p = node.TryAs<Negate>())
+            {
+                Compile(*p->Argument(), steps, depth, max_depth);
+                steps.push_back({ChainStep::Negate});
+            }
+            else if (auto op = GetArithmeticOp(node))
+            {
+                auto& binary = static_cast<BinaryOperation&>(node);
+                Compile(*binary.Lhs(), steps, depth, max_depth);
+                Compile(*binary.Rhs(), steps, depth, max_depth);
+                steps.push_back({ChainStep::Arithmetic, nullptr, nullptr, 0, *op});
+                --depth;
+            }
+            else
+            {
+                Push(steps, {ChainStep::Leaf, &node}, depth, max_depth);
+            }
+        }
+    };
+}
+
+// ArithmeticChain
+//
+ArithmeticChain::ArithmeticChain(std::unique_ptr<Statement> expression, std::vector<ChainStep> steps)
+    : expression(std::move(expression)), steps(std::move(steps))
+{
+    comparison = this->expression->TryAs<Comparison>();
+    if (comparison)
+        compare_op = GetCompareOp(comparison->GetComparator());
+}
+
+size_t ArithmeticChain::Temporaries() const
+{
+    size_t operations = std::count_if(steps.begin(), steps.end(), IsOperation);
+    return comparison ? operations : operations - 1;
+}
+
+Result ArithmeticChain::Execute(Closure& closure)
+{
+    std::array<ChainValue, MAX_DEPTH> stack;
+    size_t top = 0;
+
+    for (const auto& step : steps)
+    {
+        switch (step.kind)
+        {
+            case ChainStep::Leaf:
+                stack[top++] = Load(step.node->Execute(closure));
+                break;
+            case ChainStep::Numeric:
+                stack[top++] = {step.numeric->EvaluateNumber(closure)};
+                break;
+            case ChainStep::Constant:
+                stack[top++] = {step.constant};
+                break;
+            case ChainStep::Negate:
+            {
+                // Same as Negate::Execute
+                auto& value = stack[top - 1];
+                if (!value.boxed)
+                    value.number = -value.number;
+                else
+                    value = Load(CallOperator(Box(value), ObjectHolder::Own(Runtime::Number(-1)), ArithmeticOp::Mult));
+                break;
+            }
+            case ChainStep::Arithmetic:
+            {
+                auto& right = stack[--top];
+                auto& left = stack[top - 1];
+                if (left.boxed || right.boxed)
+                {
+                    left = Load(CallOperator(Box(left), Box(right), step.op));
+                    right.object = ObjectHolder();
+                    break;
+                }
+
+                switch (step.op)
+                {
+                    case ArithmeticOp::Add:
+                        left.number += right.number;
+                        break;
+                    case ArithmeticOp::Sub:
+                        left.number -= right.number;
+                        break;
+                    case ArithmeticOp::Mult:
+                        left.number *= right.number;
+                        break;
+                    default:
+                        left.number /= right.number;
+                        break;
+                }
+                break;
+            }
+        }
+    }
+
+    if (!comparison)
+        return Box(stack[0]);
+
+    auto& left = stack[0];
+    auto& right = stack[1];
+    bool result;
+    if (compare_op && !left.boxed && !right.boxed)
+        result = Compare(*compare_op, left.number, right.number);
+    else
+        result = comparison->GetComparator()(Box(left), Box(right));
+    return ObjectHolder::Own(Runtime::Bool(result));
+}
+
+void ArithmeticChain::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(expression);
+}
+
+// Free
+//
+EscapeStats UnboxTemporaries(std::unique_ptr<Statement>& root)
+{
+    ChainCompiler compiler;
+    compiler.Visit(root);
+    return compiler.stats;
+}
+
+} /* namespace Ast */
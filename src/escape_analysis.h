@@ -0,0 +1,75 @@
+#pragma once
+
+#include "statement.h"
+#include "type_inference.h"
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+// One step of an ArithmeticChain, in postfix order
+struct ChainStep {
+  enum Kind {
+    // Executes a node which is not a part of the chain
+    Leaf,
+    // A node proven to give a number (see type_inference.h)
+    Numeric,
+    Constant,
+    Negate,
+    Arithmetic,
+  };
+
+  Kind kind;
+  Statement* node = nullptr;
+  NumericExpression* numeric = nullptr;
+  int constant = 0;
+  ArithmeticOp op = ArithmeticOp::Add;
+};
+
+// A tree of Add, Sub, Mult, Div and Negate, or a Comparison of such trees.
+// The values inside never escape the tree, so numbers are kept unboxed on the
+// native stack; only the value of the root is put into an object.
+// Other values take the generic operations, as they do in the original nodes
+class ArithmeticChain : public Statement {
+public:
+  static const size_t MAX_DEPTH = 16;
+
+  ArithmeticChain(std::unique_ptr<Statement> expression, std::vector<ChainStep> steps);
+
+  Statement& Expression() {
+    return *expression;
+  }
+
+  // Values of the tree which are not put into objects
+  size_t Temporaries() const;
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::unique_ptr<Statement> expression;
+  std::vector<ChainStep> steps;
+  // Set when the root is a Comparison
+  Comparison* comparison = nullptr;
+  std::optional<CompareOp> compare_op;
+};
+
+struct EscapeStats {
+  size_t chains = 0;
+  size_t temporaries = 0;
+};
+
+// Replaces the arithmetic trees with intermediate values, in the program and the
+// method bodies, with ArithmeticChain. Steps point into the tree, so no pass may
+// replace its nodes after this one.
+// Leaves run inside Execute, so the pass is meant for the tree engine only
+EscapeStats UnboxTemporaries(std::unique_ptr<Statement>& root);
+
+void RunEscapeAnalysisTests(TestRunner& tr);
+
+} /* namespace Ast */
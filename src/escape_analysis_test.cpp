@@ -0,0 +1,141 @@
+#include "escape_analysis.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Run(const string& program, bool escape_analysis) {
+  istringstream input(program);
+  ostringstream output;
+  RunOptions options;
+  options.escape_analysis = escape_analysis;
+  RunMythonProgram(input, output, options);
+  return output.str();
+}
+
+}
+
+void TestTemporariesAreFound() {
+  auto program = ParseProgramFromString(R"(
+a = 2
+b = 3
+c = 4
+d = 5
+e = 6
+x = a * b + c * d - e
+print x, a + b, x < a * e + 1, -a - b
+)");
+  auto stats = UnboxTemporaries(program);
+
+  // a * b, c * d and their sum; a * e and a * e + 1; -a. a + b has none
+  ASSERT_EQUAL(stats.chains, 3u);
+  ASSERT_EQUAL(stats.temporaries, 6u);
+
+  ostringstream dump;
+  DumpTree(*program, dump);
+  ASSERT(dump.str().find("ArithmeticChain, 3 unboxed") != string::npos);
+  ASSERT_EQUAL(Execute(*program), "20 5 False -5\n");
+}
+
+void TestOtherValuesTakeGenericOperations() {
+  auto program = ParseProgramFromString(R"(
+class Money:
+  def __init__(amount):
+    self.amount = amount
+
+  def __add__(other):
+    return self.amount + other + 100
+
+  def __mult__(k):
+    return self.amount * k
+
+s = 'ab'
+m = Money(3)
+print s + 'c' + s, m + 1 + 2, -m * 2, m + 2 * 5, 'x' + str(1 + 2 * 3)
+)");
+  UnboxTemporaries(program);
+  ASSERT_EQUAL(Execute(*program), "abcab 106 -6 113 x7\n");
+
+  program = ParseProgramFromString("x = 'a'\nprint x * 2 + 1\n");
+  UnboxTemporaries(program);
+  ASSERT_THROWS(Execute(*program), std::runtime_error);
+}
+
+void TestDeepExpressionsAreLeftAlone() {
+  string expression = "x";
+  for (int i = 0; i < 20; ++i) {
+    expression = "x + (" + expression + ")";
+  }
+  auto program = ParseProgramFromString("x = 1\nprint " + expression + "\n");
+  ASSERT_EQUAL(UnboxTemporaries(program).chains, 0u);
+  ASSERT_EQUAL(Execute(*program), "21\n");
+}
+
+void TestOutputMatchesBoxedRun() {
+  const string program = R"(
+class Poly:
+  def __init__(a, b, c):
+    self.a = a
+    self.b = b
+    self.c = c
+
+  def at(x):
+    return self.a * x * x + self.b * x + self.c
+
+  def root_between(lo, hi):
+    if hi - lo < 2:
+      return lo
+    mid = (lo + hi) / 2
+    if self.at(lo) * self.at(mid) < 0 + 1 - 1:
+      return self.root_between(lo, mid)
+    return self.root_between(mid, hi)
+
+p = Poly(1, 0, 0 - 400)
+print p.at(3) - p.at(2) * 2, p.root_between(0, 100), -p.at(1) + 1
+)";
+  ASSERT_EQUAL(Run(program, false), "401 20 400\n");
+  ASSERT_EQUAL(Run(program, true), "401 20 400\n");
+}
+
+void TestChainsKeepPurity() {
+  istringstream input(R"(
+class F:
+  def f(n):
+    return n * n + n * 2 + 1
+
+x = F()
+print x.f(4), x.f(4)
+)");
+  ostringstream output, memo;
+  RunOptions options;
+  // Inlined calls do not reach the cache
+  options.inline_methods = false;
+  options.memoize = true;
+  options.memo_report = &memo;
+  RunMythonProgram(input, output, options);
+
+  ASSERT_EQUAL(output.str(), "25 25\n");
+  ASSERT(memo.str().find("F.f: 1 hits") != string::npos);
+}
+
+void RunEscapeAnalysisTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestTemporariesAreFound);
+  RUN_TEST(tr, Ast::TestOtherValuesTakeGenericOperations);
+  RUN_TEST(tr, Ast::TestDeepExpressionsAreLeftAlone);
+  RUN_TEST(tr, Ast::TestOutputMatchesBoxedRun);
+  RUN_TEST(tr, Ast::TestChainsKeepPurity);
+}
+
+} /* namespace Ast */
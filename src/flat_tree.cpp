@@ -0,0 +1,1030 @@
+#include "flat_tree.h"
+#include "comparators.h"
+#include "object.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <typeinfo>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    using IType = Runtime::IObject::Type;
+
+    template <typename T>
+    bool Is(const Statement& st)
+    {
+        return typeid(st) == typeid(T);
+    }
+
+    template <typename... Ts>
+    bool IsAny(const Statement& st)
+    {
+        return (Is<Ts>(st) || ...);
+    }
+
+    // Nodes which compute the same values as their generic base
+    std::optional<ArithmeticOp> GetArithmeticOp(const Statement& st)
+    {
+        if (IsAny<Add, NumericAdd, StringConcat, GuardedAdd>(st))
+            return ArithmeticOp::Add;
+        if (IsAny<Sub, NumericSub>(st))
+            return ArithmeticOp::Sub;
+        if (IsAny<Mult, NumericMult>(st))
+            return ArithmeticOp::Mult;
+        if (IsAny<Div, NumericDiv>(st))
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    std::string Join(const std::vector<std::string>& names, const std::vector<uint32_t>& ids, uint32_t start, uint32_t length)
+    {
+        std::string res = names[ids[start]];
+        for (uint32_t i = start + 1; i < start + length; ++i)
+            res += "." + names[ids[i]];
+        return res;
+    }
+
+    // Drops the children pushed by Children, also when an exception leaves the node
+    class ChildrenScope
+    {
+    public:
+        explicit ChildrenScope(std::vector<uint32_t>& stack)
+            : stack(stack), base(stack.size())
+        {
+        }
+
+        ~ChildrenScope()
+        {
+            stack.resize(base);
+        }
+
+        uint32_t operator[](size_t i) const
+        {
+            return stack[base + i];
+        }
+
+    private:
+        std::vector<uint32_t>& stack;
+        size_t base;
+    };
+
+    // The comparators the parser makes, by their number in a saved layout
+    using ComparatorFunction = bool (*)(ObjectHolder, ObjectHolder);
+    const ComparatorFunction COMPARATORS[] = {
+        Runtime::Equal, Runtime::NotEqual, Runtime::Less, Runtime::Greater, Runtime::LessOrEqual, Runtime::GreaterOrEqual,
+    };
+
+    enum class ConstantTag : uint8_t
+    {
+        Number,
+        String,
+        Bool,
+    };
+
+    const uint32_t NO_PARENT = UINT32_MAX;
+
+    // Numbers are written in the byte order of the machine
+    class Writer
+    {
+    public:
+        explicit Writer(std::string& out)
+            : out(out)
+        {
+        }
+
+        template <typename T>
+        void Put(T value)
+        {
+            out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        template <typename T>
+        void PutArray(const std::vector<T>& values)
+        {
+            Put(static_cast<uint32_t>(values.size()));
+            out.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+        }
+
+        void PutString(const std::string& value)
+        {
+            Put(static_cast<uint32_t>(value.size()));
+            out += value;
+        }
+
+    private:
+        std::string& out;
+    };
+
+    class Reader
+    {
+    public:
+        explicit Reader(std::string_view& data)
+            : data(data)
+        {
+        }
+
+        template <typename T>
+        T Get()
+        {
+            T value;
+            std::memcpy(&value, Take(sizeof(T)).data(), sizeof(T));
+            return value;
+        }
+
+        template <typename T>
+        std::vector<T> GetArray()
+        {
+            auto bytes = Take(size_t{Get<uint32_t>()} * sizeof(T));
+            std::vector<T> values(bytes.size() / sizeof(T));
+            std::memcpy(values.data(), bytes.data(), bytes.size());
+            return values;
+        }
+
+        // Of the items that follow, each takes a byte at least
+        uint32_t GetCount()
+        {
+            uint32_t count = Get<uint32_t>();
+            if (count > data.size())
+                throw std::runtime_error("Saved layout is cut short");
+            return count;
+        }
+
+        std::string GetString()
+        {
+            return std::string(Take(Get<uint32_t>()));
+        }
+
+    private:
+        std::string_view Take(size_t size)
+        {
+            if (size > data.size())
+                throw std::runtime_error("Saved layout is cut short");
+            auto bytes = data.substr(0, size);
+            data.remove_prefix(size);
+            return bytes;
+        }
+
+        std::string_view& data;
+    };
+}
+
+// FlatTree
+//
+uint32_t FlatTree::Emit(FlatKind kind, uint32_t first, uint32_t operand, uint32_t count)
+{
+    uint32_t index = static_cast<uint32_t>(kinds.size());
+    kinds.push_back(kind);
+    sizes.push_back(index - first + 1);
+    operands.push_back(operand);
+    counts.push_back(count);
+    return index;
+}
+
+uint32_t FlatTree::End() const
+{
+    return static_cast<uint32_t>(kinds.size());
+}
+
+uint32_t FlatTree::First(uint32_t child) const
+{
+    return child - sizes[child] + 1;
+}
+
+uint32_t FlatTree::First(const std::vector<uint32_t>& children) const
+{
+    return children.empty() ? End() : First(children.front());
+}
+
+uint32_t FlatTree::Name(const std::string& name)
+{
+    auto [it, inserted] = name_ids.emplace(name, static_cast<uint32_t>(names.size()));
+    if (inserted)
+        names.push_back(name);
+    return it->second;
+}
+
+uint32_t FlatTree::Path(const std::vector<std::string>& ids)
+{
+    uint32_t start = static_cast<uint32_t>(paths.size());
+    for (auto& id : ids)
+        paths.push_back(Name(id));
+    return start;
+}
+
+uint32_t FlatTree::AddConstant(ObjectHolder value)
+{
+    constants.push_back(std::move(value));
+    return Emit(FlatKind::Constant, End(), static_cast<uint32_t>(constants.size() - 1), 0);
+}
+
+uint32_t FlatTree::AddNone()
+{
+    return Emit(FlatKind::None, End(), 0, 0);
+}
+
+uint32_t FlatTree::AddVariable(const std::vector<std::string>& ids)
+{
+    return Emit(FlatKind::Variable, End(), Path(ids), static_cast<uint32_t>(ids.size()));
+}
+
+uint32_t FlatTree::AddAssign(const std::string& name, uint32_t value)
+{
+    return Emit(FlatKind::Assign, First(value), Name(name), 1);
+}
+
+uint32_t FlatTree::AddFieldAssign(const std::vector<std::string>& object, const std::string& field, uint32_t value)
+{
+    // The path of the object followed by the field
+    uint32_t path = Path(object);
+    paths.push_back(Name(field));
+    return Emit(FlatKind::FieldAssign, First(value), path, static_cast<uint32_t>(object.size()));
+}
+
+uint32_t FlatTree::AddPrint(const std::vector<uint32_t>& args)
+{
+    return Emit(FlatKind::Print, First(args), 0, static_cast<uint32_t>(args.size()));
+}
+
+uint32_t FlatTree::AddCall(uint32_t object, const std::string& method, const std::vector<uint32_t>& args)
+{
+    calls.push_back({Name(method)});
+    return Emit(FlatKind::Call, First(object), static_cast<uint32_t>(calls.size() - 1), static_cast<uint32_t>(args.size() + 1));
+}
+
+uint32_t FlatTree::AddTailCall(uint32_t object, const std::string& method, const std::vector<uint32_t>& args)
+{
+    return ReturnCall(AddCall(object, method, args));
+}
+
+uint32_t FlatTree::ReturnCall(uint32_t call)
+{
+    kinds[call] = FlatKind::TailCall;
+    return call;
+}
+
+uint32_t FlatTree::AddNew(const Runtime::Class& cls, const std::vector<uint32_t>& args)
+{
+    classes.push_back(&cls);
+    return Emit(FlatKind::New, First(args), static_cast<uint32_t>(classes.size() - 1), static_cast<uint32_t>(args.size()));
+}
+
+uint32_t FlatTree::AddStringify(uint32_t argument)
+{
+    return Emit(FlatKind::Stringify, First(argument), 0, 1);
+}
+
+uint32_t FlatTree::AddArithmetic(ArithmeticOp op, uint32_t lhs, uint32_t /*rhs*/)
+{
+    return Emit(FlatKind::Arithmetic, First(lhs), static_cast<uint32_t>(op), 2);
+}
+
+uint32_t FlatTree::AddNegate(uint32_t argument)
+{
+    return Emit(FlatKind::Negate, First(argument), 0, 1);
+}
+
+uint32_t FlatTree::AddLogical(FlatKind kind, uint32_t lhs, uint32_t /*rhs*/)
+{
+    return Emit(kind, First(lhs), 0, 2);
+}
+
+uint32_t FlatTree::AddNot(uint32_t argument)
+{
+    return Emit(FlatKind::Not, First(argument), 0, 1);
+}
+
+uint32_t FlatTree::AddCompare(Comparison::Comparator comparator, uint32_t lhs, uint32_t /*rhs*/)
+{
+    comparators.push_back(std::move(comparator));
+    return Emit(FlatKind::Compare, First(lhs), static_cast<uint32_t>(comparators.size() - 1), 2);
+}
+
+uint32_t FlatTree::AddCompound(const std::vector<uint32_t>& statements)
+{
+    return Emit(FlatKind::Compound, First(statements), 0, static_cast<uint32_t>(statements.size()));
+}
+
+uint32_t FlatTree::AddReturn(uint32_t value)
+{
+    return Emit(FlatKind::Return, First(value), 0, 1);
+}
+
+uint32_t FlatTree::AddIfElse(uint32_t condition, uint32_t /*if_body*/, std::optional<uint32_t> else_body)
+{
+    return Emit(FlatKind::IfElse, First(condition), 0, else_body ? 3 : 2);
+}
+
+uint32_t FlatTree::AddClassDef(ObjectHolder cls, uint32_t first)
+{
+    class_holders.push_back(std::move(cls));
+    return Emit(FlatKind::ClassDef, first, static_cast<uint32_t>(class_holders.size() - 1), 0);
+}
+
+std::vector<uint32_t> FlatTree::AppendAll(std::vector<std::unique_ptr<Statement>>& nodes, std::vector<std::unique_ptr<Statement>*>& bodies)
+{
+    std::vector<uint32_t> roots;
+    roots.reserve(nodes.size());
+    for (auto& node : nodes)
+        roots.push_back(Append(*node, bodies));
+    return roots;
+}
+
+uint32_t FlatTree::Append(Statement& st, std::vector<std::unique_ptr<Statement>*>& bodies)
+{
+    if (IsAny<NumericConst, StringConst, BoolConst>(st))
+    {
+        Closure unused;
+        return AddConstant(st.Execute(unused));
+    }
+    if (Is<None>(st))
+        return AddNone();
+    if (Is<VariableValue>(st))
+        return AddVariable(static_cast<VariableValue&>(st).dotted_ids);
+    if (Is<CachedFieldRead>(st))
+        return AddVariable(static_cast<CachedFieldRead&>(st).Variable().dotted_ids);
+    if (Is<Assignment>(st))
+    {
+        auto& p = static_cast<Assignment&>(st);
+        return AddAssign(p.var, Append(*p.rv, bodies));
+    }
+    if (Is<FieldAssignment>(st))
+    {
+        auto& p = static_cast<FieldAssignment&>(st);
+        return AddFieldAssign(p.object.dotted_ids, p.field_name, Append(*p.right_value, bodies));
+    }
+    if (Is<Print>(st))
+        return AddPrint(AppendAll(static_cast<Print&>(st).Args(), bodies));
+    if (Is<MethodCall>(st))
+    {
+        auto& p = static_cast<MethodCall&>(st);
+        uint32_t object = Append(*p.object, bodies);
+        return AddCall(object, p.method, AppendAll(p.args, bodies));
+    }
+    if (Is<TailCall>(st))
+    {
+        auto& p = static_cast<TailCall&>(st);
+        uint32_t object = Append(*p.Object(), bodies);
+        return AddTailCall(object, p.Method(), AppendAll(p.Args(), bodies));
+    }
+    if (Is<NewInstance>(st))
+    {
+        auto& p = static_cast<NewInstance&>(st);
+        return AddNew(p.class_, AppendAll(p.args, bodies));
+    }
+    if (Is<Stringify>(st))
+        return AddStringify(Append(*static_cast<Stringify&>(st).Argument(), bodies));
+    if (auto op = GetArithmeticOp(st))
+    {
+        auto& p = static_cast<BinaryOperation&>(st);
+        uint32_t lhs = Append(*p.Lhs(), bodies);
+        return AddArithmetic(*op, lhs, Append(*p.Rhs(), bodies));
+    }
+    if (IsAny<Negate, NumericNegate>(st))
+        return AddNegate(Append(*static_cast<Negate&>(st).Argument(), bodies));
+    if (IsAny<Or, BoolOr, And, BoolAnd>(st))
+    {
+        auto& p = static_cast<BinaryOperation&>(st);
+        uint32_t lhs = Append(*p.Lhs(), bodies);
+        return AddLogical(IsAny<Or, BoolOr>(st) ? FlatKind::Or : FlatKind::And, lhs, Append(*p.Rhs(), bodies));
+    }
+    if (IsAny<Not, BoolNot>(st))
+        return AddNot(Append(*static_cast<Not&>(st).Argument(), bodies));
+    if (IsAny<Comparison, NumericComparison, StringComparison, GuardedComparison>(st))
+    {
+        auto& p = static_cast<Comparison&>(st);
+        uint32_t lhs = Append(*p.Lhs(), bodies);
+        return AddCompare(p.GetComparator(), lhs, Append(*p.Rhs(), bodies));
+    }
+    if (Is<Compound>(st))
+        return AddCompound(AppendAll(static_cast<Compound&>(st).Statements(), bodies));
+    if (Is<Return>(st))
+        return AddReturn(Append(*static_cast<Return&>(st).Value(), bodies));
+    if (IsAny<IfElse, TypedIfElse>(st))
+    {
+        // Missing parts are reported by IfElse::Execute
+        auto& p = static_cast<IfElse&>(st);
+        if (p.Condition() && p.IfBody())
+        {
+            uint32_t condition = Append(*p.Condition(), bodies);
+            uint32_t if_body = Append(*p.IfBody(), bodies);
+            std::optional<uint32_t> else_body;
+            if (p.ElseBody())
+                else_body = Append(*p.ElseBody(), bodies);
+            return AddIfElse(condition, if_body, else_body);
+        }
+    }
+    if (Is<ClassDefinition>(st))
+    {
+        // Bodies are laid out after the tree, so they do not break its subtrees
+        st.ForEachChild([&bodies](std::unique_ptr<Statement>& body) {
+            bodies.push_back(&body);
+        });
+        Closure unused;
+        return AddClassDef(st.Execute(unused), End());
+    }
+
+    opaque.push_back(&st);
+    return Emit(FlatKind::Opaque, End(), static_cast<uint32_t>(opaque.size() - 1), 0);
+}
+
+size_t FlatTree::Bytes() const
+{
+    size_t bytes = kinds.capacity() * sizeof(FlatKind)
+        + (sizes.capacity() + operands.capacity() + counts.capacity() + paths.capacity()) * sizeof(uint32_t)
+        + constants.capacity() * sizeof(ObjectHolder)
+        + comparators.capacity() * sizeof(Comparison::Comparator)
+        + classes.capacity() * sizeof(const Runtime::Class*)
+        + class_holders.capacity() * sizeof(ObjectHolder)
+        + calls.capacity() * sizeof(CallSite)
+        + opaque.capacity() * sizeof(Statement*);
+    for (auto& name : names)
+        bytes += sizeof(name) + name.capacity();
+    return bytes;
+}
+
+void FlatTree::Children(uint32_t node, uint32_t count)
+{
+    // Walking back from the last child, each subtree ends right before the next one
+    size_t base = child_stack.size();
+    child_stack.resize(base + count);
+    uint32_t child = node - 1;
+    for (size_t i = count; i-- > 0;)
+    {
+        child_stack[base + i] = child;
+        child -= sizes[child];
+    }
+}
+
+ObjectHolder FlatTree::ReadPath(uint32_t start, uint32_t length, Closure& closure)
+{
+    // Same as VariableValue::Execute
+    auto* scope = &closure;
+    for (uint32_t i = start; i + 1 < start + length; ++i)
+    {
+        auto it = scope->find(names[paths[i]]);
+        if (it == scope->end())
+            throw std::runtime_error("VariableValue: \"" + names[paths[i]] + "\" wasnt found in closure. Ids: "
+                + Join(names, paths, start, length));
+        if (it->second->GetType() != IType::Instance)
+            throw std::runtime_error("VariableValue: \"" + it->first + "\" isnt class Instance. Ids: "
+                + Join(names, paths, start, length));
+        scope = &it->second.GetAs<Runtime::ClassInstance>()->Fields();
+    }
+
+    auto it = scope->find(names[paths[start + length - 1]]);
+    if (it == scope->end())
+        throw std::runtime_error("VariableValue: " + Join(names, paths, start, length) + " cant be found");
+    if (!it->second)
+        return ObjectHolder::Own(Runtime::None());
+    return it->second;
+}
+
+Result FlatTree::Call(uint32_t node, Closure& closure)
+{
+    ChildrenScope children(child_stack);
+    Children(node, counts[node]);
+
+    auto& site = calls[operands[node]];
+    const auto& method = names[site.name];
+    auto receiver = Evaluate(children[0], closure);
+    auto instance = receiver.TryAs<Runtime::ClassInstance>();
+    if (!instance)
+        throw std::runtime_error("Method " + method + " is called on non-instance");
+
+    if (&instance->GetClass() != site.cls)
+    {
+        auto met = instance->GetClass().GetMethod(method);
+        site.cls = &instance->GetClass();
+        site.method = met && met->formal_params.size() == counts[node] - 1 ? met : nullptr;
+    }
+
+    std::vector<ObjectHolder> args;
+    args.reserve(counts[node] - 1);
+    for (uint32_t i = 1; i < counts[node]; ++i)
+        args.push_back(Evaluate(children[i], closure));
+    return instance->Call(method, args, site.method);
+}
+
+Result FlatTree::EvaluateTailCall(uint32_t node, Closure& closure)
+{
+    // Same as TailCall::Execute
+    ChildrenScope children(child_stack);
+    Children(node, counts[node]);
+
+    auto receiver = Evaluate(children[0], closure);
+    std::vector<ObjectHolder> args;
+    args.reserve(counts[node] - 1);
+    for (uint32_t i = 1; i < counts[node]; ++i)
+        args.push_back(Evaluate(children[i], closure));
+    return TailCallTo(std::move(receiver), names[calls[operands[node]].name], std::move(args));
+}
+
+Result FlatTree::EvaluateFieldAssign(uint32_t node, Closure& closure)
+{
+    auto object = ReadPath(operands[node], counts[node], closure);
+    if (object->GetType() != IType::Instance)
+        throw std::runtime_error("FieldAssignment: ");
+
+    auto& res = object.GetAs<Runtime::ClassInstance>()->Fields()[names[paths[operands[node] + counts[node]]]];
+    res = Evaluate(node - 1, closure);
+    Runtime::ClassInstance::TouchFields();
+    return res;
+}
+
+Result FlatTree::EvaluatePrint(uint32_t node, Closure& closure)
+{
+    ChildrenScope children(child_stack);
+    Children(node, counts[node]);
+
+    auto& output = Print::GetOutputStream();
+    for (uint32_t i = 0; i < counts[node]; ++i)
+    {
+        if (i > 0)
+            output << " ";
+        auto res = Evaluate(children[i], closure);
+        if (res)
+            res->Print(output);
+        else
+            Runtime::None{}.Print(output);
+    }
+    output << std::endl;
+    return Result();
+}
+
+Result FlatTree::EvaluateNew(uint32_t node, Closure& closure)
+{
+    ChildrenScope children(child_stack);
+    Children(node, counts[node]);
+
+    auto instance = Runtime::ClassInstance(*classes[operands[node]]);
+    std::vector<ObjectHolder> args;
+    args.reserve(counts[node]);
+    for (uint32_t i = 0; i < counts[node]; ++i)
+        args.push_back(Evaluate(children[i], closure));
+    if (instance.HasMethod("__init__", args.size()))
+        instance.Call("__init__", args);
+    return ObjectHolder::Own(std::move(instance));
+}
+
+Result FlatTree::EvaluateStringify(uint32_t node, Closure& closure)
+{
+    std::ostringstream os;
+    Evaluate(node - 1, closure)->Print(os);
+    return ObjectHolder::Own(Runtime::String(os.str()));
+}
+
+Result FlatTree::EvaluateNot(uint32_t node, Closure& closure)
+{
+    auto obj = Evaluate(node - 1, closure);
+    if (!obj)
+        throw std::runtime_error("Not: object is nullptr");
+    if (obj.GetType() != IType::Instance)
+        return ObjectHolder::Own(Runtime::Bool(!obj->IsTrue()));
+
+    auto cls = obj.GetAs<Runtime::ClassInstance>();
+    if (!cls->HasMethod("__not__", 0))
+        throw std::runtime_error("Not: cls has no such method");
+    return cls->Call("__not__", {});
+}
+
+Result FlatTree::EvaluateCompound(uint32_t node, Closure& closure)
+{
+    ChildrenScope children(child_stack);
+    Children(node, counts[node]);
+
+    for (uint32_t i = 0; i < counts[node]; ++i)
+    {
+        auto res = Evaluate(children[i], closure);
+        if (res.IsNeedToReturn())
+            return res;
+    }
+    return Result();
+}
+
+Result FlatTree::EvaluateIfElse(uint32_t node, Closure& closure)
+{
+    ChildrenScope children(child_stack);
+    Children(node, counts[node]);
+
+    if (Evaluate(children[0], closure)->IsTrue())
+        return Evaluate(children[1], closure);
+    if (counts[node] == 3)
+        return Evaluate(children[2], closure);
+    return Result();
+}
+
+Result FlatTree::Evaluate(uint32_t node, Closure& closure)
+{
+    switch (kinds[node])
+    {
+        case FlatKind::Constant:
+            return constants[operands[node]];
+        case FlatKind::None:
+            return Result();
+        case FlatKind::Variable:
+            return ReadPath(operands[node], counts[node], closure);
+        case FlatKind::Assign:
+        {
+            auto& obj = closure[names[operands[node]]];
+            obj = Evaluate(node - 1, closure);
+            return obj;
+        }
+        case FlatKind::FieldAssign:
+            return EvaluateFieldAssign(node, closure);
+        case FlatKind::Print:
+            return EvaluatePrint(node, closure);
+        case FlatKind::Call:
+            return Call(node, closure);
+        case FlatKind::TailCall:
+            return EvaluateTailCall(node, closure);
+        case FlatKind::New:
+            return EvaluateNew(node, closure);
+        case FlatKind::Stringify:
+            return EvaluateStringify(node, closure);
+        case FlatKind::Arithmetic:
+        {
+            uint32_t rhs = node - 1;
+            auto left = Evaluate(rhs - sizes[rhs], closure), right = Evaluate(rhs, closure);
+            return CallOperator(left, right, static_cast<ArithmeticOp>(operands[node]));
+        }
+        case FlatKind::Negate:
+        {
+            auto value = Evaluate(node - 1, closure);
+            if (auto number = value.TryAs<Runtime::Number>())
+                return ObjectHolder::Own(Runtime::Number(-number->GetValue()));
+            return CallOperator(std::move(value), ObjectHolder::Own(Runtime::Number(-1)), ArithmeticOp::Mult);
+        }
+        case FlatKind::Or:
+        case FlatKind::And:
+        {
+            uint32_t rhs = node - 1;
+            auto left = Evaluate(rhs - sizes[rhs], closure), right = Evaluate(rhs, closure);
+            bool value = kinds[node] == FlatKind::Or
+                ? left->IsTrue() || right->IsTrue()
+                : left->IsTrue() && right->IsTrue();
+            return ObjectHolder::Own(Runtime::Bool(value));
+        }
+        case FlatKind::Not:
+            return EvaluateNot(node, closure);
+        case FlatKind::Compare:
+        {
+            uint32_t rhs = node - 1;
+            auto left = Evaluate(rhs - sizes[rhs], closure), right = Evaluate(rhs, closure);
+            return ObjectHolder::Own(Runtime::Bool(comparators[operands[node]](left, right)));
+        }
+        case FlatKind::Compound:
+            return EvaluateCompound(node, closure);
+        case FlatKind::Return:
+        {
+            Result res(Evaluate(node - 1, closure));
+            res.SetNeedToReturn();
+            return res;
+        }
+        case FlatKind::IfElse:
+            return EvaluateIfElse(node, closure);
+        case FlatKind::ClassDef:
+            return class_holders[operands[node]];
+        default:
+            return opaque[operands[node]]->Execute(closure);
+    }
+}
+
+// Saving and loading
+//
+bool FlatTree::Save(std::string& out) const
+{
+    if (!opaque.empty())
+        return false;
+
+    for (auto& constant : constants)
+    {
+        if (!constant.TryAs<Runtime::Number>() && !constant.TryAs<Runtime::String>() && !constant.TryAs<Runtime::Bool>())
+            return false;
+    }
+
+    std::vector<uint8_t> comparator_ids;
+    for (auto& comparator : comparators)
+    {
+        auto function = comparator.target<ComparatorFunction>();
+        auto it = function ? std::find(std::begin(COMPARATORS), std::end(COMPARATORS), *function) : std::end(COMPARATORS);
+        if (it == std::end(COMPARATORS))
+            return false;
+        comparator_ids.push_back(static_cast<uint8_t>(it - std::begin(COMPARATORS)));
+    }
+
+    // Classes are numbered in the order of their definitions, a base class comes before
+    // the classes derived from it
+    std::unordered_map<const Runtime::Class*, uint32_t> class_ids;
+    for (uint32_t i = 0; i < class_holders.size(); ++i)
+    {
+        auto& cls = *class_holders[i].TryAs<Runtime::Class>();
+        if (cls.GetParent() && !class_ids.count(cls.GetParent()))
+            return false;
+        for (auto& method : cls.Methods())
+        {
+            auto body = method.body->TryAs<FlatRoot>();
+            if (!body || body->Flat().get() != this)
+                return false;
+        }
+        class_ids.emplace(&cls, i);
+    }
+    std::vector<uint32_t> new_ids;
+    for (auto cls : classes)
+    {
+        auto it = class_ids.find(cls);
+        if (it == class_ids.end())
+            return false;
+        new_ids.push_back(it->second);
+    }
+
+    Writer writer(out);
+    writer.Put(static_cast<uint32_t>(names.size()));
+    for (auto& name : names)
+        writer.PutString(name);
+    writer.PutArray(kinds);
+    writer.PutArray(sizes);
+    writer.PutArray(operands);
+    writer.PutArray(counts);
+    writer.PutArray(paths);
+
+    writer.Put(static_cast<uint32_t>(constants.size()));
+    for (auto& constant : constants)
+    {
+        if (auto number = constant.TryAs<Runtime::Number>())
+        {
+            writer.Put(ConstantTag::Number);
+            writer.Put(number->GetValue());
+        }
+        else if (auto str = constant.TryAs<Runtime::String>())
+        {
+            writer.Put(ConstantTag::String);
+            writer.PutString(str->GetValue());
+        }
+        else
+        {
+            writer.Put(ConstantTag::Bool);
+            writer.Put(static_cast<uint8_t>(constant.TryAs<Runtime::Bool>()->GetValue()));
+        }
+    }
+    writer.PutArray(comparator_ids);
+
+    writer.Put(static_cast<uint32_t>(class_holders.size()));
+    for (auto& holder : class_holders)
+    {
+        auto& cls = *holder.TryAs<Runtime::Class>();
+        writer.PutString(cls.GetName());
+        writer.Put(cls.GetParent() ? class_ids.at(cls.GetParent()) : NO_PARENT);
+        writer.Put(static_cast<uint32_t>(cls.Methods().size()));
+        for (auto& method : cls.Methods())
+        {
+            writer.PutString(method.name);
+            writer.Put(static_cast<uint32_t>(method.formal_params.size()));
+            for (auto& param : method.formal_params)
+                writer.PutString(param);
+            writer.Put(method.body->TryAs<FlatRoot>()->Root());
+        }
+    }
+    writer.PutArray(new_ids);
+
+    std::vector<uint32_t> call_names;
+    for (auto& call : calls)
+        call_names.push_back(call.name);
+    writer.PutArray(call_names);
+    return true;
+}
+
+std::shared_ptr<FlatTree> FlatTree::Load(std::string_view& data)
+{
+    auto fail = [] {
+        throw std::runtime_error("Saved layout is inconsistent");
+    };
+
+    Reader reader(data);
+    auto flat = std::make_shared<FlatTree>();
+
+    uint32_t name_count = reader.GetCount();
+    for (uint32_t i = 0; i < name_count; ++i)
+    {
+        flat->names.push_back(reader.GetString());
+        flat->name_ids.emplace(flat->names.back(), i);
+    }
+    flat->kinds = reader.GetArray<FlatKind>();
+    flat->sizes = reader.GetArray<uint32_t>();
+    flat->operands = reader.GetArray<uint32_t>();
+    flat->counts = reader.GetArray<uint32_t>();
+    flat->paths = reader.GetArray<uint32_t>();
+    size_t size = flat->kinds.size();
+    if (flat->sizes.size() != size || flat->operands.size() != size || flat->counts.size() != size)
+        fail();
+
+    uint32_t constant_count = reader.GetCount();
+    for (uint32_t i = 0; i < constant_count; ++i)
+    {
+        switch (reader.Get<ConstantTag>())
+        {
+            case ConstantTag::Number:
+                flat->constants.push_back(ObjectHolder::Own(Runtime::Number(reader.Get<int>())));
+                break;
+            case ConstantTag::String:
+                flat->constants.push_back(ObjectHolder::Own(Runtime::String(reader.GetString())));
+                break;
+            case ConstantTag::Bool:
+                flat->constants.push_back(ObjectHolder::Own(Runtime::Bool(reader.Get<uint8_t>() != 0)));
+                break;
+            default:
+                fail();
+        }
+    }
+    for (auto id : reader.GetArray<uint8_t>())
+    {
+        if (id >= std::size(COMPARATORS))
+            fail();
+        flat->comparators.push_back(COMPARATORS[id]);
+    }
+
+    uint32_t class_count = reader.GetCount();
+    for (uint32_t i = 0; i < class_count; ++i)
+    {
+        auto name = reader.GetString();
+        uint32_t parent = reader.Get<uint32_t>();
+        if (parent != NO_PARENT && parent >= i)
+            fail();
+        std::vector<Runtime::Method> methods(reader.GetCount());
+        for (auto& method : methods)
+        {
+            method.name = reader.GetString();
+            method.formal_params.resize(reader.GetCount());
+            for (auto& param : method.formal_params)
+                param = reader.GetString();
+            uint32_t root = reader.Get<uint32_t>();
+            if (root >= size)
+                fail();
+            method.body = std::make_unique<FlatRoot>(nullptr, flat, root);
+        }
+        auto base = parent == NO_PARENT ? nullptr : flat->class_holders[parent].TryAs<Runtime::Class>();
+        flat->class_holders.push_back(ObjectHolder::Own(Runtime::Class(std::move(name), std::move(methods), base)));
+    }
+    for (auto id : reader.GetArray<uint32_t>())
+    {
+        if (id >= class_count)
+            fail();
+        flat->classes.push_back(flat->class_holders[id].TryAs<Runtime::Class>());
+    }
+    for (auto name : reader.GetArray<uint32_t>())
+        flat->calls.push_back({name});
+
+    flat->CheckLayout();
+    return flat;
+}
+
+void FlatTree::CheckLayout() const
+{
+    auto fail = [] {
+        throw std::runtime_error("Saved layout is inconsistent");
+    };
+
+    for (uint32_t name : paths)
+    {
+        if (name >= names.size())
+            fail();
+    }
+    for (auto& call : calls)
+    {
+        if (call.name >= names.size())
+            fail();
+    }
+
+    for (uint32_t node = 0; node < kinds.size(); ++node)
+    {
+        if (sizes[node] == 0 || sizes[node] > node + 1)
+            fail();
+
+        uint32_t operand = operands[node], count = counts[node];
+        bool valid = true;
+        uint32_t children = 0;
+        switch (kinds[node])
+        {
+            case FlatKind::Constant:
+                valid = operand < constants.size();
+                break;
+            case FlatKind::None:
+                break;
+            case FlatKind::Variable:
+                valid = count > 0 && size_t{operand} + count <= paths.size();
+                break;
+            case FlatKind::Assign:
+                valid = operand < names.size();
+                children = 1;
+                break;
+            case FlatKind::FieldAssign:
+                valid = count > 0 && size_t{operand} + count + 1 <= paths.size();
+                children = 1;
+                break;
+            case FlatKind::Print:
+            case FlatKind::Compound:
+                children = count;
+                break;
+            case FlatKind::Call:
+            case FlatKind::TailCall:
+                valid = operand < calls.size() && count > 0;
+                children = count;
+                break;
+            case FlatKind::New:
+                valid = operand < classes.size();
+                children = count;
+                break;
+            case FlatKind::Stringify:
+            case FlatKind::Negate:
+            case FlatKind::Not:
+            case FlatKind::Return:
+                children = 1;
+                break;
+            case FlatKind::Arithmetic:
+                valid = operand <= static_cast<uint32_t>(ArithmeticOp::Div);
+                children = 2;
+                break;
+            case FlatKind::Or:
+            case FlatKind::And:
+                children = 2;
+                break;
+            case FlatKind::Compare:
+                valid = operand < comparators.size();
+                children = 2;
+                break;
+            case FlatKind::IfElse:
+                valid = count == 2 || count == 3;
+                children = count;
+                break;
+            case FlatKind::ClassDef:
+                valid = operand < class_holders.size();
+                break;
+            default:
+                valid = false;
+                break;
+        }
+        if (!valid)
+            fail();
+
+        // The subtrees of the children fill the subtree of the node, but for the
+        // method bodies laid out inside a class definition
+        uint32_t first = node + 1 - sizes[node], end = node;
+        for (uint32_t i = 0; i < children; ++i)
+        {
+            if (end == first)
+                fail();
+            uint32_t child = end - 1;
+            end = child + 1 - sizes[child];
+            if (end < first)
+                fail();
+        }
+        if (kinds[node] != FlatKind::ClassDef && end != first)
+            fail();
+    }
+}
+
+// FlatRoot
+//
+FlatRoot::FlatRoot(std::unique_ptr<Statement> tree, std::shared_ptr<FlatTree> flat, uint32_t root)
+    : tree(std::move(tree)), flat(std::move(flat)), root(root)
+{
+}
+
+void FlatRoot::ForEachChild(const ChildVisitor& visitor)
+{
+    if (tree)
+        visitor(tree);
+}
+
+// Free
+//
+FlattenStats FlattenProgram(std::unique_ptr<Statement>& root)
+{
+    auto flat = std::make_shared<FlatTree>();
+    std::vector<std::unique_ptr<Statement>*> bodies;
+    auto replace = [&flat, &bodies](std::unique_ptr<Statement>& slot) {
+        uint32_t index = flat->Append(*slot, bodies);
+        slot = std::make_unique<FlatRoot>(std::move(slot), flat, index);
+    };
+
+    replace(root);
+    // Bodies may define no classes, but the list grows while it is walked
+    for (size_t i = 0; i < bodies.size(); ++i)
+        replace(*bodies[i]);
+
+    return {flat->Size(), flat->OpaqueNodes(), flat->Bytes()};
+}
+
+} /* namespace Ast */
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+enum class FlatKind : uint8_t {
+  Constant,
+  None,
+  Variable,
+  Assign,
+  FieldAssign,
+  Print,
+  Call,
+  New,
+  Stringify,
+  Arithmetic,
+  Negate,
+  Or,
+  And,
+  Not,
+  Compare,
+  Compound,
+  Return,
+  IfElse,
+  ClassDef,
+  // return obj.method(...) in a method, handed over as TailCall does (see tail_calls.h)
+  TailCall,
+  // A node of another kind, run by its own Execute
+  Opaque,
+};
+
+// Trees laid out in post-order in parallel arrays: the children of a node
+// precede it and its last child is right before it. A node is its kind, the
+// size of its subtree, an operand and the number of its children; names,
+// constants and call caches live in pools the operands point to.
+// Nodes of other kinds are referred to, so the tree must outlive the layout
+class FlatTree {
+public:
+  // Appends the nodes of the tree, returns the index of its root.
+  // Method bodies of the classes defined in it are laid out separately
+  // and are returned in bodies
+  uint32_t Append(Statement& root, std::vector<std::unique_ptr<Statement>*>& bodies);
+
+  // Appending node by node, the way the parser does in a single pass (see
+  // ParseFlatProgram in parse.h). The children of a node are the last subtrees
+  // appended, in order; the functions take their indices and return the index
+  // of the node
+  uint32_t AddConstant(ObjectHolder value);
+  uint32_t AddNone();
+  uint32_t AddVariable(const std::vector<std::string>& ids);
+  uint32_t AddAssign(const std::string& name, uint32_t value);
+  uint32_t AddFieldAssign(const std::vector<std::string>& object, const std::string& field, uint32_t value);
+  uint32_t AddPrint(const std::vector<uint32_t>& args);
+  uint32_t AddCall(uint32_t object, const std::string& method, const std::vector<uint32_t>& args);
+  uint32_t AddTailCall(uint32_t object, const std::string& method, const std::vector<uint32_t>& args);
+  // Makes the call, the last node appended, a tail call returning what it calls
+  uint32_t ReturnCall(uint32_t call);
+  uint32_t AddNew(const Runtime::Class& cls, const std::vector<uint32_t>& args);
+  uint32_t AddStringify(uint32_t argument);
+  uint32_t AddArithmetic(ArithmeticOp op, uint32_t lhs, uint32_t rhs);
+  uint32_t AddNegate(uint32_t argument);
+  // Or and And
+  uint32_t AddLogical(FlatKind kind, uint32_t lhs, uint32_t rhs);
+  uint32_t AddNot(uint32_t argument);
+  uint32_t AddCompare(Comparison::Comparator comparator, uint32_t lhs, uint32_t rhs);
+  uint32_t AddCompound(const std::vector<uint32_t>& statements);
+  uint32_t AddReturn(uint32_t value);
+  uint32_t AddIfElse(uint32_t condition, uint32_t if_body, std::optional<uint32_t> else_body);
+  // The class is kept by the layout. The subtree starts at first, so the
+  // bodies of the methods may be laid out inside it
+  uint32_t AddClassDef(ObjectHolder cls, uint32_t first);
+
+  Result Evaluate(uint32_t node, Runtime::Closure& closure);
+
+  size_t Size() const {
+    return kinds.size();
+  }
+
+  FlatKind Kind(uint32_t node) const {
+    return kinds[node];
+  }
+
+  uint32_t SubtreeSize(uint32_t node) const {
+    return sizes[node];
+  }
+
+  // Memory taken by the arrays and the pools
+  size_t Bytes() const;
+
+  size_t OpaqueNodes() const {
+    return opaque.size();
+  }
+
+  // The layout in the format of the program cache (see program_cache.h), the
+  // classes with their methods included. Returns false and appends nothing when
+  // it has what the format does not hold: opaque nodes, comparators other than
+  // those of comparators.h, constants other than numbers, strings and bools
+  bool Save(std::string& out) const;
+  // Reads what Save wrote from the front of data and advances past it. The
+  // arrays are copied as they are, the pools and the classes are made anew.
+  // Throws std::runtime_error when the data are cut short or inconsistent
+  static std::shared_ptr<FlatTree> Load(std::string_view& data);
+
+private:
+  // The inline cache of a call site, as in MethodCall
+  struct CallSite {
+    uint32_t name = 0;
+    const Runtime::Class* cls = nullptr;
+    const Runtime::Method* method = nullptr;
+  };
+
+  uint32_t Emit(FlatKind kind, uint32_t first, uint32_t operand, uint32_t count);
+  // Where the next node goes
+  uint32_t End() const;
+  // The first node of the subtree of the child
+  uint32_t First(uint32_t child) const;
+  // Of the first child, or End for none
+  uint32_t First(const std::vector<uint32_t>& children) const;
+  uint32_t Name(const std::string& name);
+  uint32_t Path(const std::vector<std::string>& ids);
+  std::vector<uint32_t> AppendAll(std::vector<std::unique_ptr<Statement>>& nodes, std::vector<std::unique_ptr<Statement>*>& bodies);
+
+  // Pushes the indices of the roots of the children of node, in order
+  void Children(uint32_t node, uint32_t count);
+  // The nodes which need more than a few locals are evaluated out of the
+  // switch, to keep the frames of the recursion small
+  Result Call(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateTailCall(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateFieldAssign(uint32_t node, Runtime::Closure& closure);
+  Result EvaluatePrint(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateNew(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateStringify(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateNot(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateCompound(uint32_t node, Runtime::Closure& closure);
+  Result EvaluateIfElse(uint32_t node, Runtime::Closure& closure);
+  ObjectHolder ReadPath(uint32_t start, uint32_t length, Runtime::Closure& closure);
+  // Throws std::runtime_error when a loaded node points past the pools or the
+  // subtrees of its children do not fill its own
+  void CheckLayout() const;
+
+  std::vector<FlatKind> kinds;
+  std::vector<uint32_t> sizes;
+  std::vector<uint32_t> operands;
+  std::vector<uint32_t> counts;
+
+  std::vector<ObjectHolder> constants;
+  std::vector<std::string> names;
+  // Name indices of dotted ids
+  std::vector<uint32_t> paths;
+  std::vector<Comparison::Comparator> comparators;
+  std::vector<const Runtime::Class*> classes;
+  std::vector<ObjectHolder> class_holders;
+  std::vector<CallSite> calls;
+  std::vector<Statement*> opaque;
+  std::unordered_map<std::string, uint32_t> name_ids;
+
+  // Children of the nodes being evaluated
+  std::vector<uint32_t> child_stack;
+};
+
+// A root of a FlatTree. Keeps the tree it was made of, if any
+class FlatRoot : public Statement {
+public:
+  FlatRoot(std::unique_ptr<Statement> tree, std::shared_ptr<FlatTree> flat, uint32_t root);
+
+  Result Execute(Runtime::Closure& closure) override {
+    return flat->Evaluate(root, closure);
+  }
+
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+  const std::shared_ptr<FlatTree>& Flat() const {
+    return flat;
+  }
+
+  uint32_t Root() const {
+    return root;
+  }
+
+private:
+  std::unique_ptr<Statement> tree;
+  std::shared_ptr<FlatTree> flat;
+  uint32_t root;
+};
+
+struct FlattenStats {
+  size_t nodes = 0;
+  size_t opaque = 0;
+  size_t bytes = 0;
+};
+
+// Lays out the program and every method body in one FlatTree and replaces
+// them with FlatRoot. Generic nodes and the nodes specialized by type
+// inference or a profile, which compute the same values, are laid out;
+// the rest are opaque. Goes after every other pass
+FlattenStats FlattenProgram(std::unique_ptr<Statement>& root);
+
+void RunFlatTreeTests(TestRunner& tr);
+
+} /* namespace Ast */
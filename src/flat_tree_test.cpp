@@ -0,0 +1,136 @@
+#include "flat_tree.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+const string COUNTERS = R"(
+class Counter:
+  def __init__(start):
+    self.value = start
+
+  def __str__():
+    return 'Counter(' + str(self.value) + ')'
+
+  def add(n):
+    if n > 0 and not n == 100:
+      self.value = self.value + n
+    else:
+      self.value = self.value - 1
+
+class Named(Counter):
+  def __init__(name):
+    self.name = name
+    self.value = 0
+
+c = Counter(5)
+n = Named('n')
+c.add(3)
+n.add(0 - 2)
+print c, n, n.name, c.value * 2 - -1, None
+)";
+
+}
+
+void TestPostOrderLayout() {
+  auto program = ParseProgramFromString("print 1 + 2 * x, 'a'\n");
+  FlatTree flat;
+  vector<unique_ptr<Statement>*> bodies;
+  auto root = flat.Append(*program, bodies);
+
+  const FlatKind expected[] = {
+    FlatKind::Constant, FlatKind::Constant, FlatKind::Variable, FlatKind::Arithmetic,
+    FlatKind::Arithmetic, FlatKind::Constant, FlatKind::Print, FlatKind::Compound,
+  };
+  ASSERT_EQUAL(flat.Size(), size(expected));
+  for (uint32_t i = 0; i < flat.Size(); ++i) {
+    ASSERT(flat.Kind(i) == expected[i]);
+  }
+  ASSERT_EQUAL(root, 7u);
+  ASSERT_EQUAL(flat.SubtreeSize(3), 3u);
+  ASSERT_EQUAL(flat.SubtreeSize(4), 5u);
+  ASSERT_EQUAL(flat.SubtreeSize(7), 8u);
+  ASSERT(bodies.empty());
+
+  ostringstream output;
+  Print::SetOutputStream(output);
+  Runtime::Closure closure;
+  closure["x"] = ObjectHolder::Own(Runtime::Number(4));
+  flat.Evaluate(root, closure);
+  ASSERT_EQUAL(output.str(), "9 a\n");
+}
+
+void TestMethodBodiesAreLaidOut() {
+  auto program = ParseProgramFromString(COUNTERS);
+  auto stats = FlattenProgram(program);
+
+  ASSERT_EQUAL(stats.opaque, 0u);
+  ASSERT(stats.nodes > 60u);
+  ASSERT(stats.bytes > 0u);
+  ASSERT(program->TryAs<FlatRoot>());
+  ASSERT_EQUAL(Execute(*program), "Counter(8) Counter(-1) n 17 None\n");
+}
+
+void TestSpecializedAndOtherNodes() {
+  auto program = ParseProgramFromString(COUNTERS);
+  SpecializeTypes(program);
+  ASSERT_EQUAL(FlattenProgram(program).opaque, 0u);
+  ASSERT_EQUAL(Execute(*program), "Counter(8) Counter(-1) n 17 None\n");
+
+  // Superinstructions keep their Execute
+  program = ParseProgramFromString(COUNTERS);
+  OptimizeProgram(program);
+  MarkTailCalls(program);
+  FuseSuperinstructions(program);
+  ASSERT(FlattenProgram(program).opaque > 0u);
+  ASSERT_EQUAL(Execute(*program), "Counter(8) Counter(-1) n 17 None\n");
+}
+
+void TestFlatErrorsAreTheSame() {
+  const char* programs[] = {
+    "print y\n",
+    "x = 1\nprint x.f()\n",
+    "x = 'a'\nprint x - 1\n",
+    "x = 1\nprint x.y\n",
+    "x = 1\nx.y = 2\n",
+  };
+  for (auto text : programs) {
+    auto program = ParseProgramFromString(text);
+    FlattenProgram(program);
+    ASSERT_THROWS(Execute(*program), std::runtime_error);
+  }
+}
+
+void TestRunOnFlatEngine() {
+  istringstream input(COUNTERS);
+  ostringstream output;
+  RunOptions options;
+  options.engine = Engine::Flat;
+  RunMythonProgram(input, output, options);
+  ASSERT_EQUAL(output.str(), "Counter(8) Counter(-1) n 17 None\n");
+}
+
+void RunFlatTreeTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestPostOrderLayout);
+  RUN_TEST(tr, Ast::TestMethodBodiesAreLaidOut);
+  RUN_TEST(tr, Ast::TestSpecializedAndOtherNodes);
+  RUN_TEST(tr, Ast::TestFlatErrorsAreTheSame);
+  RUN_TEST(tr, Ast::TestRunOnFlatEngine);
+}
+
+} /* namespace Ast */
@@ -0,0 +1,463 @@
+#include "inliner.h"
+#include "object.h"
+#include "optimizer.h"
+
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    const char* SELF = "self";
+    const char* TOP = "<top>";
+
+    std::string FullName(const Runtime::Class& cls, const std::string& method)
+    {
+        return cls.GetName() + "." + method;
+    }
+
+    // The guard of InlinedCall lets instances only into the slot
+    Runtime::ClassInstance& Receiver(InlineFrame& frame)
+    {
+        return *frame.slots[0].TryAs<Runtime::ClassInstance>();
+    }
+
+    // Marks the frame as used, the slots are released when the body is done
+    class ActiveFrame
+    {
+    public:
+        explicit ActiveFrame(InlineFrame& frame)
+            : frame(frame)
+        {
+            frame.active = true;
+        }
+
+        ~ActiveFrame()
+        {
+            for (auto& slot : frame.slots)
+                slot = ObjectHolder();
+            frame.active = false;
+        }
+
+    private:
+        InlineFrame& frame;
+    };
+
+    // Copies a method body onto a frame, fails on anything but the supported nodes
+    class BodyTranslator
+    {
+    public:
+        BodyTranslator(const Runtime::Method& method, std::shared_ptr<InlineFrame> frame)
+            : method(method), frame(std::move(frame))
+        {
+        }
+
+        bool Translate(std::vector<std::unique_ptr<Statement>>& stores, std::unique_ptr<Statement>& result)
+        {
+            std::vector<Statement*> body;
+            if (auto p = method.body->TryAs<Compound>())
+            {
+                for (auto& st : p->Statements())
+                    body.push_back(st.get());
+            }
+            else
+            {
+                body.push_back(method.body.get());
+            }
+
+            for (auto st : body)
+            {
+                ++nodes;
+                if (auto p = st->TryAs<FieldAssignment>())
+                {
+                    if (p->object.dotted_ids != std::vector<std::string>{SELF} || IsParam(SELF))
+                        return false;
+
+                    auto value = Expression(*p->right_value);
+                    if (!value)
+                        return false;
+                    stores.push_back(std::make_unique<InlineFieldStore>(frame, p->field_name, std::move(value)));
+                }
+                else if (auto p = st->TryAs<Return>())
+                {
+                    // Statements after the return are never run
+                    result = Expression(*p->Value());
+                    return result != nullptr;
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        size_t Nodes() const
+        {
+            return nodes;
+        }
+
+    private:
+        std::unique_ptr<Statement> Expression(Statement& st)
+        {
+            ++nodes;
+            if (auto p = st.TryAs<NumericConst>())
+                return std::make_unique<NumericConst>(p->value);
+            if (auto p = st.TryAs<StringConst>())
+                return std::make_unique<StringConst>(p->value);
+            if (auto p = st.TryAs<BoolConst>())
+                return std::make_unique<BoolConst>(p->value);
+            if (st.TryAs<None>())
+                return std::make_unique<None>();
+            if (auto p = st.TryAs<VariableValue>())
+                return Read(p->dotted_ids);
+            if (auto p = st.TryAs<CachedFieldRead>())
+                return Read(p->Variable().dotted_ids);
+            if (auto p = st.TryAs<Stringify>())
+                return Unary<Stringify>(*p);
+            if (auto p = st.TryAs<Not>())
+                return Unary<Not>(*p);
+            if (auto p = st.TryAs<Negate>())
+                return Unary<Negate>(*p);
+            if (auto p = st.TryAs<Add>())
+                return Binary<Add>(*p);
+            if (auto p = st.TryAs<Sub>())
+                return Binary<Sub>(*p);
+            if (auto p = st.TryAs<Mult>())
+                return Binary<Mult>(*p);
+            if (auto p = st.TryAs<Div>())
+                return Binary<Div>(*p);
+            if (auto p = st.TryAs<Or>())
+                return Binary<Or>(*p);
+            if (auto p = st.TryAs<And>())
+                return Binary<And>(*p);
+            if (auto p = st.TryAs<Comparison>())
+            {
+                auto lhs = Expression(*p->Lhs());
+                auto rhs = lhs ? Expression(*p->Rhs()) : nullptr;
+                if (!rhs)
+                    return nullptr;
+                return std::make_unique<Comparison>(p->GetComparator(), std::move(lhs), std::move(rhs));
+            }
+
+            // Calls, new instances and bare fields, which are copies taken when the method starts
+            return nullptr;
+        }
+
+        template <typename T>
+        std::unique_ptr<Statement> Unary(UnaryOperation& op)
+        {
+            auto argument = Expression(*op.Argument());
+            if (!argument)
+                return nullptr;
+            return std::make_unique<T>(std::move(argument));
+        }
+
+        template <typename T>
+        std::unique_ptr<Statement> Binary(BinaryOperation& op)
+        {
+            auto lhs = Expression(*op.Lhs());
+            auto rhs = lhs ? Expression(*op.Rhs()) : nullptr;
+            if (!rhs)
+                return nullptr;
+            return std::make_unique<T>(std::move(lhs), std::move(rhs));
+        }
+
+        std::unique_ptr<Statement> Read(const std::vector<std::string>& ids)
+        {
+            const auto& params = method.formal_params;
+            if (ids.size() == 1)
+            {
+                auto it = std::find(params.begin(), params.end(), ids[0]);
+                if (it == params.end())
+                    return nullptr;
+                return std::make_unique<InlineSlot>(frame, it - params.begin() + 1);
+            }
+            if (ids.size() == 2 && ids[0] == SELF && !IsParam(SELF))
+                return std::make_unique<InlineField>(frame, ids[1]);
+            return nullptr;
+        }
+
+        bool IsParam(const std::string& name) const
+        {
+            const auto& params = method.formal_params;
+            return std::find(params.begin(), params.end(), name) != params.end();
+        }
+
+        const Runtime::Method& method;
+        std::shared_ptr<InlineFrame> frame;
+        size_t nodes = 0;
+    };
+
+    class Inliner
+    {
+    public:
+        Inliner(Statement& program, const InlineOptions& options)
+            : options(options)
+        {
+            CollectClasses(program);
+        }
+
+        InlinerStats Run(std::unique_ptr<Statement>& root)
+        {
+            Visit(root, nullptr, TOP);
+            return std::move(stats);
+        }
+
+    private:
+        void CollectClasses(Statement& st)
+        {
+            if (auto p = st.TryAs<ClassDefinition>())
+                classes.push_back(&p->GetClass());
+
+            st.ForEachChild([this](std::unique_ptr<Statement>& child) {
+                CollectClasses(*child);
+            });
+        }
+
+        void Visit(std::unique_ptr<Statement>& node, const Runtime::Class* self_cls, const std::string& caller)
+        {
+            if (auto p = node->TryAs<ClassDefinition>())
+            {
+                auto& cls = p->GetClass();
+                for (auto& method : cls.Methods())
+                    Visit(method.body, &cls, FullName(cls, method.name));
+                return;
+            }
+
+            node->ForEachChild([&](std::unique_ptr<Statement>& child) {
+                Visit(child, self_cls, caller);
+            });
+
+            if (auto p = node->TryAs<MethodCall>())
+                TryInline(node, *p, self_cls, caller);
+        }
+
+        const Runtime::Method* FindTarget(MethodCall& call, const Runtime::Class* self_cls, std::string& reason)
+        {
+            if (call.cache.cls)
+                return call.cache.method;
+
+            auto receiver = call.object->TryAs<VariableValue>();
+            if (self_cls && receiver && receiver->dotted_ids == std::vector<std::string>{SELF})
+                return self_cls->GetMethod(call.method);
+
+            const Runtime::Method* target = nullptr;
+            for (auto cls : classes)
+            {
+                auto met = cls->GetMethod(call.method);
+                if (!met || met->formal_params.size() != call.args.size() || met == target)
+                    continue;
+                if (target)
+                {
+                    reason = "polymorphic";
+                    return nullptr;
+                }
+                target = met;
+            }
+            return target;
+        }
+
+        void TryInline(
+            std::unique_ptr<Statement>& node, MethodCall& call, const Runtime::Class* self_cls, const std::string& caller
+        )
+        {
+            std::string reason;
+            auto target = FindTarget(call, self_cls, reason);
+            if (target && target->formal_params.size() != call.args.size())
+                target = nullptr;
+            if (!target && reason.empty())
+                return;
+
+            // Every class which resolves the name to the target passes the guard
+            std::vector<const Runtime::Class*> guard;
+            const Runtime::Class* owner = nullptr;
+            for (auto cls : classes)
+            {
+                if (target && cls->GetMethod(call.method) == target)
+                    guard.push_back(cls);
+                if (target && !owner)
+                    for (auto& met : cls->Methods())
+                        if (&met == target)
+                            owner = cls;
+            }
+
+            InlineDecision decision;
+            decision.caller = caller;
+            decision.callee = owner ? FullName(*owner, call.method) : call.method;
+
+            auto frame = std::make_shared<InlineFrame>();
+            std::vector<std::unique_ptr<Statement>> stores;
+            std::unique_ptr<Statement> result;
+            if (target)
+            {
+                BodyTranslator translator(*target, frame);
+                bool translated = translator.Translate(stores, result);
+                decision.nodes = translator.Nodes();
+
+                if (!translated)
+                    reason = "unsupported body";
+                else if (target->formal_params.size() > options.max_params)
+                    reason = "too many parameters";
+                else if (decision.nodes > options.max_nodes)
+                    reason = "too large (" + std::to_string(decision.nodes) + " nodes)";
+            }
+
+            decision.reason = reason;
+            stats.decisions.push_back(decision);
+            if (!reason.empty())
+                return;
+
+            frame->slots.resize(call.args.size() + 1);
+            std::unique_ptr<MethodCall> original(static_cast<MethodCall*>(node.release()));
+            node = std::make_unique<InlinedCall>(
+                std::move(original), decision.callee, std::move(guard), std::move(frame), std::move(stores), std::move(result)
+            );
+        }
+
+        const InlineOptions& options;
+        std::vector<const Runtime::Class*> classes;
+        InlinerStats stats;
+    };
+}
+
+// InlineSlot
+//
+InlineSlot::InlineSlot(std::shared_ptr<InlineFrame> frame, size_t index)
+    : frame(std::move(frame)), index(index)
+{
+}
+
+Result InlineSlot::Execute(Closure&)
+{
+    return frame->slots[index];
+}
+
+// InlineField
+//
+InlineField::InlineField(std::shared_ptr<InlineFrame> frame, std::string field)
+    : frame(std::move(frame)), field(std::move(field))
+{
+}
+
+Result InlineField::Execute(Closure&)
+{
+    // Same as VariableValue reading self.field
+    const auto& fields = Receiver(*frame).Fields();
+    auto it = fields.find(field);
+    if (it == fields.end())
+        throw std::runtime_error("VariableValue: self." + field + " cant be found");
+
+    if (!it->second)
+        return ObjectHolder::Own(Runtime::None());
+    return it->second;
+}
+
+// InlineFieldStore
+//
+InlineFieldStore::InlineFieldStore(std::shared_ptr<InlineFrame> frame, std::string field, std::unique_ptr<Statement> value)
+    : frame(std::move(frame)), field(std::move(field)), value(std::move(value))
+{
+}
+
+Result InlineFieldStore::Execute(Closure& closure)
+{
+    // Same as FieldAssignment, the field exists while the value is computed
+    auto& slot = Receiver(*frame).Fields()[field];
+    slot = value->Execute(closure);
+    Runtime::ClassInstance::TouchFields();
+    return slot;
+}
+
+void InlineFieldStore::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(value);
+}
+
+// InlinedCall
+//
+InlinedCall::InlinedCall(
+    std::unique_ptr<MethodCall> call,
+    std::string callee,
+    std::vector<const Runtime::Class*> guard,
+    std::shared_ptr<InlineFrame> frame,
+    std::vector<std::unique_ptr<Statement>> stores,
+    std::unique_ptr<Statement> result
+)
+    : call(std::move(call))
+    , callee(std::move(callee))
+    , guard(std::move(guard))
+    , frame(std::move(frame))
+    , stores(std::move(stores))
+    , result(std::move(result))
+{
+}
+
+Result InlinedCall::Execute(Closure& closure)
+{
+    auto receiver = call->object->Execute(closure);
+    auto instance = receiver.TryAs<Runtime::ClassInstance>();
+    if (frame->active || !instance
+        || std::find(guard.begin(), guard.end(), &instance->GetClass()) == guard.end())
+    {
+        return call->CallOn(std::move(receiver), closure);
+    }
+
+    ActiveFrame active(*frame);
+    frame->slots[0] = std::move(receiver);
+    for (size_t i = 0; i < call->args.size(); ++i)
+        frame->slots[i + 1] = call->args[i]->Execute(closure);
+
+    for (auto& store : stores)
+        store->Execute(closure);
+
+    if (!result)
+        return Result();
+    return result->Execute(closure);
+}
+
+void InlinedCall::ForEachChild(const ChildVisitor& visitor)
+{
+    call->ForEachChild(visitor);
+    for (auto& store : stores)
+        visitor(store);
+    if (result)
+        visitor(result);
+}
+
+// InlinerStats
+//
+size_t InlinerStats::Inlined() const
+{
+    return std::count_if(decisions.begin(), decisions.end(), [](const InlineDecision& decision) {
+        return decision.reason.empty();
+    });
+}
+
+void InlinerStats::Report(std::ostream& out) const
+{
+    for (const auto& decision : decisions)
+    {
+        if (decision.reason.empty())
+            out << "inlined " << decision.callee << " into " << decision.caller << ": " << decision.nodes << " nodes\n";
+        else
+            out << "not inlined " << decision.callee << " into " << decision.caller << ": " << decision.reason << "\n";
+    }
+    out << "inlined " << Inlined() << " of " << decisions.size() << " call sites\n";
+}
+
+// Free
+//
+InlinerStats InlineMethods(std::unique_ptr<Statement>& root, const InlineOptions& options)
+{
+    return Inliner(*root, options).Run(root);
+}
+
+} /* namespace Ast */
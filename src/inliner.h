@@ -0,0 +1,141 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+struct InlineOptions {
+  // Statements and expressions of a method body
+  size_t max_nodes = 16;
+  size_t max_params = 4;
+};
+
+// The receiver and the arguments of an inlined call, read by the spliced body.
+// A body being run is not entered again, reentrant executions take the call
+struct InlineFrame {
+  std::vector<ObjectHolder> slots;
+  bool active = false;
+};
+
+// An argument of the inlined method, slot 0 is the receiver
+class InlineSlot : public Statement {
+public:
+  InlineSlot(std::shared_ptr<InlineFrame> frame, size_t index);
+
+  size_t Index() const {
+    return index;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  std::shared_ptr<InlineFrame> frame;
+  size_t index;
+};
+
+// self.field of the inlined method
+class InlineField : public Statement {
+public:
+  InlineField(std::shared_ptr<InlineFrame> frame, std::string field);
+
+  const std::string& Field() const {
+    return field;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  std::shared_ptr<InlineFrame> frame;
+  std::string field;
+};
+
+// self.field = value of the inlined method
+class InlineFieldStore : public Statement {
+public:
+  InlineFieldStore(std::shared_ptr<InlineFrame> frame, std::string field, std::unique_ptr<Statement> value);
+
+  const std::string& Field() const {
+    return field;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::shared_ptr<InlineFrame> frame;
+  std::string field;
+  std::unique_ptr<Statement> value;
+};
+
+// A call with the body of its method spliced in. Receivers of the classes in
+// the guard run the body on the evaluated arguments, without the method lookup
+// and the closure of the method; other receivers take the call
+class InlinedCall : public Statement {
+public:
+  InlinedCall(
+    std::unique_ptr<MethodCall> call,
+    std::string callee,
+    std::vector<const Runtime::Class*> guard,
+    std::shared_ptr<InlineFrame> frame,
+    std::vector<std::unique_ptr<Statement>> stores,
+    std::unique_ptr<Statement> result
+  );
+
+  MethodCall& Call() {
+    return *call;
+  }
+
+  // "Class.method"
+  const std::string& Callee() const {
+    return callee;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  // The receiver and the arguments, then the body
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::unique_ptr<MethodCall> call;
+  std::string callee;
+  std::vector<const Runtime::Class*> guard;
+  std::shared_ptr<InlineFrame> frame;
+  std::vector<std::unique_ptr<Statement>> stores;
+  std::unique_ptr<Statement> result;
+};
+
+// What was done with a call site whose method is known
+struct InlineDecision {
+  // "Class.method", or "<top>" for the program
+  std::string caller;
+  std::string callee;
+  size_t nodes = 0;
+  // Empty for inlined calls
+  std::string reason;
+};
+
+struct InlinerStats {
+  std::vector<InlineDecision> decisions;
+
+  size_t Inlined() const;
+  // One line per call site, then the total
+  void Report(std::ostream& out) const;
+};
+
+// Splices the bodies of small methods into their call sites. The method of a
+// site is the one the inline cache was primed with (see profile.h), the one of
+// the class of the caller for calls on self, or the only method with the name
+// and the arity in the program. Bodies may assign and read fields of self, read
+// the parameters and compute expressions of them without calls
+InlinerStats InlineMethods(std::unique_ptr<Statement>& root, const InlineOptions& options = {});
+
+void RunInlinerTests(TestRunner& tr);
+
+} /* namespace Ast */
@@ -0,0 +1,197 @@
+#include "inliner.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Dump(Statement& program) {
+  ostringstream out;
+  DumpTree(program, out);
+  return out.str();
+}
+
+string Report(const InlinerStats& stats) {
+  ostringstream out;
+  stats.Report(out);
+  return out.str();
+}
+
+const string POINT = R"(
+class Point:
+  def __init__(x, y):
+    self.x = x
+    self.y = y
+
+  def get_x():
+    return self.x
+
+  def set_x(x):
+    self.x = x
+
+  def moved(dx, dy):
+    self.x = self.x + dx
+    self.y = self.y + dy
+    return str(self.x) + ':' + str(self.y)
+
+  def norm1():
+    return self.get_x() + self.y
+
+p = Point(1, 2)
+p.set_x(5)
+print p.get_x(), p.norm1(), p.moved(1, 1), p.moved(0 - 1, 0)
+)";
+
+}
+
+void TestGettersAndSettersAreInlined() {
+  auto program = ParseProgramFromString(POINT);
+  auto stats = InlineMethods(program);
+
+  ASSERT_EQUAL(stats.Inlined(), 5u);
+  ASSERT_EQUAL(Report(stats),
+    "inlined Point.get_x into Point.norm1: 2 nodes\n"
+    "inlined Point.set_x into <top>: 2 nodes\n"
+    "inlined Point.get_x into <top>: 2 nodes\n"
+    "not inlined Point.norm1 into <top>: unsupported body\n"
+    "inlined Point.moved into <top>: 16 nodes\n"
+    "inlined Point.moved into <top>: 16 nodes\n"
+    "inlined 5 of 6 call sites\n"
+  );
+
+  auto dump = Dump(*program);
+  ASSERT(dump.find("InlinedCall Point.get_x") != string::npos);
+  ASSERT(dump.find("InlineFieldStore self.x") != string::npos);
+  ASSERT_EQUAL(Execute(*program), "5 7 6:3 5:3\n");
+}
+
+void TestSizeThresholds() {
+  auto program = ParseProgramFromString(POINT);
+  auto stats = InlineMethods(program, {10, 1});
+
+  ASSERT_EQUAL(stats.Inlined(), 3u);
+  auto report = Report(stats);
+  ASSERT(report.find("not inlined Point.moved into <top>: too many parameters") != string::npos);
+
+  program = ParseProgramFromString(POINT);
+  report = Report(InlineMethods(program, {10, 4}));
+  ASSERT(report.find("not inlined Point.moved into <top>: too large (16 nodes)") != string::npos);
+  ASSERT_EQUAL(Execute(*program), "5 7 6:3 5:3\n");
+}
+
+void TestGuardFallsBackToCall() {
+  auto program = ParseProgramFromString(R"(
+class Base:
+  def value():
+    return 1
+
+  def twice():
+    return self.value() * 2
+
+class Derived(Base):
+  def value():
+    return 10
+
+class Other:
+  def value():
+    return 100
+
+b = Base()
+d = Derived()
+o = Other()
+print b.twice(), d.twice()
+x = b
+print x.value()
+x = o
+print x.value()
+)");
+  auto stats = InlineMethods(program);
+
+  // Calls on self in Base are guarded by Base, Derived takes the call
+  ASSERT(Report(stats).find("inlined Base.value into Base.twice: 2 nodes") != string::npos);
+  ASSERT(Report(stats).find("not inlined value into <top>: polymorphic") != string::npos);
+  ASSERT_EQUAL(Execute(*program), "2 20\n1\n100\n");
+}
+
+void TestReentrantBodyTakesCall() {
+  auto program = ParseProgramFromString(R"(
+class Box:
+  def __init__(v):
+    self.v = v
+
+  def get(x):
+    return self.v + x
+
+  def run(x):
+    return self.get(x)
+
+  def __add__(x):
+    return self.run(x) * 10
+
+inner = Box(5)
+outer = Box(inner)
+print outer.run(1)
+)");
+  InlineMethods(program);
+  ASSERT(Dump(*program).find("InlinedCall Box.get") != string::npos);
+  ASSERT_EQUAL(Execute(*program), "60\n");
+}
+
+void TestRunOptionsAndEngines() {
+  for (Engine engine : {Engine::Tree, Engine::Stack}) {
+    istringstream input(POINT);
+    ostringstream output, report;
+    RunOptions options;
+    options.engine = engine;
+    options.inline_report = &report;
+    RunMythonProgram(input, output, options);
+    ASSERT_EQUAL(output.str(), "5 7 6:3 5:3\n");
+    ASSERT(report.str().find("inlined 5 of 6 call sites") != string::npos);
+  }
+}
+
+void TestInlinedCallsKeepPurity() {
+  istringstream input(R"(
+class M:
+  def sq(x):
+    return x * x
+
+  def f(n):
+    return self.sq(n) + 1
+
+m = M()
+print m.f(3), m.f(3)
+)");
+  ostringstream output, inlined, memo;
+  RunOptions options;
+  options.inline_report = &inlined;
+  options.memoize = true;
+  options.memo_report = &memo;
+  RunMythonProgram(input, output, options);
+
+  ASSERT_EQUAL(output.str(), "10 10\n");
+  ASSERT(inlined.str().find("inlined M.sq into M.f") != string::npos);
+  ASSERT(memo.str().find("M.f: 1 hits") != string::npos);
+}
+
+void RunInlinerTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestGettersAndSettersAreInlined);
+  RUN_TEST(tr, Ast::TestSizeThresholds);
+  RUN_TEST(tr, Ast::TestGuardFallsBackToCall);
+  RUN_TEST(tr, Ast::TestReentrantBodyTakesCall);
+  RUN_TEST(tr, Ast::TestRunOptionsAndEngines);
+  RUN_TEST(tr, Ast::TestInlinedCallsKeepPurity);
+}
+
+} /* namespace Ast */
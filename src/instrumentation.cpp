@@ -0,0 +1,57 @@
+#include "instrumentation.h"
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    class CountingStatement : public Statement {
+    public:
+        CountingStatement(std::unique_ptr<Statement> inner, DispatchStats& stats, bool is_statement)
+            : inner(std::move(inner)), stats(stats), is_statement(is_statement)
+        {
+        }
+
+        Result Execute(Closure& closure) override
+        {
+            ++stats.dispatches;
+            if (is_statement)
+                ++stats.statements;
+            return inner->Execute(closure);
+        }
+
+        void ForEachChild(const ChildVisitor& visitor) override
+        {
+            visitor(inner);
+        }
+
+    private:
+        std::unique_ptr<Statement> inner;
+        DispatchStats& stats;
+        bool is_statement;
+    };
+
+    void Instrument(std::unique_ptr<Statement>& node, DispatchStats& stats, bool is_statement)
+    {
+        bool is_compound = node->TryAs<Compound>() != nullptr;
+        node->ForEachChild([&stats, is_compound](std::unique_ptr<Statement>& child) {
+            Instrument(child, stats, is_compound);
+        });
+        node = std::make_unique<CountingStatement>(std::move(node), stats, is_statement);
+    }
+}
+
+double DispatchStats::PerStatement() const
+{
+    return statements == 0 ? 0.0 : static_cast<double>(dispatches) / statements;
+}
+
+void InstrumentDispatches(std::unique_ptr<Statement>& root, DispatchStats& stats)
+{
+    Instrument(root, stats, false);
+}
+
+} /* namespace Ast */
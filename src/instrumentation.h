@@ -0,0 +1,23 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstddef>
+#include <memory>
+
+namespace Ast {
+
+struct DispatchStats {
+  size_t dispatches = 0;
+  // Executions of nodes which are items of a Compound (program, suites, method bodies)
+  size_t statements = 0;
+
+  double PerStatement() const;
+};
+
+// Wraps every node of the tree (method bodies included) into a counter of
+// Execute calls. Is meant for measurements only: the wrappers hide node types
+// from the passes, so it should be applied last
+void InstrumentDispatches(std::unique_ptr<Statement>& root, DispatchStats& stats);
+
+} /* namespace Ast */
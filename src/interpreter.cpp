@@ -0,0 +1,285 @@
+#include "interpreter.h"
+#include "closure_compiler.h"
+#include "cpp_emitter.h"
+#include "escape_analysis.h"
+#include "flat_tree.h"
+#include "inliner.h"
+#include "jit.h"
+#include "lexer.h"
+#include "memoization.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "profile.h"
+#include "program_cache.h"
+#include "statement.h"
+#include "stack_evaluator.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+
+// Takes the constants out of the statement. The values of the variables may be
+// shared with them (see ValueStatement)
+void KeepConstants(unique_ptr<Ast::Statement>& statement, vector<unique_ptr<Ast::Statement>>& kept)
+{
+    vector<unique_ptr<Ast::Statement>*> stack = {&statement};
+    while (!stack.empty())
+    {
+        auto& node = *stack.back();
+        stack.pop_back();
+        if (node->TryAs<Ast::NumericConst>() || node->TryAs<Ast::StringConst>() || node->TryAs<Ast::BoolConst>())
+        {
+            kept.push_back(std::move(node));
+            continue;
+        }
+        node->ForEachChild([&stack](unique_ptr<Ast::Statement>& child) {
+            if (child)
+                stack.push_back(&child);
+        });
+    }
+}
+
+void RunStreaming(Parse::Lexer& lexer, const RunOptions& options)
+{
+    StatementReader reader(lexer);
+    // The definitions share the classes with the instances, the constants their
+    // values with the variables
+    vector<unique_ptr<Ast::Statement>> kept;
+    Runtime::Closure closure;
+    while (auto statement = reader.Next())
+    {
+        if (options.tail_calls)
+            Ast::MarkTailCalls(statement);
+        auto result = statement->Execute(closure);
+        if (statement->TryAs<Ast::ClassDefinition>())
+            kept.push_back(std::move(statement));
+        else
+            KeepConstants(statement, kept);
+        // A return at the top level ends the program, as it ends the Compound
+        if (result.IsNeedToReturn())
+            break;
+    }
+}
+
+bool UsesProgramCache(const RunOptions& options)
+{
+    return !options.program_cache.empty() && !options.streaming && !options.profile_output && !options.profile_input
+        && !options.tree_dump && !options.cpp_output && !options.memoize;
+}
+
+// The layout of the program as it is saved to the cache
+unique_ptr<Ast::Statement> ParseForCache(Parse::Lexer& lexer, const RunOptions& options)
+{
+    if (options.single_pass || !options.optimize)
+        return ParseFlatProgram(lexer, options.tail_calls);
+    auto program = ParseProgram(lexer);
+    Ast::OptimizeProgram(program);
+    if (options.tail_calls)
+        Ast::MarkTailCalls(program);
+    Ast::FlattenProgram(program);
+    return program;
+}
+
+void RunLazy(Parse::Lexer& lexer, const RunOptions& options)
+{
+    BodyPass prepare;
+    if (options.tail_calls)
+        prepare = [](unique_ptr<Ast::Statement>& body) { Ast::MarkTailCallsInBody(body); };
+    auto program = ParseProgram(
+        lexer, options.validate_methods ? MethodBodies::LazyValidated : MethodBodies::Lazy, std::move(prepare));
+    if (options.tail_calls)
+        Ast::MarkTailCalls(program);
+    Runtime::Closure closure;
+    program->Execute(closure);
+}
+
+// Profiles are bound to the source text, the hash of it is 0 when no profile is used
+void Run(Parse::Lexer& lexer, uint64_t source_hash, ostream& output, const RunOptions& options)
+{
+    Ast::Print::SetOutputStream(output);
+
+    if (options.single_pass)
+    {
+        auto program = ParseFlatProgram(lexer, options.tail_calls);
+        Runtime::Closure closure;
+        program->Execute(closure);
+        return;
+    }
+    if (options.streaming)
+    {
+        RunStreaming(lexer, options);
+        return;
+    }
+    if (options.lazy_methods && !options.profile_output && !options.profile_input && !options.tree_dump
+        && !options.cpp_output)
+    {
+        RunLazy(lexer, options);
+        return;
+    }
+
+    // The bodies are optimized as they are parsed, unless the tree of the parser is needed
+    bool optimize_bodies = options.parallel_methods && options.optimize && !options.profile_output
+        && !options.profile_input && !options.tree_dump && !options.cpp_output;
+    unique_ptr<Ast::Statement> program;
+    if (options.parallel_methods)
+    {
+        BodyPass prepare;
+        if (optimize_bodies)
+            prepare = [](unique_ptr<Ast::Statement>& body) { Ast::OptimizeMethodBody(body); };
+        program = ParseProgram(lexer, MethodBodies::Parallel, std::move(prepare), options.method_threads);
+    }
+    else
+        program = ParseProgram(lexer);
+
+    if (options.tree_dump)
+    {
+        *options.tree_dump << "Parsed:\n";
+        Ast::DumpTree(*program, *options.tree_dump);
+    }
+
+    // Translated from the tree of the parser, the other passes make nodes of their own
+    if (options.cpp_output)
+    {
+        Ast::EmitCpp(*program, *options.cpp_output);
+        return;
+    }
+
+    Ast::ProgramProfile profile;
+    if (options.profile_output)
+        Ast::RecordProfile(program, source_hash, profile);
+    else if (options.profile_input)
+        Ast::ApplyProfile(program, Ast::ProgramProfile::Load(*options.profile_input), source_hash);
+
+    if (options.optimize)
+        Ast::OptimizeProgram(program, !optimize_bodies);
+    // The recording nodes of a profile must see every call
+    if (options.inline_methods && !options.profile_output)
+    {
+        auto stats = Ast::InlineMethods(program, {options.inline_max_nodes, options.inline_max_params});
+        if (options.inline_report)
+            stats.Report(*options.inline_report);
+    }
+    if (options.infer_types)
+        Ast::SpecializeTypes(program);
+    if (options.tail_calls)
+        Ast::MarkTailCalls(program);
+    if (options.superinstructions)
+        Ast::FuseSuperinstructions(program);
+    // Goes last, the chains point into the trees they replace
+    if (options.escape_analysis && options.engine == Engine::Tree && !options.profile_output)
+        Ast::UnboxTemporaries(program);
+
+    if (options.tree_dump)
+    {
+        *options.tree_dump << "Optimized:\n";
+        Ast::DumpTree(*program, *options.tree_dump);
+    }
+
+    std::optional<Ast::Memoizer> memoizer;
+    if (options.memoize)
+    {
+        memoizer.emplace(options.memo_capacity);
+        memoizer->EnablePureMethods(*program, options.memoized_methods);
+    }
+
+    // The memoizer reads the trees, so they are compiled after it
+    if (options.engine == Engine::Closures)
+        Ast::CompileClosures(program);
+    else if (options.engine == Engine::Flat)
+        Ast::FlattenProgram(program);
+    else if (options.engine == Engine::Tree && options.jit && !options.profile_output)
+        Ast::EnableJit(*program, {options.jit_threshold, options.jit_perf_map});
+
+    Runtime::Closure closure;
+    if (options.engine == Engine::Stack)
+        Ast::StackEvaluator(options.max_depth).Run(*program, closure);
+    else
+        program->Execute(closure);
+
+    if (memoizer && options.memo_report)
+        memoizer->Report(*options.memo_report);
+    if (options.profile_output)
+        profile.Save(*options.profile_output);
+}
+
+}
+
+uint64_t ProgramCachePasses(const RunOptions& options)
+{
+    uint64_t passes = static_cast<uint64_t>(options.engine) << Ast::CACHED_ENGINE_SHIFT;
+    for (auto [set, bit] : {
+             pair{options.optimize, Ast::CACHED_OPTIMIZER},
+             pair{options.tail_calls, Ast::CACHED_TAIL_CALLS},
+             pair{options.single_pass, Ast::CACHED_SINGLE_PASS},
+             pair{options.inline_methods, Ast::CACHED_INLINE},
+             pair{options.infer_types, Ast::CACHED_TYPES},
+             pair{options.superinstructions, Ast::CACHED_SUPERINSTRUCTIONS},
+             pair{options.escape_analysis, Ast::CACHED_ESCAPE_ANALYSIS},
+             pair{options.jit, Ast::CACHED_JIT},
+             pair{options.lazy_methods, Ast::CACHED_LAZY_METHODS},
+         })
+    {
+        if (set)
+            passes |= bit;
+    }
+    return passes;
+}
+
+void RunMythonProgram(istream& input, ostream& output, const RunOptions& options)
+{
+    // Read in full to be hashed, or for the bodies passed over to keep their lines
+    if (options.profile_output || options.profile_input || options.lazy_methods || options.parallel_methods)
+    {
+        std::string source(std::istreambuf_iterator<char>(input), {});
+        RunMythonProgram(std::string_view(source), output, options);
+        return;
+    }
+
+    Parse::Lexer lexer(input, options.table_lexer ? Parse::LexerKind::Table : Parse::LexerKind::Handwritten);
+    if (options.pipelined_lexer && std::thread::hardware_concurrency() > 1)
+        lexer.RunAhead();
+    Run(lexer, 0, output, options);
+}
+
+void RunMythonProgram(std::string_view source, ostream& output, const RunOptions& options)
+{
+    if (UsesProgramCache(options))
+    {
+        uint64_t hash = Ast::HashSource(source);
+        auto program = Ast::LoadProgramFile(options.program_cache, hash, ProgramCachePasses(options));
+        if (!program && options.write_program_cache)
+        {
+            Parse::Lexer lexer(source, options.table_lexer ? Parse::LexerKind::Table : Parse::LexerKind::Handwritten);
+            program = ParseForCache(lexer, options);
+            // A program the format does not hold runs all the same
+            Ast::SaveProgramFile(*program, hash, options.program_cache, ProgramCachePasses(options));
+        }
+        if (program)
+        {
+            Ast::Print::SetOutputStream(output);
+            Runtime::Closure closure;
+            program->Execute(closure);
+            return;
+        }
+    }
+
+    bool profiling = options.profile_output || options.profile_input;
+    Parse::Lexer lexer(source, options.table_lexer ? Parse::LexerKind::Table : Parse::LexerKind::Handwritten);
+    // Lazy bodies are passed over by the lexer, which can not run ahead of the parser then
+    if (options.pipelined_lexer && !options.lazy_methods && !options.parallel_methods
+        && std::thread::hardware_concurrency() > 1)
+        lexer.RunAhead();
+    Run(lexer, profiling ? Ast::HashSource(source) : 0, output, options);
+}
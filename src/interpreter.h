@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class Engine {
+  // Every node executes its children recursively
+  Tree,
+  // Linear code with Mython frames on a heap stack (see stack_evaluator.h)
+  Stack,
+  // Trees compiled into callables before the run (see closure_compiler.h)
+  Closures,
+  // Trees laid out in contiguous arrays before the run (see flat_tree.h)
+  Flat,
+};
+
+struct RunOptions {
+  // Recognize tokens with the state machine rather than the handwritten tests
+  // (see Parse::LexerKind), to test the two lexers against each other
+  bool table_lexer = false;
+  // Lex on a thread of its own ahead of the parser (see Parse::Lexer::RunAhead).
+  // Not used on a single core, where the two threads would only take turns
+  bool pipelined_lexer = false;
+  // Fold constants, drop dead code, share field lookups (see optimizer.h)
+  bool optimize = true;
+  // Splice small methods into their call sites (see inliner.h)
+  bool inline_methods = true;
+  // Statements and expressions of the largest inlined body
+  size_t inline_max_nodes = 16;
+  size_t inline_max_params = 4;
+  // Where to write what was inlined
+  std::ostream* inline_report = nullptr;
+  // Replace operations on values of proven types with unboxed ones (see type_inference.h)
+  bool infer_types = true;
+  // Fuse frequent node chains into single nodes (see superinstructions.h)
+  bool superinstructions = true;
+  // Run "return obj.method(...)" without growing the native stack (see tail_calls.h)
+  bool tail_calls = true;
+
+  // Keep the numbers inside arithmetic expressions unboxed (see escape_analysis.h).
+  // Used by the tree engine only
+  bool escape_analysis = true;
+
+  Engine engine = Engine::Tree;
+  // Parse straight into the flat layout without building the tree (see ParseFlatProgram
+  // in parse.h). The program runs as parsed: the engine and the passes are not used, but
+  // for tail_calls, which the parser lays out
+  bool single_pass = false;
+  // The file of the precompiled program of the source (see program_cache.h). When it was
+  // written for the same text by a run with the same options (see ProgramCachePasses),
+  // the program is loaded from it instead of being parsed.
+  // Used for a source buffer only, not with the options that need the tree (streaming,
+  // profiles, memoization, the tree dump and the C++ translation)
+  std::string program_cache;
+  // Write the file when it is missing or stale. The program is parsed in a single pass,
+  // or into the tree and laid out after the optimizer when optimize is set and single_pass
+  // is not, with its tail calls when tail_calls is set; it runs as laid out, here and in
+  // the later runs with the same options, the engine and the other passes are not used
+  bool write_program_cache = false;
+  // Parse each method body on the first call of the method, at load its lines are only
+  // found by their indentation (see MethodBodies in parse.h). The program runs on the
+  // tree engine with its tail calls marked: the other passes would not see into the
+  // bodies. Not used with the options which need the whole tree (profiles, the tree
+  // dump and the C++ translation)
+  bool lazy_methods = false;
+  // With lazy_methods, check the syntax of every body at load
+  bool validate_methods = false;
+  // Parse the method bodies on a pool of threads once the classes have been declared,
+  // the optimizer goes through each body on the thread which parsed it (see MethodBodies
+  // in parse.h). The program and the other passes are those of the eager parse. Not
+  // used with lazy_methods
+  bool parallel_methods = false;
+  // The threads of parallel_methods, one per core when 0
+  size_t method_threads = 0;
+  // Run each top-level statement as soon as it is parsed and free it after, only the
+  // class definitions are kept (see StatementReader in parse.h). The statements run
+  // on the tree engine with their tail calls marked, the other passes are not used
+  bool streaming = false;
+  // Compile hot numeric methods into x86-64 code (see jit.h). Used by the tree engine only,
+  // MYTHON_NO_JIT in the environment turns it off too
+  bool jit = true;
+  // Calls of a method before it is compiled
+  size_t jit_threshold = 100;
+  // Write /tmp/perf-<pid>.map for perf to name the compiled code
+  bool jit_perf_map = false;
+  // Mython frames allowed by the stack engine before RecursionError is thrown
+  size_t max_depth = 100000;
+
+  // Cache results of the methods proven pure (see memoization.h)
+  bool memoize = false;
+  // "Class.method" names to memoize, empty means every pure method
+  std::vector<std::string> memoized_methods;
+  // Entries kept per memoized method
+  size_t memo_capacity = 1024;
+  // Where to write the memoization statistics after the run
+  std::ostream* memo_report = nullptr;
+  // Translate the program into C++ (see cpp_emitter.h) instead of running it
+  std::ostream* cpp_output = nullptr;
+  // Where to write the tree before and after the optimizations
+  std::ostream* tree_dump = nullptr;
+
+  // Where to write the type feedback of the run (see profile.h). Needs the tree engine
+  std::ostream* profile_output = nullptr;
+  // The feedback of earlier runs to specialize the program with. Not used when recording,
+  // a profile of another source is ignored
+  std::istream* profile_input = nullptr;
+};
+
+void RunMythonProgram(std::istream& input, std::ostream& output, const RunOptions& options = {});
+// Runs the program read in place from the buffer (see Parse::SourceFile)
+void RunMythonProgram(std::string_view source, std::ostream& output, const RunOptions& options = {});
+
+// The options recorded with the program written to program_cache, the bits of
+// program_cache.h
+uint64_t ProgramCachePasses(const RunOptions& options);
@@ -0,0 +1,1125 @@
+#include "jit.h"
+#include "escape_analysis.h"
+#include "object.h"
+#include "optimizer.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <unordered_map>
+
+#if defined(__x86_64__) && defined(__linux__)
+#define MYTHON_JIT_X64 1
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace Ast {
+
+// JitCode
+//
+class JitCode {
+public:
+    // Returns 0 when the call has to be run by the tree
+    using Function = int (*)(Runtime::ClassInstance* self, int32_t* slots, int32_t* result);
+
+    JitCode(void* memory, size_t size)
+        : memory(memory), size(size)
+    {}
+
+    ~JitCode()
+    {
+#ifdef MYTHON_JIT_X64
+        munmap(memory, size);
+#endif
+    }
+
+    void* memory;
+    size_t size;
+    Function entry = nullptr;
+    const Runtime::Class* cls = nullptr;
+    // Values and then the "assigned" flags of the parameters and locals of the entry
+    size_t slots = 0;
+    // Names passed to the runtime helpers
+    std::vector<std::unique_ptr<std::string>> names;
+};
+
+namespace {
+
+const size_t MAX_BAILOUTS = 16;
+
+#ifdef MYTHON_JIT_X64
+
+// Runtime helpers
+//
+// Called from the native code with the C calling convention, so they never throw
+
+// self.name, false when it is not a number
+bool ReadField(Runtime::ClassInstance* self, const std::string* name, int32_t* value) noexcept
+{
+    auto& fields = self->Fields();
+    auto it = fields.find(*name);
+    if (it == fields.end())
+        return false;
+    auto number = it->second.TryAs<Runtime::Number>();
+    if (!number)
+        return false;
+    *value = number->GetValue();
+    return true;
+}
+
+// The closure of a method starts with the fields of self, so a local may
+// be read before it is assigned
+void LoadLocal(Runtime::ClassInstance* self, const std::string* name, int32_t* value, int32_t* assigned) noexcept
+{
+    *assigned = ReadField(self, name, value);
+}
+
+// Assembler
+//
+enum Reg : uint8_t {
+    RAX = 0,
+    RCX = 1,
+    RDX = 2,
+    RBX = 3,
+    RSP = 4,
+    RBP = 5,
+    RSI = 6,
+    RDI = 7,
+    R12 = 12,
+    R13 = 13,
+};
+
+// Condition codes of jcc and setcc, the negation flips the lowest bit
+enum Cond : uint8_t {
+    EQUAL = 0x4,
+    NOT_EQUAL = 0x5,
+    LESS = 0xC,
+    GREATER_OR_EQUAL = 0xD,
+    LESS_OR_EQUAL = 0xE,
+    GREATER = 0xF,
+};
+
+Cond Negation(Cond cond)
+{
+    return static_cast<Cond>(cond ^ 1);
+}
+
+Cond ConditionOf(CompareOp op)
+{
+    switch (op)
+    {
+    case CompareOp::Equal:
+        return EQUAL;
+    case CompareOp::NotEqual:
+        return NOT_EQUAL;
+    case CompareOp::Less:
+        return LESS;
+    case CompareOp::Greater:
+        return GREATER;
+    case CompareOp::LessOrEqual:
+        return LESS_OR_EQUAL;
+    default:
+        return GREATER_OR_EQUAL;
+    }
+}
+
+// Emits the few instructions the templates are made of. Values are 32-bit,
+// as Runtime::Number is, and computed in eax with ecx as the second operand
+class Assembler {
+public:
+    const std::vector<uint8_t>& Bytes() const
+    {
+        return bytes;
+    }
+
+    size_t NewLabel()
+    {
+        labels.push_back(UNBOUND);
+        return labels.size() - 1;
+    }
+
+    void Bind(size_t label)
+    {
+        labels[label] = bytes.size();
+    }
+
+    size_t Position(size_t label) const
+    {
+        return labels[label];
+    }
+
+    void Push(Reg reg)
+    {
+        if (reg & 8)
+            Byte(0x41);
+        Byte(0x50 | (reg & 7));
+    }
+
+    void Pop(Reg reg)
+    {
+        if (reg & 8)
+            Byte(0x41);
+        Byte(0x58 | (reg & 7));
+    }
+
+    // dst = src, 64-bit
+    void Move(Reg dst, Reg src)
+    {
+        Rex(true, src, dst);
+        Byte(0x89);
+        Direct(src, dst);
+    }
+
+    void MoveImmediate(Reg dst, int32_t value)
+    {
+        Rex(false, 0, dst);
+        Byte(0xB8 | (dst & 7));
+        Int32(value);
+    }
+
+    void MoveAddress(Reg dst, const void* address)
+    {
+        Rex(true, 0, dst);
+        Byte(0xB8 | (dst & 7));
+        uint64_t value = reinterpret_cast<uint64_t>(address);
+        for (int i = 0; i < 8; ++i)
+            Byte(static_cast<uint8_t>(value >> (8 * i)));
+    }
+
+    // dst = [base + disp], 32-bit
+    void Load(Reg dst, Reg base, int32_t disp)
+    {
+        Rex(false, dst, base);
+        Byte(0x8B);
+        Memory(dst, base, disp);
+    }
+
+    // [base + disp] = src, 32-bit
+    void Store(Reg base, int32_t disp, Reg src)
+    {
+        Rex(false, src, base);
+        Byte(0x89);
+        Memory(src, base, disp);
+    }
+
+    void StoreImmediate(Reg base, int32_t disp, int32_t value)
+    {
+        Rex(false, 0, base);
+        Byte(0xC7);
+        Memory(0, base, disp);
+        Int32(value);
+    }
+
+    // Flags of [base + disp] - value
+    void CompareMemory(Reg base, int32_t disp, int8_t value)
+    {
+        Rex(false, 0, base);
+        Byte(0x83);
+        Memory(7, base, disp);
+        Byte(static_cast<uint8_t>(value));
+    }
+
+    void LoadAddress(Reg dst, Reg base, int32_t disp)
+    {
+        Rex(true, dst, base);
+        Byte(0x8D);
+        Memory(dst, base, disp);
+    }
+
+    void AddToStack(int32_t bytes)
+    {
+        Rex(true, 0, RSP);
+        Byte(0x81);
+        Direct(0, RSP);
+        Int32(bytes);
+    }
+
+    void SubFromStack(int32_t bytes)
+    {
+        Rex(true, 0, RSP);
+        Byte(0x81);
+        Direct(5, RSP);
+        Int32(bytes);
+    }
+
+    // eax = eax <op> ecx
+    void Arithmetic(ArithmeticOp op)
+    {
+        switch (op)
+        {
+        case ArithmeticOp::Add:
+            Bytes({0x01, 0xC8});
+            break;
+        case ArithmeticOp::Sub:
+            Bytes({0x29, 0xC8});
+            break;
+        case ArithmeticOp::Mult:
+            Bytes({0x0F, 0xAF, 0xC1});
+            break;
+        case ArithmeticOp::Div:
+            // cdq; idiv ecx
+            Bytes({0x99, 0xF7, 0xF9});
+            break;
+        }
+    }
+
+    void NegateEax()
+    {
+        Bytes({0xF7, 0xD8});
+    }
+
+    void MoveEaxToEcx()
+    {
+        Bytes({0x89, 0xC1});
+    }
+
+    void CompareEaxEcx()
+    {
+        Bytes({0x39, 0xC8});
+    }
+
+    void TestEax()
+    {
+        Bytes({0x85, 0xC0});
+    }
+
+    void TestEcx()
+    {
+        Bytes({0x85, 0xC9});
+    }
+
+    void TestAl()
+    {
+        Bytes({0x84, 0xC0});
+    }
+
+    // eax = cond ? 1 : 0
+    void Set(Cond cond)
+    {
+        Bytes({0x0F, static_cast<uint8_t>(0x90 | cond), 0xC0, 0x0F, 0xB6, 0xC0});
+    }
+
+    void OrEaxEcx()
+    {
+        Bytes({0x09, 0xC8});
+    }
+
+    void AndEaxEcx()
+    {
+        Bytes({0x21, 0xC8});
+    }
+
+    void FlipEax()
+    {
+        Bytes({0x83, 0xF0, 0x01});
+    }
+
+    void ZeroEax()
+    {
+        Bytes({0x31, 0xC0});
+    }
+
+    void CallAddress(const void* function)
+    {
+        MoveAddress(RAX, function);
+        Bytes({0xFF, 0xD0});
+    }
+
+    void Call(size_t label)
+    {
+        Byte(0xE8);
+        Fixup(label);
+    }
+
+    void Jump(size_t label)
+    {
+        Byte(0xE9);
+        Fixup(label);
+    }
+
+    void JumpIf(Cond cond, size_t label)
+    {
+        Bytes({0x0F, static_cast<uint8_t>(0x80 | cond)});
+        Fixup(label);
+    }
+
+    void Return()
+    {
+        Byte(0xC3);
+    }
+
+    // Patches the jumps and calls, every label has to be bound
+    void Finish()
+    {
+        for (auto [at, label] : fixups)
+        {
+            int32_t offset = static_cast<int32_t>(labels[label] - (at + 4));
+            std::memcpy(bytes.data() + at, &offset, sizeof(offset));
+        }
+        fixups.clear();
+    }
+
+private:
+    static constexpr size_t UNBOUND = static_cast<size_t>(-1);
+
+    void Byte(uint8_t byte)
+    {
+        bytes.push_back(byte);
+    }
+
+    void Bytes(std::initializer_list<uint8_t> list)
+    {
+        bytes.insert(bytes.end(), list);
+    }
+
+    void Int32(int32_t value)
+    {
+        for (int i = 0; i < 4; ++i)
+            Byte(static_cast<uint8_t>(static_cast<uint32_t>(value) >> (8 * i)));
+    }
+
+    void Rex(bool wide, int reg, int base)
+    {
+        uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (base & 8 ? 1 : 0);
+        if (rex != 0x40)
+            Byte(rex);
+    }
+
+    // [base + disp32]; rsp and r12 need the SIB byte
+    void Memory(int reg, int base, int32_t disp)
+    {
+        Byte(static_cast<uint8_t>(0x80 | (reg & 7) << 3 | (base & 7)));
+        if ((base & 7) == RSP)
+            Byte(0x24);
+        Int32(disp);
+    }
+
+    void Direct(int reg, int rm)
+    {
+        Byte(static_cast<uint8_t>(0xC0 | (reg & 7) << 3 | (rm & 7)));
+    }
+
+    void Fixup(size_t label)
+    {
+        fixups.emplace_back(bytes.size(), label);
+        Int32(0);
+    }
+
+    std::vector<uint8_t> bytes;
+    std::vector<size_t> labels;
+    std::vector<std::pair<size_t, size_t>> fixups;
+};
+
+// MethodCompiler
+//
+enum class ValueKind {
+    Number,
+    Bool,
+};
+
+Statement& TreeOf(const Runtime::Method& method)
+{
+    if (auto jit = method.body->TryAs<JitBody>())
+        return jit->Tree();
+    return *method.body;
+}
+
+bool IsSelf(Statement& node)
+{
+    auto variable = node.TryAs<VariableValue>();
+    return variable && variable->dotted_ids.size() == 1 && variable->dotted_ids[0] == "self";
+}
+
+// Compiles a method and the methods it calls on self into one piece of code.
+// Each method becomes a function
+//   int f(ClassInstance* self, int32_t* slots, int32_t* result)
+// with its parameters and locals in slots, followed by a flag per slot
+// telling whether it holds a number. Registers: rbx = self, r12 = slots,
+// r13 = result, [rbp - 32] is scratch for the helpers
+class MethodCompiler {
+public:
+    explicit MethodCompiler(const Runtime::Class& cls)
+        : cls(cls)
+    {}
+
+    std::unique_ptr<JitCode> Compile(const Runtime::Method& method, bool perf_map)
+    {
+        if (!AddFunction(method))
+            return nullptr;
+        for (current = 0; current < functions.size(); ++current)
+        {
+            if (!Generate(functions[current]))
+                return nullptr;
+        }
+        assembler.Finish();
+
+        auto code = Map(assembler.Bytes());
+        if (!code)
+            return nullptr;
+        code->cls = &cls;
+        code->slots = 2 * functions[0].names.size();
+        code->names = std::move(names);
+        if (perf_map)
+            WritePerfMap(*code);
+        return code;
+    }
+
+private:
+    struct Function {
+        const Runtime::Method* method = nullptr;
+        size_t label = 0;
+        std::vector<std::string> names;
+        std::unordered_map<std::string, size_t> slots;
+    };
+
+    // Scanning
+    //
+    std::optional<size_t> AddFunction(const Runtime::Method& method)
+    {
+        if (auto it = function_ids.find(&method); it != function_ids.end())
+            return it->second;
+
+        size_t id = functions.size();
+        function_ids[&method] = id;
+        functions.emplace_back();
+        functions[id].method = &method;
+        functions[id].label = assembler.NewLabel();
+        for (auto& param : method.formal_params)
+            Name(id, param);
+        if (!Scan(TreeOf(method), id))
+            return std::nullopt;
+        return id;
+    }
+
+    void Name(size_t id, const std::string& name)
+    {
+        auto& function = functions[id];
+        if (function.slots.emplace(name, function.names.size()).second)
+            function.names.push_back(name);
+    }
+
+    // Collects the names and the callees; the shapes are checked by Generate
+    bool Scan(Statement& node, size_t id)
+    {
+        if (auto call = node.TryAs<MethodCall>())
+            return ScanCall(*call->object, call->method, call->args, id);
+        if (auto call = node.TryAs<TailCall>())
+            return ScanCall(*call->Object(), call->Method(), call->Args(), id);
+        if (auto variable = node.TryAs<VariableValue>())
+            return ScanVariable(*variable, id);
+        if (auto read = node.TryAs<CachedFieldRead>())
+            return ScanVariable(read->Variable(), id);
+        if (auto ret = node.TryAs<ReturnVariable>())
+            return ScanVariable(ret->Variable(), id);
+        if (auto assignment = node.TryAs<Assignment>())
+        {
+            if (assignment->var == "self")
+                return false;
+            Name(id, assignment->var);
+        }
+        if (auto update = node.TryAs<VariableUpdate>())
+        {
+            if (update->Var() == "self")
+                return false;
+            Name(id, update->Var());
+        }
+
+        bool ok = true;
+        node.ForEachChild([this, id, &ok](std::unique_ptr<Statement>& child) {
+            if (ok && child)
+                ok = Scan(*child, id);
+        });
+        return ok;
+    }
+
+    bool ScanVariable(VariableValue& variable, size_t id)
+    {
+        if (variable.dotted_ids.size() == 1 && variable.dotted_ids[0] != "self")
+            Name(id, variable.dotted_ids[0]);
+        return true;
+    }
+
+    bool ScanCall(Statement& object, const std::string& name, std::vector<std::unique_ptr<Statement>>& args, size_t id)
+    {
+        if (!IsSelf(object))
+            return false;
+        auto callee = cls.GetMethod(name);
+        if (!callee || callee->formal_params.size() != args.size() || !AddFunction(*callee))
+            return false;
+        for (auto& arg : args)
+        {
+            if (!Scan(*arg, id))
+                return false;
+        }
+        return true;
+    }
+
+    // Code generation
+    //
+    bool Generate(Function& function)
+    {
+        auto& a = assembler;
+        int32_t count = static_cast<int32_t>(function.names.size());
+        bail = a.NewLabel();
+        epilogue = a.NewLabel();
+        entry = a.NewLabel();
+        depth = 0;
+
+        a.Bind(function.label);
+        a.Push(RBP);
+        a.Move(RBP, RSP);
+        a.Push(RBX);
+        a.Push(R12);
+        a.Push(R13);
+        a.SubFromStack(24);
+        a.Move(RBX, RDI);
+        a.Move(R12, RSI);
+        a.Move(R13, RDX);
+
+        // Calls of the method itself in tail position come back here
+        a.Bind(entry);
+        int32_t params = static_cast<int32_t>(function.method->formal_params.size());
+        for (int32_t i = 0; i < params; ++i)
+            a.StoreImmediate(R12, 4 * (count + i), 1);
+        for (int32_t i = params; i < count; ++i)
+        {
+            a.Move(RDI, RBX);
+            a.MoveAddress(RSI, Intern(function.names[i]));
+            a.LoadAddress(RDX, R12, 4 * i);
+            a.LoadAddress(RCX, R12, 4 * (count + i));
+            a.CallAddress(reinterpret_cast<const void*>(&LoadLocal));
+        }
+
+        if (!CompileStatement(TreeOf(*function.method)))
+            return false;
+
+        // Falling off the end returns None
+        a.Bind(bail);
+        a.ZeroEax();
+        a.Bind(epilogue);
+        a.LoadAddress(RSP, RBP, -24);
+        a.Pop(R13);
+        a.Pop(R12);
+        a.Pop(RBX);
+        a.Pop(RBP);
+        a.Return();
+        return true;
+    }
+
+    bool CompileStatement(Statement& node)
+    {
+        auto& a = assembler;
+        if (auto compound = node.TryAs<Compound>())
+        {
+            for (auto& statement : compound->Statements())
+            {
+                if (!CompileStatement(*statement))
+                    return false;
+            }
+            return true;
+        }
+        if (auto assignment = node.TryAs<Assignment>())
+        {
+            if (!CompileNumber(*assignment->rv))
+                return false;
+            Assign(assignment->var);
+            return true;
+        }
+        if (auto update = node.TryAs<VariableUpdate>())
+        {
+            if (!CompileRead(update->Var()))
+                return false;
+            a.Push(RAX);
+            ++depth;
+            if (!CompileNumber(*update->Rhs()))
+                return false;
+            Apply(update->Op());
+            Assign(update->Var());
+            return true;
+        }
+        if (auto ret = node.TryAs<Return>())
+        {
+            if (!ret->Value() || !CompileNumber(*ret->Value()))
+                return false;
+            ReturnEax();
+            return true;
+        }
+        if (auto ret = node.TryAs<ReturnVariable>())
+        {
+            if (!CompileVariable(ret->Variable()))
+                return false;
+            ReturnEax();
+            return true;
+        }
+        if (auto call = node.TryAs<TailCall>())
+        {
+            if (function_ids.at(cls.GetMethod(call->Method())) == current)
+                return CompileSelfTailCall(call->Args());
+            if (!CompileCall(call->Method(), call->Args()))
+                return false;
+            ReturnEax();
+            return true;
+        }
+        if (auto call = node.TryAs<MethodCall>())
+            return CompileCall(call->method, call->args);
+        if (auto branch = node.TryAs<IfElse>())
+        {
+            if (!CompileCondition(*branch->Condition()))
+                return false;
+            a.TestEax();
+            return CompileBranches(EQUAL, branch->IfBody().get(), branch->ElseBody().get());
+        }
+        if (auto branch = node.TryAs<IfCompare>())
+        {
+            auto op = GetCompareOp(branch->GetComparator());
+            if (!op || !CompileOperands(*branch->Lhs(), *branch->Rhs()))
+                return false;
+            a.CompareEaxEcx();
+            return CompileBranches(Negation(ConditionOf(*op)), branch->IfBody().get(), branch->ElseBody().get());
+        }
+        return false;
+    }
+
+    // Jumps over the if body when cond holds
+    bool CompileBranches(Cond cond, Statement* if_body, Statement* else_body)
+    {
+        auto& a = assembler;
+        size_t otherwise = a.NewLabel();
+        size_t end = a.NewLabel();
+        a.JumpIf(cond, otherwise);
+        if (if_body && !CompileStatement(*if_body))
+            return false;
+        a.Jump(end);
+        a.Bind(otherwise);
+        if (else_body && !CompileStatement(*else_body))
+            return false;
+        a.Bind(end);
+        return true;
+    }
+
+    std::optional<ValueKind> CompileExpression(Statement& node)
+    {
+        auto& a = assembler;
+        if (auto constant = node.TryAs<NumericConst>())
+        {
+            a.MoveImmediate(RAX, constant->value.GetValue());
+            return ValueKind::Number;
+        }
+        if (auto constant = node.TryAs<BoolConst>())
+        {
+            a.MoveImmediate(RAX, constant->value.GetValue() ? 1 : 0);
+            return ValueKind::Bool;
+        }
+        if (auto variable = node.TryAs<VariableValue>())
+            return NumberIf(CompileVariable(*variable));
+        if (auto read = node.TryAs<CachedFieldRead>())
+            return NumberIf(CompileVariable(read->Variable()));
+        if (auto chain = node.TryAs<ArithmeticChain>())
+            return CompileExpression(chain->Expression());
+        if (auto negate = node.TryAs<Negate>())
+        {
+            if (!CompileNumber(*negate->Argument()))
+                return std::nullopt;
+            a.NegateEax();
+            return ValueKind::Number;
+        }
+        if (auto op = ArithmeticOf(node))
+        {
+            auto& binary = static_cast<BinaryOperation&>(node);
+            if (!CompileOperands(*binary.Lhs(), *binary.Rhs()))
+                return std::nullopt;
+            Apply(*op, false);
+            return ValueKind::Number;
+        }
+        if (auto comparison = node.TryAs<Comparison>())
+        {
+            auto op = GetCompareOp(comparison->GetComparator());
+            if (!op || !CompileOperands(*comparison->Lhs(), *comparison->Rhs()))
+                return std::nullopt;
+            a.CompareEaxEcx();
+            a.Set(ConditionOf(*op));
+            return ValueKind::Bool;
+        }
+        if (auto negation = node.TryAs<Not>())
+        {
+            if (!CompileCondition(*negation->Argument()))
+                return std::nullopt;
+            a.FlipEax();
+            return ValueKind::Bool;
+        }
+        bool is_or = node.TryAs<Or>() != nullptr;
+        if (is_or || node.TryAs<And>())
+        {
+            // Mython evaluates both operands
+            auto& binary = static_cast<BinaryOperation&>(node);
+            if (!CompileCondition(*binary.Lhs()))
+                return std::nullopt;
+            a.Push(RAX);
+            ++depth;
+            if (!CompileCondition(*binary.Rhs()))
+                return std::nullopt;
+            a.MoveEaxToEcx();
+            a.Pop(RAX);
+            --depth;
+            if (is_or)
+                a.OrEaxEcx();
+            else
+                a.AndEaxEcx();
+            return ValueKind::Bool;
+        }
+        if (auto call = node.TryAs<MethodCall>())
+            return NumberIf(CompileCall(call->method, call->args));
+        return std::nullopt;
+    }
+
+    static std::optional<ValueKind> NumberIf(bool compiled)
+    {
+        if (!compiled)
+            return std::nullopt;
+        return ValueKind::Number;
+    }
+
+    static std::optional<ArithmeticOp> ArithmeticOf(Statement& node)
+    {
+        if (node.TryAs<Add>())
+            return ArithmeticOp::Add;
+        if (node.TryAs<Sub>())
+            return ArithmeticOp::Sub;
+        if (node.TryAs<Mult>())
+            return ArithmeticOp::Mult;
+        if (node.TryAs<Div>())
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    bool CompileNumber(Statement& node)
+    {
+        return CompileExpression(node) == ValueKind::Number;
+    }
+
+    // eax = IsTrue(value)
+    bool CompileCondition(Statement& node)
+    {
+        auto kind = CompileExpression(node);
+        if (kind == ValueKind::Number)
+        {
+            assembler.TestEax();
+            assembler.Set(NOT_EQUAL);
+        }
+        return kind.has_value();
+    }
+
+    // eax = lhs, ecx = rhs
+    bool CompileOperands(Statement& lhs, Statement& rhs)
+    {
+        auto& a = assembler;
+        if (!CompileNumber(lhs))
+            return false;
+        a.Push(RAX);
+        ++depth;
+        if (!CompileNumber(rhs))
+            return false;
+        a.MoveEaxToEcx();
+        a.Pop(RAX);
+        --depth;
+        return true;
+    }
+
+    // eax = popped lhs <op> eax
+    void Apply(ArithmeticOp op, bool pop = true)
+    {
+        auto& a = assembler;
+        if (pop)
+        {
+            a.MoveEaxToEcx();
+            a.Pop(RAX);
+            --depth;
+        }
+        // The tree decides what division by zero does
+        if (op == ArithmeticOp::Div)
+        {
+            a.TestEcx();
+            a.JumpIf(EQUAL, bail);
+        }
+        a.Arithmetic(op);
+    }
+
+    bool CompileVariable(VariableValue& variable)
+    {
+        auto& ids = variable.dotted_ids;
+        if (ids.size() == 1)
+            return CompileRead(ids[0]);
+        if (ids.size() == 2 && ids[0] == "self")
+        {
+            auto& a = assembler;
+            AlignedCall([&] {
+                a.Move(RDI, RBX);
+                a.MoveAddress(RSI, Intern(ids[1]));
+                a.LoadAddress(RDX, RBP, -32);
+                a.CallAddress(reinterpret_cast<const void*>(&ReadField));
+            });
+            a.TestAl();
+            a.JumpIf(EQUAL, bail);
+            a.Load(RAX, RBP, -32);
+            return true;
+        }
+        return false;
+    }
+
+    bool CompileRead(const std::string& name)
+    {
+        auto& function = functions[current];
+        auto it = function.slots.find(name);
+        if (it == function.slots.end())
+            return false;
+        int32_t slot = static_cast<int32_t>(it->second);
+        int32_t count = static_cast<int32_t>(function.names.size());
+        auto& a = assembler;
+        a.CompareMemory(R12, 4 * (count + slot), 0);
+        a.JumpIf(EQUAL, bail);
+        a.Load(RAX, R12, 4 * slot);
+        return true;
+    }
+
+    void Assign(const std::string& name)
+    {
+        auto& function = functions[current];
+        int32_t slot = static_cast<int32_t>(function.slots.at(name));
+        int32_t count = static_cast<int32_t>(function.names.size());
+        assembler.Store(R12, 4 * slot, RAX);
+        assembler.StoreImmediate(R12, 4 * (count + slot), 1);
+    }
+
+    void ReturnEax()
+    {
+        assembler.Store(R13, 0, RAX);
+        assembler.MoveImmediate(RAX, 1);
+        assembler.Jump(epilogue);
+    }
+
+    // The stack is 16-byte aligned at calls
+    template <typename Emit>
+    void AlignedCall(Emit emit)
+    {
+        if (depth % 2)
+            assembler.SubFromStack(8);
+        emit();
+        if (depth % 2)
+            assembler.AddToStack(8);
+    }
+
+    // self.method(args), a direct call of the function of the method
+    bool CompileCall(const std::string& name, std::vector<std::unique_ptr<Statement>>& args)
+    {
+        auto& a = assembler;
+        auto& callee = functions[function_ids.at(cls.GetMethod(name))];
+        for (auto& arg : args)
+        {
+            if (!CompileNumber(*arg))
+                return false;
+            a.Push(RAX);
+            ++depth;
+        }
+
+        int32_t count = static_cast<int32_t>(callee.names.size());
+        int32_t pushed = static_cast<int32_t>(8 * args.size());
+        // The slots of the callee and its result
+        int32_t frame = (8 * count + 4 + 15) / 16 * 16 + (depth % 2 ? 8 : 0);
+        a.SubFromStack(frame);
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            a.Load(RAX, RSP, frame + pushed - 8 * static_cast<int32_t>(i + 1));
+            a.Store(RSP, 4 * static_cast<int32_t>(i), RAX);
+        }
+        a.Move(RDI, RBX);
+        a.Move(RSI, RSP);
+        a.LoadAddress(RDX, RSP, 8 * count);
+        a.Call(callee.label);
+        a.TestEax();
+        a.JumpIf(EQUAL, bail);
+        a.Load(RAX, RSP, 8 * count);
+        a.AddToStack(frame + pushed);
+        depth -= static_cast<int>(args.size());
+        return true;
+    }
+
+    // A loop rather than a call, so deep recursion doesn't grow the stack: the
+    // arguments become the parameters and the locals are loaded anew, as in a
+    // fresh call
+    bool CompileSelfTailCall(std::vector<std::unique_ptr<Statement>>& args)
+    {
+        auto& a = assembler;
+        for (auto& arg : args)
+        {
+            if (!CompileNumber(*arg))
+                return false;
+            a.Push(RAX);
+            ++depth;
+        }
+        for (size_t i = args.size(); i > 0; --i)
+        {
+            a.Pop(RAX);
+            --depth;
+            a.Store(R12, 4 * static_cast<int32_t>(i - 1), RAX);
+        }
+        a.Jump(entry);
+        return true;
+    }
+
+    const std::string* Intern(const std::string& name)
+    {
+        names.push_back(std::make_unique<std::string>(name));
+        return names.back().get();
+    }
+
+    static std::unique_ptr<JitCode> Map(const std::vector<uint8_t>& bytes)
+    {
+        void* memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return nullptr;
+        std::memcpy(memory, bytes.data(), bytes.size());
+        auto code = std::make_unique<JitCode>(memory, bytes.size());
+        if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+            return nullptr;
+        code->entry = reinterpret_cast<JitCode::Function>(memory);
+        return code;
+    }
+
+    // Lines of "start size name" in hex, the format perf reads for JIT code
+    void WritePerfMap(const JitCode& code) const
+    {
+        std::ofstream out("/tmp/perf-" + std::to_string(getpid()) + ".map", std::ios::app);
+        auto start = reinterpret_cast<uintptr_t>(code.memory);
+        for (size_t i = 0; i < functions.size(); ++i)
+        {
+            size_t begin = assembler.Position(functions[i].label);
+            size_t end = i + 1 < functions.size() ? assembler.Position(functions[i + 1].label) : code.size;
+            out << std::hex << start + begin << ' ' << end - begin << std::dec
+                << " mython:" << cls.GetName() << '.' << functions[i].method->name << '\n';
+        }
+    }
+
+    const Runtime::Class& cls;
+    Assembler assembler;
+    std::vector<Function> functions;
+    std::unordered_map<const Runtime::Method*, size_t> function_ids;
+    std::vector<std::unique_ptr<std::string>> names;
+
+    // The function being generated
+    size_t current = 0;
+    size_t bail = 0;
+    size_t epilogue = 0;
+    size_t entry = 0;
+    // Values pushed by the expression being generated
+    int depth = 0;
+};
+
+#endif
+
+std::unique_ptr<JitCode> CompileMethod(const Runtime::Method& method, const Runtime::Class& cls, bool perf_map)
+{
+#ifdef MYTHON_JIT_X64
+    return MethodCompiler(cls).Compile(method, perf_map);
+#else
+    (void)method;
+    (void)cls;
+    (void)perf_map;
+    return nullptr;
+#endif
+}
+
+void WrapMethods(Statement& node, JitOptions options, size_t& wrapped)
+{
+    if (auto definition = node.TryAs<ClassDefinition>())
+    {
+        for (auto& method : definition->GetClass().Methods())
+        {
+            WrapMethods(*method.body, options, wrapped);
+            method.body = std::make_unique<JitBody>(std::move(method.body), method, options);
+            ++wrapped;
+        }
+        return;
+    }
+    node.ForEachChild([options, &wrapped](std::unique_ptr<Statement>& child) {
+        if (child)
+            WrapMethods(*child, options, wrapped);
+    });
+}
+
+}
+
+// JitBody
+//
+JitBody::JitBody(std::unique_ptr<Statement> tree, const Runtime::Method& method, JitOptions options)
+    : tree(std::move(tree)), method(method), options(options)
+{}
+
+JitBody::~JitBody() = default;
+
+const Runtime::Class* JitBody::CompiledFor() const
+{
+    return code ? code->cls : nullptr;
+}
+
+Result JitBody::Execute(Runtime::Closure& closure)
+{
+    ++calls;
+    auto self_it = closure.find("self");
+    auto self = self_it != closure.end() ? self_it->second.TryAs<Runtime::ClassInstance>() : nullptr;
+    if (!tried && calls > options.threshold && self)
+    {
+        tried = true;
+        code = CompileMethod(method, self->GetClass(), options.perf_map);
+    }
+    if (!code || !self || &self->GetClass() != code->cls)
+        return tree->Execute(closure);
+
+    slots.assign(code->slots, 0);
+    for (size_t i = 0; i < method.formal_params.size(); ++i)
+    {
+        auto arg = closure.find(method.formal_params[i]);
+        auto number = arg != closure.end() ? arg->second.TryAs<Runtime::Number>() : nullptr;
+        if (!number)
+            return tree->Execute(closure);
+        slots[i] = number->GetValue();
+    }
+
+    int32_t result = 0;
+    if (code->entry(self, slots.data(), &result))
+        return ObjectHolder::Own(Runtime::Number(result));
+
+    // Code which keeps bailing out costs more than it saves
+    if (++bailouts == MAX_BAILOUTS)
+        code.reset();
+    return tree->Execute(closure);
+}
+
+void JitBody::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(tree);
+}
+
+bool JitAvailable()
+{
+#ifdef MYTHON_JIT_X64
+    return std::getenv("MYTHON_NO_JIT") == nullptr;
+#else
+    return false;
+#endif
+}
+
+size_t EnableJit(Statement& program, JitOptions options)
+{
+    if (!JitAvailable())
+        return 0;
+    size_t wrapped = 0;
+    WrapMethods(program, options, wrapped);
+    return wrapped;
+}
+
+} /* namespace Ast */
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+struct JitOptions {
+  // Calls of a method before its body is compiled
+  size_t threshold = 100;
+  // Append the compiled functions to /tmp/perf-<pid>.map for Linux perf
+  bool perf_map = false;
+};
+
+// Native code of a hot method and of the methods it calls on self, in one
+// executable mapping
+class JitCode;
+
+// A method body which counts its calls and, once it is hot, runs native
+// x86-64 code compiled from it. The code covers numeric methods: parameters,
+// locals and fields of self holding numbers, arithmetic, comparisons, ifs,
+// returns and calls on self of other such methods. Reads of fields and of
+// locals copied from the fields call back into the runtime.
+// The code has no side effects, so when a value turns out not to be a number
+// or a method does not return one, the call is run again by the tree.
+// Calls on self are resolved in the class of the receiver the code was
+// compiled for; instances of other classes run the tree
+class JitBody : public Statement {
+public:
+  JitBody(std::unique_ptr<Statement> tree, const Runtime::Method& method, JitOptions options);
+  ~JitBody() override;
+
+  Statement& Tree() {
+    return *tree;
+  }
+
+  size_t Calls() const {
+    return calls;
+  }
+
+  // The method was compiled for instances of this class, or nullptr
+  const Runtime::Class* CompiledFor() const;
+
+  // Calls which left the native code for the tree
+  size_t Bailouts() const {
+    return bailouts;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::unique_ptr<Statement> tree;
+  const Runtime::Method& method;
+  JitOptions options;
+  size_t calls = 0;
+  size_t bailouts = 0;
+  // Set after the first attempt, successful or not
+  bool tried = false;
+  std::unique_ptr<JitCode> code;
+  std::vector<int32_t> slots;
+};
+
+// Whether native code can be made here: x86-64 Linux and MYTHON_NO_JIT
+// not set in the environment
+bool JitAvailable();
+
+// Wraps the bodies of the methods of the classes defined in the program with
+// JitBody. Does nothing when the JIT is not available. The bodies run their
+// tree through Execute, so the pass is meant for the tree engine and goes
+// after every other pass. Returns the number of wrapped bodies
+size_t EnableJit(Statement& program, JitOptions options);
+
+void RunJitTests(TestRunner& tr);
+
+} /* namespace Ast */
@@ -0,0 +1,226 @@
+#include "interpreter.h"
+#include "jit.h"
+#include "lexer.h"
+#include "object.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+// Runs the program with the JIT on, the closure keeps the classes
+string ExecuteJit(Statement& program, Runtime::Closure& closure, size_t threshold = 0) {
+  EnableJit(program, {threshold, false});
+  ostringstream output;
+  Print::SetOutputStream(output);
+  program.Execute(closure);
+  return output.str();
+}
+
+const Runtime::Class* ClassOf(Runtime::Closure& closure, const string& instance) {
+  return &closure.at(instance).TryAs<Runtime::ClassInstance>()->GetClass();
+}
+
+JitBody* BodyOf(Runtime::Closure& closure, const string& instance, const string& method) {
+  return ClassOf(closure, instance)->GetMethod(method)->body->TryAs<JitBody>();
+}
+
+const string FIB = R"(
+class Fib:
+  def __init__():
+    self.base = 1
+
+  def fib(n):
+    if n < 2:
+      return self.base * n
+    return self.fib(n - 1) + self.fib(n - 2)
+
+  def sum(n):
+    total = 0
+    if not n > 0:
+      return -1
+    total = self.fib(n) * 2 - n / 3
+    return total
+
+f = Fib()
+print f.fib(20), f.sum(10), f.sum(0), f.fib(1) == 1 and f.fib(2) >= 1
+)";
+
+}
+
+void TestHotMethodsAreCompiled() {
+  if (!JitAvailable()) {
+    return;
+  }
+  auto program = ParseProgramFromString(FIB);
+  Runtime::Closure closure;
+  ASSERT_EQUAL(ExecuteJit(*program, closure, 1), "6765 107 -1 True\n");
+
+  auto fib = BodyOf(closure, "f", "fib");
+  ASSERT(fib);
+  ASSERT(fib->CompiledFor() == ClassOf(closure, "f"));
+  ASSERT_EQUAL(fib->Bailouts(), 0u);
+  // Only the calls from the tree reach the body, the rest are native
+  ASSERT(fib->Calls() < 20u);
+  ASSERT(BodyOf(closure, "f", "sum")->CompiledFor());
+  // __init__ assigns a field
+  ASSERT(!BodyOf(closure, "f", "__init__")->CompiledFor());
+}
+
+void TestValuesOtherThanNumbersRunTheTree() {
+  if (!JitAvailable()) {
+    return;
+  }
+  auto program = ParseProgramFromString(R"(
+class Box:
+  def __init__(v):
+    self.v = v
+
+  def get():
+    return self.v
+
+  def add(n):
+    return self.v + n
+
+  def positive(n):
+    if n > 0:
+      return n
+
+b = Box(1)
+print b.get(), b.add(1), b.positive(1), b.positive(-1)
+b.v = 'x'
+print b.get(), b.add('y'), b.positive(3)
+)");
+  Runtime::Closure closure;
+  ASSERT_EQUAL(ExecuteJit(*program, closure), "1 2 1 None\nx xy 3\n");
+  ASSERT_EQUAL(BodyOf(closure, "b", "get")->Bailouts(), 1u);
+  // Arguments are checked before the native code is entered
+  ASSERT_EQUAL(BodyOf(closure, "b", "add")->Bailouts(), 0u);
+  ASSERT_EQUAL(BodyOf(closure, "b", "positive")->Bailouts(), 1u);
+}
+
+void TestOtherMethodsKeepTheTree() {
+  if (!JitAvailable()) {
+    return;
+  }
+  auto program = ParseProgramFromString(R"(
+class A:
+  def f(n):
+    return self.g(n) + 1
+
+  def g(n):
+    return n * 2
+
+  def show(n):
+    print n
+    return n
+
+class B(A):
+  def g(n):
+    return n * 3
+
+a = A()
+b = B()
+x = a.show(5)
+print a.f(1), b.f(1), b.f(2), a.f(3)
+)");
+  Runtime::Closure closure;
+  ASSERT_EQUAL(ExecuteJit(*program, closure), "5\n3 4 7 7\n");
+
+  // Calls on self are bound to the class the code was made for
+  auto f = BodyOf(closure, "a", "f");
+  ASSERT(f->CompiledFor() == ClassOf(closure, "a"));
+  ASSERT(!BodyOf(closure, "a", "show")->CompiledFor());
+}
+
+void TestSelfTailCallsDontGrowTheStack() {
+  if (!JitAvailable()) {
+    return;
+  }
+  istringstream input(R"(
+class Looper:
+  def count(n, acc):
+    step = 2
+    if n == 0:
+      return acc
+    return self.count(n - 1, acc + step)
+
+l = Looper()
+print l.count(1000000, 0), l.count(3, 1)
+)");
+  ostringstream output;
+  RunOptions options;
+  options.jit_threshold = 0;
+  RunMythonProgram(input, output, options);
+  ASSERT_EQUAL(output.str(), "2000000 7\n");
+}
+
+void TestJitKillSwitch() {
+  istringstream input(FIB);
+  ostringstream output;
+  RunOptions options;
+  options.jit = false;
+  options.jit_threshold = 0;
+  RunMythonProgram(input, output, options);
+  ASSERT_EQUAL(output.str(), "6765 107 -1 True\n");
+
+#ifdef __linux__
+  setenv("MYTHON_NO_JIT", "1", 1);
+  ASSERT(!JitAvailable());
+  auto program = ParseProgramFromString(FIB);
+  ASSERT_EQUAL(EnableJit(*program, {}), 0u);
+  unsetenv("MYTHON_NO_JIT");
+#endif
+}
+
+void TestPerfMap() {
+#ifdef __linux__
+  if (!JitAvailable()) {
+    return;
+  }
+  const string path = "/tmp/perf-" + to_string(getpid()) + ".map";
+  std::remove(path.c_str());
+
+  istringstream input(FIB);
+  ostringstream output;
+  RunOptions options;
+  options.jit_threshold = 0;
+  options.jit_perf_map = true;
+  RunMythonProgram(input, output, options);
+  ASSERT_EQUAL(output.str(), "6765 107 -1 True\n");
+
+  ifstream map(path);
+  string start, size, name;
+  ASSERT(map >> start >> size >> name);
+  ASSERT_EQUAL(name, "mython:Fib.fib");
+  ASSERT(std::stoul(size, nullptr, 16) > 0u);
+  map.close();
+  std::remove(path.c_str());
+#endif
+}
+
+void RunJitTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestHotMethodsAreCompiled);
+  RUN_TEST(tr, Ast::TestValuesOtherThanNumbersRunTheTree);
+  RUN_TEST(tr, Ast::TestOtherMethodsKeepTheTree);
+  RUN_TEST(tr, Ast::TestSelfTailCallsDontGrowTheStack);
+  RUN_TEST(tr, Ast::TestJitKillSwitch);
+  RUN_TEST(tr, Ast::TestPerfMap);
+}
+
+} /* namespace Ast */
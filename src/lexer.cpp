@@ -1,8 +1,24 @@
 #include "lexer.h"
+#include "char_scan.h"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MYTHON_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -70,72 +86,476 @@ std::ostream& operator << (std::ostream& os, const Token& rhs) {
 }
 
 
+SourceFile::SourceFile(const string& path) {
+#ifdef MYTHON_MMAP
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw runtime_error("Cannot open " + path);
+  }
+  struct stat info;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    void* memory = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (memory != MAP_FAILED) {
+      mapping = memory;
+      text = string_view(static_cast<const char*>(memory), static_cast<size_t>(info.st_size));
+    }
+  }
+  close(fd);
+  if (mapping || info.st_size == 0) {
+    return;
+  }
+#endif
+  // Pipes and the systems without mmap
+  ifstream input(path, ios::binary);
+  if (!input) {
+    throw runtime_error("Cannot open " + path);
+  }
+  contents.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  text = contents;
+}
+
+SourceFile::~SourceFile() {
+#ifdef MYTHON_MMAP
+  if (mapping) {
+    munmap(mapping, text.size());
+  }
+#endif
+}
+
+
 const int IndentedReader::Eof = std::istream::traits_type::eof();
 
-IndentedReader::IndentedReader(istream& is) : input(is), line_number(0) {
+IndentedReader::IndentedReader(istream& is) : input(&is), line_number(0) {
+  NextLine();
+}
+
+IndentedReader::IndentedReader(string_view source, int first_line) : source(source), line_number(first_line - 1) {
   NextLine();
 }
 
 int IndentedReader::Next() {
-  if (!input) {
+  if (exhausted) {
     return Eof;
   }
-  char c;
-  if (current_line_input >> c) {
-    return c;
+  position += SpacesLength(current_line.substr(position));
+  if (position < current_line.size()) {
+    return current_line[position++];
   } else {
     return '\n';
   }
 }
 
 int IndentedReader::Get() {
-  if (!input) {
+  if (exhausted) {
     return Eof;
   }
-  if (int c = current_line_input.get(); c != Eof) {
-    return c;
+  if (position < current_line.size()) {
+    return static_cast<unsigned char>(current_line[position++]);
   } else {
     return '\n';
   }
 }
 
-void IndentedReader::NextLine() {
-  auto is_space = [](char c) { return isspace(c); };
+string_view IndentedReader::Rest() const {
+  return current_line.substr(position - 1);
+}
+
+void IndentedReader::Skip(size_t count) {
+  position = min(position + count, current_line.size());
+}
+
+// As getline: the last line may have no newline, an empty source has no lines
+bool IndentedReader::ReadLine(string_view& line) {
+  if (input) {
+    if (!getline(*input, line_storage)) {
+      return false;
+    }
+    line = line_storage;
+    return true;
+  }
 
-  for (string line; getline(input, line); ) {
+  if (source_offset >= source.size()) {
+    return false;
+  }
+  auto rest = source.substr(source_offset);
+  auto end = static_cast<const char*>(memchr(rest.data(), '\n', rest.size()));
+  size_t length = end ? static_cast<size_t>(end - rest.data()) : rest.size();
+  line = rest.substr(0, length);
+  source_offset += length + 1;
+  return true;
+}
+
+void IndentedReader::NextLine() {
+  for (string_view line; ReadLine(line); ) {
     ++line_number;
-    auto it = find_if_not(begin(line), end(line), is_space);
-    if (it != end(line)) {
-      auto leading_spaces = it - begin(line);
+    if (size_t leading_spaces = SpacesLength(line); leading_spaces < line.size()) {
       if (leading_spaces % 2 == 1) {
-        throw LexerError("Odd number of spaces at the beginning of line " + line);
+        throw LexerError("Odd number of spaces at the beginning of line " + string(line));
       }
       current_indent = leading_spaces / 2;
-      current_line_input = istringstream(string(it, end(line)));
+      current_line = line.substr(leading_spaces);
+      position = 0;
       return;
     }
   }
   // When input is exhausted we must set current_indent to zero to produce enough Dedent tokens
+  exhausted = true;
+  current_line = {};
+  position = 0;
   current_indent = 0;
 }
 
-Lexer::Lexer(std::istream& input)
-  : char_reader(input)
+string_view IndentedReader::DeeperLines(int indent) const {
+  if (input) {
+    throw logic_error("Lines are passed over in a buffer only");
+  }
+  size_t end = source_offset;
+  for (size_t offset = source_offset; offset < source.size(); ) {
+    auto rest = source.substr(offset);
+    auto newline = static_cast<const char*>(memchr(rest.data(), '\n', rest.size()));
+    size_t length = newline ? static_cast<size_t>(newline - rest.data()) : rest.size();
+    auto line = rest.substr(0, length);
+    offset += min(length + 1, rest.size());
+    if (size_t leading_spaces = SpacesLength(line); leading_spaces < line.size()) {
+      if (static_cast<int>(leading_spaces / 2) <= indent) {
+        break;
+      }
+      end = offset;
+    }
+  }
+  return source.substr(source_offset, end - source_offset);
+}
+
+void IndentedReader::SkipLines(string_view lines) {
+  source_offset += lines.size();
+  line_number += static_cast<int>(count(lines.begin(), lines.end(), '\n'));
+  if (!lines.empty() && lines.back() != '\n') {
+    ++line_number;
+  }
+  NextLine();
+}
+
+Lexer::Lexer(std::istream& input, LexerKind kind)
+  : kind(kind)
+  , char_reader(input)
   , cur_char(char_reader.Get())
   , indent(0)
   , current(NextTokenImpl())
 {
 }
 
+Lexer::Lexer(std::string_view source, LexerKind kind, int first_line)
+  : kind(kind)
+  , char_reader(source, first_line)
+  , cur_char(char_reader.Get())
+  , indent(0)
+  , current(NextTokenImpl())
+{
+}
+
+Lexer::Lexer(const LineTokens* first, const LineTokens* last)
+  : kind(LexerKind::Handwritten)
+  , char_reader(string_view())
+  , cur_char(IndentedReader::Eof)
+  , indent(0)
+  , replay_line(first)
+  , replay_end(last)
+{
+  current = NextReplayedToken();
+}
+
+// Lexer::Pipeline
+//
+// A ring of tokens with one writer, the thread running the lexer, and one
+// reader, the parser. Each side owns the slots between the two counters the
+// other one does not write
+class Lexer::Pipeline {
+public:
+  explicit Pipeline(Lexer& lexer)
+    : slots(CAPACITY)
+  {
+    producer = thread([this, &lexer] { Produce(lexer); });
+  }
+
+  ~Pipeline() {
+    stopped.store(true, memory_order_relaxed);
+    producer.join();
+  }
+
+  // The Eof and the error stay in the ring for the later calls
+  Token Pop(int& line_number) {
+    size_t index = read.load(memory_order_relaxed);
+    while (written.load(memory_order_acquire) == index) {
+      this_thread::yield();
+    }
+    auto& slot = slots[index % CAPACITY];
+    if (slot.error) {
+      rethrow_exception(slot.error);
+    }
+    line_number = slot.line_number;
+    if (slot.token.Is<TokenType::Eof>()) {
+      return slot.token;
+    }
+    Token token = std::move(slot.token);
+    read.store(index + 1, memory_order_release);
+    return token;
+  }
+
+private:
+  struct Slot {
+    Token token;
+    int line_number = 0;
+    exception_ptr error;
+  };
+
+  static constexpr size_t CAPACITY = 4096;
+
+  void Produce(Lexer& lexer) {
+    for (size_t index = 0; !stopped.load(memory_order_relaxed); ++index) {
+      while (index - read.load(memory_order_acquire) == CAPACITY) {
+        if (stopped.load(memory_order_relaxed)) {
+          return;
+        }
+        this_thread::yield();
+      }
+      auto& slot = slots[index % CAPACITY];
+      bool last = false;
+      try {
+        slot.token = lexer.NextTokenImpl();
+        slot.line_number = lexer.char_reader.CurrentLineNumber();
+        last = slot.token.Is<TokenType::Eof>();
+      } catch (...) {
+        slot.error = current_exception();
+        last = true;
+      }
+      written.store(index + 1, memory_order_release);
+      if (last) {
+        return;
+      }
+    }
+  }
+
+  vector<Slot> slots;
+  // Apart to keep each side from invalidating the cache line of the other
+  alignas(64) atomic<size_t> written{0};
+  alignas(64) atomic<size_t> read{0};
+  atomic<bool> stopped{false};
+  thread producer;
+};
+
+Lexer::~Lexer() = default;
+
+void Lexer::RunAhead() {
+  if (pipeline || replay_end) {
+    return;
+  }
+  current_line_number = char_reader.CurrentLineNumber();
+  pipeline = make_unique<Pipeline>(*this);
+}
+
+int Lexer::CurrentLineNumber() const {
+  return pipeline || replay_end ? current_line_number : char_reader.CurrentLineNumber();
+}
+
 const Token& Lexer::CurrentToken() const {
   return current;
 }
 
 Token Lexer::NextToken() {
-  current = NextTokenImpl();
+  if (pipeline) {
+    current = pipeline->Pop(current_line_number);
+  } else {
+    current = replay_end ? NextReplayedToken() : NextTokenImpl();
+  }
   return current;
 }
 
+// As NextTokenImpl over the text of the lines, the blank ones make no tokens
+Token Lexer::NextReplayedToken() {
+  using namespace TokenType;
+
+  if (replay_position == 0) {
+    while (replay_line != replay_end && replay_line->IsBlank()) {
+      ++replay_line;
+    }
+  }
+  if (replay_line != replay_end) {
+    current_line_number = replay_line->number;
+    if (replay_line->odd_indent) {
+      rethrow_exception(replay_line->error);
+    }
+  }
+
+  int line_indent = replay_line != replay_end ? replay_line->indent : 0;
+  if (indent > line_indent) {
+    --indent;
+    return Dedent{};
+  } else if (indent < line_indent) {
+    ++indent;
+    return Indent{};
+  }
+
+  if (replay_line == replay_end) {
+    return Eof{};
+  } else if (replay_position < replay_line->tokens.size()) {
+    return replay_line->tokens[replay_position++];
+  } else if (replay_line->error) {
+    rethrow_exception(replay_line->error);
+  }
+
+  replay_position = 0;
+  for (++replay_line; replay_line != replay_end && replay_line->IsBlank(); ++replay_line) {
+  }
+  if (replay_line != replay_end && replay_line->odd_indent) {
+    current_line_number = replay_line->number;
+    rethrow_exception(replay_line->error);
+  }
+  return Newline{};
+}
+
+// LexedSource
+//
+namespace {
+
+// The tokens which the lexer of the whole text makes of the line, up to the
+// error if there is one
+LineTokens LexLine(string_view line, int number) {
+  LineTokens result;
+  result.number = number;
+  size_t leading_spaces = SpacesLength(line);
+  result.indent = static_cast<int>(leading_spaces / 2);
+  result.odd_indent = leading_spaces < line.size() && leading_spaces % 2 == 1;
+  try {
+    Lexer lexer(line, LexerKind::Handwritten, number);
+    Token token = lexer.CurrentToken();
+    while (token.Is<TokenType::Indent>()) {
+      token = lexer.NextToken();
+    }
+    while (!token.Is<TokenType::Newline>() && !token.Is<TokenType::Eof>()) {
+      result.tokens.push_back(std::move(token));
+      token = lexer.NextToken();
+    }
+  } catch (const LexerError&) {
+    result.error = current_exception();
+  }
+  return result;
+}
+
+// Replaces count elements at first with the items, the elements after them
+// are moved only when the two differ in number
+template <typename T>
+void Splice(vector<T>& elements, size_t first, size_t count, vector<T> items) {
+  size_t common = min(count, items.size());
+  move(items.begin(), items.begin() + common, elements.begin() + first);
+  auto end = elements.begin() + first + common;
+  if (count > common) {
+    elements.erase(end, end + (count - common));
+  } else {
+    elements.insert(end, make_move_iterator(items.begin() + common), make_move_iterator(items.end()));
+  }
+}
+
+}
+
+// An empty text has a line, the whole text is inserted into it
+LexedSource::LexedSource(string source)
+  : line_starts{0}
+  , lines(1)
+{
+  lines[0].number = 1;
+  Edit(0, 0, source);
+}
+
+size_t LexedSource::LineAt(size_t offset) const {
+  return upper_bound(line_starts.begin(), line_starts.end(), offset) - line_starts.begin() - 1;
+}
+
+LexedSource::LineEdit LexedSource::Edit(size_t offset, size_t count, string_view replacement) {
+  if (offset > text.size() || count > text.size() - offset) {
+    throw out_of_range("Edit at " + to_string(offset) + " is out of the text");
+  }
+
+  LineEdit edit;
+  edit.first = LineAt(offset);
+  edit.removed = LineAt(offset + count) - edit.first + 1;
+  text.replace(offset, count, replacement);
+
+  // The lines from the first one up to that of the end of the replacement
+  vector<size_t> starts;
+  vector<LineTokens> lexed;
+  string_view view = text;
+  size_t edit_end = offset + replacement.size();
+  for (size_t start = line_starts[edit.first]; ; ) {
+    size_t end = min(view.find('\n', start), view.size());
+    starts.push_back(start);
+    lexed.push_back(LexLine(view.substr(start, end - start), static_cast<int>(edit.first + lexed.size() + 1)));
+    if (end >= edit_end) {
+      break;
+    }
+    start = end + 1;
+  }
+  edit.inserted = lexed.size();
+
+  if (replacement.size() != count) {
+    for (size_t i = edit.first + edit.removed; i < line_starts.size(); ++i) {
+      line_starts[i] += replacement.size();
+      line_starts[i] -= count;
+    }
+  }
+  Splice(line_starts, edit.first, edit.removed, std::move(starts));
+  Splice(lines, edit.first, edit.removed, std::move(lexed));
+  if (edit.inserted != edit.removed) {
+    for (size_t i = edit.first + edit.inserted; i < lines.size(); ++i) {
+      lines[i].number = static_cast<int>(i + 1);
+    }
+  }
+  return edit;
+}
+
+namespace {
+
+// A line of the text starts with the keyword
+bool HasClassDefinition(string_view text) {
+  constexpr string_view keyword = "class";
+  for (size_t start = 0; start < text.size(); ) {
+    auto line = text.substr(start, text.find('\n', start) - start);
+    start += line.size() + 1;
+    line.remove_prefix(SpacesLength(line));
+    if (line.substr(0, keyword.size()) == keyword && IdentifierLength(line) == keyword.size()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}
+
+optional<SourceBlock> Lexer::SkipBlock() {
+  if (pipeline) {
+    throw logic_error("Lines are not passed over ahead of the parser");
+  }
+  // As NextTokenImpl, which leaves the same character for the next token
+  if (isspace(cur_char) && cur_char != '\n') {
+    cur_char = char_reader.Next();
+  }
+  if (cur_char != '\n') {
+    return nullopt;
+  }
+
+  SourceBlock block;
+  block.indent = char_reader.CurrentIndent();
+  block.first_line = char_reader.CurrentLineNumber() + 1;
+  block.kind = kind;
+  block.text = char_reader.DeeperLines(block.indent);
+  if (block.text.empty() || HasClassDefinition(block.text)) {
+    return nullopt;
+  }
+  char_reader.SkipLines(block.text);
+  cur_char = char_reader.Get();
+  current = NextTokenImpl();
+  return block;
+}
+
 Token Lexer::NextTokenImpl() {
   using namespace TokenType;
 
@@ -162,44 +582,48 @@ Token Lexer::NextTokenImpl() {
     return Indent{};
   }
 
+  // Spaces at the end of a line are skipped up to it
+  if (isspace(cur_char) && cur_char != '\n') {
+    cur_char = char_reader.Next();
+  }
+
   if (cur_char == '\n') {
     char_reader.NextLine();
     cur_char = char_reader.Get();
     return Newline{};
   }
 
-  if (isspace(cur_char)) {
-    cur_char = char_reader.Next();
-  }
-
   if (cur_char == IndentedReader::Eof) {
     return Eof{};
+  } else if (kind == LexerKind::Table) {
+    return NextTableToken();
   } else if (isdigit(cur_char)) {
+    auto text = char_reader.Rest();
+    size_t length = DigitsLength(text);
     int value = 0;
-    while (isdigit(cur_char)) {
-      value = value * 10 + (cur_char - '0');
-      cur_char = char_reader.Get();
+    for (char digit : text.substr(0, length)) {
+      value = value * 10 + (digit - '0');
     }
+    char_reader.Skip(length - 1);
+    cur_char = char_reader.Get();
     return Number{value};
   } else if (cur_char == '"' || cur_char == '\'') {
-    auto opener = cur_char;
-    bool previous_backslash = false;
-    string value;
-    while (((cur_char = char_reader.Get()) != opener || previous_backslash) && cur_char != '\n') {
-      value += cur_char;
-      previous_backslash = (cur_char == '\\');
-    }
-    if (cur_char != opener) {
+    // The characters up to the closing quote of the line are the value, escapes included
+    auto text = char_reader.Rest();
+    size_t length = 1 + StringBodyLength(text.substr(1), text[0]);
+    string value(text.substr(1, length - 1));
+    if (length == text.size()) {
       throw LexerError("String " + value + " has unbalanced quotes");
     }
+    char_reader.Skip(length);
     cur_char = char_reader.Next();
     return String{std::move(value)};
   } else if (isalpha(cur_char) || cur_char == '_') {
-    string value;
-    do {
-      value += cur_char;
-      cur_char = char_reader.Get();
-    } while (isalnum(cur_char) || cur_char == '_');
+    auto text = char_reader.Rest();
+    size_t length = 1 + IdentifierLength(text.substr(1));
+    string value(text.substr(0, length));
+    char_reader.Skip(length - 1);
+    cur_char = char_reader.Get();
 
     if (auto it = keywords.find(value); it != keywords.end()) {
       return it->second;
@@ -245,4 +669,225 @@ Token Lexer::NextTokenImpl() {
   }
 }
 
+// Table lexer
+//
+namespace {
+
+enum class CharClass : uint8_t {
+  Letter,
+  Digit,
+  Quote,
+  Equals,
+  Bang,
+  Less,
+  Greater,
+  Other,
+  // Past the end of the line
+  End,
+};
+
+constexpr size_t CHAR_CLASSES = static_cast<size_t>(CharClass::End) + 1;
+
+enum class State : uint8_t {
+  Start,
+  Id,
+  Number,
+  String,
+  Assign,
+  Bang,
+  Less,
+  Greater,
+  Eq,
+  NotEq,
+  LessOrEq,
+  GreaterOrEq,
+  Single,
+  // The token ends before the character
+  Stop,
+};
+
+constexpr size_t STATES = static_cast<size_t>(State::Stop) + 1;
+
+constexpr array<CharClass, 256> MakeCharClasses() {
+  array<CharClass, 256> classes = {};
+  for (int c = 0; c < 256; ++c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') {
+      classes[c] = CharClass::Letter;
+    } else if (c >= '0' && c <= '9') {
+      classes[c] = CharClass::Digit;
+    } else if (c == '\'' || c == '"') {
+      classes[c] = CharClass::Quote;
+    } else if (c == '=') {
+      classes[c] = CharClass::Equals;
+    } else if (c == '!') {
+      classes[c] = CharClass::Bang;
+    } else if (c == '<') {
+      classes[c] = CharClass::Less;
+    } else if (c == '>') {
+      classes[c] = CharClass::Greater;
+    } else {
+      classes[c] = CharClass::Other;
+    }
+  }
+  return classes;
+}
+
+using Transitions = array<array<State, CHAR_CLASSES>, STATES>;
+
+constexpr Transitions MakeTransitions() {
+  Transitions next = {};
+  for (auto& row : next) {
+    for (auto& state : row) {
+      state = State::Stop;
+    }
+  }
+  auto set = [&next](State from, CharClass c, State to) {
+    next[static_cast<size_t>(from)][static_cast<size_t>(c)] = to;
+  };
+  set(State::Start, CharClass::Letter, State::Id);
+  set(State::Start, CharClass::Digit, State::Number);
+  set(State::Start, CharClass::Quote, State::String);
+  set(State::Start, CharClass::Equals, State::Assign);
+  set(State::Start, CharClass::Bang, State::Bang);
+  set(State::Start, CharClass::Less, State::Less);
+  set(State::Start, CharClass::Greater, State::Greater);
+  set(State::Start, CharClass::Other, State::Single);
+  set(State::Id, CharClass::Letter, State::Id);
+  set(State::Id, CharClass::Digit, State::Id);
+  set(State::Number, CharClass::Digit, State::Number);
+  set(State::Assign, CharClass::Equals, State::Eq);
+  set(State::Bang, CharClass::Equals, State::NotEq);
+  set(State::Less, CharClass::Equals, State::LessOrEq);
+  set(State::Greater, CharClass::Equals, State::GreaterOrEq);
+  return next;
+}
+
+constexpr array<CharClass, 256> CHAR_CLASS = MakeCharClasses();
+constexpr Transitions TRANSITIONS = MakeTransitions();
+
+// Keywords
+//
+// A slot of the table is found from the first and the last letters and the
+// length. The seed which gives every keyword a slot of its own is searched
+// for by the compiler
+constexpr array<string_view, 12> KEYWORDS = {
+  "class", "return", "if", "else", "def", "print", "and", "or", "not", "None", "True", "False",
+};
+
+const Token KEYWORD_TOKENS[] = {
+  TokenType::Class{}, TokenType::Return{}, TokenType::If{}, TokenType::Else{},
+  TokenType::Def{}, TokenType::Print{}, TokenType::And{}, TokenType::Or{},
+  TokenType::Not{}, TokenType::None{}, TokenType::True{}, TokenType::False{},
+};
+
+static_assert(size(KEYWORD_TOKENS) == KEYWORDS.size());
+
+constexpr size_t KEYWORD_SLOTS = 32;
+
+constexpr size_t KeywordSlot(string_view word, uint32_t seed) {
+  return (static_cast<unsigned char>(word.front()) * seed + static_cast<unsigned char>(word.back()) + word.size())
+    % KEYWORD_SLOTS;
+}
+
+constexpr uint32_t FindKeywordSeed() {
+  for (uint32_t seed = 1; seed < 1000; ++seed) {
+    array<bool, KEYWORD_SLOTS> used = {};
+    bool perfect = true;
+    for (auto word : KEYWORDS) {
+      auto slot = KeywordSlot(word, seed);
+      perfect = perfect && !used[slot];
+      used[slot] = true;
+    }
+    if (perfect) {
+      return seed;
+    }
+  }
+  return 0;
+}
+
+constexpr uint32_t KEYWORD_SEED = FindKeywordSeed();
+static_assert(KEYWORD_SEED != 0, "No perfect hash for the keywords");
+
+constexpr array<int8_t, KEYWORD_SLOTS> MakeKeywordSlots() {
+  array<int8_t, KEYWORD_SLOTS> slots = {};
+  for (auto& slot : slots) {
+    slot = -1;
+  }
+  for (size_t i = 0; i < KEYWORDS.size(); ++i) {
+    slots[KeywordSlot(KEYWORDS[i], KEYWORD_SEED)] = static_cast<int8_t>(i);
+  }
+  return slots;
+}
+
+constexpr array<int8_t, KEYWORD_SLOTS> KEYWORD_INDEX = MakeKeywordSlots();
+constexpr size_t LONGEST_KEYWORD = 6;
+
+// The keyword token, nullptr for an id
+const Token* FindKeyword(string_view word) {
+  if (word.size() > LONGEST_KEYWORD) {
+    return nullptr;
+  }
+  int index = KEYWORD_INDEX[KeywordSlot(word, KEYWORD_SEED)];
+  return index >= 0 && KEYWORDS[index] == word ? &KEYWORD_TOKENS[index] : nullptr;
+}
+
+}
+
+Token Lexer::NextTableToken() {
+  using namespace TokenType;
+
+  // The longest token which starts at the current character
+  auto text = char_reader.Rest();
+  State state = State::Start;
+  size_t length = 0;
+  for (;;) {
+    auto c = length < text.size() ? CHAR_CLASS[static_cast<unsigned char>(text[length])] : CharClass::End;
+    State next = TRANSITIONS[static_cast<size_t>(state)][static_cast<size_t>(c)];
+    if (next == State::Stop) {
+      break;
+    }
+    state = next;
+    ++length;
+    if (state == State::String) {
+      // The characters up to the closing quote of the line are the value, escapes included
+      length += StringBodyLength(text.substr(1), text[0]);
+      if (length == text.size()) {
+        throw LexerError("String " + string(text.substr(1)) + " has unbalanced quotes");
+      }
+      ++length;
+      break;
+    }
+  }
+  char_reader.Skip(length - 1);
+  cur_char = char_reader.Get();
+
+  switch (state) {
+  case State::Id:
+    if (auto keyword = FindKeyword(text.substr(0, length))) {
+      return *keyword;
+    }
+    return Id{string(text.substr(0, length))};
+  case State::Number: {
+    int value = 0;
+    for (char digit : text.substr(0, length)) {
+      value = value * 10 + (digit - '0');
+    }
+    return Number{value};
+  }
+  case State::String:
+    return String{string(text.substr(1, length - 2))};
+  case State::Eq:
+    return Eq{};
+  case State::NotEq:
+    return NotEq{};
+  case State::LessOrEq:
+    return LessOrEq{};
+  case State::GreaterOrEq:
+    return GreaterOrEq{};
+  default:
+    // A single character: an operator, a sign of the assignment or a comparison
+    return Char{text[0]};
+  }
+}
+
 } /* namespace Parse */
@@ -1,11 +1,15 @@
 #pragma once
 
+#include <exception>
 #include <iosfwd>
 #include <string>
+#include <memory>
+#include <string_view>
 #include <sstream>
 #include <variant>
 #include <stdexcept>
 #include <optional>
+#include <vector>
 
 class TestRunner;
 
@@ -113,11 +117,34 @@ public:
   using std::runtime_error::runtime_error;
 };
 
+// The text of a source file. Mapped into memory where the system allows,
+// read in full otherwise
+class SourceFile {
+public:
+  explicit SourceFile(const std::string& path);
+  ~SourceFile();
+
+  SourceFile(const SourceFile&) = delete;
+  SourceFile& operator=(const SourceFile&) = delete;
+
+  std::string_view Text() const {
+    return text;
+  }
+
+private:
+  void* mapping = nullptr;
+  std::string contents;
+  std::string_view text;
+};
+
 class IndentedReader {
 public:
   static const int Eof;
 
   explicit IndentedReader(std::istream& input);
+  // Reads the lines in place, the buffer must outlive the reader. The lines
+  // are numbered from first_line
+  explicit IndentedReader(std::string_view source, int first_line = 1);
 
   int CurrentIndent() const {
     return current_indent;
@@ -130,28 +157,111 @@ public:
   int Next();
   int Get();
 
+  // The current line from the last character read
+  std::string_view Rest() const;
+  // Skips characters of the line after the last one read
+  void Skip(size_t count);
+
   void NextLine();
 
+  // The lines after the current one which are indented deeper than indent, up
+  // to the last such line and its newline, the blank lines among them included.
+  // Empty when the next line which is not blank is not deeper. Reads a buffer only
+  std::string_view DeeperLines(int indent) const;
+  // Passes over the lines returned by DeeperLines, the line after them becomes
+  // the current one
+  void SkipLines(std::string_view lines);
+
 private:
-  std::istream& input;
+  bool ReadLine(std::string_view& line);
+
+  std::istream* input = nullptr;
+  std::string_view source;
+  size_t source_offset = 0;
+  // The line read from the input
+  std::string line_storage;
+  bool exhausted = false;
   int line_number;
-  std::istringstream current_line_input;
+  // The current line without the indent, and the next character in it
+  std::string_view current_line;
+  size_t position = 0;
   int current_indent;
 };
 
+// Both kinds produce the same tokens, the handwritten one is kept to test the
+// table one against it
+enum class LexerKind {
+  // Tokens recognized by a chain of character tests
+  Handwritten,
+  // Tokens recognized by a state machine over character classes, keywords
+  // found by a perfect hash
+  Table,
+};
+
+// Lines of the source passed over by Lexer::SkipBlock
+struct SourceBlock {
+  std::string_view text;
+  // The number of the first line of the text
+  int first_line = 0;
+  // Of the line the block belongs to, the lines of the text are deeper
+  int indent = 0;
+  // Of the lexer which passed over the lines, they are lexed by the same kind
+  LexerKind kind = LexerKind::Handwritten;
+};
+
+// The tokens of a line lexed on its own (see LexedSource), without the Indent
+// and Dedent tokens of its indent and the Newline at its end
+struct LineTokens {
+  int number = 0;
+  int indent = 0;
+  std::vector<Token> tokens;
+  // Of the lexer, thrown when the line is replayed after its tokens. That of
+  // an odd indent is thrown by the end of the line before, as the reader of
+  // the text does
+  std::exception_ptr error;
+  bool odd_indent = false;
+
+  bool IsBlank() const {
+    return tokens.empty() && !error;
+  }
+};
+
 class Lexer {
 public:
-  explicit Lexer(std::istream& input);
+  explicit Lexer(std::istream& input, LexerKind kind = LexerKind::Handwritten);
+  // Reads the buffer in place, no line of it is copied. The buffer must
+  // outlive the lexer. The lines are numbered from first_line
+  explicit Lexer(std::string_view source, LexerKind kind = LexerKind::Handwritten, int first_line = 1);
+  // Replays the lines [first, last) lexed before, with the Indent, Dedent and
+  // Newline tokens between them that the lexer of their text makes. The lines
+  // must outlive the lexer
+  Lexer(const LineTokens* first, const LineTokens* last);
+  ~Lexer();
+
+  // Lexes the rest of the source on a thread of its own which runs ahead of the
+  // parser, NextToken takes the tokens from a ring between the two. The tokens,
+  // the errors and the line numbers of the messages stay those of the lexer
+  // running in step. The lexer must not be moved after that. Lines replayed
+  // have their tokens already, nothing runs ahead of them
+  void RunAhead();
 
   const Token& CurrentToken() const;
   Token NextToken();
 
+  // When the current token ends its line, passes over the lines after it which
+  // are indented deeper, a suite, without making tokens of them: the next token
+  // is the one after them. Blocks with a class definition are not passed over,
+  // the class must be declared when the rest of the program is parsed. nullopt
+  // when nothing is passed over, the tokens are those of the lexer then.
+  // Reads a buffer only, not ahead of the parser
+  std::optional<SourceBlock> SkipBlock();
+
   template <typename T>
   const T& Expect() const {
     if (!current.Is<T>()) {
       std::ostringstream msg;
       msg << "Expect token " << T() << " but got " << current << " at line "
-          << char_reader.CurrentLineNumber();
+          << CurrentLineNumber();
       throw LexerError(msg.str());
     }
     return current.As<T>();
@@ -162,7 +272,7 @@ public:
     if (auto& token_value = Expect<T>().value; token_value != value) {
       std::ostringstream msg;
       msg << "Expect token with value " << value << " but found " << token_value << " at line "
-          << char_reader.CurrentLineNumber();
+          << CurrentLineNumber();
       throw LexerError(msg.str());
     }
   }
@@ -180,12 +290,61 @@ public:
   }
 
 private:
+  class Pipeline;
+
   Token NextTokenImpl();
+  Token NextTableToken();
+  Token NextReplayedToken();
+  int CurrentLineNumber() const;
 
+  LexerKind kind;
   IndentedReader char_reader;
   int cur_char;
   int indent;
   Token current;
+  // The line the reader was on when the current token was made
+  int current_line_number = 0;
+  std::unique_ptr<Pipeline> pipeline;
+  // The lines replayed, the next token is in the first one unless it ends
+  const LineTokens* replay_line = nullptr;
+  const LineTokens* replay_end = nullptr;
+  size_t replay_position = 0;
+};
+
+// The lines of a source, each one lexed on its own: an edit lexes the lines it
+// touches again and keeps the tokens of the others. Lexer(first, last) makes
+// the tokens of a range of them
+class LexedSource {
+public:
+  explicit LexedSource(std::string source);
+
+  const std::string& Text() const {
+    return text;
+  }
+
+  // One per line of the text, the blank ones and an empty last one included
+  const std::vector<LineTokens>& Lines() const {
+    return lines;
+  }
+
+  // The lines replaced by an edit, from the first one
+  struct LineEdit {
+    size_t first = 0;
+    size_t removed = 0;
+    size_t inserted = 0;
+  };
+
+  // Replaces count characters at offset with the replacement. The lines after
+  // the edit are numbered again, not lexed
+  LineEdit Edit(size_t offset, size_t count, std::string_view replacement);
+
+private:
+  size_t LineAt(size_t offset) const;
+
+  std::string text;
+  // Offsets of the lines in the text
+  std::vector<size_t> line_starts;
+  std::vector<LineTokens> lines;
 };
 
 void RunLexerTests(TestRunner& test_runner);
@@ -1,8 +1,13 @@
 #include "lexer.h"
 #include <test_runner.h>
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
 #include <string>
 #include <sstream>
+#include <vector>
 
 using namespace std;
 
@@ -190,6 +195,22 @@ x = 1
   ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Eof{}));
 }
 
+void TestTrailingSpacesAreIgnored() {
+  istringstream input("x = 1 \nprint x   \n  \ny\t\n");
+  Lexer lexer(input);
+
+  ASSERT_EQUAL(lexer.CurrentToken(), Token(TokenType::Id{"x"}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Char{'='}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Number{1}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Newline{}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Print{}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Id{"x"}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Newline{}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Id{"y"}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Newline{}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Eof{}));
+}
+
 void TestMythonProgram() {
   istringstream input(R"(
 x = 4
@@ -363,6 +384,318 @@ print x + y, z + n
     ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Eof{}));
 }
 
+namespace {
+
+vector<Token> AllTokens(Lexer& lexer) {
+  vector<Token> tokens = {lexer.CurrentToken()};
+  while (!tokens.back().Is<TokenType::Eof>()) {
+    tokens.push_back(lexer.NextToken());
+  }
+  return tokens;
+}
+
+// The tokens or the error text
+template <typename MakeLexer>
+string Describe(MakeLexer make, bool run_ahead = false) {
+  try {
+    Lexer lexer = make();
+    if (run_ahead) {
+      lexer.RunAhead();
+    }
+    ostringstream os;
+    for (auto& token : AllTokens(lexer)) {
+      os << token << ' ';
+    }
+    return os.str();
+  } catch (LexerError& e) {
+    return string("error: ") + e.what();
+  }
+}
+
+// The source read from a stream and in place
+pair<string, string> LexBothWays(const string& source) {
+  istringstream input(source);
+  return {Describe([&input] { return Lexer(input); }), Describe([&source] { return Lexer(string_view(source)); })};
+}
+
+string LexWith(const string& source, LexerKind kind) {
+  return Describe([&source, kind] { return Lexer(string_view(source), kind); });
+}
+
+}
+
+void TestBufferLexerMatchesStreamLexer() {
+  const vector<string> sources = {
+    "",
+    "\n\n",
+    "x = 42",
+    "x = 42\n",
+    "class A:\n  def f(self):\n    return 'it\\'s'\n\n  \nprint A().f(), \"a\\\"b\"\nelse",
+    "if a >= b != c <= d == e:\n  x=y\n    z\nw",
+    "x = 'never closed\ny = 1",
+    "x = \"\"\n  \n",
+    "   odd",
+    "a\n\tb\n",
+    "_under_score1 = True and not None or 007\n",
+  };
+  for (auto& source : sources) {
+    auto [stream, buffer] = LexBothWays(source);
+    ASSERT_EQUAL(buffer, stream);
+  }
+
+  auto [stream, buffer] = LexBothWays("x = 'open\n");
+  ASSERT_EQUAL(buffer, "error: String open has unbalanced quotes");
+}
+
+void TestBufferLexerKeepsEscapes() {
+  string source = "s = 'a\\'b' + \"\\n\"";
+  Lexer lexer{string_view(source)};
+  lexer.NextToken();
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::String{"a\\'b"}));
+  lexer.NextToken();
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::String{"\\n"}));
+}
+
+void TestSourceFile() {
+  const string path = "mython_source_file_test.my";
+  {
+    ofstream out(path, ios::binary);
+    out << "x = 'mapped'\nprint x";
+  }
+  {
+    SourceFile file(path);
+    ASSERT_EQUAL(file.Text(), "x = 'mapped'\nprint x");
+    Lexer lexer(file.Text());
+    auto tokens = AllTokens(lexer);
+    ASSERT_EQUAL(tokens.size(), 8u);
+    ASSERT_EQUAL(tokens[2], Token(TokenType::String{"mapped"}));
+  }
+  {
+    ofstream out(path, ios::binary);
+  }
+  {
+    SourceFile file(path);
+    ASSERT(file.Text().empty());
+    Lexer lexer(file.Text());
+    ASSERT_EQUAL(lexer.CurrentToken(), Token(TokenType::Eof{}));
+  }
+  remove(path.c_str());
+
+  ASSERT_THROWS(SourceFile("no/such/mython/file.my"), std::runtime_error);
+}
+
+void TestTableLexerMatchesHandwrittenLexer() {
+  vector<string> sources = {
+    "",
+    "x = 42 \nprint x  \n",
+    "a==b a=b a!=b a!b a<=b a<b a>=b a>b a=<b a=>b ===",
+    "if x:\n  y = 'single' + \"double\" + 'it\\'s'\n  z=-1*(2+3)/4\nelse:\n    w\n",
+    "12abc abc12 _x __init__ x_1 9_",
+    "classy Class iff el non Nones TrueFalse returned prints an o d no False True None",
+    "s = 'open",
+    "\t x",
+    "   odd",
+    "x = '\xc3\xa9' + \xc3\xa9",
+  };
+
+  // Fragments glued in random orders
+  const vector<string> fragments = {
+    "x", "_y1", "class", "def", "not", "2", "007", " ", "  ", "=", "==", "!", "!=", "<", "<=",
+    ">", ">=", "'s'", "\"t\"", "'a\\'b'", "(", ")", ",", ".", ":", "+", "\n", "\n  ", "\n    ",
+  };
+  mt19937 random(7);
+  for (int i = 0; i < 300; ++i) {
+    string source;
+    for (int j = 0; j < 20; ++j) {
+      source += fragments[random() % fragments.size()];
+    }
+    sources.push_back(source);
+  }
+
+  for (auto& source : sources) {
+    ASSERT_EQUAL(LexWith(source, LexerKind::Table), LexWith(source, LexerKind::Handwritten));
+  }
+}
+
+void TestTableLexerKeywords() {
+  string source = "class return if else def print and or not None True False";
+  Lexer lexer(string_view(source), LexerKind::Table);
+  for (auto& token : AllTokens(lexer)) {
+    ASSERT(!token.Is<TokenType::Id>());
+  }
+
+  // Same length and ends as a keyword, or the keyword inside a longer word
+  for (string word : {"clads", "reTurn", "in", "esle", "dif", "prinnt", "ant", "ox", "nod", "Nine", "Tree", "Fable", "a", "returns"}) {
+    Lexer lexer(string_view(word), LexerKind::Table);
+    ASSERT_EQUAL(lexer.CurrentToken(), Token(TokenType::Id{word}));
+  }
+}
+
+// The source is many times longer than the ring of tokens
+string LongSource(int classes) {
+  string source;
+  for (int i = 0; i < classes; ++i) {
+    source += "class C" + to_string(i) + ":\n  def f(x):\n    if x >= " + to_string(i)
+      + ":\n      return 'big'\n    return x * 2 + \"small\"\n\n";
+  }
+  return source;
+}
+
+void TestPipelinedLexerMatchesLexerInStep() {
+  for (string source : {LongSource(2000), string(""), string("x = 1"), LongSource(1000) + "bad = 'quote\n" + LongSource(10)}) {
+    auto in_step = Describe([&source] { return Lexer(string_view(source)); });
+    auto ahead = Describe([&source] { return Lexer(string_view(source)); }, true);
+    ASSERT_EQUAL(ahead, in_step);
+  }
+
+  // The line numbers are those of the current token, the Eof and the error are kept
+  string source = "x = 1\ny = 2\nz = 'open\n";
+  istringstream input(source);
+  Lexer lexer(input);
+  lexer.RunAhead();
+  for (int i = 0; i < 4; ++i) {
+    lexer.NextToken();
+  }
+  ASSERT_EQUAL(lexer.CurrentToken(), Token(TokenType::Id{"y"}));
+  try {
+    lexer.Expect<TokenType::Number>();
+    ASSERT(false);
+  } catch (LexerError& e) {
+    ASSERT_EQUAL(string(e.what()), "Expect token Number{0} but got Id{y} at line 2");
+  }
+  for (int i = 0; i < 5; ++i) {
+    lexer.NextToken();
+  }
+  ASSERT_THROWS(lexer.NextToken(), LexerError);
+  ASSERT_THROWS(lexer.NextToken(), LexerError);
+
+  Lexer finished{string_view("x")};
+  finished.RunAhead();
+  finished.NextToken();
+  ASSERT_EQUAL(finished.NextToken(), Token(TokenType::Eof{}));
+  ASSERT_EQUAL(finished.NextToken(), Token(TokenType::Eof{}));
+}
+
+void TestPipelinedLexerStopsWithTheParser() {
+  // The thread blocked on the full ring is stopped by the destructor
+  string source = LongSource(20000);
+  Lexer lexer{string_view(source)};
+  lexer.RunAhead();
+  ASSERT_EQUAL(lexer.NextToken(), Token(TokenType::Id{"C0"}));
+}
+
+void TestSkipBlock() {
+  using namespace TokenType;
+
+  const string source = "class A:\n  def f():  \n    x = 1\n\n    if x:\n      y = 2\n\n  def g():\n    return 3\nprint 1";
+  Lexer lexer{string_view(source)};
+  while (!lexer.CurrentToken().Is<Def>()) {
+    lexer.NextToken();
+  }
+  ASSERT_EQUAL(lexer.NextToken(), Token(Id{"f"}));
+  ASSERT_EQUAL(lexer.NextToken(), Token(Char{'('}));
+  lexer.NextToken();
+  ASSERT_EQUAL(lexer.NextToken(), Token(Char{':'}));
+
+  auto block = lexer.SkipBlock();
+  ASSERT(block);
+  ASSERT_EQUAL(block->text, "    x = 1\n\n    if x:\n      y = 2\n");
+  ASSERT_EQUAL(block->first_line, 3);
+  ASSERT_EQUAL(block->indent, 1);
+  ASSERT(block->kind == LexerKind::Handwritten);
+
+  // The lines are lexed later by the kind of lexer which passed over them
+  Lexer table_lexer(string_view("f:\n  y\n"), LexerKind::Table);
+  ASSERT_EQUAL(table_lexer.NextToken(), Token(Char{':'}));
+  auto table_block = table_lexer.SkipBlock();
+  ASSERT(table_block && table_block->kind == LexerKind::Table);
+
+  // The tokens after the suite, as the lexer makes them after its DEDENT
+  vector<Token> rest = {
+    Def{}, Id{"g"}, Char{'('}, Char{')'}, Char{':'}, Newline{}, Indent{}, Return{}, Number{3}, Newline{},
+    Dedent{}, Dedent{}, Print{}, Number{1}, Newline{}, Eof{},
+  };
+  ASSERT_EQUAL(AllTokens(lexer), rest);
+
+  // The block of the suite can be lexed on its own
+  Lexer block_lexer(block->text, LexerKind::Table, block->first_line);
+  ASSERT_EQUAL(block_lexer.CurrentToken(), Token(Indent{}));
+  ASSERT_EQUAL(block_lexer.NextToken(), Token(Indent{}));
+
+  // Nothing is passed over when the line goes on, the block is empty or has a class
+  for (string text : {"if x: y\n  z = 1\n", "if x:\nz = 1\n", "if x:\n  class B:\n    def f():\n      return 1\n"}) {
+    Lexer skipping{string_view(text)}, expected{string_view(text)};
+    while (!(skipping.NextToken() == Token(Char{':'}))) {
+      expected.NextToken();
+    }
+    expected.NextToken();
+    ASSERT(!skipping.SkipBlock());
+    skipping.NextToken();
+    expected.NextToken();
+    ASSERT_EQUAL(AllTokens(skipping), AllTokens(expected));
+  }
+
+  istringstream input("if x:\n  y = 1\n");
+  Lexer stream_lexer(input);
+  stream_lexer.NextToken();
+  stream_lexer.NextToken();
+  ASSERT_THROWS(stream_lexer.SkipBlock(), std::logic_error);
+}
+
+namespace {
+
+// The tokens of the lines replayed, or the error text
+string Replayed(const LexedSource& source) {
+  auto& lines = source.Lines();
+  return Describe([&lines] {
+    return Lexer(lines.data(), lines.data() + lines.size());
+  });
+}
+
+string Lexed(const string& text) {
+  return Describe([&text] {
+    return Lexer{string_view(text)};
+  });
+}
+
+}
+
+void TestLexedSourceReplaysTheLexer() {
+  LexedSource source("class A:\n  def f(x):\n\n    if x:   \n      return 'a'\n    else:\n      return 2\n   \nprint A().f(1)");
+  ASSERT_EQUAL(source.Lines().size(), 9u);
+  ASSERT_EQUAL(Replayed(source), Lexed(source.Text()));
+
+  // The lines of the edit only are lexed again, those after it are numbered again
+  auto edit = source.Edit(source.Text().find("'a'"), 3, "x +\n        1");
+  ASSERT_EQUAL(edit.first, 4u);
+  ASSERT_EQUAL(edit.removed, 1u);
+  ASSERT_EQUAL(edit.inserted, 2u);
+  ASSERT_EQUAL(source.Lines().back().number, 10);
+  ASSERT_EQUAL(Replayed(source), Lexed(source.Text()));
+
+  edit = source.Edit(0, source.Text().find("print"), "");
+  ASSERT_EQUAL(edit.first, 0u);
+  ASSERT_EQUAL(edit.removed, 10u);
+  ASSERT_EQUAL(edit.inserted, 1u);
+  ASSERT_EQUAL(source.Text(), "print A().f(1)");
+  ASSERT_THROWS(source.Edit(15, 0, "x"), std::out_of_range);
+
+  // Errors are thrown after the same tokens
+  for (string text : {"x = 1\n   y = 2\n", "x = 'a\ny = 2", "if x:\n  y = 'a\n", "x\n\n\n y\n"}) {
+    ASSERT_EQUAL(Replayed(LexedSource(text)), Lexed(text));
+  }
+
+  // Edits in random places keep the tokens of the text
+  mt19937 random(42);
+  const vector<string> pieces = {"", "\n", "  ", " ", "x", "'", "if y:\n  z = 1\n", "\n  q", "else:\n"};
+  for (int i = 0; i < 500; ++i) {
+    size_t offset = random() % (source.Text().size() + 1);
+    size_t count = random() % (min<size_t>(source.Text().size() - offset, 5) + 1);
+    source.Edit(offset, count, pieces[random() % pieces.size()]);
+    ASSERT_EQUAL(Replayed(source), Lexed(source.Text()));
+  }
+}
+
 void RunLexerTests(TestRunner& tr) {
   RUN_TEST(tr, Parse::TestSimpleAssignment);
   RUN_TEST(tr, Parse::TestKeywords);
@@ -373,11 +706,21 @@ void RunLexerTests(TestRunner& tr) {
   RUN_TEST(tr, Parse::TestIndentsSimple);
   RUN_TEST(tr, Parse::TestIndentsAndNewlines);
   RUN_TEST(tr, Parse::TestEmptyLinesAreIgnored);
+  RUN_TEST(tr, Parse::TestTrailingSpacesAreIgnored);
   RUN_TEST(tr, Parse::TestExpect);
   RUN_TEST(tr, Parse::TestExpectNext);
   RUN_TEST(tr, Parse::TestMythonProgram);
   RUN_TEST(tr, Parse::TestAlwaysEmitsNewlineAtTheEndOfNonemptyLine);
   RUN_TEST(tr, Parse::TestMultiPrint);
+  RUN_TEST(tr, Parse::TestBufferLexerMatchesStreamLexer);
+  RUN_TEST(tr, Parse::TestBufferLexerKeepsEscapes);
+  RUN_TEST(tr, Parse::TestSourceFile);
+  RUN_TEST(tr, Parse::TestTableLexerMatchesHandwrittenLexer);
+  RUN_TEST(tr, Parse::TestTableLexerKeywords);
+  RUN_TEST(tr, Parse::TestPipelinedLexerMatchesLexerInStep);
+  RUN_TEST(tr, Parse::TestPipelinedLexerStopsWithTheParser);
+  RUN_TEST(tr, Parse::TestSkipBlock);
+  RUN_TEST(tr, Parse::TestLexedSourceReplaysTheLexer);
 }
 
 } /* namespace Parse */
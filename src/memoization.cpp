@@ -0,0 +1,410 @@
+#include "memoization.h"
+#include "escape_analysis.h"
+#include "inliner.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+#include <set>
+#include <unordered_map>
+
+using namespace std;
+
+namespace Ast {
+
+namespace
+{
+    using Names = std::set<std::string>;
+
+    const char* SELF = "self";
+
+    class PurityChecker
+    {
+    public:
+        explicit PurityChecker(const Runtime::Class& cls)
+            : cls(cls)
+        {
+        }
+
+        bool IsPure(const Runtime::Method& method)
+        {
+            // A method being checked is assumed pure, so recursion does not loop.
+            // If the assumption is wrong, the failure reaches the method which started the check
+            auto [it, inserted] = verdicts.emplace(&method, true);
+            if (!inserted)
+                return it->second;
+
+            Names defined(method.formal_params.begin(), method.formal_params.end());
+            bool pure = CheckStatement(*method.body, defined);
+            verdicts[&method] = pure;
+            return pure;
+        }
+
+    private:
+        bool CheckStatement(Statement& st, Names& defined)
+        {
+            if (auto p = st.TryAs<Compound>())
+            {
+                for (auto& stmt : p->Statements())
+                    if (!CheckStatement(*stmt, defined))
+                        return false;
+                return true;
+            }
+            if (auto p = st.TryAs<Assignment>())
+            {
+                if (p->var == SELF || !CheckExpression(*p->rv, defined))
+                    return false;
+                defined.insert(p->var);
+                return true;
+            }
+            if (auto p = st.TryAs<VariableUpdate>())
+                return p->Var() != SELF && defined.count(p->Var()) && CheckExpression(*p->Rhs(), defined);
+            if (auto p = st.TryAs<IfElse>())
+                return CheckExpression(*p->Condition(), defined) && CheckBranches(p->IfBody(), p->ElseBody(), defined);
+            if (auto p = st.TryAs<IfCompare>())
+                return CheckExpression(*p->Lhs(), defined) && CheckExpression(*p->Rhs(), defined)
+                    && CheckBranches(p->IfBody(), p->ElseBody(), defined);
+            if (auto p = st.TryAs<Return>())
+                return CheckExpression(*p->Value(), defined);
+            if (auto p = st.TryAs<ReturnVariable>())
+                return CheckExpression(p->Variable(), defined);
+            if (auto p = st.TryAs<TailCall>())
+                return CheckCall(*p->Object(), p->Method(), p->Args(), defined);
+
+            return CheckExpression(st, defined);
+        }
+
+        // Only the variables assigned in both branches are defined after the if
+        bool CheckBranches(std::unique_ptr<Statement>& if_body, std::unique_ptr<Statement>& else_body, Names& defined)
+        {
+            Names if_defined = defined;
+            if (!CheckStatement(*if_body, if_defined))
+                return false;
+
+            Names else_defined = defined;
+            if (else_body && !CheckStatement(*else_body, else_defined))
+                return false;
+
+            std::set_intersection(
+                if_defined.begin(), if_defined.end(), else_defined.begin(), else_defined.end(),
+                std::inserter(defined, defined.end())
+            );
+            return true;
+        }
+
+        bool CheckExpression(Statement& st, const Names& defined)
+        {
+            if (st.TryAs<NumericConst>() || st.TryAs<StringConst>() || st.TryAs<BoolConst>() || st.TryAs<None>())
+                return true;
+            if (auto p = st.TryAs<VariableValue>())
+                return p->dotted_ids.size() == 1 && p->dotted_ids[0] != SELF && defined.count(p->dotted_ids[0]);
+            if (auto p = st.TryAs<MethodCall>())
+                return CheckCall(*p->object, p->method, p->args, defined);
+            if (auto p = st.TryAs<ArithmeticChain>())
+                return CheckExpression(p->Expression(), defined);
+            if (auto p = st.TryAs<InlinedCall>())
+                return CheckCall(*p->Call().object, p->Call().method, p->Call().args, defined);
+
+            if (st.TryAs<UnaryOperation>() || st.TryAs<BinaryOperation>() || st.TryAs<Comparison>())
+            {
+                bool pure = true;
+                st.ForEachChild([&](std::unique_ptr<Statement>& child) {
+                    pure = pure && CheckExpression(*child, defined);
+                });
+                return pure;
+            }
+
+            // Fields, output, new instances and unknown nodes
+            return false;
+        }
+
+        bool CheckCall(
+            Statement& object, const std::string& name, std::vector<std::unique_ptr<Statement>>& args, const Names& defined
+        )
+        {
+            auto receiver = object.TryAs<VariableValue>();
+            if (!receiver || receiver->dotted_ids != std::vector<std::string>{SELF})
+                return false;
+
+            auto method = cls.GetMethod(name);
+            if (!method || method->formal_params.size() != args.size())
+                return false;
+
+            for (auto& arg : args)
+                if (!CheckExpression(*arg, defined))
+                    return false;
+
+            return IsPure(*method);
+        }
+
+        const Runtime::Class& cls;
+        std::unordered_map<const Runtime::Method*, bool> verdicts;
+    };
+
+    // Values are copied, so the cache does not depend on the lifetime of the
+    // objects the method has returned
+    std::optional<ObjectHolder> CopyValue(const ObjectHolder& value)
+    {
+        if (!value || value.TryAs<Runtime::None>())
+            return ObjectHolder();
+        if (auto p = value.TryAs<Runtime::Number>())
+            return ObjectHolder::Own(Runtime::Number(*p));
+        if (auto p = value.TryAs<Runtime::String>())
+            return ObjectHolder::Own(Runtime::String(*p));
+        if (auto p = value.TryAs<Runtime::Bool>())
+            return ObjectHolder::Own(Runtime::Bool(*p));
+        return std::nullopt;
+    }
+
+    void CollectClasses(Statement& st, std::vector<Runtime::Class*>& classes)
+    {
+        if (auto p = st.TryAs<ClassDefinition>())
+            classes.push_back(&p->GetClass());
+
+        st.ForEachChild([&classes](std::unique_ptr<Statement>& child) {
+            CollectClasses(*child, classes);
+        });
+    }
+
+    thread_local Memoizer* current = nullptr;
+}
+
+bool IsPureMethod(const Runtime::Class& cls, const Runtime::Method& method)
+{
+    return PurityChecker(cls).IsPure(method);
+}
+
+// MemoStats
+//
+double MemoStats::HitRate() const
+{
+    size_t lookups = hits + misses;
+    return lookups ? static_cast<double>(hits) / lookups : 0.0;
+}
+
+// MemoCache
+//
+MemoCache::MemoCache(size_t capacity)
+    : capacity(capacity)
+{
+}
+
+std::optional<std::string> MemoCache::MakeKey(const ObjectHolder* args, size_t count)
+{
+    std::string key;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const auto& arg = args[i];
+        if (!arg || arg.TryAs<Runtime::None>())
+        {
+            key += 'N';
+        }
+        else if (auto p = arg.TryAs<Runtime::Number>())
+        {
+            key += 'n';
+            key += std::to_string(p->GetValue());
+            key += ';';
+        }
+        else if (auto p = arg.TryAs<Runtime::String>())
+        {
+            key += 's';
+            key += std::to_string(p->GetValue().size());
+            key += ':';
+            key += p->GetValue();
+        }
+        else if (auto p = arg.TryAs<Runtime::Bool>())
+        {
+            key += p->GetValue() ? 'T' : 'F';
+        }
+        else
+        {
+            return std::nullopt;
+        }
+    }
+    return key;
+}
+
+std::optional<ObjectHolder> MemoCache::Find(const std::string& key)
+{
+    auto it = index.find(key);
+    if (it == index.end())
+    {
+        ++stats.misses;
+        return std::nullopt;
+    }
+
+    ++stats.hits;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+void MemoCache::Store(std::string key, const ObjectHolder& result)
+{
+    auto value = CopyValue(result);
+    if (!value || capacity == 0)
+        return;
+
+    if (auto it = index.find(key); it != index.end())
+    {
+        it->second->second = std::move(*value);
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+
+    if (index.size() >= capacity)
+    {
+        index.erase(entries.back().first);
+        entries.pop_back();
+        ++stats.evictions;
+    }
+
+    entries.emplace_front(std::move(key), std::move(*value));
+    index[entries.front().first] = entries.begin();
+}
+
+// Memoizer
+//
+Memoizer::Memoizer(size_t capacity)
+    : capacity(capacity), previous(current)
+{
+    current = this;
+}
+
+Memoizer::~Memoizer()
+{
+    current = previous;
+}
+
+Memoizer* Memoizer::Current()
+{
+    return current;
+}
+
+bool Memoizer::Enable(const Runtime::Class& cls, const std::string& method)
+{
+    auto met = cls.GetMethod(method);
+    if (!met || !IsPureMethod(cls, *met))
+    {
+        rejected.push_back(cls.GetName() + "." + method);
+        return false;
+    }
+
+    auto& cache = caches[{&cls, method}];
+    if (!cache)
+        cache = std::make_unique<MemoCache>(capacity);
+    return true;
+}
+
+size_t Memoizer::EnablePureMethods(Statement& program, const std::vector<std::string>& only)
+{
+    std::vector<Runtime::Class*> classes;
+    CollectClasses(program, classes);
+
+    size_t enabled = 0;
+    for (auto cls : classes)
+    {
+        std::set<std::string> methods;
+        for (auto c = static_cast<const Runtime::Class*>(cls); c; c = c->GetParent())
+            for (auto& method : c->Methods())
+                methods.insert(method.name);
+
+        for (auto& method : methods)
+        {
+            if (only.empty())
+            {
+                auto met = cls->GetMethod(method);
+                if (IsPureMethod(*cls, *met))
+                    enabled += Enable(*cls, method);
+            }
+            else if (std::find(only.begin(), only.end(), cls->GetName() + "." + method) != only.end())
+            {
+                enabled += Enable(*cls, method);
+            }
+        }
+    }
+    return enabled;
+}
+
+MemoCache* Memoizer::Find(const Runtime::Class& cls, const std::string& method)
+{
+    if (caches.empty())
+        return nullptr;
+
+    auto it = caches.find({&cls, method});
+    return it == caches.end() ? nullptr : it->second.get();
+}
+
+MemoStats Memoizer::Total() const
+{
+    MemoStats total;
+    for (auto& [key, cache] : caches)
+    {
+        total.hits += cache->Stats().hits;
+        total.misses += cache->Stats().misses;
+        total.evictions += cache->Stats().evictions;
+    }
+    return total;
+}
+
+void Memoizer::Report(std::ostream& out) const
+{
+    auto print = [&out](const MemoStats& stats) {
+        out << stats.hits << " hits, " << stats.misses << " misses ("
+            << std::fixed << std::setprecision(1) << stats.HitRate() * 100 << "%), "
+            << stats.evictions << " evictions";
+    };
+
+    for (auto& [key, cache] : caches)
+    {
+        out << key.first->GetName() << "." << key.second << ": ";
+        print(cache->Stats());
+        out << ", " << cache->Size() << " entries\n";
+    }
+    for (auto& name : rejected)
+        out << name << ": not pure, not memoized\n";
+
+    out << "total: ";
+    print(Total());
+    out << "\n";
+}
+
+// PendingMemo
+//
+bool PendingMemo::Lookup(
+    const Runtime::ClassInstance& receiver, const std::string& method, const ObjectHolder* args, size_t count,
+    ObjectHolder& result
+)
+{
+    auto memoizer = Memoizer::Current();
+    if (!memoizer)
+        return false;
+
+    auto cache = memoizer->Find(receiver.GetClass(), method);
+    if (!cache)
+        return false;
+
+    auto key = MemoCache::MakeKey(args, count);
+    if (!key)
+        return false;
+
+    if (auto cached = cache->Find(*key))
+    {
+        result = std::move(*cached);
+        Resolve(result);
+        return true;
+    }
+
+    entries.emplace_back(cache, std::move(*key));
+    return false;
+}
+
+void PendingMemo::Resolve(const ObjectHolder& result)
+{
+    for (auto& [cache, key] : entries)
+        cache->Store(std::move(key), result);
+    entries.clear();
+}
+
+} /* namespace Ast */
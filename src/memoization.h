@@ -0,0 +1,131 @@
+#pragma once
+
+#include "object.h"
+#include "statement.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+// A method is pure when its result depends on the arguments only:
+// it does not assign or read fields, does not print, does not create instances,
+// reads only its parameters and the variables it has assigned on every path,
+// and calls only pure methods of self.
+// Calls on self are resolved in cls, the class of the receiver
+bool IsPureMethod(const Runtime::Class& cls, const Runtime::Method& method);
+
+struct MemoStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+
+  double HitRate() const;
+};
+
+// Results of one method of one class keyed by the argument values.
+// The least recently used entry is evicted when the capacity is reached
+class MemoCache {
+public:
+  explicit MemoCache(size_t capacity);
+
+  // nullopt when some argument is not a number, a string, a bool or None
+  static std::optional<std::string> MakeKey(const ObjectHolder* args, size_t count);
+
+  // Counts a hit or a miss
+  std::optional<ObjectHolder> Find(const std::string& key);
+  // Results which are not values are not stored
+  void Store(std::string key, const ObjectHolder& result);
+
+  size_t Size() const {
+    return index.size();
+  }
+
+  const MemoStats& Stats() const {
+    return stats;
+  }
+
+private:
+  using Entry = std::pair<std::string, ObjectHolder>;
+
+  size_t capacity;
+  std::list<Entry> entries;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index;
+  MemoStats stats;
+};
+
+// Owns the caches of the opted-in methods and makes them visible to
+// ClassInstance::Call and the stack evaluator while it is alive
+class Memoizer {
+public:
+  explicit Memoizer(size_t capacity = 1024);
+  ~Memoizer();
+
+  Memoizer(const Memoizer&) = delete;
+  Memoizer& operator=(const Memoizer&) = delete;
+
+  // Opts the method in for instances of exactly this class.
+  // Returns false and leaves the method as is when it is not pure
+  bool Enable(const Runtime::Class& cls, const std::string& method);
+
+  // Opts in the methods of the classes defined in the program, own and inherited.
+  // "Class.method" names in only restrict the set, otherwise every pure method is taken.
+  // Returns the number of enabled methods
+  size_t EnablePureMethods(Statement& program, const std::vector<std::string>& only = {});
+
+  MemoCache* Find(const Runtime::Class& cls, const std::string& method);
+  MemoStats Total() const;
+  void Report(std::ostream& out) const;
+
+  // The innermost memoizer alive on the current thread, or nullptr
+  static Memoizer* Current();
+
+private:
+  using Key = std::pair<const Runtime::Class*, std::string>;
+
+  size_t capacity;
+  std::map<Key, std::unique_ptr<MemoCache>> caches;
+  std::vector<std::string> rejected;
+
+  Memoizer* previous;
+};
+
+// Cache entries of the calls which missed and wait for their result.
+// A chain of tail calls returns the value of its last call, so one result
+// completes all of them
+class PendingMemo {
+public:
+  // True when the result of the call is found in the cache,
+  // the pending entries are completed with it then
+  bool Lookup(
+    const Runtime::ClassInstance& receiver,
+    const std::string& method,
+    const ObjectHolder* args,
+    size_t count,
+    ObjectHolder& result
+  );
+
+  void Resolve(const ObjectHolder& result);
+
+  // Forgets the pending entries, for calls left by an exception
+  void Discard() {
+    entries.clear();
+  }
+
+private:
+  std::vector<std::pair<MemoCache*, std::string>> entries;
+};
+
+void RunMemoizationTests(TestRunner& tr);
+
+} /* namespace Ast */
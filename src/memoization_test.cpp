@@ -0,0 +1,263 @@
+#include "memoization.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "parse.h"
+#include "stack_evaluator.h"
+#include "tail_calls.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Execute(Statement& program, Runtime::Closure& closure, Engine engine) {
+  ostringstream output;
+  Print::SetOutputStream(output);
+  if (engine == Engine::Stack) {
+    StackEvaluator().Run(program, closure);
+  } else {
+    program.Execute(closure);
+  }
+  return output.str();
+}
+
+const Runtime::Class* FindClass(Statement& program, const string& name) {
+  if (auto definition = program.TryAs<ClassDefinition>()) {
+    if (definition->GetClass().GetName() == name) {
+      return &definition->GetClass();
+    }
+  }
+
+  const Runtime::Class* found = nullptr;
+  program.ForEachChild([&](unique_ptr<Statement>& child) {
+    if (!found) {
+      found = FindClass(*child, name);
+    }
+  });
+  return found;
+}
+
+const string FIB_PROGRAM = R"(
+class Fib:
+  def fib(n):
+    if n < 2:
+      return n
+    return self.fib(n - 1) + self.fib(n - 2)
+
+f = Fib()
+print f.fib(25)
+)";
+
+}
+
+void TestPurityAnalysis() {
+  auto program = ParseProgramFromString(R"(
+class Calc:
+  def __init__():
+    self.base = 1
+
+  def sq(x):
+    return x * x
+
+  def sum_sq(a, b):
+    s = self.sq(a)
+    s = s + self.sq(b)
+    return s
+
+  def sign(x):
+    if x < 0:
+      r = 0 - 1
+    else:
+      r = 1
+    return r
+
+  def maybe(x):
+    if x < 0:
+      r = 1
+    return r
+
+  def with_base(x):
+    return x + self.base
+
+  def field_name(x):
+    return base
+
+  def set(x):
+    self.base = x
+
+  def show(x):
+    print x
+
+  def calls_impure(x):
+    return self.with_base(x)
+
+  def itself():
+    return self
+)");
+
+  Runtime::Closure closure;
+  Execute(*program, closure, Engine::Tree);
+  auto& cls = *FindClass(*program, "Calc");
+  auto pure = [&cls](const string& name) {
+    return IsPureMethod(cls, *cls.GetMethod(name));
+  };
+
+  ASSERT(pure("sq"));
+  ASSERT(pure("sum_sq"));
+  ASSERT(pure("sign"));
+  ASSERT(!pure("maybe"));
+  ASSERT(!pure("__init__"));
+  ASSERT(!pure("with_base"));
+  ASSERT(!pure("field_name"));
+  ASSERT(!pure("set"));
+  ASSERT(!pure("show"));
+  ASSERT(!pure("calls_impure"));
+  ASSERT(!pure("itself"));
+}
+
+void TestRecursiveMethodIsMemoized() {
+  for (auto engine : {Engine::Tree, Engine::Stack}) {
+    auto program = ParseProgramFromString(FIB_PROGRAM);
+    Memoizer memoizer;
+    ASSERT_EQUAL(memoizer.EnablePureMethods(*program), 1u);
+
+    Runtime::Closure closure;
+    ASSERT_EQUAL(Execute(*program, closure, engine), "75025\n");
+
+    auto cache = memoizer.Find(*FindClass(*program, "Fib"), "fib");
+    ASSERT(cache);
+    // Every fib(n) for n in 0..25 is computed once
+    ASSERT_EQUAL(cache->Stats().misses, 26u);
+    ASSERT_EQUAL(cache->Stats().hits, 23u);
+    ASSERT_EQUAL(cache->Size(), 26u);
+  }
+}
+
+void TestLeastRecentlyUsedIsEvicted() {
+  auto program = ParseProgramFromString(R"(
+class Calc:
+  def sq(x):
+    return x * x
+
+c = Calc()
+print c.sq(1), c.sq(2), c.sq(1), c.sq(3), c.sq(2), c.sq(1)
+)");
+  Memoizer memoizer(2);
+  memoizer.EnablePureMethods(*program);
+
+  Runtime::Closure closure;
+  ASSERT_EQUAL(Execute(*program, closure, Engine::Tree), "1 4 1 9 4 1\n");
+
+  // 1 2 [1] 3 evicts 2, 2 evicts 1, 1 evicts 3
+  auto& stats = memoizer.Find(*FindClass(*program, "Calc"), "sq")->Stats();
+  ASSERT_EQUAL(stats.hits, 1u);
+  ASSERT_EQUAL(stats.misses, 5u);
+  ASSERT_EQUAL(stats.evictions, 3u);
+}
+
+void TestTailCallChainIsMemoized() {
+  for (auto engine : {Engine::Tree, Engine::Stack}) {
+    auto program = ParseProgramFromString(R"(
+class Counter:
+  def count(n, acc):
+    if n == 0:
+      return acc
+    return self.count(n - 1, acc + 1)
+
+c = Counter()
+print c.count(10, 0), c.count(5, 5)
+)");
+    MarkTailCalls(program);
+    Memoizer memoizer;
+    memoizer.EnablePureMethods(*program);
+
+    Runtime::Closure closure;
+    ASSERT_EQUAL(Execute(*program, closure, engine), "10 10\n");
+
+    // The whole chain of the first call is stored, the second one is its part
+    auto cache = memoizer.Find(*FindClass(*program, "Counter"), "count");
+    ASSERT_EQUAL(cache->Size(), 11u);
+    ASSERT_EQUAL(cache->Stats().hits, 1u);
+  }
+}
+
+void TestInstancesAreNotCached() {
+  auto program = ParseProgramFromString(R"(
+class Box:
+  def __init__(v):
+    self.v = v
+
+class Id:
+  def same(x):
+    return x
+
+i = Id()
+b = Box(1)
+x = i.same(b)
+print x.v, i.same(2)
+)");
+  Memoizer memoizer;
+  memoizer.EnablePureMethods(*program);
+
+  Runtime::Closure closure;
+  ASSERT_EQUAL(Execute(*program, closure, Engine::Tree), "1 2\n");
+
+  auto& stats = memoizer.Find(*FindClass(*program, "Id"), "same")->Stats();
+  ASSERT_EQUAL(stats.misses, 1u);
+}
+
+void TestOnlyNamedMethodsAreEnabled() {
+  auto program = ParseProgramFromString(R"(
+class Calc:
+  def sq(x):
+    return x * x
+
+  def cube(x):
+    return x * x * x
+
+  def show(x):
+    print x
+)");
+  Memoizer memoizer;
+  ASSERT_EQUAL(memoizer.EnablePureMethods(*program, {"Calc.sq", "Calc.show"}), 1u);
+
+  ostringstream report;
+  memoizer.Report(report);
+  ASSERT_EQUAL(report.str(),
+    "Calc.sq: 0 hits, 0 misses (0.0%), 0 evictions, 0 entries\n"
+    "Calc.show: not pure, not memoized\n"
+    "total: 0 hits, 0 misses (0.0%), 0 evictions\n"
+  );
+}
+
+void TestRunOptions() {
+  istringstream input(FIB_PROGRAM);
+  ostringstream output, report;
+
+  RunOptions options;
+  options.memoize = true;
+  options.memo_report = &report;
+  RunMythonProgram(input, output, options);
+
+  ASSERT_EQUAL(output.str(), "75025\n");
+  ASSERT(report.str().find("Fib.fib: 23 hits, 26 misses") != string::npos);
+}
+
+void RunMemoizationTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestPurityAnalysis);
+  RUN_TEST(tr, Ast::TestRecursiveMethodIsMemoized);
+  RUN_TEST(tr, Ast::TestLeastRecentlyUsedIsEvicted);
+  RUN_TEST(tr, Ast::TestTailCallChainIsMemoized);
+  RUN_TEST(tr, Ast::TestInstancesAreNotCached);
+  RUN_TEST(tr, Ast::TestOnlyNamedMethodsAreEnabled);
+  RUN_TEST(tr, Ast::TestRunOptions);
+}
+
+} /* namespace Ast */
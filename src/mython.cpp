@@ -1,8 +1,27 @@
 #include "object.h"
 #include "object_holder.h"
 #include "statement.h"
+#include "closure_compiler.h"
+#include "cpp_emitter.h"
+#include "escape_analysis.h"
+#include "flat_tree.h"
+#include "inliner.h"
+#include "jit.h"
+#include "memoization.h"
+#include "optimizer.h"
+#include "profile.h"
+#include "program_cache.h"
+#include "stack_evaluator.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
 #include "lexer.h"
 #include "parse.h"
+#include "interpreter.h"
+#include "benchmarks.h"
+#include "batch.h"
+#include "char_scan.h"
+#include "parallel_for.h"
 
 #include <test_runner.h>
 
@@ -18,18 +37,129 @@ using namespace std;
 
 void TestAll();
 
-void RunMythonProgram(istream& input, ostream& output);
-
-int main() {
+int main(int argc, char* argv[]) {
 	int errcode = 0;
 	try {
 #ifdef TEST
 		TestAll();
 		std::cout << "\n\n\n";
 #endif
+		RunOptions options;
+		std::ofstream profile_output;
+		std::ifstream profile_input;
+		std::ofstream cpp_output;
+		string source_path;
+		bool use_program_cache = true;
+		for (int i = 1; i < argc; ++i) {
+			const string arg = argv[i];
+			if (arg == "--bench") {
+				RunBenchmarks(std::cout);
+				return 0;
+			} else if (arg == "--lexer=table") {
+				options.table_lexer = true;
+			} else if (arg == "--lexer=handwritten") {
+				options.table_lexer = false;
+			} else if (arg == "--pipelined-lexer") {
+				options.pipelined_lexer = true;
+			} else if (arg == "--streaming") {
+				options.streaming = true;
+			} else if (arg == "--lazy-methods") {
+				options.lazy_methods = true;
+			} else if (arg == "--validate-methods") {
+				options.validate_methods = true;
+			} else if (arg == "--parallel-methods") {
+				options.parallel_methods = true;
+			} else if (arg.rfind("--method-threads=", 0) == 0) {
+				options.method_threads = std::stoul(arg.substr(arg.find('=') + 1));
+			} else if (arg == "--no-optimize") {
+				options.optimize = false;
+			} else if (arg == "--no-inline") {
+				options.inline_methods = false;
+			} else if (arg.rfind("--inline-max-nodes=", 0) == 0) {
+				options.inline_max_nodes = std::stoul(arg.substr(arg.find('=') + 1));
+			} else if (arg.rfind("--inline-max-params=", 0) == 0) {
+				options.inline_max_params = std::stoul(arg.substr(arg.find('=') + 1));
+			} else if (arg == "--inline-stats") {
+				options.inline_report = &std::cerr;
+			} else if (arg == "--no-escape-analysis") {
+				options.escape_analysis = false;
+			} else if (arg == "--no-type-inference") {
+				options.infer_types = false;
+			} else if (arg == "--dump-tree") {
+				options.tree_dump = &std::cerr;
+			} else if (arg == "--no-superinstructions") {
+				options.superinstructions = false;
+			} else if (arg == "--no-tail-calls") {
+				options.tail_calls = false;
+			} else if (arg == "--engine=tree") {
+				options.engine = Engine::Tree;
+			} else if (arg == "--engine=stack") {
+				options.engine = Engine::Stack;
+			} else if (arg == "--engine=closures") {
+				options.engine = Engine::Closures;
+			} else if (arg == "--engine=flat") {
+				options.engine = Engine::Flat;
+			} else if (arg == "--single-pass") {
+				options.single_pass = true;
+			} else if (arg == "--program-cache") {
+				options.write_program_cache = true;
+			} else if (arg == "--no-program-cache") {
+				use_program_cache = false;
+			} else if (arg == "--no-jit") {
+				options.jit = false;
+			} else if (arg.rfind("--jit-threshold=", 0) == 0) {
+				options.jit_threshold = std::stoul(arg.substr(arg.find('=') + 1));
+			} else if (arg == "--jit-perf-map") {
+				options.jit_perf_map = true;
+			} else if (arg.rfind("--max-depth=", 0) == 0) {
+				options.max_depth = std::stoul(arg.substr(arg.find('=') + 1));
+			} else if (arg == "--memoize") {
+				options.memoize = true;
+			} else if (arg.rfind("--memoize=", 0) == 0) {
+				options.memoize = true;
+				std::istringstream names(arg.substr(arg.find('=') + 1));
+				for (string name; std::getline(names, name, ',');)
+					options.memoized_methods.push_back(name);
+			} else if (arg.rfind("--memo-capacity=", 0) == 0) {
+				options.memo_capacity = std::stoul(arg.substr(arg.find('=') + 1));
+			} else if (arg == "--memo-stats") {
+				options.memo_report = &std::cerr;
+			} else if (arg.rfind("--profile-record=", 0) == 0) {
+				profile_output.open(arg.substr(arg.find('=') + 1));
+				if (!profile_output)
+					throw std::runtime_error("Cannot open " + arg.substr(arg.find('=') + 1));
+				options.profile_output = &profile_output;
+			} else if (arg.rfind("--profile-use=", 0) == 0) {
+				profile_input.open(arg.substr(arg.find('=') + 1));
+				if (!profile_input)
+					throw std::runtime_error("Cannot open " + arg.substr(arg.find('=') + 1));
+				options.profile_input = &profile_input;
+			} else if (arg.rfind("--emit-cpp=", 0) == 0) {
+				cpp_output.open(arg.substr(arg.find('=') + 1));
+				if (!cpp_output)
+					throw std::runtime_error("Cannot open " + arg.substr(arg.find('=') + 1));
+				options.cpp_output = &cpp_output;
+			} else if (arg.rfind("--", 0) != 0 && source_path.empty()) {
+				source_path = arg;
+			} else {
+				throw std::invalid_argument("Unknown option " + arg);
+			}
+		}
+
+		// A file is read in place, mapped into memory where the system allows. Its
+		// precompiled program is run instead when it is up to date and was written
+		// with the same options
+		if (!source_path.empty()) {
+			Parse::SourceFile file(source_path);
+			if (use_program_cache)
+				options.program_cache = Ast::ProgramCachePath(source_path);
+			RunMythonProgram(file.Text(), cout, options);
+			return 0;
+		}
+
 		std::cout << "This is Mython intepreter. Indent is 2 spaces.\n";
 		std::cout << "Type in EOF command after input(CTRL+d for Linux, CTRL+z for Windows)\n";
-		RunMythonProgram(cin, cout);
+		RunMythonProgram(cin, cout, options);
 	}
 	catch (std::exception& e)
 	{
@@ -51,7 +181,24 @@ void TestAll() {
   Runtime::RunObjectHolderTests(tr);
   Runtime::RunObjectsTests(tr);
   Ast::RunUnitTests(tr);
+  Ast::RunSuperinstructionsTests(tr);
+  Ast::RunTailCallsTests(tr);
+  Ast::RunStackEvaluatorTests(tr);
+  Ast::RunMemoizationTests(tr);
+  Ast::RunOptimizerTests(tr);
+  Ast::RunTypeInferenceTests(tr);
+  Ast::RunProfileTests(tr);
+  Ast::RunInlinerTests(tr);
+  Ast::RunEscapeAnalysisTests(tr);
+  Ast::RunClosureCompilerTests(tr);
+  Ast::RunFlatTreeTests(tr);
+  Ast::RunProgramCacheTests(tr);
+  Ast::RunJitTests(tr);
+  Ast::RunCppEmitterTests(tr);
+  Ast::RunBatchTests(tr);
   Parse::RunLexerTests(tr);
+  Parse::RunCharScanTests(tr);
+  RunParallelForTests(tr);
   TestParseProgram(tr);
   TestCases(tr);
 }
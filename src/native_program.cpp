@@ -0,0 +1,30 @@
+#include "native_program.h"
+
+#include <exception>
+#include <iostream>
+#include <memory>
+
+namespace Ast {
+
+Runtime::Method NativeMethod(std::string name, std::vector<std::string> formal_params, NativeFunction body)
+{
+    return {std::move(name), std::move(formal_params), std::make_unique<NativeBody>(body)};
+}
+
+int RunNativeProgram(NativeFunction program)
+{
+    try
+    {
+        Print::SetOutputStream(std::cout);
+        Runtime::Closure closure;
+        program(closure);
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+} /* namespace Ast */
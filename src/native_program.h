@@ -0,0 +1,40 @@
+#pragma once
+
+#include "comparators.h"
+#include "object.h"
+#include "object_holder.h"
+#include "statement.h"
+#include "tail_calls.h"
+
+#include <string>
+#include <vector>
+
+// What the C++ translation of a Mython program (see cpp_emitter.h) is built on.
+// The translation includes this header and links the mython_runtime library
+
+namespace Ast {
+
+// A method body or a program translated into a C++ function
+using NativeFunction = Result (*)(Runtime::Closure& closure);
+
+// The body of a translated method, so the runtime calls it as any other
+class NativeBody : public Statement {
+public:
+  explicit NativeBody(NativeFunction function) : function(function) {
+  }
+
+  Result Execute(Runtime::Closure& closure) override {
+    return function(closure);
+  }
+
+private:
+  NativeFunction function;
+};
+
+Runtime::Method NativeMethod(std::string name, std::vector<std::string> formal_params, NativeFunction body);
+
+// Runs the program with print writing to stdout. Errors go to stderr as they do
+// in the interpreter; returns the exit code
+int RunNativeProgram(NativeFunction program);
+
+} /* namespace Ast */
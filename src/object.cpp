@@ -1,6 +1,8 @@
 #include "object.h"
 #include "object_holder.h"
 #include "statement.h"
+#include "memoization.h"
+#include "stack_evaluator.h"
 
 #include <algorithm>
 #include <ios>
@@ -33,6 +35,21 @@ const std::string& Class::GetName() const
     return name;
 }
 
+const Class* Class::GetParent() const
+{
+    return parent;
+}
+
+std::vector<Method>& Class::Methods()
+{
+    return methods;
+}
+
+const std::vector<Method>& Class::Methods() const
+{
+    return methods;
+}
+
 const Method* Class::GetMethod(const std::string& name) const 
 {
     auto it = std::find_if(methods.cbegin(), methods.cend(), [&name](const auto& method){ return method.name == name;});
@@ -60,11 +77,30 @@ bool Class::IsTrue() const
 }
 
 // ClassInstance
+namespace {
+    size_t fields_epoch = 0;
+}
+
 ClassInstance::ClassInstance(const Class& cls)
 : Object(Type::Instance), cls(cls)
 {
 }
 
+ClassInstance::~ClassInstance()
+{
+    TouchFields();
+}
+
+size_t ClassInstance::FieldsEpoch()
+{
+    return fields_epoch;
+}
+
+void ClassInstance::TouchFields()
+{
+    ++fields_epoch;
+}
+
 void ClassInstance::Print(std::ostream& os)
 {
     const char* str = "__str__";
@@ -82,6 +118,10 @@ bool ClassInstance::HasMethod(const std::string& method, size_t argument_count)
     return true;
 }
 
+const Class& ClassInstance::GetClass() const {
+    return cls;
+}
+
 const Closure& ClassInstance::Fields() const {
     return fields;
 }
@@ -91,20 +131,52 @@ Closure& ClassInstance::Fields() {
 }
 
 
-ObjectHolder ClassInstance::Call(const std::string& method, const std::vector<ObjectHolder>& actual_args) 
+ObjectHolder ClassInstance::Call(
+    const std::string& method, const std::vector<ObjectHolder>& actual_args, const Method* resolved
+)
+{
+    if (auto evaluator = Ast::StackEvaluator::Current())
+        return evaluator->Call(*this, method, actual_args);
+
+    Ast::PendingMemo memo;
+    ObjectHolder cached;
+    if (memo.Lookup(*this, method, actual_args.data(), actual_args.size(), cached))
+        return cached;
+
+    auto res = Invoke(method, actual_args, resolved);
+
+    // Calls in tail position come back here instead of growing the native stack
+    while (auto call = res.TakeTailCall())
+    {
+        auto instance = call->receiver.TryAs<ClassInstance>();
+        if (!instance)
+            throw std::runtime_error("Method " + *call->method + " is called on non-instance");
+
+        if (memo.Lookup(*instance, *call->method, call->args.data(), call->args.size(), cached))
+            return cached;
+
+        res = instance->Invoke(*call->method, call->args);
+    }
+
+    memo.Resolve(res);
+    return std::move(res);
+}
+
+Ast::Result ClassInstance::Invoke(
+    const std::string& method, const std::vector<ObjectHolder>& actual_args, const Method* resolved
+)
 {
-    if (!HasMethod(method, actual_args.size()))
+    if (!resolved && !HasMethod(method, actual_args.size()))
         throw std::runtime_error(std::string("ClassInstance ") + cls.GetName() +
                 " doesnt have method " + method + "(" + std::to_string(actual_args.size()) + ")");  
 
-    auto met = cls.GetMethod(method);
+    auto met = resolved ? resolved : cls.GetMethod(method);
     auto tempClosure = fields;
     tempClosure["self"] = ObjectHolder::Share(*this);
     for (size_t i = 0; i < actual_args.size(); ++i)
         tempClosure[met->formal_params[i]] = actual_args[i];
 
-    auto res = met->body->Execute(tempClosure);
-    return std::move(res);
+    return met->body->Execute(tempClosure);
 }
 
 bool ClassInstance::IsTrue() const
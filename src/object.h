@@ -11,6 +11,7 @@
 
 namespace Ast {
   class Statement;
+  struct Result;
 }
 
 class TestRunner;
@@ -34,8 +35,9 @@ public:
 
 template <typename T>
 class ValueObject : public Object {
-    using typename Runtime::IObject::Type;
 protected:
+    using typename Runtime::IObject::Type;
+
     ValueObject(Type type, const T& value)
         : Object(type), value(value)
     {}
@@ -108,6 +110,11 @@ public:
   explicit Class(std::string name, std::vector<Method> methods, const Class* parent = nullptr);
   const Method* GetMethod(const std::string& name) const;
   const std::string& GetName() const;
+  const Class* GetParent() const;
+
+  // Own methods only, without the inherited ones
+  std::vector<Method>& Methods();
+  const std::vector<Method>& Methods() const;
   void Print(std::ostream& os) override;
 
   bool IsTrue() const override;
@@ -121,18 +128,34 @@ private:
 class ClassInstance : public Object {
 public:
   explicit ClassInstance(const Class& cls);
+  ClassInstance(ClassInstance&&) = default;
+  ~ClassInstance() override;
 
   void Print(std::ostream& os) override;
 
-  ObjectHolder Call(const std::string& method, const std::vector<ObjectHolder>& actual_args);
+  // resolved is the method already found for the class of the instance, if any
+  ObjectHolder Call(
+      const std::string& method, const std::vector<ObjectHolder>& actual_args, const Method* resolved = nullptr
+  );
   bool HasMethod(const std::string& method, size_t argument_count) const;
+  const Class& GetClass() const;
 
   Closure& Fields();
   const Closure& Fields() const;
 
   bool IsTrue() const override;
 
+  // Changes whenever a field is assigned or an instance is destroyed,
+  // so objects found through fields may be cached while it stays the same
+  static size_t FieldsEpoch();
+  static void TouchFields();
+
 private:
+  // Executes a single frame, a pending tail call is left in the result
+  Ast::Result Invoke(
+      const std::string& method, const std::vector<ObjectHolder>& actual_args, const Method* resolved = nullptr
+  );
+
   const Class& cls;
   Closure fields;
 };
@@ -0,0 +1,578 @@
+#include "optimizer.h"
+#include "closure_compiler.h"
+#include "comparators.h"
+#include "escape_analysis.h"
+#include "flat_tree.h"
+#include "inliner.h"
+#include "jit.h"
+#include "object.h"
+#include "profile.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "type_inference.h"
+
+#include <map>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    using Path = std::vector<std::string>;
+
+    // Numbers, strings and bools. None is left alone, its node gives no object
+    std::optional<ObjectHolder> ConstantValue(Statement& st)
+    {
+        if (st.TryAs<NumericConst>() || st.TryAs<StringConst>() || st.TryAs<BoolConst>())
+        {
+            Closure empty;
+            return st.Execute(empty);
+        }
+        return std::nullopt;
+    }
+
+    std::unique_ptr<Statement> MakeConstant(const ObjectHolder& value)
+    {
+        if (auto p = value.TryAs<Runtime::Number>())
+            return std::make_unique<NumericConst>(*p);
+        if (auto p = value.TryAs<Runtime::String>())
+            return std::make_unique<StringConst>(*p);
+        if (auto p = value.TryAs<Runtime::Bool>())
+            return std::make_unique<BoolConst>(*p);
+        return nullptr;
+    }
+
+    std::unique_ptr<Statement> MakeBool(bool value)
+    {
+        return std::make_unique<BoolConst>(Runtime::Bool(value));
+    }
+
+    std::optional<ArithmeticOp> GetArithmeticOp(Statement& st)
+    {
+        if (st.TryAs<Add>())
+            return ArithmeticOp::Add;
+        if (st.TryAs<Sub>())
+            return ArithmeticOp::Sub;
+        if (st.TryAs<Mult>())
+            return ArithmeticOp::Mult;
+        if (st.TryAs<Div>())
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    bool IsMinusOne(Statement& st)
+    {
+        auto p = st.TryAs<NumericConst>();
+        return p && p->value.GetValue() == -1;
+    }
+
+    // Expressions whose operands are constants. Operations which fail on
+    // the operands are left for the runtime, so is division by zero
+    std::unique_ptr<Statement> FoldExpression(Statement& st)
+    {
+        if (auto op = GetArithmeticOp(st))
+        {
+            auto& binary = static_cast<BinaryOperation&>(st);
+            auto lhs = ConstantValue(*binary.Lhs()), rhs = ConstantValue(*binary.Rhs());
+            if (!lhs || !rhs)
+                return nullptr;
+
+            auto divisor = rhs->TryAs<Runtime::Number>();
+            if (*op == ArithmeticOp::Div && divisor && divisor->GetValue() == 0)
+                return nullptr;
+
+            try
+            {
+                return MakeConstant(CallOperator(*lhs, *rhs, *op));
+            }
+            catch (std::runtime_error&)
+            {
+                return nullptr;
+            }
+        }
+        if (st.TryAs<Or>() || st.TryAs<And>())
+        {
+            auto& binary = static_cast<BinaryOperation&>(st);
+            auto lhs = ConstantValue(*binary.Lhs()), rhs = ConstantValue(*binary.Rhs());
+            if (!lhs || !rhs)
+                return nullptr;
+
+            if (st.TryAs<Or>())
+                return MakeBool((*lhs)->IsTrue() || (*rhs)->IsTrue());
+            return MakeBool((*lhs)->IsTrue() && (*rhs)->IsTrue());
+        }
+        if (auto p = st.TryAs<Comparison>())
+        {
+            auto lhs = ConstantValue(*p->Lhs()), rhs = ConstantValue(*p->Rhs());
+            if (!lhs || !rhs)
+                return nullptr;
+
+            try
+            {
+                return MakeBool(p->GetComparator()(*lhs, *rhs));
+            }
+            catch (std::runtime_error&)
+            {
+                return nullptr;
+            }
+        }
+        if (auto p = st.TryAs<Not>())
+        {
+            auto value = ConstantValue(*p->Argument());
+            return value ? MakeBool(!(*value)->IsTrue()) : nullptr;
+        }
+        if (auto p = st.TryAs<Stringify>())
+        {
+            auto value = ConstantValue(*p->Argument());
+            if (!value)
+                return nullptr;
+
+            std::ostringstream os;
+            (*value)->Print(os);
+            return std::make_unique<StringConst>(os.str());
+        }
+        return nullptr;
+    }
+
+    // if with a constant condition is replaced by the branch it takes
+    std::unique_ptr<Statement> FoldCondition(IfElse& if_else)
+    {
+        std::optional<bool> taken;
+        if (if_else.Condition()->TryAs<None>())
+            taken = false;
+        else if (auto value = ConstantValue(*if_else.Condition()))
+            taken = (*value)->IsTrue();
+
+        if (!taken)
+            return nullptr;
+        if (*taken)
+            return std::move(if_else.IfBody());
+        if (if_else.ElseBody())
+            return std::move(if_else.ElseBody());
+        return std::make_unique<Compound>();
+    }
+
+    // The children of the node, those of a class definition (its method bodies) only when into_classes is set
+    void ForEachChildIn(Statement& node, bool into_classes, const ChildVisitor& visitor)
+    {
+        if (into_classes || !node.TryAs<ClassDefinition>())
+            node.ForEachChild(visitor);
+    }
+
+    void Fold(std::unique_ptr<Statement>& node, OptimizerStats& stats, bool into_classes)
+    {
+        ForEachChildIn(*node, into_classes, [&stats, into_classes](std::unique_ptr<Statement>& child) {
+            Fold(child, stats, into_classes);
+        });
+
+        if (auto p = node->TryAs<IfElse>())
+        {
+            if (auto branch = FoldCondition(*p))
+            {
+                node = std::move(branch);
+                ++stats.dead_branches;
+            }
+        }
+        else if (auto folded = FoldExpression(*node))
+        {
+            node = std::move(folded);
+            ++stats.folded_constants;
+        }
+        else if (auto p = node->TryAs<Mult>(); p && IsMinusOne(*p->Rhs()))
+        {
+            node = std::make_unique<Negate>(std::move(p->Lhs()));
+            ++stats.negations;
+        }
+    }
+
+    bool AlwaysReturns(Statement& st)
+    {
+        if (st.TryAs<Return>() || st.TryAs<ReturnVariable>() || st.TryAs<TailCall>())
+            return true;
+
+        if (auto p = st.TryAs<Compound>())
+        {
+            for (auto& stmt : p->Statements())
+                if (AlwaysReturns(*stmt))
+                    return true;
+            return false;
+        }
+        if (auto p = st.TryAs<IfElse>())
+            return p->ElseBody() && AlwaysReturns(*p->IfBody()) && AlwaysReturns(*p->ElseBody());
+
+        return false;
+    }
+
+    void RemoveUnreachable(Statement& node, OptimizerStats& stats, bool into_classes)
+    {
+        ForEachChildIn(node, into_classes, [&stats, into_classes](std::unique_ptr<Statement>& child) {
+            RemoveUnreachable(*child, stats, into_classes);
+        });
+
+        auto compound = node.TryAs<Compound>();
+        if (!compound)
+            return;
+
+        auto& statements = compound->Statements();
+        auto it = statements.begin();
+        while (it != statements.end() && !AlwaysReturns(**it))
+            ++it;
+        if (it == statements.end())
+            return;
+
+        // Classes are declared by the parser and owned by their definitions, so those stay
+        std::vector<std::unique_ptr<Statement>> kept(std::make_move_iterator(statements.begin()), std::make_move_iterator(++it));
+        for (; it != statements.end(); ++it)
+        {
+            if ((*it)->TryAs<ClassDefinition>())
+                kept.push_back(std::move(*it));
+            else
+                ++stats.unreachable_statements;
+        }
+        statements = std::move(kept);
+    }
+
+    bool IsCacheable(Statement& st)
+    {
+        auto var = st.TryAs<VariableValue>();
+        return var && var->dotted_ids.size() >= 3;
+    }
+
+    Path OwnerPath(Statement& st)
+    {
+        auto& ids = st.TryAs<VariableValue>()->dotted_ids;
+        return Path(ids.begin(), ids.end() - 1);
+    }
+
+    void CountReads(Statement& node, std::map<Path, size_t>& reads, bool into_classes)
+    {
+        ForEachChildIn(node, into_classes, [&reads, into_classes](std::unique_ptr<Statement>& child) {
+            if (IsCacheable(*child))
+                ++reads[OwnerPath(*child)];
+            else
+                CountReads(*child, reads, into_classes);
+        });
+    }
+
+    void ShareReads(
+        Statement& node, std::map<Path, std::shared_ptr<FieldPathCache>>& caches, OptimizerStats& stats, bool into_classes)
+    {
+        ForEachChildIn(node, into_classes, [&](std::unique_ptr<Statement>& child) {
+            if (!IsCacheable(*child))
+            {
+                ShareReads(*child, caches, stats, into_classes);
+                return;
+            }
+
+            auto it = caches.find(OwnerPath(*child));
+            if (it == caches.end())
+                return;
+
+            child = std::make_unique<CachedFieldRead>(std::move(*child->TryAs<VariableValue>()), it->second);
+            ++stats.cached_reads;
+        });
+    }
+
+    void ShareBodyReads(Statement& body, OptimizerStats& stats, bool into_classes)
+    {
+        std::map<Path, size_t> reads;
+        CountReads(body, reads, into_classes);
+
+        std::map<Path, std::shared_ptr<FieldPathCache>> caches;
+        for (auto& [path, count] : reads)
+            if (count > 1)
+                caches[path] = std::make_shared<FieldPathCache>();
+
+        if (!caches.empty())
+            ShareReads(body, caches, stats, into_classes);
+    }
+
+    void ShareMethodReads(Statement& node, OptimizerStats& stats)
+    {
+        if (auto p = node.TryAs<ClassDefinition>())
+        {
+            for (auto& method : p->GetClass().Methods())
+                ShareBodyReads(*method.body, stats, true);
+            return;
+        }
+
+        node.ForEachChild([&stats](std::unique_ptr<Statement>& child) {
+            ShareMethodReads(*child, stats);
+        });
+    }
+
+    std::string Join(const Path& ids)
+    {
+        std::string res = ids[0];
+        for (size_t i = 1; i < ids.size(); ++i)
+            res += "." + ids[i];
+        return res;
+    }
+
+    const char* OperatorName(ArithmeticOp op)
+    {
+        switch (op)
+        {
+            case ArithmeticOp::Add:
+                return "+";
+            case ArithmeticOp::Sub:
+                return "-";
+            case ArithmeticOp::Mult:
+                return "*";
+            default:
+                return "/";
+        }
+    }
+
+    const char* ComparatorName(const Comparison::Comparator& comparator)
+    {
+        using Function = bool (*)(ObjectHolder, ObjectHolder);
+        auto fn = comparator.target<Function>();
+        if (!fn)
+            return "?";
+        if (*fn == &Runtime::Equal)
+            return "==";
+        if (*fn == &Runtime::NotEqual)
+            return "!=";
+        if (*fn == &Runtime::Less)
+            return "<";
+        if (*fn == &Runtime::Greater)
+            return ">";
+        if (*fn == &Runtime::LessOrEqual)
+            return "<=";
+        if (*fn == &Runtime::GreaterOrEqual)
+            return ">=";
+        return "?";
+    }
+
+    std::string Describe(Statement& st)
+    {
+        if (auto p = st.TryAs<NumericConst>())
+            return "NumericConst " + std::to_string(p->value.GetValue());
+        if (auto p = st.TryAs<StringConst>())
+            return "StringConst '" + p->value.GetValue() + "'";
+        if (auto p = st.TryAs<BoolConst>())
+            return std::string("BoolConst ") + (p->value.GetValue() ? "True" : "False");
+        if (st.TryAs<None>())
+            return "None";
+        if (auto p = st.TryAs<VariableValue>())
+            return "VariableValue " + Join(p->dotted_ids);
+        if (auto p = st.TryAs<CachedFieldRead>())
+            return "CachedFieldRead " + Join(p->Variable().dotted_ids);
+        if (auto p = st.TryAs<Assignment>())
+            return "Assignment " + p->var;
+        if (auto p = st.TryAs<FieldAssignment>())
+            return "FieldAssignment " + Join(p->object.dotted_ids) + "." + p->field_name;
+        if (st.TryAs<Print>())
+            return "Print";
+        if (auto p = st.TryAs<MethodCall>())
+        {
+            if (p->cache.cls)
+                return "MethodCall " + p->method + " cached " + p->cache.cls->GetName();
+            return "MethodCall " + p->method;
+        }
+        if (auto p = st.TryAs<NewInstance>())
+            return "NewInstance " + p->class_.GetName();
+        if (st.TryAs<CompiledTree>())
+            return "CompiledTree";
+        if (st.TryAs<FlatRoot>())
+            return "FlatRoot";
+        if (st.TryAs<JitBody>())
+            return "JitBody";
+        if (auto p = st.TryAs<ArithmeticChain>())
+            return "ArithmeticChain, " + std::to_string(p->Temporaries()) + " unboxed";
+        if (auto p = st.TryAs<InlinedCall>())
+            return "InlinedCall " + p->Callee();
+        if (auto p = st.TryAs<InlineSlot>())
+            return "InlineSlot " + std::to_string(p->Index());
+        if (auto p = st.TryAs<InlineField>())
+            return "InlineField self." + p->Field();
+        if (auto p = st.TryAs<InlineFieldStore>())
+            return "InlineFieldStore self." + p->Field();
+        if (st.TryAs<NumericAdd>())
+            return "NumericAdd";
+        if (auto p = st.TryAs<GuardedAdd>())
+            return std::string("GuardedAdd ") + (p->Expected() == NUMBER_TYPE ? "numbers" : "strings");
+        if (st.TryAs<NumericSub>())
+            return "NumericSub";
+        if (st.TryAs<NumericMult>())
+            return "NumericMult";
+        if (st.TryAs<NumericDiv>())
+            return "NumericDiv";
+        if (st.TryAs<NumericNegate>())
+            return "NumericNegate";
+        if (st.TryAs<StringConcat>())
+            return "StringConcat";
+        if (auto p = st.TryAs<NumericComparison>())
+            return std::string("NumericComparison ") + ComparatorName(p->GetComparator());
+        if (auto p = st.TryAs<GuardedComparison>())
+            return std::string("GuardedComparison ") + ComparatorName(p->GetComparator());
+        if (auto p = st.TryAs<StringComparison>())
+            return std::string("StringComparison ") + ComparatorName(p->GetComparator());
+        if (st.TryAs<BoolNot>())
+            return "BoolNot";
+        if (st.TryAs<BoolOr>())
+            return "BoolOr";
+        if (st.TryAs<BoolAnd>())
+            return "BoolAnd";
+        if (st.TryAs<TypedIfElse>())
+            return "TypedIfElse";
+        if (st.TryAs<Stringify>())
+            return "Stringify";
+        if (st.TryAs<Not>())
+            return "Not";
+        if (st.TryAs<Negate>())
+            return "Negate";
+        if (st.TryAs<Add>())
+            return "Add";
+        if (st.TryAs<Sub>())
+            return "Sub";
+        if (st.TryAs<Mult>())
+            return "Mult";
+        if (st.TryAs<Div>())
+            return "Div";
+        if (st.TryAs<Or>())
+            return "Or";
+        if (st.TryAs<And>())
+            return "And";
+        if (auto p = st.TryAs<Comparison>())
+            return std::string("Comparison ") + ComparatorName(p->GetComparator());
+        if (st.TryAs<Compound>())
+            return "Compound";
+        if (st.TryAs<Return>())
+            return "Return";
+        if (auto p = st.TryAs<ClassDefinition>())
+            return "ClassDefinition " + p->GetClass().GetName();
+        if (st.TryAs<IfElse>())
+            return "IfElse";
+        if (auto p = st.TryAs<FieldUpdate>())
+            return "FieldUpdate " + Join(p->Object().dotted_ids) + "." + p->FieldName() + " " + OperatorName(p->Op()) + "=";
+        if (auto p = st.TryAs<VariableUpdate>())
+            return "VariableUpdate " + p->Var() + " " + OperatorName(p->Op()) + "=";
+        if (auto p = st.TryAs<ReturnVariable>())
+            return "ReturnVariable " + Join(p->Variable().dotted_ids);
+        if (auto p = st.TryAs<IfCompare>())
+            return std::string("IfCompare ") + ComparatorName(p->GetComparator());
+        if (auto p = st.TryAs<TailCall>())
+            return "TailCall " + p->Method();
+        return typeid(st).name();
+    }
+
+    void Dump(Statement& st, std::ostream& out, size_t depth)
+    {
+        out << std::string(depth * 2, ' ') << Describe(st) << "\n";
+
+        if (auto p = st.TryAs<ClassDefinition>())
+        {
+            for (auto& method : p->GetClass().Methods())
+            {
+                out << std::string((depth + 1) * 2, ' ') << "def " << method.name << "(";
+                for (size_t i = 0; i < method.formal_params.size(); ++i)
+                    out << (i > 0 ? ", " : "") << method.formal_params[i];
+                out << ")\n";
+                Dump(*method.body, out, depth + 2);
+            }
+            return;
+        }
+
+        st.ForEachChild([&out, depth](std::unique_ptr<Statement>& child) {
+            Dump(*child, out, depth + 1);
+        });
+    }
+}
+
+// Negate
+//
+Result Negate::Execute(Closure& closure)
+{
+    auto value = argument->Execute(closure);
+    if (auto number = value.TryAs<Runtime::Number>())
+        return ObjectHolder::Own(Runtime::Number(-number->GetValue()));
+
+    return CallOperator(std::move(value), ObjectHolder::Own(Runtime::Number(-1)), ArithmeticOp::Mult);
+}
+
+// CachedFieldRead
+//
+CachedFieldRead::CachedFieldRead(VariableValue variable, std::shared_ptr<FieldPathCache> cache)
+    : variable(std::move(variable)), cache(std::move(cache))
+{
+}
+
+Result CachedFieldRead::Execute(Closure& closure)
+{
+    // Anything unusual is left to VariableValue, so are its errors
+    const auto& ids = variable.dotted_ids;
+    auto head = closure.find(ids[0]);
+    if (head == closure.end())
+        return variable.Execute(closure);
+
+    if (cache->head != head->second.Get() || cache->epoch != Runtime::ClassInstance::FieldsEpoch())
+    {
+        auto owner = head->second;
+        for (size_t i = 1; i + 1 < ids.size(); ++i)
+        {
+            auto instance = owner.TryAs<Runtime::ClassInstance>();
+            if (!instance)
+                return variable.Execute(closure);
+
+            auto it = instance->Fields().find(ids[i]);
+            if (it == instance->Fields().end())
+                return variable.Execute(closure);
+            owner = it->second;
+        }
+
+        if (!owner.TryAs<Runtime::ClassInstance>())
+            return variable.Execute(closure);
+
+        cache->head = head->second.Get();
+        cache->epoch = Runtime::ClassInstance::FieldsEpoch();
+        cache->owner = std::move(owner);
+    }
+
+    auto& fields = cache->owner.TryAs<Runtime::ClassInstance>()->Fields();
+    auto it = fields.find(ids.back());
+    if (it == fields.end())
+        return variable.Execute(closure);
+    if (!it->second)
+        return ObjectHolder::Own(Runtime::None());
+    return it->second;
+}
+
+// Free
+//
+OptimizerStats OptimizeProgram(std::unique_ptr<Statement>& root, bool method_bodies)
+{
+    OptimizerStats stats;
+    Fold(root, stats, method_bodies);
+    RemoveUnreachable(*root, stats, method_bodies);
+    if (method_bodies)
+        ShareMethodReads(*root, stats);
+    return stats;
+}
+
+OptimizerStats OptimizeMethodBody(std::unique_ptr<Statement>& body)
+{
+    OptimizerStats stats;
+    Fold(body, stats, false);
+    RemoveUnreachable(*body, stats, false);
+    ShareBodyReads(*body, stats, false);
+    return stats;
+}
+
+void DumpTree(Statement& root, std::ostream& out)
+{
+    Dump(root, out, 0);
+}
+
+} /* namespace Ast */
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+
+class TestRunner;
+
+namespace Ast {
+
+// -x. The parser emits Mult(x, -1) for it, Negate does the same without the
+// second operand: numbers are negated in place, anything else gets x * -1
+class Negate : public UnaryOperation {
+public:
+  using UnaryOperation::UnaryOperation;
+  Result Execute(Runtime::Closure& closure) override;
+};
+
+// Objects found on the way of a.b.c reads, shared by the reads of one method.
+// Valid while the head object and Runtime::ClassInstance::FieldsEpoch() stay the same
+struct FieldPathCache {
+  const Runtime::IObject* head = nullptr;
+  size_t epoch = static_cast<size_t>(-1);
+  ObjectHolder owner;
+};
+
+// a.b.c which takes a.b from the cache when it is still valid
+class CachedFieldRead : public Statement {
+public:
+  CachedFieldRead(VariableValue variable, std::shared_ptr<FieldPathCache> cache);
+
+  VariableValue& Variable() {
+    return variable;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  VariableValue variable;
+  std::shared_ptr<FieldPathCache> cache;
+};
+
+struct OptimizerStats {
+  size_t folded_constants = 0;
+  size_t negations = 0;
+  size_t unreachable_statements = 0;
+  size_t dead_branches = 0;
+  size_t cached_reads = 0;
+};
+
+// Rewrites the tree (method bodies included) in place:
+// folds constant expressions, replaces Mult(x, -1) with Negate, drops
+// statements after return and the branches of ifs with constant conditions,
+// and shares repeated a.b.c lookups inside each method. The method bodies are
+// left as they are when method_bodies is false
+OptimizerStats OptimizeProgram(std::unique_ptr<Statement>& root, bool method_bodies = true);
+
+// The same rewrites of one method body, without the bodies of the classes
+// defined in it. Touches no node outside the body, so the bodies can be
+// rewritten on threads of their own
+OptimizerStats OptimizeMethodBody(std::unique_ptr<Statement>& body);
+
+// One node per line, children are indented by two spaces
+void DumpTree(Statement& root, std::ostream& out);
+
+void RunOptimizerTests(TestRunner& tr);
+
+} /* namespace Ast */
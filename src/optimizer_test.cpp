@@ -0,0 +1,219 @@
+#include "optimizer.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Dump(Statement& program) {
+  ostringstream out;
+  DumpTree(program, out);
+  return out.str();
+}
+
+}
+
+void TestConstantsAreFolded() {
+  auto program = ParseProgramFromString("x = 2 * 60 * 60\nprint x, 'a' + 'b', str(5), 1 < 2, not 0, x / 0\n");
+  auto stats = OptimizeProgram(program);
+
+  // The division by zero is left for the runtime
+  ASSERT_EQUAL(stats.folded_constants, 6u);
+  ASSERT(Dump(*program).find("NumericConst 7200") != string::npos);
+  ASSERT(Dump(*program).find("Div") != string::npos);
+
+  program = ParseProgramFromString("print 2 * 60 * 60, 'a' + 'b', str(5), 1 < 2, not 0, True and 0, 'x' < 1\n");
+  OptimizeProgram(program);
+  ASSERT_THROWS(Execute(*program), std::runtime_error);
+
+  program = ParseProgramFromString("print 2 * 60 * 60, 'a' + 'b', str(5), 1 < 2, not 0, True and 0\n");
+  OptimizeProgram(program);
+  ASSERT_EQUAL(Execute(*program), "7200 ab 5 True True False\n");
+}
+
+void TestUnaryMinusIsSimplified() {
+  auto program = ParseProgramFromString("x = 5\nprint -x, -3, - -x, 2 - -x\n");
+  auto stats = OptimizeProgram(program);
+
+  ASSERT_EQUAL(stats.folded_constants, 1u);
+  ASSERT_EQUAL(stats.negations, 4u);
+  ASSERT_EQUAL(Execute(*program), "-5 -3 5 7\n");
+}
+
+void TestNegateCallsUserOperator() {
+  auto program = ParseProgramFromString(R"(
+class Money:
+  def __init__(amount):
+    self.amount = amount
+
+  def __mult__(k):
+    return self.amount * k * 100
+
+m = Money(7)
+print -m
+)");
+  OptimizeProgram(program);
+  ASSERT_EQUAL(Execute(*program), "-700\n");
+}
+
+void TestUnreachableStatementsAreRemoved() {
+  auto program = ParseProgramFromString(R"(
+class Sign:
+  def of(x):
+    if x < 0:
+      return 0 - 1
+      print 'never'
+    else:
+      return 1
+    print 'never'
+    return 0
+
+s = Sign()
+print s.of(0 - 5), s.of(5)
+)");
+  auto stats = OptimizeProgram(program);
+
+  ASSERT_EQUAL(stats.unreachable_statements, 3u);
+  ASSERT_EQUAL(Execute(*program), "-1 1\n");
+}
+
+void TestDeadBranchesAreRemoved() {
+  auto program = ParseProgramFromString(R"(
+if True:
+  print 1
+else:
+  print 2
+if 0:
+  print 3
+if 'a' == 'b':
+  print 4
+else:
+  print 5
+)");
+  auto stats = OptimizeProgram(program);
+
+  ASSERT_EQUAL(stats.dead_branches, 3u);
+  ASSERT(Dump(*program).find("IfElse") == string::npos);
+  ASSERT_EQUAL(Execute(*program), "1\n5\n");
+}
+
+void TestFieldReadsAreShared() {
+  auto program = ParseProgramFromString(R"(
+class Inner:
+  def __init__(v):
+    self.v = v
+
+class Outer:
+  def __init__(v):
+    self.inner = Inner(v)
+
+  def twice():
+    return self.inner.v + self.inner.v
+
+  def replace():
+    x = self.inner.v
+    self.inner = Inner(5)
+    return x + self.inner.v
+
+a = Outer(1)
+b = Outer(2)
+print a.twice(), b.twice(), a.twice()
+print a.replace(), a.replace()
+)");
+  auto stats = OptimizeProgram(program);
+
+  ASSERT_EQUAL(stats.cached_reads, 4u);
+  ASSERT_EQUAL(Execute(*program), "2 4 2\n6 10\n");
+}
+
+void TestTreeIsDumped() {
+  istringstream input(R"(
+class Calc:
+  def sq(x):
+    return x * x
+    print x
+
+if 1 > 2:
+  print 0
+c = Calc()
+print -3, c.sq(2)
+)");
+  ostringstream output, dump;
+
+  RunOptions options;
+  options.tail_calls = false;
+  options.superinstructions = false;
+  options.inline_methods = false;
+  options.tree_dump = &dump;
+  RunMythonProgram(input, output, options);
+
+  ASSERT_EQUAL(output.str(), "-3 4\n");
+  ASSERT_EQUAL(dump.str(),
+    "Parsed:\n"
+    "Compound\n"
+    "  ClassDefinition Calc\n"
+    "    def sq(x)\n"
+    "      Compound\n"
+    "        Return\n"
+    "          Mult\n"
+    "            VariableValue x\n"
+    "            VariableValue x\n"
+    "        Print\n"
+    "          VariableValue x\n"
+    "  IfElse\n"
+    "    Comparison >\n"
+    "      NumericConst 1\n"
+    "      NumericConst 2\n"
+    "    Compound\n"
+    "      Print\n"
+    "        NumericConst 0\n"
+    "  Assignment c\n"
+    "    NewInstance Calc\n"
+    "  Print\n"
+    "    Mult\n"
+    "      NumericConst 3\n"
+    "      NumericConst -1\n"
+    "    MethodCall sq\n"
+    "      VariableValue c\n"
+    "      NumericConst 2\n"
+    "Optimized:\n"
+    "Compound\n"
+    "  ClassDefinition Calc\n"
+    "    def sq(x)\n"
+    "      Compound\n"
+    "        Return\n"
+    "          Mult\n"
+    "            VariableValue x\n"
+    "            VariableValue x\n"
+    "  Compound\n"
+    "  Assignment c\n"
+    "    NewInstance Calc\n"
+    "  Print\n"
+    "    NumericConst -3\n"
+    "    MethodCall sq\n"
+    "      VariableValue c\n"
+    "      NumericConst 2\n"
+  );
+}
+
+void RunOptimizerTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestConstantsAreFolded);
+  RUN_TEST(tr, Ast::TestUnaryMinusIsSimplified);
+  RUN_TEST(tr, Ast::TestNegateCallsUserOperator);
+  RUN_TEST(tr, Ast::TestUnreachableStatementsAreRemoved);
+  RUN_TEST(tr, Ast::TestDeadBranchesAreRemoved);
+  RUN_TEST(tr, Ast::TestFieldReadsAreShared);
+  RUN_TEST(tr, Ast::TestTreeIsDumped);
+}
+
+} /* namespace Ast */
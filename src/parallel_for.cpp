@@ -0,0 +1,107 @@
+#include "parallel_for.h"
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// The indices [begin, end) left to a thread
+struct TaskRun {
+  mutex lock;
+  size_t begin = 0;
+  size_t end = 0;
+};
+
+// The first index of the run of the thread, false when it is empty
+bool TakeFront(TaskRun& run, size_t& index) {
+  lock_guard guard(run.lock);
+  if (run.begin == run.end) {
+    return false;
+  }
+  index = run.begin++;
+  return true;
+}
+
+// Moves the back half of the run of another thread to that of the thief, false
+// when all are empty. No two runs are locked at once: the stolen indices are
+// in neither run for a moment, their thief runs them all the same
+bool Steal(vector<TaskRun>& runs, size_t thief) {
+  for (size_t i = 1; i < runs.size(); ++i) {
+    auto& victim = runs[(thief + i) % runs.size()];
+    size_t begin = 0;
+    size_t end = 0;
+    {
+      lock_guard guard(victim.lock);
+      if (victim.begin == victim.end) {
+        continue;
+      }
+      end = victim.end;
+      begin = victim.end - (victim.end - victim.begin + 1) / 2;
+      victim.end = begin;
+    }
+    lock_guard guard(runs[thief].lock);
+    runs[thief].begin = begin;
+    runs[thief].end = end;
+    return true;
+  }
+  return false;
+}
+
+}
+
+void ParallelFor(size_t count, const function<void(size_t)>& task, size_t threads) {
+  if (threads == 0) {
+    threads = max(thread::hardware_concurrency(), 1u);
+  }
+  threads = min(threads, count);
+  if (threads == 0) {
+    return;
+  }
+
+  vector<TaskRun> runs(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    runs[i].begin = count * i / threads;
+    runs[i].end = count * (i + 1) / threads;
+  }
+
+  mutex error_lock;
+  exception_ptr error;
+  size_t error_index = count;
+  auto work = [&](size_t self) {
+    size_t index = 0;
+    for (;;) {
+      if (!TakeFront(runs[self], index)) {
+        if (!Steal(runs, self)) {
+          return;
+        }
+        continue;
+      }
+      try {
+        task(index);
+      } catch (...) {
+        lock_guard guard(error_lock);
+        if (index < error_index) {
+          error = current_exception();
+          error_index = index;
+        }
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (size_t i = 1; i < threads; ++i) {
+    workers.emplace_back(work, i);
+  }
+  work(0);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  if (error) {
+    rethrow_exception(error);
+  }
+}
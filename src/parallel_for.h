@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+
+class TestRunner;
+
+// Runs task(0), ..., task(count - 1) on the given number of threads, one per
+// core when it is 0, the calling thread being one of them. Returns when every
+// task has finished. Each thread starts with an even run of the indices and
+// takes them from its front; a thread which has run out steals the back half
+// of the run of another, so tasks of uneven lengths keep all threads busy.
+// The tasks run concurrently and must not share what they write. When tasks
+// throw, the exception of the lowest index is rethrown, after the others ran
+void ParallelFor(size_t count, const std::function<void(size_t)>& task, size_t threads = 0);
+
+void RunParallelForTests(TestRunner& tr);
@@ -0,0 +1,59 @@
+#include "parallel_for.h"
+
+#include <test_runner.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+void TestEveryIndexRunsOnce() {
+  for (size_t threads : {1, 2, 3, 8}) {
+    for (size_t count : {0, 1, 5, 1000}) {
+      vector<atomic<int>> runs(count);
+      ParallelFor(count, [&runs](size_t i) { ++runs[i]; }, threads);
+      for (auto& run : runs) {
+        ASSERT_EQUAL(run.load(), 1);
+      }
+    }
+  }
+}
+
+void TestUnevenTasksAreStolen() {
+  // The first run of indices is long, the others take from it
+  atomic<size_t> total = 0;
+  ParallelFor(64, [&total](size_t i) {
+    size_t sum = 0;
+    for (size_t k = 0; k < (i < 16 ? 200000 : 10); ++k) {
+      sum += k % 7;
+    }
+    total += sum > 0 ? 1 : 0;
+  }, 4);
+  ASSERT_EQUAL(total.load(), 64u);
+}
+
+void TestErrorOfTheLowestIndexIsThrown() {
+  for (size_t threads : {1, 4}) {
+    atomic<size_t> ran = 0;
+    try {
+      ParallelFor(100, [&ran](size_t i) {
+        ++ran;
+        if (i % 30 == 29) {
+          throw runtime_error("task " + to_string(i));
+        }
+      }, threads);
+      ASSERT(false);
+    } catch (const runtime_error& e) {
+      ASSERT_EQUAL(string(e.what()), "task 29");
+    }
+    ASSERT_EQUAL(ran.load(), 100u);
+  }
+}
+
+void RunParallelForTests(TestRunner& tr) {
+  RUN_TEST(tr, TestEveryIndexRunsOnce);
+  RUN_TEST(tr, TestUnevenTasksAreStolen);
+  RUN_TEST(tr, TestErrorOfTheLowestIndexIsThrown);
+}
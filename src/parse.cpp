@@ -1,11 +1,17 @@
 #include "parse.h"
+#include "flat_tree.h"
 #include "statement.h"
 #include "lexer.h" //         Mython
 #include "comparators.h"
+#include "parallel_for.h"
 
 #include <algorithm>
+#include <cstddef>
+#include <exception>
 #include <string>
 #include <cctype>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <optional>
 
@@ -25,42 +31,498 @@ bool operator != (const Parse::Token& token, char c) {
 
 }
 
+// Makes the nodes of the tree
+class TreeBuilder {
+public:
+  using Node = unique_ptr<Ast::Statement>;
+
+  size_t Position() const {
+    return 0;
+  }
+
+  Node Number(int value) {
+    return make_unique<Ast::NumericConst>(value);
+  }
+
+  Node String(string value) {
+    return make_unique<Ast::StringConst>(std::move(value));
+  }
+
+  Node Bool(bool value) {
+    return make_unique<Ast::BoolConst>(Runtime::Bool(value));
+  }
+
+  Node None() {
+    return make_unique<Ast::None>();
+  }
+
+  Node Variable(vector<string> ids) {
+    return make_unique<Ast::VariableValue>(std::move(ids));
+  }
+
+  Node Assignment(string name, Node value) {
+    return make_unique<Ast::Assignment>(std::move(name), std::move(value));
+  }
+
+  Node FieldAssignment(vector<string> object, string field, Node value) {
+    return make_unique<Ast::FieldAssignment>(
+      Ast::VariableValue{std::move(object)}, std::move(field), std::move(value)
+    );
+  }
+
+  Node MethodCall(Node object, string method, vector<Node> args) {
+    return make_unique<Ast::MethodCall>(std::move(object), std::move(method), std::move(args));
+  }
+
+  Node NewInstance(const Runtime::Class& cls, vector<Node> args) {
+    return make_unique<Ast::NewInstance>(cls, std::move(args));
+  }
+
+  Node Stringify(Node argument) {
+    return make_unique<Ast::Stringify>(std::move(argument));
+  }
+
+  Node Arithmetic(Ast::ArithmeticOp op, Node lhs, Node rhs) {
+    switch (op) {
+      case Ast::ArithmeticOp::Add:
+        return make_unique<Ast::Add>(std::move(lhs), std::move(rhs));
+      case Ast::ArithmeticOp::Sub:
+        return make_unique<Ast::Sub>(std::move(lhs), std::move(rhs));
+      case Ast::ArithmeticOp::Mult:
+        return make_unique<Ast::Mult>(std::move(lhs), std::move(rhs));
+      default:
+        return make_unique<Ast::Div>(std::move(lhs), std::move(rhs));
+    }
+  }
+
+  Node Or(Node lhs, Node rhs) {
+    return make_unique<Ast::Or>(std::move(lhs), std::move(rhs));
+  }
+
+  Node And(Node lhs, Node rhs) {
+    return make_unique<Ast::And>(std::move(lhs), std::move(rhs));
+  }
+
+  Node Not(Node argument) {
+    return make_unique<Ast::Not>(std::move(argument));
+  }
+
+  Node Comparison(Ast::Comparison::Comparator comparator, Node lhs, Node rhs) {
+    return make_unique<Ast::Comparison>(std::move(comparator), std::move(lhs), std::move(rhs));
+  }
+
+  Node Compound(vector<Node> statements) {
+    auto result = make_unique<Ast::Compound>();
+    for (auto& statement : statements) {
+      result->AddStatement(std::move(statement));
+    }
+    return result;
+  }
+
+  // Tail calls of the tree are marked by a pass (see tail_calls.h)
+  Node Return(Node value, bool /*in_method*/) {
+    return make_unique<Ast::Return>(std::move(value));
+  }
+
+  Node Print(vector<Node> args) {
+    return make_unique<Ast::Print>(std::move(args));
+  }
+
+  Node IfElse(Node condition, Node if_body, optional<Node> else_body) {
+    return make_unique<Ast::IfElse>(
+      std::move(condition), std::move(if_body), else_body ? std::move(*else_body) : nullptr
+    );
+  }
+
+  Node ClassDefinition(ObjectHolder cls, size_t) {
+    return make_unique<Ast::ClassDefinition>(std::move(cls));
+  }
+
+  unique_ptr<Ast::Statement> Body(Node body) {
+    return body;
+  }
+};
+
+// Appends the nodes to a FlatTree as they are parsed, no tree is built.
+// A node is the index of its root
+class FlatBuilder {
+public:
+  using Node = uint32_t;
+
+  explicit FlatBuilder(bool tail_calls) : flat(make_shared<Ast::FlatTree>()), tail_calls(tail_calls) {
+  }
+
+  size_t Position() const {
+    return flat->Size();
+  }
+
+  Node Number(int value) {
+    return flat->AddConstant(ObjectHolder::Own(Runtime::Number(value)));
+  }
+
+  Node String(string value) {
+    return flat->AddConstant(ObjectHolder::Own(Runtime::String(std::move(value))));
+  }
+
+  Node Bool(bool value) {
+    return flat->AddConstant(ObjectHolder::Own(Runtime::Bool(value)));
+  }
+
+  Node None() {
+    return flat->AddNone();
+  }
+
+  Node Variable(vector<string> ids) {
+    return flat->AddVariable(ids);
+  }
+
+  Node Assignment(string name, Node value) {
+    return flat->AddAssign(name, value);
+  }
+
+  Node FieldAssignment(vector<string> object, string field, Node value) {
+    return flat->AddFieldAssign(object, field, value);
+  }
+
+  Node MethodCall(Node object, string method, vector<Node> args) {
+    return flat->AddCall(object, method, args);
+  }
+
+  Node NewInstance(const Runtime::Class& cls, vector<Node> args) {
+    return flat->AddNew(cls, args);
+  }
+
+  Node Stringify(Node argument) {
+    return flat->AddStringify(argument);
+  }
+
+  Node Arithmetic(Ast::ArithmeticOp op, Node lhs, Node rhs) {
+    return flat->AddArithmetic(op, lhs, rhs);
+  }
+
+  Node Or(Node lhs, Node rhs) {
+    return flat->AddLogical(Ast::FlatKind::Or, lhs, rhs);
+  }
+
+  Node And(Node lhs, Node rhs) {
+    return flat->AddLogical(Ast::FlatKind::And, lhs, rhs);
+  }
+
+  Node Not(Node argument) {
+    return flat->AddNot(argument);
+  }
+
+  Node Comparison(Ast::Comparison::Comparator comparator, Node lhs, Node rhs) {
+    return flat->AddCompare(std::move(comparator), lhs, rhs);
+  }
+
+  Node Compound(vector<Node> statements) {
+    return flat->AddCompound(statements);
+  }
+
+  // return obj.method(...) in a method is a tail call, as MarkTailCalls makes it
+  Node Return(Node value, bool in_method) {
+    if (tail_calls && in_method && flat->Kind(value) == Ast::FlatKind::Call) {
+      return flat->ReturnCall(value);
+    }
+    return flat->AddReturn(value);
+  }
+
+  Node Print(vector<Node> args) {
+    return flat->AddPrint(args);
+  }
+
+  Node IfElse(Node condition, Node if_body, optional<Node> else_body) {
+    return flat->AddIfElse(condition, if_body, else_body);
+  }
+
+  // The bodies of the methods were appended since start
+  Node ClassDefinition(ObjectHolder cls, size_t start) {
+    return flat->AddClassDef(std::move(cls), static_cast<uint32_t>(start));
+  }
+
+  unique_ptr<Ast::Statement> Body(Node body) {
+    return make_unique<Ast::FlatRoot>(nullptr, flat, body);
+  }
+
+private:
+  shared_ptr<Ast::FlatTree> flat;
+  bool tail_calls;
+};
+
+// Makes nothing, the syntax is only checked
+class CheckBuilder {
+public:
+  struct Node {};
+
+  size_t Position() const {
+    return 0;
+  }
+
+  Node Number(int) {
+    return {};
+  }
+
+  Node String(string) {
+    return {};
+  }
+
+  Node Bool(bool) {
+    return {};
+  }
+
+  Node None() {
+    return {};
+  }
+
+  Node Variable(vector<string>) {
+    return {};
+  }
+
+  Node Assignment(string, Node) {
+    return {};
+  }
+
+  Node FieldAssignment(vector<string>, string, Node) {
+    return {};
+  }
+
+  Node MethodCall(Node, string, vector<Node>) {
+    return {};
+  }
+
+  Node NewInstance(const Runtime::Class&, vector<Node>) {
+    return {};
+  }
+
+  Node Stringify(Node) {
+    return {};
+  }
+
+  Node Arithmetic(Ast::ArithmeticOp, Node, Node) {
+    return {};
+  }
+
+  Node Or(Node, Node) {
+    return {};
+  }
+
+  Node And(Node, Node) {
+    return {};
+  }
+
+  Node Not(Node) {
+    return {};
+  }
+
+  Node Comparison(Ast::Comparison::Comparator, Node, Node) {
+    return {};
+  }
+
+  Node Compound(vector<Node>) {
+    return {};
+  }
+
+  Node Return(Node, bool) {
+    return {};
+  }
+
+  Node Print(vector<Node>) {
+    return {};
+  }
+
+  Node IfElse(Node, Node, optional<Node>) {
+    return {};
+  }
+
+  Node ClassDefinition(ObjectHolder, size_t) {
+    return {};
+  }
+
+  unique_ptr<Ast::Statement> Body(Node) {
+    return nullptr;
+  }
+};
+
+// The classes of a program in the order of their definitions, not owned
+struct ClassOrder {
+  vector<ObjectHolder> classes;
+  // The position of each class by its name, no two classes of a program share one
+  unordered_map<string, size_t> positions;
+
+  void Add(ObjectHolder cls) {
+    positions.emplace(cls.TryAs<Runtime::Class>()->GetName(), classes.size());
+    classes.push_back(std::move(cls));
+  }
+};
+
+// A method body kept as its lines, the first classes of the order are those
+// declared before it
+unique_ptr<Ast::Statement> MakeLazyBody(
+  Parse::SourceBlock block, shared_ptr<const ClassOrder> classes, size_t class_count, BodyPass prepare
+);
+
+// The grammar, the Builder makes what it is parsed into. Nodes are made
+// children first and left to right, in the order of the source
+template <typename Builder>
 class Parser {
 public:
-  explicit Parser(Parse::Lexer& lexer) : lexer(lexer) {
+  using Node = typename Builder::Node;
+
+  // The classes of outer_classes are known as well, they were declared before
+  // the lines the lexer reads
+  Parser(Parse::Lexer& lexer, Builder& builder, const Runtime::Closure* outer_classes = nullptr)
+    : lexer(lexer), builder(builder), outer_classes(outer_classes) {
+  }
+
+  // The first class_count classes of the order are known as well
+  Parser(Parse::Lexer& lexer, Builder& builder, const ClassOrder& outer_order, size_t class_count)
+    : lexer(lexer), builder(builder), outer_classes(nullptr), outer_order(&outer_order), outer_count(class_count) {
+  }
+
+  // Method bodies are passed over and parsed on their first calls (see MethodBodies)
+  void ParseBodiesLazily(bool validate, BodyPass prepare) {
+    lazy_bodies = true;
+    validate_bodies = validate;
+    prepare_body = std::move(prepare);
+    class_order = make_shared<ClassOrder>();
+  }
+
+  // The classes parsed, the nested ones too, in the order of their definitions.
+  // Kept when the method bodies are parsed lazily only
+  ClassOrder& ClassesInOrder() {
+    return *class_order;
+  }
+
+  // Throws the first syntax error of the bodies passed over so far, they are
+  // checked as those of MethodBodies::LazyValidated
+  void CheckSkippedBodies() {
+    for (const auto& block : skipped_bodies) {
+      CheckBody(block);
+    }
   }
 
   // Program -> eps
   //          | Statement \n Program
   unique_ptr<Ast::Statement> ParseProgram() {
-    auto result = make_unique<Ast::Compound>();
+    vector<Node> statements;
     while (!lexer.CurrentToken().Is<TokenType::Eof>()) {
-      result->AddStatement(ParseStatement());
+      statements.push_back(ParseStatement());
     }
 
-    return result;
+    return builder.Body(builder.Compound(std::move(statements)));
+  }
+
+  // The next statement of the program, nullopt at its end
+  optional<Node> ParseNextStatement() {
+    if (lexer.CurrentToken().Is<TokenType::Eof>()) {
+      return nullopt;
+    }
+    return ParseStatement();
+  }
+
+  // The classes defined by what has been parsed
+  const Runtime::Closure& DeclaredClasses() const {
+    return declared_classes;
+  }
+
+  // The names looked up among the outer classes, found there or not. What
+  // has been parsed depends on no other outer class
+  const unordered_set<string>& OuterLookups() const {
+    return outer_lookups;
+  }
+
+  // Block -> INDENT{indent} Indented, the lines passed over by Lexer::SkipBlock
+  Node ParseBlock(int indent) {
+    for (int i = 0; i < indent; ++i) {
+      lexer.Expect<TokenType::Indent>();
+      lexer.NextToken();
+    }
+    return ParseIndented();
   }
 
 private:
   Parse::Lexer& lexer;
+  Builder& builder;
   Runtime::Closure declared_classes;
+  const Runtime::Closure* outer_classes;
+  unordered_set<string> outer_lookups;
+  const ClassOrder* outer_order = nullptr;
+  size_t outer_count = 0;
+
+  bool lazy_bodies = false;
+  bool validate_bodies = false;
+  BodyPass prepare_body;
+  shared_ptr<ClassOrder> class_order;
+  vector<Parse::SourceBlock> skipped_bodies;
+  // Of the method bodies being parsed, nested in one another
+  int method_depth = 0;
+  // The depth of the expression parsed last, and the parentheses open around it
+  size_t expression_depth = 0;
+  size_t open_parens = 0;
+
+  // The depth of a node over operands, thrown at before the node is made
+  void SetExpressionDepth(size_t depth) {
+    if (depth + open_parens > MAX_EXPRESSION_DEPTH) {
+      throw ParseError("Expression nested deeper than " + to_string(MAX_EXPRESSION_DEPTH) + " levels");
+    }
+    expression_depth = depth;
+  }
 
-  // Suite -> NEWLINE INDENT (Statement)+ DEDENT
-  unique_ptr<Ast::Statement> ParseSuite() {
+  // Parses inside parentheses, which are not followed deeper than the tree may go
+  template <typename ParseInside>
+  auto ParseInParentheses(ParseInside parse_inside) {
+    SetExpressionDepth(1);
+    ++open_parens;
+    auto result = parse_inside();
+    --open_parens;
+    SetExpressionDepth(expression_depth + 1);
+    return result;
+  }
+
+  const Runtime::Class* FindClass(const string& name) {
+    if (auto it = declared_classes.find(name); it != declared_classes.end()) {
+      return static_cast<const Runtime::Class*>(it->second.Get());
+    }
+    return FindOuterClass(name);
+  }
+
+  const Runtime::Class* FindOuterClass(const string& name) {
+    if (outer_order) {
+      auto it = outer_order->positions.find(name);
+      return it != outer_order->positions.end() && it->second < outer_count
+        ? outer_order->classes[it->second].TryAs<Runtime::Class>()
+        : nullptr;
+    }
+    if (!outer_classes) {
+      return nullptr;
+    }
+    outer_lookups.insert(name);
+    auto it = outer_classes->find(name);
+    return it != outer_classes->end() ? static_cast<const Runtime::Class*>(it->second.Get()) : nullptr;
+  }
+
+  // Suite -> NEWLINE Indented
+  Node ParseSuite() {
     lexer.Expect<TokenType::Newline>();
-    lexer.ExpectNext<TokenType::Indent>();
+    lexer.NextToken();
+    return ParseIndented();
+  }
 
+  // Indented -> INDENT (Statement)+ DEDENT
+  Node ParseIndented() {
+    lexer.Expect<TokenType::Indent>();
     lexer.NextToken();
 
-    auto result = make_unique<Ast::Compound>();
+    vector<Node> statements;
     while (!lexer.CurrentToken().Is<TokenType::Dedent>()) {
-      result->AddStatement(ParseStatement());
+      statements.push_back(ParseStatement());
     }
 
     lexer.Expect<TokenType::Dedent>();
     lexer.NextToken();
 
-    return result;
+    return builder.Compound(std::move(statements));
   }
 
   // Methods -> [def id(Params) : Suite]*
@@ -82,17 +544,34 @@ private:
 
       lexer.Expect<TokenType::Char>(')');
       lexer.ExpectNext<TokenType::Char>(':');
-      lexer.NextToken();
 
-      m.body = ParseSuite();
+      if (auto block = lazy_bodies ? lexer.SkipBlock() : nullopt) {
+        if (validate_bodies) {
+          CheckBody(*block);
+        }
+        skipped_bodies.push_back(*block);
+        m.body = MakeLazyBody(*block, class_order, class_order->classes.size(), prepare_body);
+      } else {
+        lexer.NextToken();
+        ++method_depth;
+        m.body = builder.Body(ParseSuite());
+        --method_depth;
+      }
 
       result.push_back(std::move(m));
     }
     return result;
   }
 
+  // The errors of the body are thrown at load, no tree is built
+  void CheckBody(const Parse::SourceBlock& block) {
+    Parse::Lexer body_lexer(block.text, block.kind, block.first_line);
+    CheckBuilder checker;
+    Parser<CheckBuilder>(body_lexer, checker, &declared_classes).ParseBlock(block.indent);
+  }
+
   // ClassDefinition -> Id ['(' Id ')'] : new_line indent MethodList dedent
-  unique_ptr<Ast::Statement> ParseClassDefinition() {
+  Node ParseClassDefinition(size_t start) {
     string class_name = lexer.Expect<TokenType::Id>().value;
 
     lexer.NextToken();
@@ -103,10 +582,9 @@ private:
       lexer.ExpectNext<TokenType::Char>(')');
       lexer.NextToken();
 
-      if (auto it = declared_classes.find(name); it == declared_classes.end()) {
+      base_class = FindClass(name);
+      if (!base_class) {
         throw ParseError("Base class " + name + " not found for class " + class_name);
-      } else {
-        base_class = static_cast<const Runtime::Class*>(it->second.Get());
       }
     }
 
@@ -124,11 +602,14 @@ private:
       ObjectHolder::Own(Runtime::Class(class_name, std::move(methods), base_class))
     });
 
-    if (!inserted) {
+    if (!inserted || FindOuterClass(class_name)) {
       throw ParseError("Class " + class_name + " already exists");
     }
+    if (class_order) {
+      class_order->Add(ObjectHolder::Share(*it->second));
+    }
 
-    return make_unique<Ast::ClassDefinition>(it->second);
+    return builder.ClassDefinition(it->second, start);
   }
 
   vector<string> ParseDottedIds() {
@@ -143,7 +624,7 @@ private:
 
   //  AssgnOrCall -> DottedIds = Expr
   //               | DottedIds '(' ExprList ')'
-  unique_ptr<Ast::Statement> ParseAssignmentOrCall() {
+  Node ParseAssignmentOrCall() {
     lexer.Expect<TokenType::Id>();
 
     vector<string> id_list = ParseDottedIds();
@@ -154,11 +635,9 @@ private:
       lexer.NextToken();
 
       if (id_list.empty()) {
-        return make_unique<Ast::Assignment>(std::move(last_name), ParseTest());
+        return builder.Assignment(std::move(last_name), ParseTest());
       } else {
-        return make_unique<Ast::FieldAssignment>(
-          Ast::VariableValue{std::move(id_list)}, std::move(last_name), ParseTest()
-        );
+        return builder.FieldAssignment(std::move(id_list), std::move(last_name), ParseTest());
       }
     } else {
       lexer.Expect<TokenType::Char>('(');
@@ -168,145 +647,230 @@ private:
         throw ParseError("Mython doesn't support functions, only methods: " + last_name);
       }
 
+      auto object = builder.Variable(std::move(id_list));
 
-      vector<unique_ptr<Ast::Statement>> args;
+      vector<Node> args;
       if (lexer.CurrentToken() != ')') {
         args = ParseTestList();
       }
       lexer.Expect<TokenType::Char>(')');
       lexer.NextToken();
 
-      return make_unique<Ast::MethodCall>(
-        make_unique<Ast::VariableValue>(std::move(id_list)),
-        std::move(last_name),
-        std::move(args)
-      );
+      return builder.MethodCall(std::move(object), std::move(last_name), std::move(args));
     }
   }
 
-  // Expr -> Adder ['+'/'-' Adder]*
-  unique_ptr<Ast::Statement> ParseExpression() {
-    unique_ptr<Ast::Statement> result = ParseAdder();
-    while (lexer.CurrentToken() == '+' || lexer.CurrentToken() == '-') {
-      char op = lexer.CurrentToken().As<TokenType::Char>().value;
-      lexer.NextToken();
-
-      if (op == '+') {
-        result = make_unique<Ast::Add>(std::move(result), ParseAdder());
-      } else {
-        result = make_unique<Ast::Sub>(std::move(result), ParseAdder());
+  // The binary operators by their precedence, each one binds tighter than
+  // the ones above it. Or, And and the arithmetic are left associative,
+  // a comparison can not be an operand of another one
+  enum class Level {
+    Or = 1,
+    And,
+    // The operand of NOT
+    Not,
+    Comparison,
+    Sum,
+    Product,
+  };
+
+  struct BinaryOperator {
+    Level level;
+    Ast::ArithmeticOp arithmetic = Ast::ArithmeticOp::Add;
+    bool (*comparator)(Runtime::ObjectHolder, Runtime::ObjectHolder) = nullptr;
+  };
+
+  static optional<BinaryOperator> FindBinaryOperator(const Parse::Token& token) {
+    if (auto c = token.TryAs<TokenType::Char>()) {
+      switch (c->value) {
+      case '+':
+        return BinaryOperator{Level::Sum, Ast::ArithmeticOp::Add};
+      case '-':
+        return BinaryOperator{Level::Sum, Ast::ArithmeticOp::Sub};
+      case '*':
+        return BinaryOperator{Level::Product, Ast::ArithmeticOp::Mult};
+      case '/':
+        return BinaryOperator{Level::Product, Ast::ArithmeticOp::Div};
+      case '<':
+        return BinaryOperator{Level::Comparison, {}, Runtime::Less};
+      case '>':
+        return BinaryOperator{Level::Comparison, {}, Runtime::Greater};
+      default:
+        return nullopt;
       }
+    } else if (token.Is<TokenType::Or>()) {
+      return BinaryOperator{Level::Or};
+    } else if (token.Is<TokenType::And>()) {
+      return BinaryOperator{Level::And};
+    } else if (token.Is<TokenType::Eq>()) {
+      return BinaryOperator{Level::Comparison, {}, Runtime::Equal};
+    } else if (token.Is<TokenType::NotEq>()) {
+      return BinaryOperator{Level::Comparison, {}, Runtime::NotEqual};
+    } else if (token.Is<TokenType::LessOrEq>()) {
+      return BinaryOperator{Level::Comparison, {}, Runtime::LessOrEqual};
+    } else if (token.Is<TokenType::GreaterOrEq>()) {
+      return BinaryOperator{Level::Comparison, {}, Runtime::GreaterOrEqual};
     }
-    return result;
+    return nullopt;
   }
 
-  // Adder -> Mult ['*'/'/' Mult]*
-  unique_ptr<Ast::Statement> ParseAdder() {
-    unique_ptr<Ast::Statement> result = ParseMult();
-    while (lexer.CurrentToken() == '*' || lexer.CurrentToken() == '/') {
-      char op = lexer.CurrentToken().As<TokenType::Char>().value;
+  Node MakeBinary(const BinaryOperator& op, Node lhs, Node rhs) {
+    switch (op.level) {
+    case Level::Or:
+      return builder.Or(std::move(lhs), std::move(rhs));
+    case Level::And:
+      return builder.And(std::move(lhs), std::move(rhs));
+    case Level::Comparison:
+      return builder.Comparison(op.comparator, std::move(lhs), std::move(rhs));
+    default:
+      return builder.Arithmetic(op.arithmetic, std::move(lhs), std::move(rhs));
+    }
+  }
+
+  // LogicalExpr -> Operand [BINARY_OP Operand]*
+  //
+  // Precedence climbing: the operators of the level and the tighter ones are
+  // folded in a loop, a call is made only for the right operand of a tighter
+  // operator. So a literal costs two calls and a long chain of terms no stack
+  Node ParseBinary(Level min_level) {
+    // Only the arithmetic is compared. The operand of NOT took the comparison
+    // after it, an operator of a lower level took it in its right operand
+    bool comparable = !(min_level <= Level::Not && lexer.CurrentToken().Is<TokenType::Not>());
+    Node result = ParseUnary(min_level);
+    while (auto op = FindBinaryOperator(lexer.CurrentToken())) {
+      if (op->level < min_level || (op->level == Level::Comparison && !comparable)) {
+        break;
+      }
+      comparable = comparable && op->level > Level::Comparison;
       lexer.NextToken();
+      size_t lhs_depth = expression_depth;
+      // Left associative: the right operand takes only the tighter operators
+      Node rhs = ParseBinary(static_cast<Level>(static_cast<int>(op->level) + 1));
+      SetExpressionDepth(max(lhs_depth, expression_depth) + 1);
+      result = MakeBinary(*op, std::move(result), std::move(rhs));
+    }
+    return result;
+  }
 
-      if (op == '*') {
-        result = make_unique<Ast::Mult>(std::move(result), ParseMult());
-      } else {
-        result = make_unique<Ast::Div>(std::move(result), ParseMult());
+  // Operand -> NOT LogicalExpr of the operators tighter than AND, where the
+  //            operators above allow it
+  //          | ['-']* Primary
+  Node ParseUnary(Level min_level) {
+    if (min_level <= Level::Not && lexer.CurrentToken().Is<TokenType::Not>()) {
+      size_t count = 0;
+      for (; lexer.CurrentToken().Is<TokenType::Not>(); lexer.NextToken()) {
+        ++count;
+      }
+      Node result = ParseBinary(Level::Not);
+      SetExpressionDepth(expression_depth + count);
+      for (size_t i = 0; i < count; ++i) {
+        result = builder.Not(std::move(result));
       }
+      return result;
+    }
+
+    size_t negations = 0;
+    for (; lexer.CurrentToken() == '-'; lexer.NextToken()) {
+      ++negations;
+    }
+    Node result = ParsePrimary();
+    SetExpressionDepth(expression_depth + negations);
+    for (size_t i = 0; i < negations; ++i) {
+      result = builder.Arithmetic(Ast::ArithmeticOp::Mult, std::move(result), builder.Number(-1));
     }
     return result;
   }
 
-  // Mult -> '(' Expr ')'
-  //       | NUMBER
-  //       | '-' Mult
-  //       | STRING
-  //       | NONE
-  //       | TRUE
-  //       | FALSE
-  //       | DottedIds '(' ExprList ')'
-  //       | DottedIds
-  unique_ptr<Ast::Statement> ParseMult() {
+  // Primary -> '(' LogicalExpr ')'
+  //          | NUMBER
+  //          | STRING
+  //          | NONE
+  //          | TRUE
+  //          | FALSE
+  //          | DottedIds '(' ExprList ')'
+  //          | DottedIds
+  Node ParsePrimary() {
     if (lexer.CurrentToken() == '(') {
       lexer.NextToken();
-      auto result = ParseTest();
+      auto result = ParseInParentheses([this] { return ParseTest(); });
       lexer.Expect<TokenType::Char>(')');
       lexer.NextToken();
       return result;
-    } else if (lexer.CurrentToken() == '-') {
-      lexer.NextToken();
-      return make_unique<Ast::Mult>(
-        ParseMult(),
-        make_unique<Ast::NumericConst>(-1)
-      );
-    } else if (auto num = lexer.CurrentToken().TryAs<TokenType::Number>()) {
+    }
+    // The depth of a primary which is not in parentheses
+    SetExpressionDepth(1);
+    if (auto num = lexer.CurrentToken().TryAs<TokenType::Number>()) {
       int result = num->value;
       lexer.NextToken();
-      return make_unique<Ast::NumericConst>(result);
+      return builder.Number(result);
     } else if (auto str = lexer.CurrentToken().TryAs<TokenType::String>()) {
       string result = str->value;
       lexer.NextToken();
-      return make_unique<Ast::StringConst>(std::move(result));
+      return builder.String(std::move(result));
     } else if (lexer.CurrentToken().Is<TokenType::True>()) {
       lexer.NextToken();
-      return make_unique<Ast::BoolConst>(Runtime::Bool(true));
+      return builder.Bool(true);
     } else if (lexer.CurrentToken().Is<TokenType::False>()) {
       lexer.NextToken();
-      return make_unique<Ast::BoolConst>(Runtime::Bool(false));
+      return builder.Bool(false);
     } else if (lexer.CurrentToken().Is<TokenType::None>()) {
       lexer.NextToken();
-      return make_unique<Ast::None>();
+      return builder.None();
     } else {
       vector<string> names = ParseDottedIds();
 
       if (lexer.CurrentToken() == '(') {
         // various calls
-        vector<unique_ptr<Ast::Statement>> args;
+        auto method_name = names.back();
+        names.pop_back();
+
+        // The object goes before the arguments
+        optional<Node> object;
+        if (!names.empty()) {
+          object = builder.Variable(std::move(names));
+        }
+
+        vector<Node> args;
         if (lexer.NextToken() != ')') {
-          args = ParseTestList();
+          args = ParseInParentheses([this] { return ParseTestList(); });
         }
         lexer.Expect<TokenType::Char>(')');
         lexer.NextToken();
 
-        auto method_name = names.back();
-        names.pop_back();
-
-        if (!names.empty()) {
-          return make_unique<Ast::MethodCall>(
-            make_unique<Ast::VariableValue>(std::move(names)),
-            std::move(method_name),
-            std::move(args)
-          );
-        } else if (auto it = declared_classes.find(method_name); it != end(declared_classes)) {
-          return make_unique<Ast::NewInstance>(
-            static_cast<const Runtime::Class&>(*it->second), std::move(args)
-          );
+        if (object) {
+          return builder.MethodCall(std::move(*object), std::move(method_name), std::move(args));
+        } else if (auto cls = FindClass(method_name)) {
+          return builder.NewInstance(*cls, std::move(args));
         } else if (method_name == "str") {
           if (args.size() != 1) {
             throw ParseError("Function str takes exactly one argument");
           }
-          return make_unique<Ast::Stringify>(std::move(args.front()));
+          return builder.Stringify(std::move(args.front()));
         } else {
           throw ParseError("Unknown call to " + method_name + "()");
         }
       } else {
-        return make_unique<Ast::VariableValue>(std::move(names));
+        return builder.Variable(std::move(names));
       }
     }
   }
 
-  vector<unique_ptr<Ast::Statement>> ParseTestList() {
-    vector<unique_ptr<Ast::Statement>> result;
+  // The depth is that of the deepest expression of the list
+  vector<Node> ParseTestList() {
+    vector<Node> result;
     result.push_back(ParseTest());
+    size_t depth = expression_depth;
 
     while (lexer.CurrentToken() == ',') {
       lexer.NextToken();
       result.push_back(ParseTest());
+      depth = max(depth, expression_depth);
     }
+    expression_depth = depth;
     return result;
   }
 
   // Condition -> if LogicalExpr: Suite [else: Suite]
-  unique_ptr<Ast::Statement> ParseCondition() {
+  Node ParseCondition() {
     lexer.Expect<TokenType::If>();
     lexer.NextToken();
 
@@ -317,85 +881,30 @@ private:
 
     auto if_body = ParseSuite();
 
-    unique_ptr<Ast::Statement> else_body;
+    optional<Node> else_body;
     if (lexer.CurrentToken().Is<TokenType::Else>()) {
       lexer.ExpectNext<TokenType::Char>(':');
       lexer.NextToken();
       else_body = ParseSuite();
     }
 
-    return make_unique<Ast::IfElse>(std::move(condition), std::move(if_body), std::move(else_body));
+    return builder.IfElse(std::move(condition), std::move(if_body), std::move(else_body));
   }
 
-  // LogicalExpr -> AndTest [OR AndTest]
-  // AndTest -> NotTest [AND NotTest]
-  // NotTest -> [NOT] NotTest
-  //          | Comparison
-  unique_ptr<Ast::Statement> ParseTest() {
-    auto result = ParseAndTest();
-    while (lexer.CurrentToken().Is<TokenType::Or>()) {
-      lexer.NextToken();
-      result = make_unique<Ast::Or>(std::move(result), ParseAndTest());
-    }
-    return result;
-  }
-
-  unique_ptr<Ast::Statement> ParseAndTest() {
-    auto result = ParseNotTest();
-    while (lexer.CurrentToken().Is<TokenType::And>()) {
-      lexer.NextToken();
-      result = make_unique<Ast::And>(std::move(result), ParseNotTest());
-    }
-    return result;
-  }
-
-  unique_ptr<Ast::Statement> ParseNotTest() {
-    if (lexer.CurrentToken().Is<TokenType::Not>()) {
-      lexer.NextToken();
-      return make_unique<Ast::Not>(ParseNotTest());
-    } else {
-      return ParseComparison();
-    }
-  }
-
-  // Comparison -> Expr [COMP_OP Expr]
-  unique_ptr<Ast::Statement> ParseComparison() {
-    auto result = ParseExpression();
-
-    const auto tok = lexer.CurrentToken();
-
-    if (tok == '<') {
-      lexer.NextToken();
-      return make_unique<Ast::Comparison>(Runtime::Less, std::move(result), ParseExpression());
-    } else if (tok == '>') {
-      lexer.NextToken();
-      return make_unique<Ast::Comparison>(Runtime::Greater, std::move(result), ParseExpression());
-    } else if (tok.Is<TokenType::Eq>()) {
-      lexer.NextToken();
-      return make_unique<Ast::Comparison>(Runtime::Equal, std::move(result), ParseExpression());
-    } else if (tok.Is<TokenType::NotEq>()) {
-      lexer.NextToken();
-      return make_unique<Ast::Comparison>(Runtime::NotEqual, std::move(result), ParseExpression());
-    } else if (tok.Is<TokenType::LessOrEq>()) {
-      lexer.NextToken();
-      return make_unique<Ast::Comparison>(Runtime::LessOrEqual, std::move(result), ParseExpression());
-    } else if (tok.Is<TokenType::GreaterOrEq>()) {
-      lexer.NextToken();
-      return make_unique<Ast::Comparison>(Runtime::GreaterOrEqual, std::move(result), ParseExpression());
-    } else {
-      return result;
-    }
+  Node ParseTest() {
+    return ParseBinary(Level::Or);
   }
 
   //Statement -> SimpleStatement Newline
   //           | class ClassDefinition
   //           | if Condition
-  unique_ptr<Ast::Statement> ParseStatement() {
+  Node ParseStatement() {
     const auto& tok = lexer.CurrentToken();
 
     if (tok.Is<TokenType::Class>()) {
+      auto start = builder.Position();
       lexer.NextToken();
-      return ParseClassDefinition();
+      return ParseClassDefinition(start);
     } else if (tok.Is<TokenType::If>()) {
       return ParseCondition();
     } else {
@@ -409,25 +918,342 @@ private:
   //StatementBody -> return Expression
   //               | print ExpressionList
   //               | AssignmentOrCall
-  unique_ptr<Ast::Statement> ParseSimpleStatement() {
+  Node ParseSimpleStatement() {
     const auto& tok = lexer.CurrentToken();
 
     if (tok.Is<TokenType::Return>()) {
       lexer.NextToken();
-      return make_unique<Ast::Return>(ParseTest());
+      return builder.Return(ParseTest(), method_depth > 0);
     } else if (tok.Is<TokenType::Print>()) {
       lexer.NextToken();
-      vector<unique_ptr<Ast::Statement>> args;
+      vector<Node> args;
       if (!lexer.CurrentToken().Is<TokenType::Newline>()) {
         args = ParseTestList();
       }
-      return make_unique<Ast::Print>(std::move(args));
+      return builder.Print(std::move(args));
     } else {
       return ParseAssignmentOrCall();
     }
   }
 };
 
-unique_ptr<Ast::Statement> ParseProgram(Parse::Lexer& lexer) {
-  return Parser{lexer}.ParseProgram();
+// LazyMethodBody
+//
+class LazyMethodBody : public Ast::Statement {
+public:
+  LazyMethodBody(Parse::SourceBlock block, shared_ptr<const ClassOrder> classes, size_t class_count, BodyPass prepare)
+    : block(block), classes(std::move(classes)), class_count(class_count), prepare(std::move(prepare)) {
+  }
+
+  Ast::Result Execute(Runtime::Closure& closure) override {
+    if (!body) {
+      Parse();
+    }
+    return body->Execute(closure);
+  }
+
+  void ForEachChild(const Ast::ChildVisitor& visitor) override {
+    if (body) {
+      visitor(body);
+    }
+  }
+
+  // The tree of the body, parsed and prepared now if it has not been
+  unique_ptr<Ast::Statement> TakeBody() {
+    if (!body) {
+      Parse();
+    }
+    return std::move(body);
+  }
+
+  int FirstLine() const {
+    return block.first_line;
+  }
+
+private:
+  void Parse() {
+    Parse::Lexer lexer(block.text, block.kind, block.first_line);
+    TreeBuilder builder;
+    auto parsed = Parser<TreeBuilder>(lexer, builder, *classes, class_count).ParseBlock(block.indent);
+    if (prepare) {
+      prepare(parsed);
+    }
+    body = std::move(parsed);
+  }
+
+  Parse::SourceBlock block;
+  shared_ptr<const ClassOrder> classes;
+  size_t class_count;
+  BodyPass prepare;
+  unique_ptr<Ast::Statement> body;
+};
+
+unique_ptr<Ast::Statement> MakeLazyBody(
+  Parse::SourceBlock block, shared_ptr<const ClassOrder> classes, size_t class_count, BodyPass prepare
+) {
+  return make_unique<LazyMethodBody>(block, std::move(classes), class_count, std::move(prepare));
+}
+
+// Parses the lazy bodies of the classes on the threads, which apply the pass to
+// them and to the other bodies as well. Every class has been declared, a body
+// sees those declared before it. The error of the first body in the source is
+// thrown
+void PrepareBodiesInParallel(ClassOrder& order, const BodyPass& prepare, size_t threads) {
+  vector<unique_ptr<Ast::Statement>*> bodies;
+  vector<unique_ptr<Ast::Statement>*> parsed_bodies;
+  for (auto& cls : order.classes) {
+    for (auto& method : cls.TryAs<Runtime::Class>()->Methods()) {
+      (method.body->TryAs<LazyMethodBody>() ? bodies : parsed_bodies).push_back(&method.body);
+    }
+  }
+  // Nested classes are ordered by their ends, their bodies not by their lines
+  sort(bodies.begin(), bodies.end(), [](const unique_ptr<Ast::Statement>* lhs, const unique_ptr<Ast::Statement>* rhs) {
+    return (*lhs)->TryAs<LazyMethodBody>()->FirstLine() < (*rhs)->TryAs<LazyMethodBody>()->FirstLine();
+  });
+  bodies.insert(bodies.end(), parsed_bodies.begin(), parsed_bodies.end());
+
+  ParallelFor(bodies.size(), [&bodies, &prepare](size_t i) {
+    auto& body = *bodies[i];
+    if (auto lazy = body->TryAs<LazyMethodBody>()) {
+      body = lazy->TakeBody();
+    } else if (prepare) {
+      prepare(body);
+    }
+  }, threads);
+}
+
+// Free
+//
+unique_ptr<Ast::Statement> ParseProgram(Parse::Lexer& lexer, MethodBodies bodies, BodyPass prepare, size_t threads) {
+  TreeBuilder builder;
+  Parser<TreeBuilder> parser(lexer, builder);
+  if (bodies == MethodBodies::Eager) {
+    return parser.ParseProgram();
+  }
+  parser.ParseBodiesLazily(bodies == MethodBodies::LazyValidated, prepare);
+  if (bodies != MethodBodies::Parallel) {
+    return parser.ParseProgram();
+  }
+
+  unique_ptr<Ast::Statement> program;
+  try {
+    program = parser.ParseProgram();
+  } catch (const std::exception&) {
+    // A body passed over before the error may hold an earlier one
+    parser.CheckSkippedBodies();
+    throw;
+  }
+  PrepareBodiesInParallel(parser.ClassesInOrder(), prepare, threads);
+  return program;
+}
+
+unique_ptr<Ast::Statement> ParseFlatProgram(Parse::Lexer& lexer, bool tail_calls) {
+  FlatBuilder builder(tail_calls);
+  return Parser<FlatBuilder>(lexer, builder).ParseProgram();
+}
+
+// StatementReader
+//
+class StatementReader::Impl {
+public:
+  explicit Impl(Parse::Lexer& lexer)
+    : parser(lexer, builder)
+  {
+  }
+
+  unique_ptr<Ast::Statement> Next() {
+    auto statement = parser.ParseNextStatement();
+    return statement ? std::move(*statement) : nullptr;
+  }
+
+private:
+  TreeBuilder builder;
+  Parser<TreeBuilder> parser;
+};
+
+StatementReader::StatementReader(Parse::Lexer& lexer)
+  : impl(make_unique<Impl>(lexer))
+{
+}
+
+StatementReader::~StatementReader() = default;
+
+unique_ptr<Ast::Statement> StatementReader::Next() {
+  return impl->Next();
+}
+
+// IncrementalProgram
+//
+class IncrementalProgram::Impl {
+public:
+  explicit Impl(string text)
+    : source(std::move(text))
+  {
+    Update({0, 0, source.Lines().size()});
+  }
+
+  const string& Source() const {
+    return source.Text();
+  }
+
+  EditStats Edit(size_t offset, size_t count, string_view replacement) {
+    return Update(source.Edit(offset, count, replacement));
+  }
+
+  vector<Ast::Statement*> Statements() const {
+    vector<Ast::Statement*> result;
+    for (auto& statement : statements) {
+      if (statement.error) {
+        rethrow_exception(statement.error);
+      }
+      result.push_back(statement.tree.get());
+    }
+    return result;
+  }
+
+private:
+  // A top-level statement on the lines [first, last), the blank ones after it
+  // are not its own
+  struct Statement {
+    size_t first = 0;
+    size_t last = 0;
+    unique_ptr<Ast::Statement> tree;
+    // Defined by the statement, and those defined before which it looked up
+    Runtime::Closure classes;
+    unordered_set<string> uses;
+    exception_ptr error;
+  };
+
+  // A statement starts with a line which is not indented and does not go on
+  // with else. The lines before the first such line make a statement as well
+  vector<Statement> FindStatements() const {
+    auto& lines = source.Lines();
+    vector<Statement> result;
+    for (size_t i = 0; i < lines.size(); ++i) {
+      if (lines[i].IsBlank()) {
+        continue;
+      }
+      auto& tokens = lines[i].tokens;
+      bool goes_on = lines[i].indent > 0 || (!tokens.empty() && tokens.front().Is<TokenType::Else>());
+      if (result.empty() || !goes_on) {
+        result.emplace_back();
+        result.back().first = i;
+      }
+      result.back().last = i + 1;
+    }
+    return result;
+  }
+
+  // The tree depends on one of the classes. That of an error is made again
+  // with any class defined again
+  static bool Uses(const Statement& statement, const unordered_set<string>& classes) {
+    if (statement.error) {
+      return !classes.empty();
+    }
+    for (auto& name : statement.uses) {
+      if (classes.count(name)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The classes of the statements before it are declared
+  void ParseStatement(Statement& statement, const Runtime::Closure& classes) const {
+    auto& lines = source.Lines();
+    try {
+      Parse::Lexer lexer(lines.data() + statement.first, lines.data() + statement.last);
+      TreeBuilder builder;
+      Parser<TreeBuilder> parser(lexer, builder, &classes);
+      statement.tree = parser.ParseProgram();
+      statement.classes = parser.DeclaredClasses();
+      statement.uses = parser.OuterLookups();
+    } catch (const std::exception&) {
+      statement.error = current_exception();
+    }
+  }
+
+  EditStats Update(const Parse::LexedSource::LineEdit& edit) {
+    EditStats stats;
+    stats.lines_lexed = edit.inserted;
+
+    // A statement off the edited lines keeps its tree if its lines, moved by
+    // those the edit added or removed, are still those of a statement
+    auto moved = [&edit](size_t line) {
+      return line >= edit.first + edit.removed ? line + edit.inserted - edit.removed : line;
+    };
+    unordered_map<size_t, size_t> untouched;
+    for (size_t i = 0; i < statements.size(); ++i) {
+      if (statements[i].last <= edit.first || statements[i].first >= edit.first + edit.removed) {
+        untouched[moved(statements[i].first)] = i;
+      }
+    }
+
+    auto found = FindStatements();
+    vector<Statement*> kept(found.size(), nullptr);
+    vector<bool> reused(statements.size(), false);
+    for (size_t i = 0; i < found.size(); ++i) {
+      auto it = untouched.find(found[i].first);
+      if (it != untouched.end() && moved(statements[it->second].last) == found[i].last) {
+        kept[i] = &statements[it->second];
+        reused[it->second] = true;
+      }
+    }
+
+    // The trees made while a class was declared hold it, they are parsed
+    // again when it is defined again
+    unordered_set<string> redefined;
+    auto add_classes = [&redefined](const Statement& statement) {
+      for (auto& [name, cls] : statement.classes) {
+        redefined.insert(name);
+      }
+    };
+    for (size_t i = 0; i < statements.size(); ++i) {
+      if (!reused[i]) {
+        add_classes(statements[i]);
+      }
+    }
+
+    Runtime::Closure classes;
+    for (size_t i = 0; i < found.size(); ++i) {
+      if (kept[i] && !Uses(*kept[i], redefined)) {
+        found[i].tree = std::move(kept[i]->tree);
+        found[i].classes = std::move(kept[i]->classes);
+        found[i].uses = std::move(kept[i]->uses);
+        found[i].error = kept[i]->error;
+      } else {
+        if (kept[i]) {
+          add_classes(*kept[i]);
+        }
+        ParseStatement(found[i], classes);
+        add_classes(found[i]);
+        ++stats.statements_parsed;
+      }
+      classes.insert(found[i].classes.begin(), found[i].classes.end());
+    }
+    statements = std::move(found);
+    return stats;
+  }
+
+  Parse::LexedSource source;
+  vector<Statement> statements;
+};
+
+IncrementalProgram::IncrementalProgram(string source)
+  : impl(make_unique<Impl>(std::move(source)))
+{
+}
+
+IncrementalProgram::~IncrementalProgram() = default;
+
+const string& IncrementalProgram::Source() const {
+  return impl->Source();
+}
+
+IncrementalProgram::EditStats IncrementalProgram::Edit(size_t offset, size_t count, string_view replacement) {
+  return impl->Edit(offset, count, replacement);
+}
+
+vector<Ast::Statement*> IncrementalProgram::Statements() const {
+  return impl->Statements();
 }
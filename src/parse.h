@@ -1,7 +1,12 @@
 #pragma once
 
+#include <cstddef>
+#include <functional>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace Ast {
   class Statement;
@@ -17,6 +22,91 @@ struct ParseError : std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
-std::unique_ptr<Ast::Statement> ParseProgram(Parse::Lexer& lexer);
+// The deepest expression of a program, a ParseError is thrown for a deeper one.
+// The passes, the engines and the destructors of the trees recurse once per
+// level, so that much more would exhaust the native stack. Parentheses and the
+// arguments of a call are a level too
+const size_t MAX_EXPRESSION_DEPTH = 1000;
+
+// How ParseProgram parses the bodies of the methods
+enum class MethodBodies {
+  Eager,
+  // The lines of a body are found by their indentation at load (see
+  // Parse::Lexer::SkipBlock) and parsed by the first call of the method, which
+  // throws the syntax errors of the body. Needs a lexer reading a buffer in
+  // place, the buffer must outlive the program
+  Lazy,
+  // Lazy, but the syntax of each body is checked at load, without its tree
+  LazyValidated,
+  // The bodies are passed over as the Lazy ones, then parsed and prepared
+  // together by a pool of threads (see parallel_for.h) once the classes have
+  // been declared in the order of the source. The tree and the errors are
+  // those of Eager. Needs a lexer reading a buffer in place
+  Parallel,
+};
+
+// Applied to a lazy body when it has been parsed. With MethodBodies::Parallel it
+// is applied to every method body, on the threads of the pool: it must change
+// nothing outside the body, nor the bodies of the classes defined in it
+using BodyPass = std::function<void(std::unique_ptr<Ast::Statement>&)>;
+
+// The threads of MethodBodies::Parallel, one per core when 0
+std::unique_ptr<Ast::Statement> ParseProgram(
+  Parse::Lexer& lexer, MethodBodies bodies = MethodBodies::Eager, BodyPass prepare = {}, size_t threads = 0
+);
+
+// Parses in a single pass into a FlatTree (see flat_tree.h): the nodes are
+// appended as the parser finishes them and no tree is built, so loading takes
+// the memory of the layout only. The program and the method bodies are
+// FlatRoots without trees, the passes which rewrite trees do not see into them.
+// With tail_calls, "return obj.method(...)" in a method is laid out as a tail
+// call, the way MarkTailCalls (see tail_calls.h) rewrites the tree
+std::unique_ptr<Ast::Statement> ParseFlatProgram(Parse::Lexer& lexer, bool tail_calls = true);
+
+// Parses a program a top-level statement at a time, so that each one can run
+// as soon as it is parsed and be freed after it. The classes defined so far
+// are kept by the reader for the statements which make their instances
+class StatementReader {
+public:
+  explicit StatementReader(Parse::Lexer& lexer);
+  ~StatementReader();
+
+  // nullptr at the end of the program
+  std::unique_ptr<Ast::Statement> Next();
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+// A program kept as the tokens of each line of its source (see
+// Parse::LexedSource) and the tree of each top-level statement, for sources
+// edited while they are loaded. An edit lexes the lines it touches again and
+// parses the statements on them, and the statements after them which look up
+// a class those define. The trees of the other statements are kept
+class IncrementalProgram {
+public:
+  // What an edit lexed and parsed again
+  struct EditStats {
+    size_t lines_lexed = 0;
+    size_t statements_parsed = 0;
+  };
+
+  explicit IncrementalProgram(std::string source);
+  ~IncrementalProgram();
+
+  const std::string& Source() const;
+
+  // Replaces count characters of the source at offset with the replacement
+  EditStats Edit(size_t offset, size_t count, std::string_view replacement);
+
+  // The trees of the top-level statements in order, kept until an edit parses
+  // them again. Throws the first error of the lexer or the parser
+  std::vector<Ast::Statement*> Statements() const;
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
 
 void TestParseProgram(TestRunner& tr);
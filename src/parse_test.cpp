@@ -1,22 +1,21 @@
 #include "parse.h"
+#include "flat_tree.h"
 #include "lexer.h"
+#include "object.h"
+#include "optimizer.h"
 #include "statement.h"
+#include "test_helpers.h"
 
 #include <test_runner.h>
 
 #include <string>
 #include <sstream>
+#include <vector>
 
 using namespace std;
 
 namespace Parse {
 
-unique_ptr<Ast::Statement> ParseProgramFromString(const string& program) {
-  istringstream is(program);
-  Parse::Lexer lexer(is);
-  return ParseProgram(lexer);
-}
-
 void TestSimpleProgram() {
   const string program = R"(
 x = 4
@@ -281,7 +280,467 @@ print r, c, t1, t2
   ASSERT_EQUAL(os.str(), "Rect(10x20) Circle(52) Triangle(3, 4, 5) Wrong triangle\n");
 }
 
+string RunFlat(const string& program, Runtime::Closure& closure) {
+  istringstream is(program);
+  Parse::Lexer lexer(is);
+  auto flat = ParseFlatProgram(lexer);
+
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  flat->Execute(closure);
+  return os.str();
+}
+
+void TestSinglePassMakesNoTree() {
+  const string program = R"(
+class Shape:
+  def __init__(w):
+    self.w = w
+
+  def area():
+    return self.w * self.w
+
+class Square(Shape):
+  def __str__():
+    return 'Square(' + str(self.w) + ')'
+
+s = Square(3)
+if s.area() > 5 and not s.w == 4:
+  print s, s.area(), -s.w
+else:
+  print 'small'
+)";
+  Runtime::Closure closure;
+  ASSERT_EQUAL(RunFlat(program, closure), "Square(3) 9 -3\n");
+
+  istringstream is(program);
+  Parse::Lexer lexer(is);
+  auto flat = ParseFlatProgram(lexer);
+  ASSERT(flat->TryAs<Ast::FlatRoot>());
+  size_t children = 0;
+  flat->ForEachChild([&children](unique_ptr<Ast::Statement>&) {
+    ++children;
+  });
+  ASSERT_EQUAL(children, 0u);
+
+  auto& cls = closure.at("s").TryAs<Runtime::ClassInstance>()->GetClass();
+  ASSERT(cls.GetMethod("__str__")->body->TryAs<Ast::FlatRoot>());
+  ASSERT(cls.GetMethod("area")->body->TryAs<Ast::FlatRoot>());
+}
+
+void TestSinglePassErrors() {
+  auto parse = [](const string& program) {
+    istringstream is(program);
+    Parse::Lexer lexer(is);
+    return ParseFlatProgram(lexer);
+  };
+  ASSERT_THROWS(parse("x = y(1)\n"), ParseError);
+  ASSERT_THROWS(parse("x = str(1, 2)\n"), ParseError);
+  ASSERT_THROWS(parse("class B(A):\n  def f():\n    return 1\n"), ParseError);
+}
+
+void TestSinglePassOfLargeScript() {
+  string program = "total = 0\n";
+  for (int i = 0; i < 100000; ++i) {
+    program += "total = total + " + to_string(i % 10) + "\n";
+  }
+  program += "print total\n";
+
+  Runtime::Closure closure;
+  ASSERT_EQUAL(RunFlat(program, closure), "450000\n");
+}
+
+void TestSinglePassMakesTailCalls() {
+  const string program = R"(
+class Looper:
+  def count(n, acc):
+    if n == 0:
+      return acc
+    return self.count(n - 1, acc + 2)
+
+l = Looper()
+print l.count(1000000, 0)
+)";
+  Runtime::Closure closure;
+  ASSERT_EQUAL(RunFlat(program, closure), "2000000\n");
+
+  // The calls returned by methods only, unless they are turned off
+  const string top_level_return = program + "return l.count(1, 0)\n";
+  for (bool tail_calls : {true, false}) {
+    Parse::Lexer lexer{string_view(top_level_return)};
+    auto flat = ParseFlatProgram(lexer, tail_calls)->TryAs<Ast::FlatRoot>()->Flat();
+    size_t marked = 0, calls = 0;
+    for (uint32_t node = 0; node < flat->Size(); ++node) {
+      marked += flat->Kind(node) == Ast::FlatKind::TailCall;
+      calls += flat->Kind(node) == Ast::FlatKind::Call;
+    }
+    ASSERT_EQUAL(marked, tail_calls ? 1u : 0u);
+    ASSERT_EQUAL(calls, tail_calls ? 2u : 3u);
+  }
+}
+
+void TestOperatorPrecedence() {
+  const string program = R"(
+a = 2
+b = 3
+print 1 + a * b - 8 / a / 2, -a * b, - -a, 2 - 3 - 4, (1 + a) * b
+print not a > b, not not a, a < b or a > b and False, a + 1 == b, 1 < 2 and 3 < 2
+print a == b or not b, -(a + b) * 2 >= -10
+)";
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  Runtime::Closure closure;
+  auto tree = ParseProgramFromString(program);
+  tree->Execute(closure);
+  ASSERT_EQUAL(os.str(), "5 -6 2 -5 9\nTrue True True True False\nFalse True\n");
+
+  // A comparison is not an operand of another one, NOT takes no operand of an arithmetic
+  for (string expression : {"a < b < 1", "a == b != True", "not a < b < 1", "a or b < 1 < 2", "a == not b", "a + not b", "- not a"}) {
+    ASSERT_THROWS(ParseProgramFromString("x = " + expression + "\n"), std::exception);
+  }
+  ASSERT_DOESNT_THROW(ParseProgramFromString("x = (a < b) < 1\n"));
+}
+
+// Long chains of operators are folded in a loop
+void TestExpressionsOf100kTerms() {
+  auto count_nodes = [](const unique_ptr<Ast::Statement>& root) {
+    size_t count = 0;
+    vector<Ast::Statement*> stack = {root.get()};
+    while (!stack.empty()) {
+      auto node = stack.back();
+      stack.pop_back();
+      ++count;
+      node->ForEachChild([&stack](unique_ptr<Ast::Statement>& child) {
+        stack.push_back(child.get());
+      });
+    }
+    return count;
+  };
+  // Each operator, minus and NOT is a level, and so are parentheses
+  auto make = [](size_t levels) {
+    string sum = "x = 1", calls = "x = ";
+    for (size_t i = 1; i < levels; ++i) {
+      sum += " + 1";
+      calls += "str(";
+    }
+    return vector<string>{
+      sum,
+      calls + "a" + string(levels - 1, ')'),
+      "x = " + string(levels - 1, '-') + "a",
+      "x = " + string(levels - 1, '(') + "a" + string(levels - 1, ')'),
+    };
+  };
+
+  // The program, the assignment, the terms and the operators
+  const size_t max_terms = MAX_EXPRESSION_DEPTH;
+  ASSERT_EQUAL(count_nodes(ParseProgramFromString(make(max_terms)[0] + "\n")), 2u + max_terms + (max_terms - 1));
+  for (auto& program : make(max_terms)) {
+    ASSERT_DOESNT_THROW(ParseProgramFromString(program + "\n"));
+  }
+  for (auto& program : make(max_terms + 1)) {
+    ASSERT_THROWS(ParseProgramFromString(program + "\n"), ParseError);
+  }
+
+  // Thrown at as soon as the limit is passed, not when the whole tree is built
+  const int TERMS = 100000;
+  string nots = "x = ", mixed = "x = a";
+  for (int i = 1; i < TERMS; ++i) {
+    nots += "not ";
+    mixed += i % 3 == 0 ? " * b" : i % 3 == 1 ? " - -a" : " or not a";
+  }
+  auto programs = make(TERMS);
+  programs.push_back(nots + "a");
+  programs.push_back(mixed);
+  for (auto& program : programs) {
+    ASSERT_THROWS(ParseProgramFromString(program + "\n"), ParseError);
+    istringstream is(program + "\n");
+    Parse::Lexer lexer(is);
+    ASSERT_THROWS(ParseFlatProgram(lexer), ParseError);
+  }
+}
+
+namespace {
+
+// The output, or the text of the error
+string RunWithBodies(const string& program, MethodBodies bodies) {
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  try {
+    Parse::Lexer lexer{string_view(program)};
+    auto tree = ParseProgram(lexer, bodies);
+    Runtime::Closure closure;
+    tree->Execute(closure);
+  } catch (const std::exception& e) {
+    os << "error: " << e.what();
+  }
+  return os.str();
+}
+
+size_t CountChildren(Ast::Statement& statement) {
+  size_t children = 0;
+  statement.ForEachChild([&children](unique_ptr<Ast::Statement>&) {
+    ++children;
+  });
+  return children;
+}
+
+}
+
+void TestLazyBodiesAreParsedOnFirstCall() {
+  const string program = R"(
+class Counter:
+  def __init__():
+    self.n = 0
+
+  def broken():
+    self.n = = 1
 
+  def count(k):
+    if k > 0:
+
+      return self.count(k - 1) + 1
+    return 0
+
+c = Counter()
+print c.count(3), c.n
+)";
+  const string expected_error = "error: Expect token Id{} but got Char{=} at line 7";
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::Eager), expected_error);
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::LazyValidated), expected_error);
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::Lazy), "3 0\n");
+  // Thrown by the call, the line is that of the source
+  ASSERT_EQUAL(RunWithBodies(program + "c.broken()\n", MethodBodies::Lazy), "3 0\n" + expected_error);
+
+  Parse::Lexer lexer{string_view(program)};
+  auto tree = ParseProgram(lexer, MethodBodies::Lazy);
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  Runtime::Closure closure;
+  tree->Execute(closure);
+  auto& cls = closure.at("c").TryAs<Runtime::ClassInstance>()->GetClass();
+  ASSERT_EQUAL(CountChildren(*cls.GetMethod("count")->body), 1u);
+  ASSERT_EQUAL(CountChildren(*cls.GetMethod("broken")->body), 0u);
+}
+
+void TestLazyBodiesKeepDeclarationOrder() {
+  // A body knows the classes declared before its own
+  const string program = R"(
+class A:
+  def make():
+    return B()
+
+class B:
+  def make():
+    return A()
+
+  def __str__():
+    return 'B'
+
+b = B()
+a = b.make()
+print a.make()
+)";
+  const string expected_error = "error: Unknown call to B()";
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::Eager), expected_error);
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::LazyValidated), expected_error);
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::Lazy), expected_error);
+  ASSERT_EQUAL(RunWithBodies(program, MethodBodies::Parallel), expected_error);
+
+  const string ordered = R"(
+class A:
+  def __str__():
+    return 'A'
+
+class B(A):
+  def make():
+    if True:
+      return A()
+
+b = B()
+print b.make(), b
+)";
+  for (auto bodies : {MethodBodies::Eager, MethodBodies::Lazy, MethodBodies::LazyValidated, MethodBodies::Parallel}) {
+    ASSERT_EQUAL(RunWithBodies(ordered, bodies), "A A\n");
+  }
+
+  // A class defined in a body is declared at load
+  const string nested = R"(
+class A:
+  def define():
+    class Inner:
+      def f():
+        return 1
+    return None
+
+i = Inner()
+print i.f()
+)";
+  ASSERT_EQUAL(RunWithBodies(nested, MethodBodies::Eager), "1\n");
+  ASSERT_EQUAL(RunWithBodies(nested, MethodBodies::Lazy), "1\n");
+  ASSERT_EQUAL(RunWithBodies(nested, MethodBodies::Parallel), "1\n");
+}
+
+namespace {
+
+// Classes C0, ..., C<count - 1>, each derived from the one before it
+string ClassChain(int count) {
+  string program;
+  for (int i = 0; i < count; ++i) {
+    program += "class C" + to_string(i) + (i > 0 ? "(C" + to_string(i - 1) + ")" : "") + ":\n";
+    program += "  def f" + to_string(i) + "(x):\n";
+    program += i > 0 ? "    return self.f" + to_string(i - 1) + "(x) + 1\n" : "    return x + 2 * 3\n";
+    if (i > 0) {
+      program += "  def make():\n    return C" + to_string(i - 1) + "()\n";
+    }
+    program += "\n";
+  }
+  return program;
+}
+
+string Dump(const string& program, MethodBodies bodies, BodyPass prepare, size_t threads) {
+  Parse::Lexer lexer{string_view(program)};
+  auto tree = ParseProgram(lexer, bodies, std::move(prepare), threads);
+  Ast::OptimizeProgram(tree, bodies != MethodBodies::Parallel);
+  ostringstream os;
+  Ast::DumpTree(*tree, os);
+  return os.str();
+}
+
+string RunInParallel(const string& program, size_t threads) {
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  try {
+    Parse::Lexer lexer{string_view(program)};
+    auto tree = ParseProgram(lexer, MethodBodies::Parallel, {}, threads);
+    Runtime::Closure closure;
+    tree->Execute(closure);
+  } catch (const std::exception& e) {
+    os << "error: " << e.what();
+  }
+  return os.str();
+}
+
+}
+
+void TestParallelBodiesMatchTheEagerParse() {
+  const string program = ClassChain(40) + "c = C39()\nd = c.make()\nprint c.f39(1), d.f37(0)\n";
+  const BodyPass optimize = [](unique_ptr<Ast::Statement>& body) {
+    Ast::OptimizeMethodBody(body);
+  };
+  const string expected = Dump(program, MethodBodies::Eager, {}, 0);
+  for (size_t threads : {1, 4}) {
+    ASSERT_EQUAL(RunInParallel(program, threads), "46 43\n");
+    ASSERT_EQUAL(Dump(program, MethodBodies::Parallel, optimize, threads), expected);
+  }
+
+  // The error of the eager parse, which stops at the first one in the source
+  const string broken_body = "  def broken():\n    return = 1\n";
+  const string later_error = "x = )\n";
+  for (const string& broken : {
+    ClassChain(10) + "class Broken:\n" + broken_body + "\n" + ClassChain(30) + later_error,
+    ClassChain(10) + later_error + "class Broken:\n" + broken_body,
+    "class Broken:\n" + broken_body + "  def also():\n    if:\n      return 1\n\nprint 1\n",
+    ClassChain(3) + "class Late(Missing):\n" + broken_body,
+  }) {
+    const string expected_error = RunWithBodies(broken, MethodBodies::Eager);
+    ASSERT(expected_error.rfind("error: ", 0) == 0);
+    for (size_t threads : {1, 4}) {
+      ASSERT_EQUAL(RunInParallel(broken, threads), expected_error);
+    }
+  }
+}
+
+namespace {
+
+// The output of the statements run in order, or the text of the error
+string RunStatements(const IncrementalProgram& program) {
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  try {
+    Runtime::Closure closure;
+    for (auto statement : program.Statements()) {
+      statement->Execute(closure);
+    }
+  } catch (const std::exception& e) {
+    os << "error: " << e.what();
+  }
+  return os.str();
+}
+
+}
+
+void TestIncrementalProgramParsesEditedStatements() {
+  IncrementalProgram program(R"(
+class Shape:
+  def area():
+    return 0
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.w = w
+    self.h = h
+
+  def area():
+    return self.w * self.h
+
+r = Rect(2, 3)
+if r.area() > 5:
+  print 'big', r.area()
+else:
+  print 'small'
+
+n = 10
+print n
+)");
+  ASSERT_EQUAL(program.Statements().size(), 6u);
+  ASSERT_EQUAL(RunStatements(program), "big 6\n10\n");
+
+  // The lines of a method body, in its class only
+  auto& source = program.Source();
+  auto stats = program.Edit(source.find("return self.w * self.h"), 22, "s = self.w + self.h\n    return s");
+  ASSERT_EQUAL(stats.lines_lexed, 2u);
+  ASSERT_EQUAL(stats.statements_parsed, 2u);
+  ASSERT_EQUAL(RunStatements(program), "small\n10\n");
+
+  // A statement which names no class
+  auto kept = program.Statements();
+  stats = program.Edit(source.find("n = 10"), 6, "n = 11");
+  ASSERT_EQUAL(stats.lines_lexed, 1u);
+  ASSERT_EQUAL(stats.statements_parsed, 1u);
+  ASSERT_EQUAL(RunStatements(program), "small\n11\n");
+  ASSERT(program.Statements()[0] == kept[0]);
+  ASSERT(program.Statements()[4] != kept[4]);
+
+  // A class defined again: those which name it are parsed again, with it
+  stats = program.Edit(source.find("return 0"), 8, "return 1");
+  ASSERT_EQUAL(stats.statements_parsed, 3u);
+  ASSERT_EQUAL(RunStatements(program), "small\n11\n");
+
+  // The blank lines are of no statement, an else goes on with its if
+  stats = program.Edit(source.find("\nn = 11"), 0, "\n\n");
+  ASSERT_EQUAL(stats.statements_parsed, 0u);
+  stats = program.Edit(source.find("else:"), 0, "print 'if'\n");
+  ASSERT_EQUAL(stats.statements_parsed, 2u);
+  ASSERT_EQUAL(RunStatements(program), "error: Expect token Id{} but got Else at line 19");
+
+  // The error is that of its statement until it is edited
+  stats = program.Edit(source.find("print 'if'"), 11, "");
+  ASSERT_EQUAL(stats.statements_parsed, 1u);
+  ASSERT_EQUAL(RunStatements(program), "small\n11\n");
+  program.Edit(source.find("Shape:"), 5, "Form");
+  ASSERT_EQUAL(RunStatements(program), "error: Base class Shape not found for class Rect");
+  program.Edit(source.find("Rect(Shape)"), 11, "Rect(Form)");
+  ASSERT_EQUAL(RunStatements(program), "small\n11\n");
+
+  // Every statement is that of the source parsed as a whole
+  istringstream input(source);
+  Parse::Lexer lexer(input);
+  ostringstream os;
+  Ast::Print::SetOutputStream(os);
+  Runtime::Closure closure;
+  ParseProgram(lexer)->Execute(closure);
+  ASSERT_EQUAL(os.str(), RunStatements(program));
+}
 
 }
 
@@ -295,4 +754,14 @@ void TestParseProgram(TestRunner& tr) {
   RUN_TEST(tr, Parse::TestRecursion2);
   RUN_TEST(tr, Parse::TestComplexLogicalExpression);
   RUN_TEST(tr, Parse::TestClassicalPolymorphism);
+  RUN_TEST(tr, Parse::TestSinglePassMakesNoTree);
+  RUN_TEST(tr, Parse::TestSinglePassErrors);
+  RUN_TEST(tr, Parse::TestSinglePassOfLargeScript);
+  RUN_TEST(tr, Parse::TestSinglePassMakesTailCalls);
+  RUN_TEST(tr, Parse::TestOperatorPrecedence);
+  RUN_TEST(tr, Parse::TestExpressionsOf100kTerms);
+  RUN_TEST(tr, Parse::TestLazyBodiesAreParsedOnFirstCall);
+  RUN_TEST(tr, Parse::TestLazyBodiesKeepDeclarationOrder);
+  RUN_TEST(tr, Parse::TestParallelBodiesMatchTheEagerParse);
+  RUN_TEST(tr, Parse::TestIncrementalProgramParsesEditedStatements);
 }
@@ -0,0 +1,502 @@
+#include "profile.h"
+#include "object.h"
+
+#include <algorithm>
+#include <functional>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    const char* MAGIC = "mython-profile";
+
+    using IType = Runtime::IObject::Type;
+
+    TypeSet TypeOf(const ObjectHolder& holder)
+    {
+        if (!holder)
+            return NONE_TYPE;
+
+        switch (holder.GetType())
+        {
+            case IType::Number:
+                return NUMBER_TYPE;
+            case IType::String:
+                return STRING_TYPE;
+            case IType::Bool:
+                return BOOL_TYPE;
+            case IType::None:
+                return NONE_TYPE;
+            case IType::Instance:
+                return INSTANCE_TYPE;
+            case IType::Class:
+                return CLASS_TYPE;
+            default:
+                return ANY_TYPE;
+        }
+    }
+
+    bool Is(const ObjectHolder& holder, IType type)
+    {
+        return holder && holder.GetType() == type;
+    }
+
+    template <typename T>
+    const T& ValueOf(const ObjectHolder& holder)
+    {
+        return static_cast<const T&>(*holder);
+    }
+
+    std::optional<SiteKind> KindOf(Statement& st)
+    {
+        if (st.TryAs<Add>())
+            return SiteKind::Add;
+        if (st.TryAs<Comparison>())
+            return SiteKind::Comparison;
+        if (st.TryAs<MethodCall>())
+            return SiteKind::MethodCall;
+        if (st.TryAs<IfElse>())
+            return SiteKind::IfElse;
+        return std::nullopt;
+    }
+
+    using SiteVisitor = std::function<void(std::unique_ptr<Statement>&, SiteKind)>;
+
+    // The visitor may replace the site, the children of the new node are visited then
+    void ForEachSite(std::unique_ptr<Statement>& node, const SiteVisitor& visitor)
+    {
+        if (auto kind = KindOf(*node))
+            visitor(node, *kind);
+
+        node->ForEachChild([&visitor](std::unique_ptr<Statement>& child) {
+            ForEachSite(child, visitor);
+        });
+    }
+
+    const char* KindName(SiteKind kind)
+    {
+        switch (kind)
+        {
+            case SiteKind::Add:
+                return "add";
+            case SiteKind::Comparison:
+                return "cmp";
+            case SiteKind::MethodCall:
+                return "call";
+            default:
+                return "if";
+        }
+    }
+
+    SiteKind ParseKind(const std::string& name)
+    {
+        for (auto kind : {SiteKind::Add, SiteKind::Comparison, SiteKind::MethodCall, SiteKind::IfElse})
+            if (name == KindName(kind))
+                return kind;
+        throw std::runtime_error("Bad profile site kind " + name);
+    }
+
+    class RecordingAdd : public Add
+    {
+    public:
+        RecordingAdd(SiteProfile& site, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs)
+            : Add(std::move(lhs), std::move(rhs)), site(site)
+        {
+        }
+
+        Result Execute(Closure& closure) override
+        {
+            auto left = lhs->Execute(closure), right = rhs->Execute(closure);
+            site.lhs |= TypeOf(left);
+            site.rhs |= TypeOf(right);
+            return CallOperator(left, right, ArithmeticOp::Add);
+        }
+
+    private:
+        SiteProfile& site;
+    };
+
+    class RecordingComparison : public Comparison
+    {
+    public:
+        RecordingComparison(
+            SiteProfile& site, Comparator comparator, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs
+        )
+            : Comparison(std::move(comparator), std::move(lhs), std::move(rhs)), site(site)
+        {
+        }
+
+        Result Execute(Closure& closure) override
+        {
+            auto left = Lhs()->Execute(closure), right = Rhs()->Execute(closure);
+            site.lhs |= TypeOf(left);
+            site.rhs |= TypeOf(right);
+            return ObjectHolder::Own(Runtime::Bool(GetComparator()(left, right)));
+        }
+
+    private:
+        SiteProfile& site;
+    };
+
+    class RecordingMethodCall : public MethodCall
+    {
+    public:
+        RecordingMethodCall(SiteProfile& site, MethodCall&& call)
+            : MethodCall(std::move(call.object), std::move(call.method), std::move(call.args)), site(site)
+        {
+        }
+
+        Result Execute(Closure& closure) override
+        {
+            auto receiver = object->Execute(closure);
+            if (auto instance = receiver.TryAs<Runtime::ClassInstance>())
+                Record(instance->GetClass().GetName());
+            return CallOn(std::move(receiver), closure);
+        }
+
+    private:
+        void Record(const std::string& name)
+        {
+            auto& receivers = site.receivers;
+            if (site.megamorphic || std::find(receivers.begin(), receivers.end(), name) != receivers.end())
+                return;
+
+            if (receivers.size() < ProgramProfile::MAX_RECEIVERS)
+                receivers.push_back(name);
+            else
+                site.megamorphic = true;
+        }
+
+        SiteProfile& site;
+    };
+
+    class RecordingIfElse : public IfElse
+    {
+    public:
+        RecordingIfElse(SiteProfile& site, IfElse& if_else)
+            : IfElse(std::move(if_else.Condition()), std::move(if_else.IfBody()), std::move(if_else.ElseBody()))
+            , site(site)
+        {
+        }
+
+        Result Execute(Closure& closure) override
+        {
+            auto condition = Condition()->Execute(closure);
+            site.lhs |= TypeOf(condition);
+
+            if (condition->IsTrue())
+            {
+                ++site.taken;
+                return IfBody()->Execute(closure);
+            }
+
+            ++site.not_taken;
+            if (ElseBody())
+                return ElseBody()->Execute(closure);
+            return Result();
+        }
+
+    private:
+        SiteProfile& site;
+    };
+
+    size_t CountSites(std::unique_ptr<Statement>& root, std::vector<SiteKind>& kinds)
+    {
+        ForEachSite(root, [&kinds](std::unique_ptr<Statement>&, SiteKind kind) {
+            kinds.push_back(kind);
+        });
+        return kinds.size();
+    }
+
+    void CollectClasses(Statement& st, std::unordered_map<std::string, const Runtime::Class*>& classes)
+    {
+        if (auto p = st.TryAs<ClassDefinition>())
+        {
+            // Redefined names are ambiguous
+            auto [it, inserted] = classes.emplace(p->GetClass().GetName(), &p->GetClass());
+            if (!inserted)
+                it->second = nullptr;
+        }
+
+        st.ForEachChild([&classes](std::unique_ptr<Statement>& child) {
+            CollectClasses(*child, classes);
+        });
+    }
+
+    bool IsSingleType(TypeSet lhs, TypeSet rhs)
+    {
+        return lhs == rhs && (lhs == NUMBER_TYPE || lhs == STRING_TYPE);
+    }
+}
+
+// SiteProfile
+//
+bool SiteProfile::Executed() const
+{
+    return lhs || rhs || !receivers.empty() || megamorphic || taken || not_taken;
+}
+
+// ProgramProfile
+//
+void ProgramProfile::Save(std::ostream& out) const
+{
+    out << MAGIC << " " << VERSION << " " << std::hex << source_hash << std::dec << " " << sites.size() << "\n";
+
+    for (size_t id = 0; id < sites.size(); ++id)
+    {
+        const auto& site = sites[id];
+        if (!site.Executed())
+            continue;
+
+        out << id << " " << KindName(site.kind);
+        switch (site.kind)
+        {
+            case SiteKind::Add:
+            case SiteKind::Comparison:
+                out << " " << site.lhs << " " << site.rhs;
+                break;
+            case SiteKind::MethodCall:
+                if (site.megamorphic)
+                {
+                    out << " *";
+                }
+                else
+                {
+                    out << " " << site.receivers.size();
+                    for (const auto& name : site.receivers)
+                        out << " " << name;
+                }
+                break;
+            case SiteKind::IfElse:
+                out << " " << site.lhs << " " << site.taken << " " << site.not_taken;
+                break;
+        }
+        out << "\n";
+    }
+}
+
+ProgramProfile ProgramProfile::Load(std::istream& in)
+{
+    std::string magic;
+    int version = 0;
+    size_t count = 0;
+    ProgramProfile profile;
+
+    in >> magic >> version >> std::hex >> profile.source_hash >> std::dec >> count;
+    if (!in || magic != MAGIC)
+        throw std::runtime_error("Input is not a Mython profile");
+    if (version != VERSION)
+        throw std::runtime_error("Unsupported profile version " + std::to_string(version));
+
+    profile.sites.resize(count);
+    for (std::string line; std::getline(in, line);)
+    {
+        std::istringstream fields(line);
+        size_t id;
+        std::string kind;
+        if (!(fields >> id))
+            continue;
+        if (!(fields >> kind) || id >= count)
+            throw std::runtime_error("Bad profile line: " + line);
+
+        auto& site = profile.sites[id];
+        site.kind = ParseKind(kind);
+        switch (site.kind)
+        {
+            case SiteKind::Add:
+            case SiteKind::Comparison:
+                fields >> site.lhs >> site.rhs;
+                break;
+            case SiteKind::MethodCall:
+            {
+                std::string receivers;
+                fields >> receivers;
+                if (receivers == "*")
+                {
+                    site.megamorphic = true;
+                    break;
+                }
+
+                site.receivers.resize(std::stoul(receivers));
+                for (auto& name : site.receivers)
+                    fields >> name;
+                break;
+            }
+            case SiteKind::IfElse:
+                fields >> site.lhs >> site.taken >> site.not_taken;
+                break;
+        }
+        if (!fields)
+            throw std::runtime_error("Bad profile line: " + line);
+    }
+    return profile;
+}
+
+// GuardedAdd
+//
+GuardedAdd::GuardedAdd(TypeSet expected, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs)
+    : Add(std::move(lhs), std::move(rhs)), expected(expected)
+{
+}
+
+Result GuardedAdd::Execute(Closure& closure)
+{
+    auto left = lhs->Execute(closure), right = rhs->Execute(closure);
+    if (expected == NUMBER_TYPE && Is(left, IType::Number) && Is(right, IType::Number))
+    {
+        return ObjectHolder::Own(Runtime::Number(
+            ValueOf<Runtime::Number>(left).GetValue() + ValueOf<Runtime::Number>(right).GetValue()
+        ));
+    }
+    if (expected == STRING_TYPE && Is(left, IType::String) && Is(right, IType::String))
+    {
+        return ObjectHolder::Own(Runtime::String(
+            ValueOf<Runtime::String>(left).GetValue() + ValueOf<Runtime::String>(right).GetValue()
+        ));
+    }
+    return CallOperator(left, right, ArithmeticOp::Add);
+}
+
+// GuardedComparison
+//
+GuardedComparison::GuardedComparison(
+    TypeSet expected, CompareOp op, Comparator comparator,
+    std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs
+)
+    : Comparison(std::move(comparator), std::move(lhs), std::move(rhs)), expected(expected), op(op)
+{
+}
+
+Result GuardedComparison::Execute(Closure& closure)
+{
+    auto left = Lhs()->Execute(closure), right = Rhs()->Execute(closure);
+    bool result;
+    if (expected == NUMBER_TYPE && Is(left, IType::Number) && Is(right, IType::Number))
+        result = Compare(op, ValueOf<Runtime::Number>(left).GetValue(), ValueOf<Runtime::Number>(right).GetValue());
+    else if (expected == STRING_TYPE && Is(left, IType::String) && Is(right, IType::String))
+        result = Compare(op, ValueOf<Runtime::String>(left).GetValue(), ValueOf<Runtime::String>(right).GetValue());
+    else
+        result = GetComparator()(left, right);
+    return ObjectHolder::Own(Runtime::Bool(result));
+}
+
+// Free
+//
+uint64_t HashSource(std::string_view source)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char c : source)
+    {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void RecordProfile(std::unique_ptr<Statement>& root, uint64_t source_hash, ProgramProfile& profile)
+{
+    std::vector<SiteKind> kinds;
+    profile.source_hash = source_hash;
+    profile.sites.assign(CountSites(root, kinds), SiteProfile());
+
+    size_t id = 0;
+    ForEachSite(root, [&profile, &id](std::unique_ptr<Statement>& node, SiteKind kind) {
+        auto& site = profile.sites[id++];
+        site.kind = kind;
+
+        switch (kind)
+        {
+            case SiteKind::Add:
+            {
+                auto& add = static_cast<Add&>(*node);
+                node = std::make_unique<RecordingAdd>(site, std::move(add.Lhs()), std::move(add.Rhs()));
+                break;
+            }
+            case SiteKind::Comparison:
+            {
+                auto& cmp = static_cast<Comparison&>(*node);
+                node = std::make_unique<RecordingComparison>(
+                    site, cmp.GetComparator(), std::move(cmp.Lhs()), std::move(cmp.Rhs())
+                );
+                break;
+            }
+            case SiteKind::MethodCall:
+                node = std::make_unique<RecordingMethodCall>(site, std::move(static_cast<MethodCall&>(*node)));
+                break;
+            case SiteKind::IfElse:
+                node = std::make_unique<RecordingIfElse>(site, static_cast<IfElse&>(*node));
+                break;
+        }
+    });
+}
+
+ProfileStats ApplyProfile(std::unique_ptr<Statement>& root, const ProgramProfile& profile, uint64_t source_hash)
+{
+    ProfileStats stats;
+
+    std::vector<SiteKind> kinds;
+    if (profile.source_hash != source_hash || CountSites(root, kinds) != profile.sites.size())
+    {
+        stats.stale = true;
+        return stats;
+    }
+    for (size_t id = 0; id < kinds.size(); ++id)
+    {
+        if (profile.sites[id].Executed() && profile.sites[id].kind != kinds[id])
+        {
+            stats.stale = true;
+            return stats;
+        }
+    }
+
+    std::unordered_map<std::string, const Runtime::Class*> classes;
+    CollectClasses(*root, classes);
+
+    size_t id = 0;
+    ForEachSite(root, [&](std::unique_ptr<Statement>& node, SiteKind kind) {
+        const auto& site = profile.sites[id++];
+        if (!site.Executed())
+            return;
+
+        if (kind == SiteKind::Add && IsSingleType(site.lhs, site.rhs))
+        {
+            auto& add = static_cast<Add&>(*node);
+            node = std::make_unique<GuardedAdd>(site.lhs, std::move(add.Lhs()), std::move(add.Rhs()));
+            ++stats.specialized;
+        }
+        else if (kind == SiteKind::Comparison && IsSingleType(site.lhs, site.rhs))
+        {
+            auto& cmp = static_cast<Comparison&>(*node);
+            if (auto op = GetCompareOp(cmp.GetComparator()))
+            {
+                node = std::make_unique<GuardedComparison>(
+                    site.lhs, *op, cmp.GetComparator(), std::move(cmp.Lhs()), std::move(cmp.Rhs())
+                );
+                ++stats.specialized;
+            }
+        }
+        else if (kind == SiteKind::MethodCall && !site.megamorphic && site.receivers.size() == 1)
+        {
+            auto it = classes.find(site.receivers[0]);
+            if (it != classes.end() && it->second)
+            {
+                static_cast<MethodCall&>(*node).Prime(*it->second);
+                ++stats.primed_calls;
+            }
+        }
+    });
+    return stats;
+}
+
+} /* namespace Ast */
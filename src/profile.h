@@ -0,0 +1,110 @@
+#pragma once
+
+#include "statement.h"
+#include "type_inference.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+// Nodes whose behaviour is recorded. Sites are numbered in pre-order of the
+// parsed tree (method bodies included), so the numbers are the same in every
+// run of the same source
+enum class SiteKind {
+  Add,
+  Comparison,
+  MethodCall,
+  IfElse,
+};
+
+struct SiteProfile {
+  SiteKind kind = SiteKind::Add;
+  // Types of the operands of Add and Comparison, of the condition of IfElse
+  TypeSet lhs = 0;
+  TypeSet rhs = 0;
+  // Names of the receiver classes of MethodCall, until there are too many of them
+  std::vector<std::string> receivers;
+  bool megamorphic = false;
+  // Executions of IfElse by the branch taken
+  uint64_t taken = 0;
+  uint64_t not_taken = 0;
+
+  bool Executed() const;
+};
+
+struct ProgramProfile {
+  static const int VERSION = 1;
+  static const size_t MAX_RECEIVERS = 4;
+
+  uint64_t source_hash = 0;
+  // Indexed by the site number
+  std::vector<SiteProfile> sites;
+
+  // One line per executed site
+  void Save(std::ostream& out) const;
+  // Throws std::runtime_error when the input is not a profile of this version
+  static ProgramProfile Load(std::istream& in);
+};
+
+uint64_t HashSource(std::string_view source);
+
+// Numbers the sites of the parsed tree and replaces them with nodes which
+// record into profile. The profile must outlive the tree. The stack engine
+// compiles the recording nodes as the plain ones, so only the tree engine records
+void RecordProfile(std::unique_ptr<Statement>& root, uint64_t source_hash, ProgramProfile& profile);
+
+struct ProfileStats {
+  // The profile was recorded for another source, nothing was applied
+  bool stale = false;
+  size_t specialized = 0;
+  size_t primed_calls = 0;
+};
+
+// Replaces the Add and Comparison sites which saw a single type of operands
+// with guarded versions and fills the inline caches of the MethodCall sites
+// which saw a single receiver class. Branch bias is kept in the profile for
+// inspection only, the tree has no code layout to adapt to it.
+// Must be applied to the parsed tree, before the other passes
+ProfileStats ApplyProfile(std::unique_ptr<Statement>& root, const ProgramProfile& profile, uint64_t source_hash);
+
+// Add with a fast path for the operands of the expected type (numbers or strings).
+// Other operands take the generic way
+class GuardedAdd : public Add {
+public:
+  GuardedAdd(TypeSet expected, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs);
+
+  TypeSet Expected() const {
+    return expected;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  TypeSet expected;
+};
+
+class GuardedComparison : public Comparison {
+public:
+  GuardedComparison(
+    TypeSet expected, CompareOp op, Comparator comparator,
+    std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs
+  );
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  TypeSet expected;
+  CompareOp op;
+};
+
+void RunProfileTests(TestRunner& tr);
+
+} /* namespace Ast */
@@ -0,0 +1,194 @@
+#include "profile.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+const string PROGRAM = R"(
+class Shape:
+  def __init__(w, h):
+    self.w = w
+    self.h = h
+
+  def area():
+    return self.w * self.h
+
+class Words:
+  def join(a, b):
+    return a + ' ' + b
+
+s = Shape(2, 3)
+t = Shape(4, 5)
+w = Words()
+total = s.area() + t.area()
+if total > 100:
+  print 'big'
+else:
+  print total, w.join('a', 'b')
+)";
+
+string Dump(Statement& program) {
+  ostringstream out;
+  DumpTree(program, out);
+  return out.str();
+}
+
+bool Contains(const string& text, const string& part) {
+  return text.find(part) != string::npos;
+}
+
+ProgramProfile Record(const string& source) {
+  ProgramProfile profile;
+  auto program = ParseProgramFromString(source);
+  RecordProfile(program, HashSource(source), profile);
+  Execute(*program);
+  return profile;
+}
+
+}
+
+void TestFeedbackIsRecorded() {
+  auto profile = Record(PROGRAM);
+
+  // Three Add, three MethodCall, the Comparison and the IfElse
+  ASSERT_EQUAL(profile.sites.size(), 8u);
+  ASSERT_EQUAL(profile.source_hash, HashSource(PROGRAM));
+
+  size_t adds = 0, calls = 0;
+  for (const auto& site : profile.sites) {
+    if (site.kind == SiteKind::Add) {
+      ++adds;
+      ASSERT(site.lhs == site.rhs);
+    } else if (site.kind == SiteKind::Comparison) {
+      ASSERT_EQUAL(site.lhs, unsigned(NUMBER_TYPE));
+    } else if (site.kind == SiteKind::MethodCall) {
+      ++calls;
+      ASSERT_EQUAL(site.receivers.size(), 1u);
+    } else {
+      ASSERT_EQUAL(site.lhs, unsigned(BOOL_TYPE));
+      ASSERT_EQUAL(site.taken, 0u);
+      ASSERT_EQUAL(site.not_taken, 1u);
+    }
+  }
+  ASSERT_EQUAL(adds, 3u);
+  ASSERT_EQUAL(calls, 3u);
+}
+
+void TestProfileIsSavedAndLoaded() {
+  auto profile = Record(PROGRAM);
+  ostringstream out;
+  profile.Save(out);
+
+  istringstream in(out.str());
+  auto loaded = ProgramProfile::Load(in);
+  ASSERT_EQUAL(loaded.source_hash, profile.source_hash);
+  ASSERT_EQUAL(loaded.sites.size(), profile.sites.size());
+  for (size_t i = 0; i < loaded.sites.size(); ++i) {
+    ASSERT(loaded.sites[i].kind == profile.sites[i].kind);
+    ASSERT_EQUAL(loaded.sites[i].lhs, profile.sites[i].lhs);
+    ASSERT_EQUAL(loaded.sites[i].rhs, profile.sites[i].rhs);
+    ASSERT_EQUAL(loaded.sites[i].receivers, profile.sites[i].receivers);
+    ASSERT_EQUAL(loaded.sites[i].taken, profile.sites[i].taken);
+    ASSERT_EQUAL(loaded.sites[i].not_taken, profile.sites[i].not_taken);
+  }
+
+  istringstream garbage("not a profile");
+  ASSERT_THROWS(ProgramProfile::Load(garbage), std::runtime_error);
+  istringstream future("mython-profile 99 0 0\n");
+  ASSERT_THROWS(ProgramProfile::Load(future), std::runtime_error);
+}
+
+void TestProfileSpecializesNodes() {
+  auto profile = Record(PROGRAM);
+  auto program = ParseProgramFromString(PROGRAM);
+  auto stats = ApplyProfile(program, profile, HashSource(PROGRAM));
+
+  ASSERT(!stats.stale);
+  ASSERT_EQUAL(stats.specialized, 4u);
+  ASSERT_EQUAL(stats.primed_calls, 3u);
+
+  auto dump = Dump(*program);
+  ASSERT(Contains(dump, "GuardedAdd numbers"));
+  ASSERT(Contains(dump, "GuardedAdd strings"));
+  ASSERT(Contains(dump, "GuardedComparison >"));
+  ASSERT(Contains(dump, "MethodCall area cached Shape"));
+  ASSERT_EQUAL(Execute(*program), "26 a b\n");
+}
+
+void TestStaleProfileIsIgnored() {
+  auto profile = Record(PROGRAM);
+  const string changed = PROGRAM + "print 1 + 2\n";
+  auto program = ParseProgramFromString(changed);
+  auto stats = ApplyProfile(program, profile, HashSource(changed));
+
+  ASSERT(stats.stale);
+  ASSERT_EQUAL(stats.specialized, 0u);
+  ASSERT(!Contains(Dump(*program), "Guarded"));
+}
+
+void TestGuardsFallBack() {
+  const string source = R"(
+class Pair:
+  def sum(a, b):
+    return a + b
+
+p = Pair()
+print p.sum(1, 2), p.sum('x', 'y'), p.sum(1, 2) < p.sum(3, 4)
+)";
+  auto profile = Record(source);
+  // Pretend only numbers were seen
+  for (auto& site : profile.sites) {
+    if (site.kind != SiteKind::MethodCall) {
+      site.lhs = site.rhs = NUMBER_TYPE;
+    }
+  }
+
+  auto program = ParseProgramFromString(source);
+  ASSERT_EQUAL(ApplyProfile(program, profile, HashSource(source)).specialized, 2u);
+  ASSERT_EQUAL(Execute(*program), "3 xy True\n");
+}
+
+void TestProfileRoundTripThroughRun() {
+  ostringstream recorded;
+  {
+    istringstream input(PROGRAM);
+    ostringstream output;
+    RunOptions options;
+    options.profile_output = &recorded;
+    RunMythonProgram(input, output, options);
+    ASSERT_EQUAL(output.str(), "26 a b\n");
+  }
+
+  istringstream profile(recorded.str());
+  istringstream input(PROGRAM);
+  ostringstream output, dump;
+  RunOptions options;
+  options.profile_input = &profile;
+  options.tree_dump = &dump;
+  RunMythonProgram(input, output, options);
+  ASSERT_EQUAL(output.str(), "26 a b\n");
+  ASSERT(Contains(dump.str(), "GuardedAdd numbers"));
+}
+
+void RunProfileTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestFeedbackIsRecorded);
+  RUN_TEST(tr, Ast::TestProfileIsSavedAndLoaded);
+  RUN_TEST(tr, Ast::TestProfileSpecializesNodes);
+  RUN_TEST(tr, Ast::TestStaleProfileIsIgnored);
+  RUN_TEST(tr, Ast::TestGuardsFallBack);
+  RUN_TEST(tr, Ast::TestProfileRoundTripThroughRun);
+}
+
+} /* namespace Ast */
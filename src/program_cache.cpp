@@ -0,0 +1,94 @@
+#include "program_cache.h"
+#include "flat_tree.h"
+#include "lexer.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace Ast {
+
+namespace
+{
+    const char MAGIC[8] = {'M', 'Y', 'T', 'H', 'O', 'N', 'P', 'C'};
+}
+
+string ProgramCachePath(const string& source_path)
+{
+    return source_path + ".myc";
+}
+
+bool SaveProgram(const Statement& program, uint64_t source_hash, ostream& out, uint64_t passes)
+{
+    auto root = program.TryAs<FlatRoot>();
+    if (!root)
+        return false;
+
+    ProgramCacheHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.root = root->Root();
+    header.source_hash = source_hash;
+    header.passes = passes;
+
+    string data(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!root->Flat()->Save(data))
+        return false;
+    out.write(data.data(), static_cast<streamsize>(data.size()));
+    return true;
+}
+
+unique_ptr<Statement> LoadProgram(string_view data, uint64_t source_hash, uint64_t passes)
+{
+    ProgramCacheHeader header;
+    if (data.size() < sizeof(header))
+        return nullptr;
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != ProgramCacheHeader::VERSION
+        || header.source_hash != source_hash || header.passes != passes)
+        return nullptr;
+
+    data.remove_prefix(sizeof(header));
+    auto flat = FlatTree::Load(data);
+    if (header.root >= flat->Size() || !data.empty())
+        throw runtime_error("Program cache is inconsistent");
+    return make_unique<FlatRoot>(nullptr, std::move(flat), header.root);
+}
+
+bool SaveProgramFile(const Statement& program, uint64_t source_hash, const string& path, uint64_t passes)
+{
+    string temporary = path + ".tmp";
+    {
+        ofstream out(temporary, ios::binary);
+        if (!out || !SaveProgram(program, source_hash, out, passes) || !out.flush())
+        {
+            out.close();
+            remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+unique_ptr<Statement> LoadProgramFile(const string& path, uint64_t source_hash, uint64_t passes)
+{
+    try
+    {
+        Parse::SourceFile file(path);
+        return LoadProgram(file.Text(), source_hash, passes);
+    }
+    catch (const runtime_error&)
+    {
+        return nullptr;
+    }
+}
+
+} /* namespace Ast */
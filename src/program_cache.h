@@ -0,0 +1,68 @@
+#pragma once
+
+#include "statement.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+
+class TestRunner;
+
+namespace Ast {
+
+// Programs laid out in a FlatTree, saved so that a later run of the same
+// source loads them instead of parsing it again. The file is a header (a magic
+// number, the version of the format, the hash of the source, see HashSource in
+// profile.h, the index of the root and the passes the program went through)
+// followed by the layout (see FlatTree::Save). Numbers are in the byte order of
+// the machine that wrote it
+struct ProgramCacheHeader {
+  static const uint32_t VERSION = 3;
+
+  char magic[8];
+  uint32_t version = VERSION;
+  uint32_t root = 0;
+  uint64_t source_hash = 0;
+  uint64_t passes = 0;
+};
+
+// The bits of the passes, and of the options of the run which wrote the program.
+// It went through the passes of the first three, the cached run goes without the
+// others; a program is loaded only by a run with the same ones, so that no option
+// is ignored in silence
+const uint64_t CACHED_OPTIMIZER = 1;
+const uint64_t CACHED_TAIL_CALLS = 2;
+const uint64_t CACHED_SINGLE_PASS = 4;
+const uint64_t CACHED_INLINE = 8;
+const uint64_t CACHED_TYPES = 16;
+const uint64_t CACHED_SUPERINSTRUCTIONS = 32;
+const uint64_t CACHED_ESCAPE_ANALYSIS = 64;
+const uint64_t CACHED_JIT = 128;
+const uint64_t CACHED_LAZY_METHODS = 256;
+// The engine of the run (see Engine in interpreter.h) is kept from this bit on
+const int CACHED_ENGINE_SHIFT = 16;
+
+// Where the program of the source file is kept: next to it, with ".myc" appended
+std::string ProgramCachePath(const std::string& source_path);
+
+// Writes the program, a FlatRoot as made by ParseFlatProgram or FlattenProgram.
+// Returns false and writes nothing when the layout has nodes the format does
+// not hold
+bool SaveProgram(const Statement& program, uint64_t source_hash, std::ostream& out, uint64_t passes = 0);
+// The program saved for the source of the hash, nullptr when the data were
+// written for another source, after other passes or by another version. Throws
+// std::runtime_error when they are damaged
+std::unique_ptr<Statement> LoadProgram(std::string_view data, uint64_t source_hash, uint64_t passes = 0);
+
+// The same with files. The file is written under another name and renamed, so
+// that a run never reads one half written; false when it can not be written.
+// The file is read from a mapping (see Parse::SourceFile); nullptr when it is
+// missing, stale or damaged, the source is parsed then
+bool SaveProgramFile(const Statement& program, uint64_t source_hash, const std::string& path, uint64_t passes = 0);
+std::unique_ptr<Statement> LoadProgramFile(const std::string& path, uint64_t source_hash, uint64_t passes = 0);
+
+void RunProgramCacheTests(TestRunner& tr);
+
+} /* namespace Ast */
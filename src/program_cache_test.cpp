@@ -0,0 +1,250 @@
+#include "program_cache.h"
+#include "flat_tree.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "optimizer.h"
+#include "parse.h"
+#include "profile.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+const string SHAPES = R"(
+class Shape:
+  def __init__(name):
+    self.name = name
+
+  def __str__():
+    return self.name + ' of ' + str(self.area())
+
+  def bigger(other):
+    return self.area() > other.area() or self.area() == other.area()
+
+class Rect(Shape):
+  def __init__(w, h):
+    self.name = 'rect'
+    self.w = w
+    self.h = h
+
+  def area():
+    return self.w * self.h
+
+class Square(Rect):
+  def __init__(side):
+    self.name = "square"
+    self.w = side
+    self.h = side
+
+r = Rect(2, 3)
+s = Square(3)
+if s.bigger(r) and not r.bigger(s):
+  print r, s, r.w <= s.w, r.h >= s.w, r.w != 2, -r.h / 2, None, True
+else:
+  print 'never'
+)";
+
+unique_ptr<Statement> ParseFlat(const string& program) {
+  istringstream input(program);
+  Parse::Lexer lexer(input);
+  return ParseFlatProgram(lexer);
+}
+
+string Save(const Statement& program, uint64_t source_hash) {
+  ostringstream out;
+  ASSERT(SaveProgram(program, source_hash, out));
+  return out.str();
+}
+
+string Run(const string& source, const RunOptions& options) {
+  ostringstream output;
+  RunMythonProgram(string_view(source), output, options);
+  return output.str();
+}
+
+bool Exists(const string& path) {
+  return ifstream(path).good();
+}
+
+}
+
+void TestProgramIsSavedAndLoaded() {
+  auto program = ParseFlat(SHAPES);
+  const string expected = Execute(*program);
+  ASSERT_EQUAL(expected, "rect of 6 square of 9 True True False -1 None True\n");
+
+  auto data = Save(*program, 42);
+  auto loaded = LoadProgram(data, 42);
+  ASSERT(loaded);
+  ASSERT_EQUAL(Execute(*loaded), expected);
+  // The same bytes again
+  ASSERT_EQUAL(Save(*loaded, 42), data);
+
+  // Laid out after the optimizer
+  istringstream input(SHAPES);
+  Parse::Lexer lexer(input);
+  auto optimized = ParseProgram(lexer);
+  OptimizeProgram(optimized);
+  ASSERT_EQUAL(FlattenProgram(optimized).opaque, 0u);
+  auto loaded_optimized = LoadProgram(Save(*optimized, 42), 42);
+  ASSERT(loaded_optimized);
+  ASSERT_EQUAL(Execute(*loaded_optimized), expected);
+}
+
+void TestOtherSourcesAndVersionsAreNotLoaded() {
+  auto data = Save(*ParseFlat(SHAPES), 42);
+  ASSERT(!LoadProgram(data, 43));
+  ASSERT(!LoadProgram(data, 42, CACHED_TAIL_CALLS));
+  ASSERT(!LoadProgram("", 42));
+
+  auto other_version = data;
+  other_version[offsetof(ProgramCacheHeader, version)] ^= 1;
+  ASSERT(!LoadProgram(other_version, 42));
+
+  // Damaged data are found before they run
+  ASSERT_THROWS(LoadProgram(data.substr(0, data.size() - 1), 42), std::runtime_error);
+  ASSERT_THROWS(LoadProgram(data + "x", 42), std::runtime_error);
+  // A name or a value may change, but no index may point out of its array
+  for (size_t at = sizeof(ProgramCacheHeader); at < data.size(); ++at) {
+    auto damaged = data;
+    damaged[at] = static_cast<char>(0xff);
+    try {
+      LoadProgram(damaged, 42);
+    } catch (const std::runtime_error&) {
+    }
+  }
+
+  ASSERT(!LoadProgramFile("no/such/mython/file.myc", 42));
+}
+
+void TestNodesOutsideTheFormatAreNotSaved() {
+  // Superinstructions keep their Execute
+  istringstream input(R"(
+class Counter:
+  def add(n):
+    self.value = self.value + n
+
+c = Counter()
+c.value = 1
+c.add(2)
+print c.value
+)");
+  Parse::Lexer lexer(input);
+  auto program = ParseProgram(lexer);
+  OptimizeProgram(program);
+  MarkTailCalls(program);
+  FuseSuperinstructions(program);
+  ASSERT(FlattenProgram(program).opaque > 0u);
+
+  ostringstream out;
+  ASSERT(!SaveProgram(*program, 42, out));
+  ASSERT(out.str().empty());
+  // Not laid out at all
+  istringstream tree_input("print 1");
+  Parse::Lexer tree_lexer(tree_input);
+  ASSERT(!SaveProgram(*ParseProgram(tree_lexer), 42, out));
+}
+
+void TestRunUsesCacheOfTheSameSource() {
+  const string path = ProgramCachePath("mython_program_cache_test.my");
+  remove(path.c_str());
+
+  RunOptions options;
+  options.program_cache = path;
+  const string expected = Run(SHAPES, RunOptions());
+  ASSERT_EQUAL(Run(SHAPES, options), expected);
+  ASSERT(!Exists(path));
+
+  options.write_program_cache = true;
+  for (bool optimize : {false, true}) {
+    options.optimize = optimize;
+    ASSERT_EQUAL(Run(SHAPES, options), expected);
+    ASSERT(Exists(path));
+    ASSERT_EQUAL(Run(SHAPES, options), expected);
+    remove(path.c_str());
+  }
+
+  // What is saved for the hash of the source and the passes runs instead of it
+  options.write_program_cache = false;
+  ASSERT(SaveProgramFile(*ParseFlat("print 'cached'"), HashSource(SHAPES), path, ProgramCachePasses(options)));
+  ASSERT_EQUAL(Run(SHAPES, options), "cached\n");
+  ASSERT_EQUAL(Run(SHAPES + "print 1\n", options), expected + "1\n");
+
+  // A run with other options parses the source, none of them is ignored
+  for (auto change : {&RunOptions::tail_calls, &RunOptions::single_pass, &RunOptions::inline_methods,
+                      &RunOptions::infer_types, &RunOptions::superinstructions, &RunOptions::escape_analysis,
+                      &RunOptions::jit, &RunOptions::lazy_methods}) {
+    RunOptions other = options;
+    other.*change = !(other.*change);
+    ASSERT_EQUAL(Run(SHAPES, other), expected);
+  }
+  for (Engine engine : {Engine::Stack, Engine::Closures, Engine::Flat}) {
+    RunOptions other = options;
+    other.engine = engine;
+    ASSERT_EQUAL(Run(SHAPES, other), expected);
+  }
+  options.memoize = true;
+  ASSERT_EQUAL(Run(SHAPES, options), expected);
+  options.memoize = false;
+
+  // The options which need the tree parse the source
+  ostringstream dump;
+  options.tree_dump = &dump;
+  ASSERT_EQUAL(Run(SHAPES, options), expected);
+  options.tree_dump = nullptr;
+
+  // A stale file is replaced
+  options.write_program_cache = true;
+  ASSERT_EQUAL(Run(SHAPES + "print 1\n", options), expected + "1\n");
+  ASSERT(!LoadProgramFile(path, HashSource(SHAPES), ProgramCachePasses(options)));
+  ASSERT(LoadProgramFile(path, HashSource(SHAPES + "print 1\n"), ProgramCachePasses(options)));
+  remove(path.c_str());
+}
+
+void TestCachedProgramKeepsTailCalls() {
+  const string path = ProgramCachePath("mython_program_cache_tail_calls_test.my");
+  const string looper = R"(
+class Looper:
+  def count(n, acc):
+    if n == 0:
+      return acc
+    return self.count(n - 1, acc + 2)
+
+l = Looper()
+print l.count(1000000, 0)
+)";
+  RunOptions options;
+  options.program_cache = path;
+  options.write_program_cache = true;
+  for (bool optimize : {false, true}) {
+    remove(path.c_str());
+    options.optimize = optimize;
+    ASSERT_EQUAL(Run(looper, options), "2000000\n");
+    ASSERT(LoadProgramFile(path, HashSource(looper), ProgramCachePasses(options)));
+    ASSERT_EQUAL(Run(looper, options), "2000000\n");
+  }
+  remove(path.c_str());
+}
+
+void RunProgramCacheTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestProgramIsSavedAndLoaded);
+  RUN_TEST(tr, Ast::TestOtherSourcesAndVersionsAreNotLoaded);
+  RUN_TEST(tr, Ast::TestNodesOutsideTheFormatAreNotSaved);
+  RUN_TEST(tr, Ast::TestRunUsesCacheOfTheSameSource);
+  RUN_TEST(tr, Ast::TestCachedProgramKeepsTailCalls);
+}
+
+} /* namespace Ast */
@@ -0,0 +1,762 @@
+#include "stack_evaluator.h"
+#include "memoization.h"
+#include "object.h"
+#include "optimizer.h"
+#include "superinstructions.h"
+#include "tail_calls.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    enum class OpCode
+    {
+        Leaf,           // push node->Execute(), the node does not recurse
+        Opaque,         // node->Execute() for nodes the compiler does not know
+        Pop,
+        TouchVar,
+        ReadVar,
+        StoreVar,
+        BeginField,
+        ReadField,
+        StoreField,
+        PrintSeparator,
+        PrintValue,
+        PrintNewline,
+        Call,
+        New,
+        TailCall,
+        Stringify,
+        Arith,
+        Or,
+        And,
+        Not,
+        Compare,
+        Jump,
+        JumpIfFalse,
+        CompareJump,    // pops two operands, jumps if the comparator gives false
+        Return,
+        ReturnNone,
+    };
+
+    struct Instruction
+    {
+        OpCode op;
+        Statement* node = nullptr;
+        const std::string* name = nullptr;
+        ArithmeticOp arith = ArithmeticOp::Add;
+        size_t count = 0;
+        size_t target = 0;
+    };
+
+    const char* INIT_METHOD = "__init__";
+    const char* NOT_METHOD = "__not__";
+
+    NumericConst MINUS_ONE(-1);
+
+    const char* OperatorMethod(ArithmeticOp op)
+    {
+        switch (op)
+        {
+            case ArithmeticOp::Add:
+                return "__add__";
+            case ArithmeticOp::Sub:
+                return "__sub__";
+            case ArithmeticOp::Mult:
+                return "__mult__";
+            default:
+                return "__div__";
+        }
+    }
+
+    // An unset value reads as None, the same way VariableValue does
+    ObjectHolder ReadSlot(const ObjectHolder& slot)
+    {
+        if (!slot)
+            return ObjectHolder::Own(Runtime::None());
+        return slot;
+    }
+
+    Runtime::ClassInstance& AsFieldOwner(ObjectHolder& holder)
+    {
+        auto instance = holder.TryAs<Runtime::ClassInstance>();
+        if (!instance)
+            throw std::runtime_error("FieldAssignment: ");
+        return *instance;
+    }
+
+    bool ReadsVariable(Statement& node, const std::string& var)
+    {
+        if (auto value = node.TryAs<VariableValue>())
+            return value->dotted_ids.front() == var;
+
+        bool reads = false;
+        node.ForEachChild([&reads, &var](std::unique_ptr<Statement>& child) {
+            reads = reads || ReadsVariable(*child, var);
+        });
+        return reads;
+    }
+}
+
+struct StackEvaluator::Code
+{
+    std::vector<Instruction> instructions;
+};
+
+struct StackEvaluator::Frame
+{
+    Closure own;
+    Closure* env = nullptr;
+    const Code* code = nullptr;
+    size_t pc = 0;
+    size_t stack_base = 0;
+    ObjectHolder receiver;
+    // Set for __init__ frames: the new instance is the value of the frame
+    ObjectHolder constructed;
+    // Memoized calls completed by the value of the frame
+    PendingMemo memo;
+};
+
+namespace
+{
+    class Compiler
+    {
+    public:
+        explicit Compiler(std::vector<Instruction>& code)
+            : code(code)
+        {
+        }
+
+        void CompileStatement(Statement& node)
+        {
+            if (auto p = node.TryAs<Compound>())
+            {
+                for (auto& st : p->Statements())
+                    CompileStatement(*st);
+            }
+            else if (auto p = node.TryAs<Assignment>())
+            {
+                // Assignment creates the variable before its value is computed
+                if (ReadsVariable(*p->rv, p->var))
+                    Emit({OpCode::TouchVar, nullptr, &p->var});
+                CompileExpression(*p->rv);
+                Emit({OpCode::StoreVar, nullptr, &p->var});
+            }
+            else if (auto p = node.TryAs<FieldAssignment>())
+            {
+                Emit({OpCode::Leaf, &p->object});
+                Emit({OpCode::BeginField, nullptr, &p->field_name});
+                CompileExpression(*p->right_value);
+                Emit({OpCode::StoreField, nullptr, &p->field_name});
+            }
+            else if (auto p = node.TryAs<FieldUpdate>())
+            {
+                Emit({OpCode::Leaf, &p->Object()});
+                Emit({OpCode::ReadField, nullptr, &p->FieldName()});
+                CompileExpression(*p->Rhs());
+                Emit({OpCode::Arith, nullptr, nullptr, p->Op()});
+                Emit({OpCode::StoreField, nullptr, &p->FieldName()});
+            }
+            else if (auto p = node.TryAs<VariableUpdate>())
+            {
+                Emit({OpCode::ReadVar, nullptr, &p->Var()});
+                CompileExpression(*p->Rhs());
+                Emit({OpCode::Arith, nullptr, nullptr, p->Op()});
+                Emit({OpCode::StoreVar, nullptr, &p->Var()});
+            }
+            else if (auto p = node.TryAs<Print>())
+            {
+                for (size_t i = 0; i < p->Args().size(); ++i)
+                {
+                    if (i > 0)
+                        Emit({OpCode::PrintSeparator});
+                    CompileExpression(*p->Args()[i]);
+                    Emit({OpCode::PrintValue});
+                }
+                Emit({OpCode::PrintNewline});
+            }
+            else if (auto p = node.TryAs<Return>())
+            {
+                CompileExpression(*p->Value());
+                Emit({OpCode::Return});
+            }
+            else if (auto p = node.TryAs<TailCall>())
+            {
+                CompileExpression(*p->Object());
+                for (auto& arg : p->Args())
+                    CompileExpression(*arg);
+                Emit({OpCode::TailCall, p, &p->Method(), ArithmeticOp::Add, p->Args().size()});
+            }
+            else if (auto p = node.TryAs<IfElse>())
+            {
+                CompileExpression(*p->Condition());
+                CompileBranches(Emit({OpCode::JumpIfFalse}), *p->IfBody(), p->ElseBody().get());
+            }
+            else if (auto p = node.TryAs<IfCompare>())
+            {
+                CompileExpression(*p->Lhs());
+                CompileExpression(*p->Rhs());
+                CompileBranches(Emit({OpCode::CompareJump, p}), *p->IfBody(), p->ElseBody().get());
+            }
+            else if (node.TryAs<ClassDefinition>())
+            {
+                // The class is created by the parser, nothing to do
+            }
+            else
+            {
+                CompileExpression(node);
+                Emit({OpCode::Pop});
+            }
+        }
+
+        void CompileExpression(Statement& node)
+        {
+            if (node.TryAs<NumericConst>() || node.TryAs<StringConst>() || node.TryAs<BoolConst>()
+                || node.TryAs<None>() || node.TryAs<VariableValue>() || node.TryAs<CachedFieldRead>())
+            {
+                Emit({OpCode::Leaf, &node});
+            }
+            else if (auto p = node.TryAs<MethodCall>())
+            {
+                CompileExpression(*p->object);
+                for (auto& arg : p->args)
+                    CompileExpression(*arg);
+                Emit({OpCode::Call, p, &p->method, ArithmeticOp::Add, p->args.size()});
+            }
+            else if (auto p = node.TryAs<NewInstance>())
+            {
+                for (auto& arg : p->args)
+                    CompileExpression(*arg);
+                Emit({OpCode::New, p, nullptr, ArithmeticOp::Add, p->args.size()});
+            }
+            else if (auto p = node.TryAs<Stringify>())
+            {
+                CompileExpression(*p->Argument());
+                Emit({OpCode::Stringify});
+            }
+            else if (auto p = node.TryAs<Not>())
+            {
+                CompileExpression(*p->Argument());
+                Emit({OpCode::Not});
+            }
+            else if (auto p = node.TryAs<Negate>())
+            {
+                // Same as the Mult(x, -1) the parser gives, __mult__ of instances included
+                CompileExpression(*p->Argument());
+                Emit({OpCode::Leaf, &MINUS_ONE});
+                Emit({OpCode::Arith, nullptr, nullptr, ArithmeticOp::Mult});
+            }
+            else if (auto p = node.TryAs<Comparison>())
+            {
+                CompileExpression(*p->Lhs());
+                CompileExpression(*p->Rhs());
+                Emit({OpCode::Compare, p});
+            }
+            else if (node.TryAs<Add>())
+                CompileBinary(node, {OpCode::Arith, nullptr, nullptr, ArithmeticOp::Add});
+            else if (node.TryAs<Sub>())
+                CompileBinary(node, {OpCode::Arith, nullptr, nullptr, ArithmeticOp::Sub});
+            else if (node.TryAs<Mult>())
+                CompileBinary(node, {OpCode::Arith, nullptr, nullptr, ArithmeticOp::Mult});
+            else if (node.TryAs<Div>())
+                CompileBinary(node, {OpCode::Arith, nullptr, nullptr, ArithmeticOp::Div});
+            else if (node.TryAs<Or>())
+                CompileBinary(node, {OpCode::Or});
+            else if (node.TryAs<And>())
+                CompileBinary(node, {OpCode::And});
+            else
+                Emit({OpCode::Opaque, &node});
+        }
+
+    private:
+        size_t Emit(Instruction instruction)
+        {
+            code.push_back(instruction);
+            return code.size() - 1;
+        }
+
+        void CompileBinary(Statement& node, Instruction instruction)
+        {
+            auto& binary = static_cast<BinaryOperation&>(node);
+            CompileExpression(*binary.Lhs());
+            CompileExpression(*binary.Rhs());
+            Emit(instruction);
+        }
+
+        void CompileBranches(size_t jump_to_else, Statement& if_body, Statement* else_body)
+        {
+            CompileStatement(if_body);
+            if (!else_body)
+            {
+                code[jump_to_else].target = code.size();
+                return;
+            }
+
+            size_t jump_to_end = Emit({OpCode::Jump});
+            code[jump_to_else].target = code.size();
+            CompileStatement(*else_body);
+            code[jump_to_end].target = code.size();
+        }
+
+        std::vector<Instruction>& code;
+    };
+
+    thread_local StackEvaluator* current = nullptr;
+}
+
+StackEvaluator::StackEvaluator(size_t max_depth, size_t max_nesting)
+    : max_depth(max_depth), max_nesting(max_nesting), previous(current)
+{
+    current = this;
+}
+
+StackEvaluator::~StackEvaluator()
+{
+    current = previous;
+}
+
+StackEvaluator* StackEvaluator::Current()
+{
+    return current;
+}
+
+const StackEvaluator::Code& StackEvaluator::CodeFor(Statement& body)
+{
+    auto& code = codes[&body];
+    if (!code)
+    {
+        code = std::make_unique<Code>();
+        Compiler(code->instructions).CompileStatement(body);
+        code->instructions.push_back({OpCode::ReturnNone});
+    }
+    return *code;
+}
+
+StackEvaluator::Frame& StackEvaluator::PushFrame(const Code& code)
+{
+    if (frames.size() >= max_depth)
+        throw RecursionError("Maximum recursion depth " + std::to_string(max_depth) + " exceeded");
+
+    std::unique_ptr<Frame> frame;
+    if (free_frames.empty())
+    {
+        frame = std::make_unique<Frame>();
+        ++frames_allocated;
+    }
+    else
+    {
+        frame = std::move(free_frames.back());
+        free_frames.pop_back();
+    }
+
+    frame->env = &frame->own;
+    frame->code = &code;
+    frame->pc = 0;
+    frame->stack_base = values.size();
+    frames.push_back(std::move(frame));
+    return *frames.back();
+}
+
+void StackEvaluator::PushMethodFrame(
+    const ObjectHolder& receiver, const std::string& method, const ObjectHolder* args, size_t count
+)
+{
+    auto instance = const_cast<ObjectHolder&>(receiver).TryAs<Runtime::ClassInstance>();
+    if (!instance)
+        throw std::runtime_error("Method " + method + " is called on non-instance");
+
+    if (!instance->HasMethod(method, count))
+        throw std::runtime_error(std::string("ClassInstance ") + instance->GetClass().GetName() +
+                " doesnt have method " + method + "(" + std::to_string(count) + ")");
+
+    auto met = instance->GetClass().GetMethod(method);
+    auto& frame = PushFrame(CodeFor(*met->body));
+    frame.own = instance->Fields();
+    frame.own["self"] = ObjectHolder::Share(*instance);
+    for (size_t i = 0; i < count; ++i)
+        frame.own[met->formal_params[i]] = args[i];
+    frame.receiver = receiver;
+}
+
+void StackEvaluator::ReuseFrame(
+    Frame& frame, ObjectHolder receiver, const std::string& method, std::vector<ObjectHolder> args
+)
+{
+    auto instance = receiver.TryAs<Runtime::ClassInstance>();
+    if (!instance)
+        throw std::runtime_error("Method " + method + " is called on non-instance");
+
+    if (!instance->HasMethod(method, args.size()))
+        throw std::runtime_error(std::string("ClassInstance ") + instance->GetClass().GetName() +
+                " doesnt have method " + method + "(" + std::to_string(args.size()) + ")");
+
+    auto met = instance->GetClass().GetMethod(method);
+    frame.code = &CodeFor(*met->body);
+    frame.pc = 0;
+    frame.own = instance->Fields();
+    frame.own["self"] = ObjectHolder::Share(*instance);
+    for (size_t i = 0; i < args.size(); ++i)
+        frame.own[met->formal_params[i]] = std::move(args[i]);
+    frame.env = &frame.own;
+    frame.receiver = std::move(receiver);
+}
+
+bool StackEvaluator::FinishFrame(ObjectHolder value, size_t entry_depth, ObjectHolder& result)
+{
+    auto frame = std::move(frames.back());
+    frames.pop_back();
+    values.resize(frame->stack_base);
+    frame->memo.Resolve(value);
+
+    ObjectHolder res = frame->constructed ? frame->constructed : std::move(value);
+    frame->own.clear();
+    frame->receiver = ObjectHolder();
+    frame->constructed = ObjectHolder();
+    free_frames.push_back(std::move(frame));
+
+    if (frames.size() == entry_depth)
+    {
+        result = std::move(res);
+        return true;
+    }
+
+    values.push_back(std::move(res));
+    return false;
+}
+
+void StackEvaluator::Unwind(size_t depth)
+{
+    while (frames.size() > depth)
+    {
+        ObjectHolder ignored;
+        frames.back()->memo.Discard();
+        FinishFrame(ObjectHolder(), frames.size() - 1, ignored);
+    }
+}
+
+ObjectHolder StackEvaluator::Run(Statement& program, Closure& closure)
+{
+    size_t depth = frames.size();
+    auto& frame = PushFrame(CodeFor(program));
+    frame.env = &closure;
+
+    try
+    {
+        return Loop(depth);
+    }
+    catch (...)
+    {
+        Unwind(depth);
+        throw;
+    }
+}
+
+ObjectHolder StackEvaluator::Call(
+    Runtime::ClassInstance& instance, const std::string& method, const std::vector<ObjectHolder>& actual_args
+)
+{
+    if (nesting >= max_nesting)
+        throw RecursionError("Maximum nesting " + std::to_string(max_nesting) + " of runtime calls exceeded");
+
+    struct NestingGuard
+    {
+        size_t& nesting;
+        explicit NestingGuard(size_t& nesting) : nesting(++nesting) {}
+        ~NestingGuard() { --nesting; }
+    } guard(nesting);
+
+    PendingMemo memo;
+    ObjectHolder cached;
+    if (memo.Lookup(instance, method, actual_args.data(), actual_args.size(), cached))
+        return cached;
+
+    size_t depth = frames.size();
+    try
+    {
+        PushMethodFrame(ObjectHolder::Share(instance), method, actual_args.data(), actual_args.size());
+        frames.back()->memo = std::move(memo);
+        return Loop(depth);
+    }
+    catch (...)
+    {
+        Unwind(depth);
+        throw;
+    }
+}
+
+ObjectHolder StackEvaluator::Loop(size_t entry_depth)
+{
+    ObjectHolder result;
+    auto pop = [this] {
+        auto value = std::move(values.back());
+        values.pop_back();
+        return value;
+    };
+
+    while (true)
+    {
+        Frame& frame = *frames.back();
+        const Instruction& ins = frame.code->instructions[frame.pc++];
+        Closure& env = *frame.env;
+
+        switch (ins.op)
+        {
+            case OpCode::Leaf:
+                values.push_back(ins.node->Execute(env));
+                break;
+
+            case OpCode::Opaque:
+            {
+                auto res = ins.node->Execute(env);
+                if (!res.IsNeedToReturn())
+                {
+                    values.push_back(std::move(res));
+                }
+                else if (auto call = res.TakeTailCall())
+                {
+                    ObjectHolder cached;
+                    auto instance = call->receiver.TryAs<Runtime::ClassInstance>();
+                    if (instance && frame.memo.Lookup(*instance, *call->method, call->args.data(), call->args.size(), cached))
+                    {
+                        if (FinishFrame(std::move(cached), entry_depth, result))
+                            return result;
+                        break;
+                    }
+
+                    values.resize(frame.stack_base);
+                    ReuseFrame(frame, std::move(call->receiver), *call->method, std::move(call->args));
+                }
+                else if (FinishFrame(std::move(res), entry_depth, result))
+                {
+                    return result;
+                }
+                break;
+            }
+
+            case OpCode::Pop:
+                values.pop_back();
+                break;
+
+            case OpCode::TouchVar:
+                env[*ins.name];
+                break;
+
+            case OpCode::ReadVar:
+                values.push_back(ReadSlot(env[*ins.name]));
+                break;
+
+            case OpCode::StoreVar:
+                env[*ins.name] = pop();
+                break;
+
+            case OpCode::BeginField:
+                AsFieldOwner(values.back()).Fields()[*ins.name];
+                break;
+
+            case OpCode::ReadField:
+            {
+                auto& fields = AsFieldOwner(values.back()).Fields();
+                values.push_back(ReadSlot(fields[*ins.name]));
+                break;
+            }
+
+            case OpCode::StoreField:
+            {
+                auto value = pop();
+                auto owner = pop();
+                AsFieldOwner(owner).Fields()[*ins.name] = std::move(value);
+                Runtime::ClassInstance::TouchFields();
+                break;
+            }
+
+            case OpCode::PrintSeparator:
+                Print::GetOutputStream() << " ";
+                break;
+
+            case OpCode::PrintValue:
+            {
+                auto value = pop();
+                if (value)
+                    value->Print(Print::GetOutputStream());
+                else
+                    Runtime::None{}.Print(Print::GetOutputStream());
+                break;
+            }
+
+            case OpCode::PrintNewline:
+                Print::GetOutputStream() << std::endl;
+                break;
+
+            case OpCode::Call:
+            {
+                size_t base = values.size() - ins.count - 1;
+                auto receiver = values[base];
+                PendingMemo memo;
+                ObjectHolder cached;
+                auto instance = receiver.TryAs<Runtime::ClassInstance>();
+                if (instance && memo.Lookup(*instance, *ins.name, values.data() + base + 1, ins.count, cached))
+                {
+                    values.resize(base);
+                    values.push_back(std::move(cached));
+                    break;
+                }
+
+                PushMethodFrame(receiver, *ins.name, values.data() + base + 1, ins.count);
+                values.resize(base);
+                frames.back()->stack_base = base;
+                frames.back()->memo = std::move(memo);
+                break;
+            }
+
+            case OpCode::New:
+            {
+                auto& new_instance = static_cast<NewInstance&>(*ins.node);
+                size_t base = values.size() - ins.count;
+                auto instance = ObjectHolder::Own(Runtime::ClassInstance(new_instance.class_));
+                if (instance.TryAs<Runtime::ClassInstance>()->HasMethod(INIT_METHOD, ins.count))
+                {
+                    PushMethodFrame(instance, INIT_METHOD, values.data() + base, ins.count);
+                    values.resize(base);
+                    frames.back()->stack_base = base;
+                    frames.back()->constructed = std::move(instance);
+                }
+                else
+                {
+                    values.resize(base);
+                    values.push_back(std::move(instance));
+                }
+                break;
+            }
+
+            case OpCode::TailCall:
+            {
+                size_t base = values.size() - ins.count - 1;
+                auto receiver = values[base];
+                ObjectHolder cached;
+                auto instance = receiver.TryAs<Runtime::ClassInstance>();
+                if (instance && frame.memo.Lookup(*instance, *ins.name, values.data() + base + 1, ins.count, cached))
+                {
+                    if (FinishFrame(std::move(cached), entry_depth, result))
+                        return result;
+                    break;
+                }
+
+                std::vector<ObjectHolder> args(values.begin() + base + 1, values.end());
+                values.resize(frame.stack_base);
+                ReuseFrame(frame, std::move(receiver), *ins.name, std::move(args));
+                break;
+            }
+
+            case OpCode::Stringify:
+            {
+                std::ostringstream os;
+                pop()->Print(os);
+                values.push_back(ObjectHolder::Own(Runtime::String(os.str())));
+                break;
+            }
+
+            case OpCode::Arith:
+            {
+                auto right = pop();
+                auto left = pop();
+                auto instance = left.TryAs<Runtime::ClassInstance>();
+                const char* method = OperatorMethod(ins.arith);
+                if (instance && instance->HasMethod(method, 1))
+                {
+                    size_t base = values.size();
+                    values.push_back(std::move(right));
+                    PushMethodFrame(left, method, values.data() + base, 1);
+                    values.resize(base);
+                    frames.back()->stack_base = base;
+                }
+                else
+                {
+                    values.push_back(CallOperator(std::move(left), std::move(right), ins.arith));
+                }
+                break;
+            }
+
+            case OpCode::Or:
+            {
+                auto right = pop();
+                auto left = pop();
+                values.push_back(ObjectHolder::Own(Runtime::Bool(left->IsTrue() || right->IsTrue())));
+                break;
+            }
+
+            case OpCode::And:
+            {
+                auto right = pop();
+                auto left = pop();
+                values.push_back(ObjectHolder::Own(Runtime::Bool(left->IsTrue() && right->IsTrue())));
+                break;
+            }
+
+            case OpCode::Not:
+            {
+                auto value = pop();
+                if (!value)
+                    throw std::runtime_error("Not: object is nullptr");
+
+                auto instance = value.TryAs<Runtime::ClassInstance>();
+                if (!instance)
+                {
+                    values.push_back(ObjectHolder::Own(Runtime::Bool(!value->IsTrue())));
+                    break;
+                }
+                if (!instance->HasMethod(NOT_METHOD, 0))
+                    throw std::runtime_error("Not: cls has no such method");
+
+                size_t base = values.size();
+                PushMethodFrame(value, NOT_METHOD, nullptr, 0);
+                frames.back()->stack_base = base;
+                break;
+            }
+
+            case OpCode::Compare:
+            {
+                auto right = pop();
+                auto left = pop();
+                auto& comparator = static_cast<Comparison&>(*ins.node).GetComparator();
+                values.push_back(ObjectHolder::Own(Runtime::Bool(comparator(left, right))));
+                break;
+            }
+
+            case OpCode::Jump:
+                frame.pc = ins.target;
+                break;
+
+            case OpCode::JumpIfFalse:
+                if (!pop()->IsTrue())
+                    frame.pc = ins.target;
+                break;
+
+            case OpCode::CompareJump:
+            {
+                auto right = pop();
+                auto left = pop();
+                if (!static_cast<IfCompare&>(*ins.node).GetComparator()(left, right))
+                    frame.pc = ins.target;
+                break;
+            }
+
+            case OpCode::Return:
+                if (FinishFrame(pop(), entry_depth, result))
+                    return result;
+                break;
+
+            case OpCode::ReturnNone:
+                if (FinishFrame(ObjectHolder(), entry_depth, result))
+                    return result;
+                break;
+        }
+    }
+}
+
+} /* namespace Ast */
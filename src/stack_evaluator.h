@@ -0,0 +1,77 @@
+#pragma once
+
+#include "statement.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+struct RecursionError : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+// Evaluator which does not recurse on the native stack.
+// Every executed tree (the program and method bodies) is compiled on first use
+// into a linear code for a stack machine. Mython frames live in a heap-allocated
+// stack, finished frames go to a free list and are reused by later calls.
+//
+// Calls made by the runtime itself (__str__ from print, __eq__/__lt__ from
+// comparisons) come through ClassInstance::Call and are run by a nested loop
+// of the same evaluator, so only such calls take native stack
+class StackEvaluator {
+public:
+  explicit StackEvaluator(size_t max_depth = 100000, size_t max_nesting = 200);
+  ~StackEvaluator();
+
+  StackEvaluator(const StackEvaluator&) = delete;
+  StackEvaluator& operator=(const StackEvaluator&) = delete;
+
+  ObjectHolder Run(Statement& program, Runtime::Closure& closure);
+  ObjectHolder Call(
+    Runtime::ClassInstance& instance,
+    const std::string& method,
+    const std::vector<ObjectHolder>& actual_args
+  );
+
+  // The innermost evaluator alive on the current thread, or nullptr
+  static StackEvaluator* Current();
+
+  size_t FramesAllocated() const {
+    return frames_allocated;
+  }
+
+  struct Code;
+  struct Frame;
+
+private:
+  const Code& CodeFor(Statement& body);
+  Frame& PushFrame(const Code& code);
+  void PushMethodFrame(const ObjectHolder& receiver, const std::string& method, const ObjectHolder* args, size_t count);
+  // Tail calls run the callee in the frame of the caller
+  void ReuseFrame(Frame& frame, ObjectHolder receiver, const std::string& method, std::vector<ObjectHolder> args);
+  ObjectHolder Loop(size_t entry_depth);
+  bool FinishFrame(ObjectHolder value, size_t entry_depth, ObjectHolder& result);
+  void Unwind(size_t depth);
+
+  size_t max_depth;
+  size_t max_nesting;
+  size_t nesting = 0;
+  size_t frames_allocated = 0;
+
+  std::unordered_map<const Statement*, std::unique_ptr<Code>> codes;
+  std::vector<std::unique_ptr<Frame>> frames;
+  std::vector<std::unique_ptr<Frame>> free_frames;
+  std::vector<ObjectHolder> values;
+
+  StackEvaluator* previous;
+};
+
+void RunStackEvaluatorTests(TestRunner& tr);
+
+} /* namespace Ast */
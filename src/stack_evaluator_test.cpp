@@ -0,0 +1,120 @@
+#include "stack_evaluator.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Run(StackEvaluator& evaluator, const string& program) {
+  auto tree = ParseProgramFromString(program);
+
+  ostringstream output;
+  Print::SetOutputStream(output);
+  Runtime::Closure closure;
+  evaluator.Run(*tree, closure);
+  return output.str();
+}
+
+const string SUM_PROGRAM = R"(
+class Summator:
+  def sum(n):
+    if n == 0:
+      return 0
+    return n + self.sum(n - 1)
+
+s = Summator()
+)";
+
+}
+
+void TestDeepRecursion() {
+  StackEvaluator evaluator;
+  ASSERT_EQUAL(Run(evaluator, SUM_PROGRAM + "print s.sum(50000)\n"), "1250025000\n");
+}
+
+void TestDepthLimitIsCatchable() {
+  StackEvaluator evaluator(1000);
+  ASSERT_THROWS(Run(evaluator, SUM_PROGRAM + "print s.sum(5000)\n"), RecursionError);
+  // The evaluator is usable after the error
+  ASSERT_EQUAL(Run(evaluator, SUM_PROGRAM + "print s.sum(500)\n"), "125250\n");
+}
+
+void TestFramesAreReused() {
+  StackEvaluator evaluator;
+  string program = SUM_PROGRAM;
+  for (int i = 0; i < 100; ++i) {
+    program += "x = s.sum(10)\n";
+  }
+  Run(evaluator, program);
+  // The program frame and a chain of 11 nested calls
+  ASSERT_EQUAL(evaluator.FramesAllocated(), 12u);
+}
+
+void TestRuntimeCallsAreNested() {
+  const string program = R"(
+class Node:
+  def __init__():
+    self.next = 0
+
+  def __str__():
+    return str(self.next)
+
+class Builder:
+  def build(n):
+    if n > 0:
+      node = Node()
+      node.next = self.build(n - 1)
+      return node
+    return 7
+)";
+
+  {
+    StackEvaluator evaluator;
+    ASSERT_EQUAL(Run(evaluator, program + "b = Builder()\nprint b.build(50)\n"), "7\n");
+  }
+  {
+    StackEvaluator evaluator(100000, 20);
+    ASSERT_THROWS(Run(evaluator, program + "b = Builder()\nprint b.build(50)\n"), RecursionError);
+  }
+}
+
+void TestOperatorsAndConstructors() {
+  const string program = R"(
+class Vec:
+  def __init__(x, y):
+    self.x = x
+    self.y = y
+
+  def __add__(other):
+    return self.x + other.x + self.y + other.y
+
+  def __str__():
+    return '(' + str(self.x) + ', ' + str(self.y) + ')'
+
+a = Vec(1, 2)
+b = Vec(10, 20)
+print a, a + b, not 0, 1 < 2 and 'a' < 'b'
+)";
+
+  StackEvaluator evaluator;
+  ASSERT_EQUAL(Run(evaluator, program), "(1, 2) 33 True True\n");
+}
+
+void RunStackEvaluatorTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestDeepRecursion);
+  RUN_TEST(tr, Ast::TestDepthLimitIsCatchable);
+  RUN_TEST(tr, Ast::TestFramesAreReused);
+  RUN_TEST(tr, Ast::TestRuntimeCallsAreNested);
+  RUN_TEST(tr, Ast::TestOperatorsAndConstructors);
+}
+
+} /* namespace Ast */
@@ -105,6 +105,11 @@ VariableValue::VariableValue(std::vector<std::string> dotted_ids)
 
 
 Result VariableValue::Execute(Closure& closure)
+{
+    return ReadVariable(closure, dotted_ids);
+}
+
+ObjectHolder ReadVariable(Closure& closure, const std::vector<std::string>& dotted_ids)
 {
     auto& inner = GetClosure(closure, dotted_ids, VAR_STR);
 
@@ -135,6 +140,11 @@ Result Assignment::Execute(Closure& closure)
     return obj;
 }
 
+void Assignment::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(rv);
+}
+
 // FieldAssignment
 FieldAssignment::FieldAssignment(
   VariableValue object, std::string field_name, std::unique_ptr<Statement> rv
@@ -149,15 +159,25 @@ FieldAssignment::FieldAssignment(
 
 Result FieldAssignment::Execute(Runtime::Closure& closure)
 {
-    auto pCls = object.Execute(closure);
-    if (pCls->GetType() != Runtime::IObject::Type::Instance)
-        Throw(FIELD_STR, "");
-
-    auto &res = pCls.GetAs<Runtime::ClassInstance>()->Fields()[field_name];
+    auto &res = FieldsOf(object.Execute(closure))[field_name];
     res = right_value->Execute(closure);
+    Runtime::ClassInstance::TouchFields();
     return res;
 }
 
+Closure& FieldsOf(ObjectHolder object)
+{
+    if (object->GetType() != Runtime::IObject::Type::Instance)
+        Throw(FIELD_STR, "");
+
+    return object.GetAs<Runtime::ClassInstance>()->Fields();
+}
+
+void FieldAssignment::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(right_value);
+}
+
 // Print
 //
 
@@ -188,24 +208,37 @@ Result Print::Execute(Closure& closure)
         else
             (*output) << " ";
 
-        auto res = (*it)->Execute(closure);
-        if (res)
-            res->Print(*output);
-        else
-            Runtime::None{}.Print(*output);
-
+        PrintValue(*output, (*it)->Execute(closure));
     }
     (*output) << std::endl;
 
     return ObjectHolder();
 }
 
+void PrintValue(std::ostream& output, ObjectHolder value)
+{
+    if (value)
+        value->Print(output);
+    else
+        Runtime::None{}.Print(output);
+}
+
+void Print::ForEachChild(const ChildVisitor& visitor)
+{
+    for (auto& arg : args)
+        visitor(arg);
+}
+
 ostream* Print::output = &cout;
 
 void Print::SetOutputStream(ostream& output_stream) {
   output = &output_stream;
 }
 
+ostream& Print::GetOutputStream() {
+  return *output;
+}
+
 // MethodCall
 //
 
@@ -218,10 +251,47 @@ MethodCall::MethodCall(
 {
 }
 
+void MethodCall::Prime(const Runtime::Class& cls)
+{
+    auto met = cls.GetMethod(method);
+    cache.cls = &cls;
+    cache.method = met && met->formal_params.size() == args.size() ? met : nullptr;
+}
+
+Runtime::ClassInstance& MethodCall::Receiver(ObjectHolder& receiver)
+{
+    auto& instance = ReceiverOf(receiver, method);
+    if (&instance.GetClass() != cache.cls)
+        Prime(instance.GetClass());
+
+    return instance;
+}
+
+Runtime::ClassInstance& ReceiverOf(ObjectHolder& receiver, const std::string& method)
+{
+    auto instance = receiver.TryAs<Runtime::ClassInstance>();
+    if (!instance)
+        throw std::runtime_error("Method " + method + " is called on non-instance");
+
+    return *instance;
+}
+
+Result MethodCall::CallOn(ObjectHolder receiver, Closure& closure)
+{
+    auto& instance = Receiver(receiver);
+    return instance.Call(method, ActualizeArgs(args, closure), cache.method);
+}
+
 Result MethodCall::Execute(Closure& closure)
 {
-    auto obj = object->Execute(closure);
-    return obj.GetAs<Runtime::ClassInstance>()->Call(method, std::move(ActualizeArgs(args, closure)));
+    return CallOn(object->Execute(closure), closure);
+}
+
+void MethodCall::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(object);
+    for (auto& arg : args)
+        visitor(arg);
 }
 
 // NewInstance
@@ -241,15 +311,25 @@ NewInstance::NewInstance(const Runtime::Class& class_)
 }
 
 Result NewInstance::Execute(Runtime::Closure& closure) 
+{
+    return Instantiate(class_, ActualizeArgs(args, closure));
+}
+
+ObjectHolder Instantiate(const Runtime::Class& class_, const std::vector<ObjectHolder>& actualArgs)
 {
     auto cls = Runtime::ClassInstance(class_);
-    auto actualArgs = ActualizeArgs(args, closure);
     if (cls.HasMethod(initFunc, actualArgs.size()))
         cls.Call(initFunc, actualArgs);
 
     return ObjectHolder::Own(std::move(cls));
 }
 
+void NewInstance::ForEachChild(const ChildVisitor& visitor)
+{
+    for (auto& arg : args)
+        visitor(arg);
+}
+
 // Stringify
 //
 
@@ -258,8 +338,13 @@ Result Stringify::Execute(Closure& closure)
     if (!argument)
         throw std::runtime_error("Stringify: no argument");
 
+    return StringifyValue(argument->Execute(closure));
+}
+
+ObjectHolder StringifyValue(ObjectHolder value)
+{
     std::ostringstream os;
-    argument->Execute(closure)->Print(os);
+    value->Print(os);
     
     return ObjectHolder::Own(Runtime::String(os.str()));
 }
@@ -267,13 +352,7 @@ Result Stringify::Execute(Closure& closure)
 // BinaryOps
 //
 namespace {
-    enum class Op
-    {
-        Add,
-        Sub,
-        Mult,
-        Div,
-    };
+    using Op = ArithmeticOp;
 
     std::map<Op, std::string> opToStr = {
         {Op::Add, "__add__"},
@@ -397,6 +476,12 @@ Result Compound::Execute(Closure& closure)
     return Result();
 }
 
+void Compound::ForEachChild(const ChildVisitor& visitor)
+{
+    for (auto& st : statements)
+        visitor(st);
+}
+
 // Return
 Result Return::Execute(Closure& closure)
 {
@@ -405,15 +490,31 @@ Result Return::Execute(Closure& closure)
     return res;
 }
 
+void Return::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(statement);
+}
+
 ClassDefinition::ClassDefinition(ObjectHolder class_)
     : cls(std::move(class_)), class_name(cls.GetAs<Runtime::Class>()->GetName())
 {
 }
 
+Runtime::Class& ClassDefinition::GetClass()
+{
+    return *cls.TryAs<Runtime::Class>();
+}
+
 Result ClassDefinition::Execute(Runtime::Closure& closure) {
     return cls;
 }
 
+void ClassDefinition::ForEachChild(const ChildVisitor& visitor)
+{
+    for (auto& method : GetClass().Methods())
+        visitor(method.body);
+}
+
 // IfElse
 //
 IfElse::IfElse(
@@ -441,13 +542,23 @@ Result IfElse::Execute(Runtime::Closure& closure) {
     return res;
 }
 
+void IfElse::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(condition);
+    visitor(if_body);
+    if (else_body)
+        visitor(else_body);
+}
+
 // Not
 //
 
 Result Not::Execute(Runtime::Closure& closure) {
+    return NotValue(argument->Execute(closure));
+}
 
-    ObjectHolder res;
-    auto obj = argument->Execute(closure);
+ObjectHolder NotValue(ObjectHolder obj)
+{
     if (!obj)
         Throw("Not", "object is nullptr");
 
@@ -482,4 +593,10 @@ Result Comparison::Execute(Runtime::Closure& closure) {
     return ObjectHolder::Own(Runtime::Bool(comparator(left->Execute(closure), right->Execute(closure))));
 }
 
+void Comparison::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(left);
+    visitor(right);
+}
+
 } /* namespace Ast */
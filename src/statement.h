@@ -14,6 +14,15 @@ class TestRunner;
 
 namespace Ast {
 
+// A method call in tail position is not performed by the frame that reached it:
+// it is handed over to ClassInstance::Call, which runs it in its own loop
+struct TailCallRequest
+{
+    ObjectHolder receiver;
+    const std::string* method;
+    std::vector<ObjectHolder> args;
+};
+
 struct Result : public ObjectHolder
 {
     Result() = default;
@@ -33,19 +42,45 @@ struct Result : public ObjectHolder
         needToReturn = true;
     }
 
+    void SetTailCall(std::shared_ptr<TailCallRequest> call)
+    {
+        tailCall = std::move(call);
+        needToReturn = true;
+    }
+
+    std::shared_ptr<TailCallRequest> TakeTailCall()
+    {
+        return std::move(tailCall);
+    }
+
 private:
     bool needToReturn = false;
+    std::shared_ptr<TailCallRequest> tailCall;
 };
 
+class Statement;
+
+// Passes over the tree receive every owned child by reference, so they can
+// both inspect and replace it
+using ChildVisitor = std::function<void(std::unique_ptr<Statement>&)>;
+
 class Statement {
 public:
   virtual ~Statement() = default;
   virtual Result Execute(Runtime::Closure& closure) = 0;
 
+  virtual void ForEachChild(const ChildVisitor&) {}
+
   template <typename T>
   T* TryAs()
   {
-      return dynamic_cast<T>(this);
+      return dynamic_cast<T*>(this);
+  }
+
+  template <typename T>
+  const T* TryAs() const
+  {
+      return dynamic_cast<const T*>(this);
   }
 };
 
@@ -79,6 +114,7 @@ struct Assignment : Statement {
 
   Assignment(std::string var, std::unique_ptr<Statement> rv);
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 };
 
 struct FieldAssignment : Statement {
@@ -88,6 +124,7 @@ struct FieldAssignment : Statement {
 
   FieldAssignment(VariableValue object, std::string field_name, std::unique_ptr<Statement> rv);
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 };
 
 struct None : Statement {
@@ -103,9 +140,15 @@ public:
 
   static std::unique_ptr<Print> Variable(std::string name);
 
+  std::vector<std::unique_ptr<Statement>>& Args() {
+    return args;
+  }
+
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 
   static void SetOutputStream(std::ostream& output_stream);
+  static std::ostream& GetOutputStream();
 
 private:
   std::vector<std::unique_ptr<Statement>> args;
@@ -117,13 +160,27 @@ struct MethodCall : Statement {
   std::string method;
   std::vector<std::unique_ptr<Statement>> args;
 
+  // The method found for the receiver class of the last call
+  struct InlineCache {
+    const Runtime::Class* cls = nullptr;
+    const Runtime::Method* method = nullptr;
+  } cache;
+
   MethodCall(
     std::unique_ptr<Statement> object,
     std::string method,
     std::vector<std::unique_ptr<Statement>> args
   );
 
+  // Fills the cache for the receivers of class cls
+  void Prime(const Runtime::Class& cls);
+  // Checks that the receiver is an instance and fills the cache for its class
+  Runtime::ClassInstance& Receiver(ObjectHolder& receiver);
+  // Calls the method on an evaluated receiver
+  Result CallOn(ObjectHolder receiver, Runtime::Closure& closure);
+
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 };
 
 struct NewInstance : Statement {
@@ -133,6 +190,7 @@ struct NewInstance : Statement {
   NewInstance(const Runtime::Class& class_);
   NewInstance(const Runtime::Class& class_, std::vector<std::unique_ptr<Statement>> args);
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 };
 
 class UnaryOperation : public Statement {
@@ -142,6 +200,14 @@ public:
           throw std::runtime_error("UnaryOperation: arg is missed");
   }
 
+  std::unique_ptr<Statement>& Argument() {
+    return argument;
+  }
+
+  void ForEachChild(const ChildVisitor& visitor) override {
+    visitor(argument);
+  }
+
 protected:
   std::unique_ptr<Statement> argument;
 };
@@ -162,6 +228,19 @@ public:
           throw std::runtime_error("BinaryOperation: args are missed");
   }
 
+  std::unique_ptr<Statement>& Lhs() {
+    return lhs;
+  }
+
+  std::unique_ptr<Statement>& Rhs() {
+    return rhs;
+  }
+
+  void ForEachChild(const ChildVisitor& visitor) override {
+    visitor(lhs);
+    visitor(rhs);
+  }
+
 protected:
   std::unique_ptr<Statement> lhs, rhs;
 };
@@ -219,7 +298,12 @@ public:
     statements.push_back(std::move(stmt));
   }
 
+  std::vector<std::unique_ptr<Statement>>& Statements() {
+    return statements;
+  }
+
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 
 private:
   std::vector<std::unique_ptr<Statement>> statements;
@@ -232,7 +316,12 @@ public:
   {
   }
 
+  std::unique_ptr<Statement>& Value() {
+    return statement;
+  }
+
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 
 private:
   std::unique_ptr<Statement> statement;
@@ -242,7 +331,11 @@ class ClassDefinition : public Statement {
 public:
   explicit ClassDefinition(ObjectHolder cls);
 
+  Runtime::Class& GetClass();
+
   Result Execute(Runtime::Closure& closure) override;
+  // Visits the bodies of the class methods
+  void ForEachChild(const ChildVisitor& visitor) override;
 
 private:
   ObjectHolder cls;
@@ -257,7 +350,20 @@ public:
     std::unique_ptr<Statement> else_body
   );
 
+  std::unique_ptr<Statement>& Condition() {
+    return condition;
+  }
+
+  std::unique_ptr<Statement>& IfBody() {
+    return if_body;
+  }
+
+  std::unique_ptr<Statement>& ElseBody() {
+    return else_body;
+  }
+
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 
 private:
   std::unique_ptr<Statement> condition, if_body, else_body;
@@ -273,13 +379,53 @@ public:
     std::unique_ptr<Statement> rhs
   );
 
+  const Comparator& GetComparator() const {
+    return comparator;
+  }
+
+  std::unique_ptr<Statement>& Lhs() {
+    return left;
+  }
+
+  std::unique_ptr<Statement>& Rhs() {
+    return right;
+  }
+
   Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
 
 private:
   Comparator comparator;
   std::unique_ptr<Statement> left, right;
 };
 
+enum class ArithmeticOp
+{
+    Add,
+    Sub,
+    Mult,
+    Div,
+};
+
+// Shared by Add/Sub/Mult/Div and by the nodes that replace them:
+// numbers, string concatenation and user-defined __add__ and friends
+ObjectHolder CallOperator(ObjectHolder left, ObjectHolder right, ArithmeticOp op);
+
+// Operations of the other nodes on evaluated operands, shared with the C++
+// the programs are translated into (see cpp_emitter.h)
+
+// a.b.c, an unset variable reads as None
+ObjectHolder ReadVariable(Runtime::Closure& closure, const std::vector<std::string>& dotted_ids);
+// The fields of the object of a field assignment
+Runtime::Closure& FieldsOf(ObjectHolder object);
+// The receiver of a method call, checked before the arguments are evaluated
+Runtime::ClassInstance& ReceiverOf(ObjectHolder& receiver, const std::string& method);
+ObjectHolder Instantiate(const Runtime::Class& cls, const std::vector<ObjectHolder>& args);
+ObjectHolder StringifyValue(ObjectHolder value);
+ObjectHolder NotValue(ObjectHolder value);
+// One argument of print
+void PrintValue(std::ostream& output, ObjectHolder value);
+
 void RunUnitTests(TestRunner& tr);
 
 }
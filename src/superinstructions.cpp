@@ -0,0 +1,247 @@
+#include "superinstructions.h"
+#include "object.h"
+#include "object_holder.h"
+#include "type_inference.h"
+
+#include <optional>
+#include <stdexcept>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    // An unset value reads as None, the same way VariableValue does
+    ObjectHolder ReadSlot(const ObjectHolder& slot)
+    {
+        if (!slot)
+            return ObjectHolder::Own(Runtime::None());
+        return slot;
+    }
+
+    ObjectHolder Apply(ArithmeticOp op, ObjectHolder left, ObjectHolder right)
+    {
+        auto* l = left.TryAs<Runtime::Number>();
+        auto* r = right.TryAs<Runtime::Number>();
+        if (!l || !r || op == ArithmeticOp::Div)
+            return CallOperator(std::move(left), std::move(right), op);
+
+        switch (op)
+        {
+            case ArithmeticOp::Add:
+                return ObjectHolder::Own(Runtime::Number(l->GetValue() + r->GetValue()));
+            case ArithmeticOp::Sub:
+                return ObjectHolder::Own(Runtime::Number(l->GetValue() - r->GetValue()));
+            default:
+                return ObjectHolder::Own(Runtime::Number(l->GetValue() * r->GetValue()));
+        }
+    }
+
+    std::optional<ArithmeticOp> GetArithmeticOp(Statement& st)
+    {
+        if (st.TryAs<Add>())
+            return ArithmeticOp::Add;
+        if (st.TryAs<Sub>())
+            return ArithmeticOp::Sub;
+        if (st.TryAs<Mult>())
+            return ArithmeticOp::Mult;
+        if (st.TryAs<Div>())
+            return ArithmeticOp::Div;
+        return std::nullopt;
+    }
+
+    bool IsVariable(const Statement& st, const std::vector<std::string>& dotted_ids)
+    {
+        auto var = st.TryAs<VariableValue>();
+        return var && var->dotted_ids == dotted_ids;
+    }
+
+    // x = x <op> rhs
+    std::unique_ptr<Statement> TryFuseAssignment(Assignment& assign)
+    {
+        auto op = GetArithmeticOp(*assign.rv);
+        if (!op)
+            return nullptr;
+
+        auto& binary = static_cast<BinaryOperation&>(*assign.rv);
+        if (!IsVariable(*binary.Lhs(), {assign.var}))
+            return nullptr;
+
+        return std::make_unique<VariableUpdate>(assign.var, *op, std::move(binary.Rhs()));
+    }
+
+    // obj.field = obj.field <op> rhs
+    std::unique_ptr<Statement> TryFuseFieldAssignment(FieldAssignment& assign)
+    {
+        auto op = GetArithmeticOp(*assign.right_value);
+        if (!op)
+            return nullptr;
+
+        auto& binary = static_cast<BinaryOperation&>(*assign.right_value);
+        auto ids = assign.object.dotted_ids;
+        ids.push_back(assign.field_name);
+        if (!IsVariable(*binary.Lhs(), ids))
+            return nullptr;
+
+        return std::make_unique<FieldUpdate>(
+            std::move(assign.object), std::move(assign.field_name), *op, std::move(binary.Rhs())
+        );
+    }
+
+    std::unique_ptr<Statement> TryFuseReturn(Return& ret)
+    {
+        auto var = ret.Value()->TryAs<VariableValue>();
+        if (!var)
+            return nullptr;
+
+        return std::make_unique<ReturnVariable>(std::move(*var));
+    }
+
+    std::unique_ptr<Statement> TryFuseIfElse(IfElse& if_else)
+    {
+        // Typed comparisons already give an unboxed bool
+        if (dynamic_cast<BoolExpression*>(if_else.Condition().get()))
+            return nullptr;
+
+        auto cmp = if_else.Condition()->TryAs<Comparison>();
+        if (!cmp)
+            return nullptr;
+
+        return std::make_unique<IfCompare>(
+            cmp->GetComparator(), std::move(cmp->Lhs()), std::move(cmp->Rhs()),
+            std::move(if_else.IfBody()), std::move(if_else.ElseBody())
+        );
+    }
+
+    std::unique_ptr<Statement> TryFuse(Statement& st)
+    {
+        if (auto p = st.TryAs<Assignment>())
+            return TryFuseAssignment(*p);
+        if (auto p = st.TryAs<FieldAssignment>())
+            return TryFuseFieldAssignment(*p);
+        if (auto p = st.TryAs<Return>())
+            return TryFuseReturn(*p);
+        if (auto p = st.TryAs<IfElse>())
+            return TryFuseIfElse(*p);
+        return nullptr;
+    }
+}
+
+// FieldUpdate
+//
+FieldUpdate::FieldUpdate(VariableValue object, std::string field_name, ArithmeticOp op, std::unique_ptr<Statement> rhs)
+    : object(std::move(object)), field_name(std::move(field_name)), op(op), rhs(std::move(rhs))
+{
+}
+
+Result FieldUpdate::Execute(Closure& closure)
+{
+    // The slot is added before it is read, as FieldAssignment does, so a missing
+    // field reads as None
+    auto& fields = FieldsOf(object.Execute(closure));
+    auto current = ReadSlot(fields[field_name]);
+    auto res = Apply(op, std::move(current), rhs->Execute(closure));
+    // rhs may have added fields, so the slot is looked up once again
+    fields[field_name] = res;
+    Runtime::ClassInstance::TouchFields();
+    return res;
+}
+
+void FieldUpdate::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(rhs);
+}
+
+// VariableUpdate
+//
+VariableUpdate::VariableUpdate(std::string var, ArithmeticOp op, std::unique_ptr<Statement> rhs)
+    : var(std::move(var)), op(op), rhs(std::move(rhs))
+{
+}
+
+Result VariableUpdate::Execute(Closure& closure)
+{
+    // The slot is added before it is read, as Assignment does
+    auto current = ReadSlot(closure[var]);
+    auto res = Apply(op, std::move(current), rhs->Execute(closure));
+    closure[var] = res;
+    return res;
+}
+
+void VariableUpdate::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(rhs);
+}
+
+// ReturnVariable
+//
+ReturnVariable::ReturnVariable(VariableValue variable)
+    : variable(std::move(variable))
+{
+}
+
+Result ReturnVariable::Execute(Closure& closure)
+{
+    Result res(variable.Execute(closure));
+    res.SetNeedToReturn();
+    return res;
+}
+
+// IfCompare
+//
+IfCompare::IfCompare(
+    Comparison::Comparator comparator,
+    std::unique_ptr<Statement> lhs,
+    std::unique_ptr<Statement> rhs,
+    std::unique_ptr<Statement> if_body,
+    std::unique_ptr<Statement> else_body
+)
+    : comparator(std::move(comparator)), lhs(std::move(lhs)), rhs(std::move(rhs))
+    , if_body(std::move(if_body)), else_body(std::move(else_body))
+{
+    if (!this->lhs || !this->rhs || !this->if_body)
+        throw std::runtime_error("IfCompare: arguments are missed");
+}
+
+Result IfCompare::Execute(Closure& closure)
+{
+    // Same expression as in Comparison::Execute, so operands are evaluated in the same order
+    if (comparator(lhs->Execute(closure), rhs->Execute(closure)))
+        return if_body->Execute(closure);
+    else if (else_body)
+        return else_body->Execute(closure);
+
+    return Result();
+}
+
+void IfCompare::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(lhs);
+    visitor(rhs);
+    visitor(if_body);
+    if (else_body)
+        visitor(else_body);
+}
+
+// Free
+//
+size_t FuseSuperinstructions(std::unique_ptr<Statement>& root)
+{
+    size_t fused = 0;
+    root->ForEachChild([&fused](std::unique_ptr<Statement>& child) {
+        fused += FuseSuperinstructions(child);
+    });
+
+    if (auto replacement = TryFuse(*root))
+    {
+        root = std::move(replacement);
+        ++fused;
+    }
+
+    return fused;
+}
+
+} /* namespace Ast */
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "statement.h"
+
+#include <memory>
+#include <string>
+
+class TestRunner;
+
+namespace Ast {
+
+// Superinstructions replace the most frequent chains of nodes with a single
+// node doing the same work in one Execute call
+
+// obj.field = obj.field <op> rhs
+class FieldUpdate : public Statement {
+public:
+  FieldUpdate(VariableValue object, std::string field_name, ArithmeticOp op, std::unique_ptr<Statement> rhs);
+
+  VariableValue& Object() {
+    return object;
+  }
+
+  const std::string& FieldName() const {
+    return field_name;
+  }
+
+  ArithmeticOp Op() const {
+    return op;
+  }
+
+  std::unique_ptr<Statement>& Rhs() {
+    return rhs;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  VariableValue object;
+  std::string field_name;
+  ArithmeticOp op;
+  std::unique_ptr<Statement> rhs;
+};
+
+// var = var <op> rhs
+class VariableUpdate : public Statement {
+public:
+  VariableUpdate(std::string var, ArithmeticOp op, std::unique_ptr<Statement> rhs);
+
+  const std::string& Var() const {
+    return var;
+  }
+
+  ArithmeticOp Op() const {
+    return op;
+  }
+
+  std::unique_ptr<Statement>& Rhs() {
+    return rhs;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::string var;
+  ArithmeticOp op;
+  std::unique_ptr<Statement> rhs;
+};
+
+// return var / return obj.field
+class ReturnVariable : public Statement {
+public:
+  explicit ReturnVariable(VariableValue variable);
+
+  VariableValue& Variable() {
+    return variable;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  VariableValue variable;
+};
+
+// if lhs <cmp> rhs: ... else: ...
+// The comparison result is used directly, without boxing it into Runtime::Bool
+class IfCompare : public Statement {
+public:
+  IfCompare(
+    Comparison::Comparator comparator,
+    std::unique_ptr<Statement> lhs,
+    std::unique_ptr<Statement> rhs,
+    std::unique_ptr<Statement> if_body,
+    std::unique_ptr<Statement> else_body
+  );
+
+  const Comparison::Comparator& GetComparator() const {
+    return comparator;
+  }
+
+  std::unique_ptr<Statement>& Lhs() {
+    return lhs;
+  }
+
+  std::unique_ptr<Statement>& Rhs() {
+    return rhs;
+  }
+
+  std::unique_ptr<Statement>& IfBody() {
+    return if_body;
+  }
+
+  std::unique_ptr<Statement>& ElseBody() {
+    return else_body;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  Comparison::Comparator comparator;
+  std::unique_ptr<Statement> lhs, rhs, if_body, else_body;
+};
+
+// Rewrites the tree (method bodies included) in place.
+// Returns the number of created superinstructions
+size_t FuseSuperinstructions(std::unique_ptr<Statement>& root);
+
+void RunSuperinstructionsTests(TestRunner& tr);
+
+} /* namespace Ast */
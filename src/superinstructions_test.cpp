@@ -0,0 +1,124 @@
+#include "superinstructions.h"
+#include "instrumentation.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+const string COUNTER_PROGRAM = R"(
+class Counter:
+  def __init__():
+    self.value = 0
+
+  def add(step):
+    self.value = self.value + step
+
+  def get():
+    return self.value
+
+  def run(n):
+    if n > 0:
+      self.add(2)
+      x = n
+      x = x - 1
+      return self.run(x)
+    return self.get()
+
+c = Counter()
+print c.run(10)
+s = 'a'
+s = s + 'b'
+print s
+)";
+
+}
+
+void TestIdiomsAreFused() {
+  auto program = ParseProgramFromString(COUNTER_PROGRAM);
+  // field update, return self.value, if n > 0, x = x - 1, s = s + 'b'
+  ASSERT_EQUAL(FuseSuperinstructions(program), 5u);
+  ASSERT_EQUAL(Execute(*program), "20\nab\n");
+}
+
+void TestFusionReducesDispatches() {
+  auto plain = ParseProgramFromString(COUNTER_PROGRAM);
+  auto fused = ParseProgramFromString(COUNTER_PROGRAM);
+  FuseSuperinstructions(fused);
+
+  DispatchStats plain_stats, fused_stats;
+  InstrumentDispatches(plain, plain_stats);
+  InstrumentDispatches(fused, fused_stats);
+
+  ASSERT_EQUAL(Execute(*plain), Execute(*fused));
+  ASSERT_EQUAL(plain_stats.statements, fused_stats.statements);
+  ASSERT(fused_stats.PerStatement() < plain_stats.PerStatement());
+}
+
+void TestFusedUpdateCallsUserOperator() {
+  auto program = ParseProgramFromString(R"(
+class Vec:
+  def __init__(x):
+    self.x = x
+
+  def __add__(other):
+    return self.x + other.x
+
+class Holder:
+  def __init__():
+    self.v = Vec(1)
+
+  def grow():
+    self.v = self.v + Vec(2)
+
+h = Holder()
+h.grow()
+print h.v
+)");
+
+  FuseSuperinstructions(program);
+  ASSERT_EQUAL(Execute(*program), "3\n");
+}
+
+void TestFusedUpdateOfUndefinedVariableThrows() {
+  // The same error and the same slots as the assignment the update replaces
+  const string a = "class A:\n  def f():\n    return 1\n\na = A()\n";
+  for (const string update : {"x = x + 1\n", "a.y = a.y + 1\n", "b.y = b.y + 1\n"}) {
+    string errors[2];
+    Runtime::Closure closures[2];
+    for (bool fuse : {false, true}) {
+      auto program = ParseProgramFromString(a + update);
+      if (fuse) {
+        ASSERT_EQUAL(FuseSuperinstructions(program), 1u);
+      }
+      try {
+        program->Execute(closures[fuse]);
+      } catch (const std::runtime_error& e) {
+        errors[fuse] = e.what();
+      }
+    }
+    ASSERT(!errors[0].empty());
+    ASSERT_EQUAL(errors[1], errors[0]);
+    ASSERT_EQUAL(closures[1].count("x"), closures[0].count("x"));
+    ASSERT_EQUAL(closures[1].at("a").TryAs<Runtime::ClassInstance>()->Fields().count("y"),
+                 closures[0].at("a").TryAs<Runtime::ClassInstance>()->Fields().count("y"));
+  }
+}
+
+void RunSuperinstructionsTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestIdiomsAreFused);
+  RUN_TEST(tr, Ast::TestFusionReducesDispatches);
+  RUN_TEST(tr, Ast::TestFusedUpdateCallsUserOperator);
+  RUN_TEST(tr, Ast::TestFusedUpdateOfUndefinedVariableThrows);
+}
+
+} /* namespace Ast */
@@ -0,0 +1,81 @@
+#include "tail_calls.h"
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    size_t Mark(std::unique_ptr<Statement>& node, bool in_method)
+    {
+        size_t marked = 0;
+        bool children_in_method = in_method || node->TryAs<ClassDefinition>();
+        node->ForEachChild([&marked, children_in_method](std::unique_ptr<Statement>& child) {
+            marked += Mark(child, children_in_method);
+        });
+
+        auto ret = node->TryAs<Return>();
+        if (!in_method || !ret)
+            return marked;
+
+        auto call = ret->Value()->TryAs<MethodCall>();
+        if (!call)
+            return marked;
+
+        node = std::make_unique<TailCall>(std::move(call->object), std::move(call->method), std::move(call->args));
+        return marked + 1;
+    }
+}
+
+TailCall::TailCall(
+    std::unique_ptr<Statement> object,
+    std::string method,
+    std::vector<std::unique_ptr<Statement>> args
+)
+    : object(std::move(object)), method(std::move(method)), args(std::move(args))
+{
+}
+
+Result TailCall::Execute(Closure& closure)
+{
+    auto receiver = object->Execute(closure);
+    std::vector<ObjectHolder> actual_args;
+    actual_args.reserve(args.size());
+    for (auto& arg : args)
+        actual_args.push_back(arg->Execute(closure));
+
+    return TailCallTo(std::move(receiver), method, std::move(actual_args));
+}
+
+Result TailCallTo(ObjectHolder receiver, const std::string& method, std::vector<ObjectHolder> args)
+{
+    auto call = std::make_shared<TailCallRequest>();
+    call->receiver = std::move(receiver);
+    call->method = &method;
+    call->args = std::move(args);
+
+    Result res;
+    res.SetTailCall(std::move(call));
+    return res;
+}
+
+void TailCall::ForEachChild(const ChildVisitor& visitor)
+{
+    visitor(object);
+    for (auto& arg : args)
+        visitor(arg);
+}
+
+size_t MarkTailCalls(std::unique_ptr<Statement>& root)
+{
+    return Mark(root, false);
+}
+
+size_t MarkTailCallsInBody(std::unique_ptr<Statement>& body)
+{
+    return Mark(body, true);
+}
+
+} /* namespace Ast */
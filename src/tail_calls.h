@@ -0,0 +1,59 @@
+#pragma once
+
+#include "statement.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class TestRunner;
+
+namespace Ast {
+
+// return obj.method(args) inside a method body.
+// Evaluates the receiver and the arguments and hands the call over to
+// ClassInstance::Call, so the frame of the current method is left before
+// the callee starts
+class TailCall : public Statement {
+public:
+  TailCall(
+    std::unique_ptr<Statement> object,
+    std::string method,
+    std::vector<std::unique_ptr<Statement>> args
+  );
+
+  std::unique_ptr<Statement>& Object() {
+    return object;
+  }
+
+  const std::string& Method() const {
+    return method;
+  }
+
+  std::vector<std::unique_ptr<Statement>>& Args() {
+    return args;
+  }
+
+  Result Execute(Runtime::Closure& closure) override;
+  void ForEachChild(const ChildVisitor& visitor) override;
+
+private:
+  std::unique_ptr<Statement> object;
+  std::string method;
+  std::vector<std::unique_ptr<Statement>> args;
+};
+
+// The result which hands the call over to ClassInstance::Call. The name must
+// outlive the call
+Result TailCallTo(ObjectHolder receiver, const std::string& method, std::vector<ObjectHolder> args);
+
+// Replaces "return obj.method(...)" in method bodies with TailCall.
+// Any return of Mython leaves the method immediately, so each of them is in
+// tail position. Returns the number of replaced statements
+size_t MarkTailCalls(std::unique_ptr<Statement>& root);
+// The same for a method body parsed on its own
+size_t MarkTailCallsInBody(std::unique_ptr<Statement>& body);
+
+void RunTailCallsTests(TestRunner& tr);
+
+} /* namespace Ast */
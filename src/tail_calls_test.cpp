@@ -0,0 +1,102 @@
+#include "tail_calls.h"
+#include "lexer.h"
+#include "parse.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string RunWithTailCalls(const string& program, size_t expected_marks) {
+  istringstream input(program);
+  Parse::Lexer lexer(input);
+  auto tree = ParseProgram(lexer);
+  ASSERT_EQUAL(MarkTailCalls(tree), expected_marks);
+
+  ostringstream output;
+  Print::SetOutputStream(output);
+  Runtime::Closure closure;
+  tree->Execute(closure);
+  return output.str();
+}
+
+}
+
+void TestDeepTailRecursion() {
+  const string program = R"(
+class Looper:
+  def count(n, acc):
+    if n == 0:
+      return acc
+    return self.count(n - 1, acc + 2)
+
+l = Looper()
+print l.count(1000000, 0)
+)";
+
+  ASSERT_EQUAL(RunWithTailCalls(program, 1u), "2000000\n");
+}
+
+void TestMutualTailRecursion() {
+  const string program = R"(
+class Pong:
+  def __init__():
+    self.hits = 0
+
+  def hit(other, n):
+    self.hits = self.hits + 1
+    if n > 0:
+      return other.hit(self, n - 1)
+    return self.hits
+
+p1 = Pong()
+p2 = Pong()
+print p1.hit(p2, 200001), p1.hits, p2.hits
+)";
+
+  ASSERT_EQUAL(RunWithTailCalls(program, 1u), "100001 100001 100001\n");
+}
+
+void TestReturnOfArithmeticOverCallsIsNotMarked() {
+  const string program = R"(
+class A:
+  def get():
+    return 5
+
+  def twice():
+    return self.get() + self.get()
+
+a = A()
+print a.twice()
+)";
+
+  ASSERT_EQUAL(RunWithTailCalls(program, 0u), "10\n");
+}
+
+void TestTailCallToMissingMethodThrows() {
+  const string program = R"(
+class A:
+  def f():
+    return self.g(1)
+
+a = A()
+a.f()
+)";
+
+  ASSERT_THROWS(RunWithTailCalls(program, 1u), std::runtime_error);
+}
+
+void RunTailCallsTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestDeepTailRecursion);
+  RUN_TEST(tr, Ast::TestMutualTailRecursion);
+  RUN_TEST(tr, Ast::TestReturnOfArithmeticOverCallsIsNotMarked);
+  RUN_TEST(tr, Ast::TestTailCallToMissingMethodThrows);
+}
+
+} /* namespace Ast */
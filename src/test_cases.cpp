@@ -3,6 +3,7 @@
 #include "statement.h"
 #include "lexer.h"
 #include "parse.h"
+#include "interpreter.h"
 
 #include <test_runner.h>
 
@@ -13,16 +14,69 @@
 #include <iostream>
 #include <fstream>
 #include <sstream>
+#include <iterator>
 
 using namespace std;
-void RunMythonProgram(istream& input, ostream& output) {
-  Ast::Print::SetOutputStream(output);
 
-  Parse::Lexer lexer(input);
-  auto program = ParseProgram(lexer);
+namespace {
+
+const Engine ENGINES[] = {Engine::Tree, Engine::Stack, Engine::Closures, Engine::Flat};
+
+string RunWith(const string& program, const RunOptions& options) {
+  istringstream input(program);
+  ostringstream output;
+  RunMythonProgram(input, output, options);
+  return output.str();
+}
+
+// Runs the program with every engine, all of them must print the same
+void RunOnAllEngines(istream& input, ostream& output) {
+  const string program{istreambuf_iterator<char>(input), istreambuf_iterator<char>()};
+
+  string expected;
+  for (auto engine : ENGINES) {
+    RunOptions options;
+    options.engine = engine;
+    auto engine_output = RunWith(program, options);
+
+    if (engine == ENGINES[0]) {
+      expected = engine_output;
+    } else {
+      ASSERT_EQUAL(engine_output, expected);
+    }
+  }
+
+  // The tree with every method compiled on its first call
+  RunOptions options;
+  options.jit_threshold = 0;
+  ASSERT_EQUAL(RunWith(program, options), expected);
+
+  // Parsed into the flat layout without the tree
+  RunOptions single_pass;
+  single_pass.single_pass = true;
+  ASSERT_EQUAL(RunWith(program, single_pass), expected);
+
+  // A statement at a time
+  RunOptions streaming;
+  streaming.streaming = true;
+  ASSERT_EQUAL(RunWith(program, streaming), expected);
+
+  // Method bodies parsed by their first calls
+  RunOptions lazy;
+  lazy.lazy_methods = true;
+  ASSERT_EQUAL(RunWith(program, lazy), expected);
+  lazy.validate_methods = true;
+  ASSERT_EQUAL(RunWith(program, lazy), expected);
+
+  // Method bodies parsed and optimized by threads of their own
+  RunOptions parallel;
+  parallel.parallel_methods = true;
+  parallel.method_threads = 4;
+  ASSERT_EQUAL(RunWith(program, parallel), expected);
+
+  output << expected;
+}
 
-  Runtime::Closure closure;
-  program->Execute(closure);
 }
 
 void TestSimplePrints() {
@@ -37,7 +91,7 @@ print None
 )");
 
   ostringstream output;
-  RunMythonProgram(input, output);
+  RunOnAllEngines(input, output);
 
   ASSERT_EQUAL(output.str(), "57\n10 24 -8\nhello\nworld\nTrue False\n\nNone\n");
 }
@@ -56,7 +110,7 @@ print x, y
 )");
 
   ostringstream output;
-  RunMythonProgram(input, output);
+  RunOnAllEngines(input, output);
 
   ASSERT_EQUAL(output.str(), "57\nC++ black belt\nFalse\nNone False\n");
 }
@@ -67,7 +121,7 @@ void TestArithmetics() {
   );
 
   ostringstream output;
-  RunMythonProgram(input, output);
+  RunOnAllEngines(input, output);
 
   ASSERT_EQUAL(output.str(), "15 120 -13 3 15\n");
 }
@@ -100,7 +154,7 @@ print y.value
 )");
 
   ostringstream output;
-  RunMythonProgram(input, output);
+  RunOnAllEngines(input, output);
 
   ASSERT_EQUAL(output.str(), "2\n3\n");
 }
@@ -120,7 +174,7 @@ str_3 = str_2
 print str(str_ + str_2 + str_3)
 )");
 ostringstream output;
-RunMythonProgram(input, output);
+RunOnAllEngines(input, output);
 
 ASSERT_EQUAL(output.str(), "stringstringstring\n");
 }
@@ -199,7 +253,7 @@ else:
 )");
 
 ostringstream output;
-RunMythonProgram(input, output);
+RunOnAllEngines(input, output);
 }
 
 void TestCase8()
@@ -261,8 +315,74 @@ print result1, result2, result3, result4, result5, result6, result7, result8, re
 )");
 
     ostringstream output;
-    RunMythonProgram(input, output);
+    RunOnAllEngines(input, output);
 }
+// The statements before an error in the source have run
+void TestStreamingRunsStatementsAsParsed()
+{
+  const string program = R"(
+class Point:
+  def __init__(x, y):
+    self.x = x
+    self.y = y
+
+  def __str__():
+    return '(' + str(self.x) + ', ' + str(self.y) + ')'
+
+p = Point(1, 'two')
+name = 'kept'
+print p, name
+q = Point(p, 3)
+print q
+print name, q.x.y
+x = )
+print 'never'
+)";
+
+  RunOptions streaming;
+  streaming.streaming = true;
+  istringstream input(program);
+  ostringstream output;
+  ASSERT_THROWS(RunMythonProgram(input, output, streaming), std::exception);
+  ASSERT_EQUAL(output.str(), "(1, two) kept\n((1, two), 3)\nkept two\n");
+
+  istringstream whole_input(program);
+  ostringstream whole_output;
+  ASSERT_THROWS(RunMythonProgram(whole_input, whole_output), std::exception);
+  ASSERT_EQUAL(whole_output.str(), "");
+}
+
+// The passes and the engines recurse once per level of an expression, the parser
+// throws for one too deep for them before any of them runs
+void TestOverDeepExpressionsAreRejected()
+{
+  string sum = "x = 1";
+  for (size_t i = 1; i < MAX_EXPRESSION_DEPTH; ++i) {
+    sum += " + 1";
+  }
+  istringstream input(sum + "\nprint x\n");
+  ostringstream output;
+  RunOnAllEngines(input, output);
+  ASSERT_EQUAL(output.str(), to_string(MAX_EXPRESSION_DEPTH) + "\n");
+
+  for (size_t i = MAX_EXPRESSION_DEPTH; i < 100000; ++i) {
+    sum += " + 1";
+  }
+  const string nested = "x = " + string(100000, '(') + "1" + string(100000, ')');
+  for (const string& program : {sum + "\nprint x\n", nested + "\nprint x\n"}) {
+    vector<RunOptions> runs;
+    for (auto engine : ENGINES) {
+      runs.emplace_back().engine = engine;
+    }
+    runs.emplace_back().single_pass = true;
+    runs.emplace_back().streaming = true;
+    runs.emplace_back().lazy_methods = true;
+    for (auto& options : runs) {
+      ASSERT_THROWS(RunWith(program, options), ParseError);
+    }
+  }
+}
+
 void TestCases(TestRunner& tr)
 {
   RUN_TEST(tr, TestSimplePrints);
@@ -272,4 +392,6 @@ void TestCases(TestRunner& tr)
   RUN_TEST(tr, TestCase3);
   RUN_TEST(tr, TestCase6);
   RUN_TEST(tr, TestCase8);
+  RUN_TEST(tr, TestStreamingRunsStatementsAsParsed);
+  RUN_TEST(tr, TestOverDeepExpressionsAreRejected);
 }
@@ -0,0 +1,30 @@
+#include "test_helpers.h"
+#include "lexer.h"
+#include "parse.h"
+#include "statement.h"
+
+#include <sstream>
+
+using namespace std;
+
+namespace Parse {
+
+unique_ptr<Ast::Statement> ParseProgramFromString(const string& program) {
+  istringstream is(program);
+  Parse::Lexer lexer(is);
+  return ParseProgram(lexer);
+}
+
+} /* namespace Parse */
+
+namespace Ast {
+
+string Execute(Statement& program) {
+  ostringstream output;
+  Print::SetOutputStream(output);
+  Runtime::Closure closure;
+  program.Execute(closure);
+  return output.str();
+}
+
+} /* namespace Ast */
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+// Parsing and running the programs of the tests
+
+namespace Ast {
+  class Statement;
+}
+
+namespace Parse {
+
+// The tree of the program, the method bodies parsed eagerly
+std::unique_ptr<Ast::Statement> ParseProgramFromString(const std::string& program);
+
+} /* namespace Parse */
+
+namespace Ast {
+
+using Parse::ParseProgramFromString;
+
+// Runs the program in a closure of its own, returns what it printed
+std::string Execute(Statement& program);
+
+} /* namespace Ast */
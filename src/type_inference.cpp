@@ -0,0 +1,670 @@
+#include "type_inference.h"
+#include "comparators.h"
+#include "object.h"
+
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+namespace Ast {
+
+using Runtime::Closure;
+
+namespace
+{
+    // The variable may be missing from the closure. Never a type of a value
+    const TypeSet UNSET = 64;
+
+    const char* SELF = "self";
+
+    template <typename T>
+    const T& ValueOf(const ObjectHolder& holder)
+    {
+        return static_cast<const T&>(*holder);
+    }
+
+    bool IsSpecialized(Statement& st)
+    {
+        return dynamic_cast<NumericExpression*>(&st) || dynamic_cast<BoolExpression*>(&st)
+            || st.TryAs<StringConcat>() || st.TryAs<TypedIfElse>();
+    }
+
+    // What an expression may do besides computing its value
+    struct Effects
+    {
+        // User methods may run and see the fields
+        bool calls = false;
+        std::set<std::string> field_reads;
+    };
+
+    struct Scope
+    {
+        std::unordered_map<std::string, TypeSet> vars;
+        // The class of the method, nullptr at the top level
+        const Runtime::Class* cls = nullptr;
+        TypeSet* returns = nullptr;
+        Effects* effects = nullptr;
+    };
+
+    class TypeInference
+    {
+    public:
+        explicit TypeInference(Statement& program)
+        {
+            CollectClasses(program);
+        }
+
+        size_t Run(std::unique_ptr<Statement>& root)
+        {
+            // Field and method result types only grow, so the loop ends
+            do
+            {
+                changed = false;
+                AnalyzeProgram(root, false);
+            }
+            while (changed);
+
+            AnalyzeProgram(root, true);
+            return specialized;
+        }
+
+    private:
+        void CollectClasses(Statement& st)
+        {
+            if (auto p = st.TryAs<ClassDefinition>())
+                classes.push_back(&p->GetClass());
+
+            st.ForEachChild([this](std::unique_ptr<Statement>& child) {
+                CollectClasses(*child);
+            });
+        }
+
+        void AnalyzeProgram(std::unique_ptr<Statement>& root, bool rewrite)
+        {
+            this->rewrite = rewrite;
+
+            for (auto cls : classes)
+            {
+                for (auto& method : cls->Methods())
+                {
+                    TypeSet returns = 0;
+                    Effects effects;
+                    Scope scope{{}, cls, &returns, &effects};
+                    for (auto& param : method.formal_params)
+                        scope.vars[param] = ANY_TYPE;
+
+                    if (VisitStatement(method.body, scope))
+                        returns |= NONE_TYPE;
+                    Join(method_returns[&method], returns);
+                }
+            }
+
+            TypeSet returns = 0;
+            Effects effects;
+            Scope scope{{}, nullptr, &returns, &effects};
+            VisitStatement(root, scope);
+        }
+
+        void Join(TypeSet& slot, TypeSet types)
+        {
+            if ((slot | types) != slot)
+            {
+                slot |= types;
+                changed = true;
+            }
+        }
+
+        static bool IsSubclass(const Runtime::Class* cls, const Runtime::Class* base)
+        {
+            for (; cls; cls = cls->GetParent())
+                if (cls == base)
+                    return true;
+            return false;
+        }
+
+        // self may be an instance of any subclass of cls, whose fields are
+        // assigned by the methods of the subclass and of its bases
+        TypeSet SelfFieldType(const Runtime::Class& cls, const std::string& field)
+        {
+            TypeSet types = other_writes[field];
+            for (auto instance_cls : classes)
+            {
+                if (!IsSubclass(instance_cls, &cls))
+                    continue;
+                for (auto c = static_cast<const Runtime::Class*>(instance_cls); c; c = c->GetParent())
+                    if (auto it = self_writes.find({c, field}); it != self_writes.end())
+                        types |= it->second;
+            }
+            return types;
+        }
+
+        TypeSet AnyFieldType(const std::string& field)
+        {
+            TypeSet types = other_writes[field];
+            for (auto& [key, written] : self_writes)
+                if (key.second == field)
+                    types |= written;
+            return types;
+        }
+
+        TypeSet ReturnType(const Runtime::Class* self_cls, const std::string& method, size_t arg_count)
+        {
+            TypeSet types = 0;
+            for (auto cls : classes)
+            {
+                if (self_cls && !IsSubclass(cls, self_cls))
+                    continue;
+
+                auto met = cls->GetMethod(method);
+                if (met && met->formal_params.size() == arg_count)
+                    types |= method_returns[met];
+            }
+            return types;
+        }
+
+        bool IsSelf(const Scope& scope, const std::vector<std::string>& ids, size_t length)
+        {
+            return scope.cls && ids.size() == length && ids[0] == SELF && !scope.vars.count(SELF);
+        }
+
+        TypeSet Lookup(const Scope& scope, const std::string& name)
+        {
+            if (auto it = scope.vars.find(name); it != scope.vars.end())
+                return it->second;
+            if (!scope.cls)
+                return UNSET;
+            if (name == SELF)
+                return INSTANCE_TYPE;
+            // Fields are copied into the closure of a method
+            return SelfFieldType(*scope.cls, name) | UNSET;
+        }
+
+        TypeSet ReadType(const VariableValue& var, Scope& scope)
+        {
+            const auto& ids = var.dotted_ids;
+            if (ids.size() == 1)
+                return Lookup(scope, ids[0]) & ~UNSET;
+
+            scope.effects->field_reads.insert(ids.back());
+            if (IsSelf(scope, ids, 2))
+                return SelfFieldType(*scope.cls, ids.back());
+            return AnyFieldType(ids.back());
+        }
+
+        void Replace(std::unique_ptr<Statement>& node, std::unique_ptr<Statement> replacement)
+        {
+            node = std::move(replacement);
+            ++specialized;
+        }
+
+        // Returns false when the statement never completes, that is returns
+        bool VisitStatement(std::unique_ptr<Statement>& node, Scope& scope)
+        {
+            if (auto p = node->TryAs<Compound>())
+            {
+                for (auto& st : p->Statements())
+                    if (!VisitStatement(st, scope))
+                        return false;
+                return true;
+            }
+            if (auto p = node->TryAs<Assignment>())
+            {
+                // The variable is created before its value is computed, a missing one reads as None
+                TypeSet before = Lookup(scope, p->var);
+                if (before & UNSET)
+                    scope.vars[p->var] = (before & ~UNSET) | NONE_TYPE;
+
+                scope.vars[p->var] = VisitExpression(p->rv, scope);
+                return true;
+            }
+            if (auto p = node->TryAs<FieldAssignment>())
+            {
+                ReadType(p->object, scope);
+
+                Effects effects;
+                auto outer = scope.effects;
+                scope.effects = &effects;
+                TypeSet types = VisitExpression(p->right_value, scope);
+                scope.effects = outer;
+
+                // The slot is created before the value is computed and reads as None meanwhile
+                if (effects.calls || effects.field_reads.count(p->field_name))
+                    Join(other_writes[p->field_name], NONE_TYPE);
+
+                if (IsSelf(scope, p->object.dotted_ids, 1))
+                    Join(self_writes[{scope.cls, p->field_name}], types);
+                else
+                    Join(other_writes[p->field_name], types);
+                return true;
+            }
+            if (auto p = node->TryAs<Return>())
+            {
+                *scope.returns |= VisitExpression(p->Value(), scope);
+                return false;
+            }
+            if (auto p = node->TryAs<IfElse>())
+                return VisitIfElse(node, *p, scope);
+            if (node->TryAs<ClassDefinition>())
+                return true;
+            if (auto p = node->TryAs<Print>())
+            {
+                for (auto& arg : p->Args())
+                    VisitExpression(arg, scope);
+                return true;
+            }
+
+            VisitExpression(node, scope);
+            return true;
+        }
+
+        bool VisitIfElse(std::unique_ptr<Statement>& node, IfElse& if_else, Scope& scope)
+        {
+            TypeSet condition = VisitExpression(if_else.Condition(), scope);
+
+            Scope if_scope = scope;
+            bool if_completes = VisitStatement(if_else.IfBody(), if_scope);
+
+            Scope else_scope = scope;
+            bool else_completes = true;
+            if (if_else.ElseBody())
+                else_completes = VisitStatement(if_else.ElseBody(), else_scope);
+
+            if (if_completes && else_completes)
+            {
+                for (auto& [name, types] : if_scope.vars)
+                    scope.vars[name] = types | Lookup(else_scope, name);
+                for (auto& [name, types] : else_scope.vars)
+                    scope.vars[name] = types | Lookup(if_scope, name);
+            }
+            else if (if_completes)
+            {
+                scope.vars = std::move(if_scope.vars);
+            }
+            else if (else_completes)
+            {
+                scope.vars = std::move(else_scope.vars);
+            }
+
+            if (rewrite && condition == BOOL_TYPE && !IsSpecialized(*node))
+            {
+                Replace(node, std::make_unique<TypedIfElse>(
+                    std::move(if_else.Condition()), std::move(if_else.IfBody()), std::move(if_else.ElseBody())
+                ));
+            }
+            return if_completes || else_completes;
+        }
+
+        TypeSet VisitExpression(std::unique_ptr<Statement>& node, Scope& scope)
+        {
+            Statement& st = *node;
+            if (st.TryAs<NumericConst>())
+                return NUMBER_TYPE;
+            if (st.TryAs<StringConst>())
+                return STRING_TYPE;
+            if (st.TryAs<BoolConst>())
+                return BOOL_TYPE;
+            if (st.TryAs<None>())
+                return NONE_TYPE;
+            if (auto p = st.TryAs<VariableValue>())
+                return ReadType(*p, scope);
+            if (auto p = st.TryAs<CachedFieldRead>())
+                return ReadType(p->Variable(), scope);
+
+            if (auto p = st.TryAs<MethodCall>())
+            {
+                VisitExpression(p->object, scope);
+                for (auto& arg : p->args)
+                    VisitExpression(arg, scope);
+                scope.effects->calls = true;
+
+                auto receiver = p->object->TryAs<VariableValue>();
+                bool on_self = receiver && IsSelf(scope, receiver->dotted_ids, 1);
+                return ReturnType(on_self ? scope.cls : nullptr, p->method, p->args.size());
+            }
+            if (auto p = st.TryAs<NewInstance>())
+            {
+                for (auto& arg : p->args)
+                    VisitExpression(arg, scope);
+                scope.effects->calls = true;
+                return INSTANCE_TYPE;
+            }
+            if (auto p = st.TryAs<Stringify>())
+            {
+                if (VisitExpression(p->Argument(), scope) & INSTANCE_TYPE)
+                    scope.effects->calls = true;
+                return STRING_TYPE;
+            }
+            if (auto p = st.TryAs<Not>())
+            {
+                TypeSet arg = VisitExpression(p->Argument(), scope);
+                if (rewrite && arg == BOOL_TYPE && !IsSpecialized(st))
+                    Replace(node, std::make_unique<BoolNot>(std::move(p->Argument())));
+
+                if (arg & INSTANCE_TYPE)
+                {
+                    scope.effects->calls = true;
+                    return ANY_TYPE;
+                }
+                return BOOL_TYPE;
+            }
+            if (auto p = st.TryAs<Negate>())
+            {
+                TypeSet arg = VisitExpression(p->Argument(), scope);
+                if (rewrite && arg == NUMBER_TYPE && !IsSpecialized(st))
+                    Replace(node, std::make_unique<NumericNegate>(std::move(p->Argument())));
+
+                if (arg & INSTANCE_TYPE)
+                {
+                    scope.effects->calls = true;
+                    return ANY_TYPE;
+                }
+                return arg & NUMBER_TYPE;
+            }
+            if (st.TryAs<Add>() || st.TryAs<Sub>() || st.TryAs<Mult>() || st.TryAs<Div>())
+                return VisitArithmetic(node, static_cast<BinaryOperation&>(st), scope);
+            if (st.TryAs<Or>() || st.TryAs<And>())
+            {
+                auto& binary = static_cast<BinaryOperation&>(st);
+                TypeSet lhs = VisitExpression(binary.Lhs(), scope);
+                TypeSet rhs = VisitExpression(binary.Rhs(), scope);
+                if (rewrite && lhs == BOOL_TYPE && rhs == BOOL_TYPE && !IsSpecialized(st))
+                {
+                    if (st.TryAs<Or>())
+                        Replace(node, std::make_unique<BoolOr>(std::move(binary.Lhs()), std::move(binary.Rhs())));
+                    else
+                        Replace(node, std::make_unique<BoolAnd>(std::move(binary.Lhs()), std::move(binary.Rhs())));
+                }
+                return BOOL_TYPE;
+            }
+            if (auto p = st.TryAs<Comparison>())
+            {
+                TypeSet lhs = VisitExpression(p->Lhs(), scope);
+                TypeSet rhs = VisitExpression(p->Rhs(), scope);
+                if ((lhs | rhs) & INSTANCE_TYPE)
+                    scope.effects->calls = true;
+
+                auto op = GetCompareOp(p->GetComparator());
+                if (rewrite && op && lhs == rhs && !IsSpecialized(st))
+                {
+                    if (lhs == NUMBER_TYPE)
+                        Replace(node, std::make_unique<NumericComparison>(
+                            p->GetComparator(), *op, std::move(p->Lhs()), std::move(p->Rhs())
+                        ));
+                    else if (lhs == STRING_TYPE)
+                        Replace(node, std::make_unique<StringComparison>(
+                            p->GetComparator(), *op, std::move(p->Lhs()), std::move(p->Rhs())
+                        ));
+                }
+                return BOOL_TYPE;
+            }
+
+            // Unknown nodes may do anything
+            st.ForEachChild([this, &scope](std::unique_ptr<Statement>& child) {
+                VisitExpression(child, scope);
+            });
+            scope.effects->calls = true;
+            return ANY_TYPE;
+        }
+
+        TypeSet VisitArithmetic(std::unique_ptr<Statement>& node, BinaryOperation& binary, Scope& scope)
+        {
+            TypeSet lhs = VisitExpression(binary.Lhs(), scope);
+            TypeSet rhs = VisitExpression(binary.Rhs(), scope);
+            bool is_add = binary.TryAs<Add>();
+
+            if (rewrite && !IsSpecialized(binary))
+            {
+                auto l = std::move(binary.Lhs());
+                auto r = std::move(binary.Rhs());
+                if (lhs == NUMBER_TYPE && rhs == NUMBER_TYPE)
+                {
+                    if (is_add)
+                        Replace(node, std::make_unique<NumericAdd>(std::move(l), std::move(r)));
+                    else if (binary.TryAs<Sub>())
+                        Replace(node, std::make_unique<NumericSub>(std::move(l), std::move(r)));
+                    else if (binary.TryAs<Mult>())
+                        Replace(node, std::make_unique<NumericMult>(std::move(l), std::move(r)));
+                    else
+                        Replace(node, std::make_unique<NumericDiv>(std::move(l), std::move(r)));
+                }
+                else if (is_add && lhs == STRING_TYPE && rhs == STRING_TYPE)
+                {
+                    Replace(node, std::make_unique<StringConcat>(std::move(l), std::move(r)));
+                }
+                else
+                {
+                    binary.Lhs() = std::move(l);
+                    binary.Rhs() = std::move(r);
+                }
+            }
+
+            TypeSet types = lhs & rhs & NUMBER_TYPE;
+            if (is_add)
+                types |= lhs & rhs & STRING_TYPE;
+            if (lhs & INSTANCE_TYPE)
+            {
+                scope.effects->calls = true;
+                types = ANY_TYPE;
+            }
+            return types;
+        }
+
+        std::vector<Runtime::Class*> classes;
+        // Fields assigned through self in the methods of a class
+        std::map<std::pair<const Runtime::Class*, std::string>, TypeSet> self_writes;
+        // Fields assigned through other objects, of any class
+        std::unordered_map<std::string, TypeSet> other_writes;
+        std::unordered_map<const Runtime::Method*, TypeSet> method_returns;
+
+        bool changed = false;
+        bool rewrite = false;
+        size_t specialized = 0;
+    };
+}
+
+// NumericOperand
+//
+NumericOperand::NumericOperand(std::unique_ptr<Statement>& slot)
+    : slot(&slot)
+{
+}
+
+void NumericOperand::Resolve()
+{
+    seen = slot->get();
+    typed = dynamic_cast<NumericExpression*>(seen);
+    auto number = seen->TryAs<NumericConst>();
+    constant = number ? &number->value : nullptr;
+}
+
+int NumericOperand::Get(Closure& closure)
+{
+    if (slot->get() != seen)
+        Resolve();
+
+    if (constant)
+        return constant->GetValue();
+    if (typed)
+        return typed->EvaluateNumber(closure);
+    return ValueOf<Runtime::Number>((*slot)->Execute(closure)).GetValue();
+}
+
+// BoolOperand
+//
+BoolOperand::BoolOperand(std::unique_ptr<Statement>& slot)
+    : slot(&slot)
+{
+}
+
+bool BoolOperand::Get(Closure& closure)
+{
+    if (slot->get() != seen)
+    {
+        seen = slot->get();
+        typed = dynamic_cast<BoolExpression*>(seen);
+    }
+
+    if (typed)
+        return typed->EvaluateBool(closure);
+    return ValueOf<Runtime::Bool>((*slot)->Execute(closure)).GetValue();
+}
+
+// NumericArithmetic
+//
+template <typename Base>
+int NumericArithmetic<Base>::EvaluateNumber(Closure& closure)
+{
+    int lhs = left.Get(closure);
+    int rhs = right.Get(closure);
+    if constexpr (std::is_same_v<Base, Add>)
+        return lhs + rhs;
+    else if constexpr (std::is_same_v<Base, Sub>)
+        return lhs - rhs;
+    else if constexpr (std::is_same_v<Base, Mult>)
+        return lhs * rhs;
+    else
+        return lhs / rhs;
+}
+
+template class NumericArithmetic<Add>;
+template class NumericArithmetic<Sub>;
+template class NumericArithmetic<Mult>;
+template class NumericArithmetic<Div>;
+
+// StringConcat
+//
+Result StringConcat::Execute(Closure& closure)
+{
+    auto left = lhs->Execute(closure), right = rhs->Execute(closure);
+    return ObjectHolder::Own(Runtime::String(
+        ValueOf<Runtime::String>(left).GetValue() + ValueOf<Runtime::String>(right).GetValue()
+    ));
+}
+
+// NumericNegate
+//
+NumericNegate::NumericNegate(std::unique_ptr<Statement> argument)
+    : Negate(std::move(argument)), value(this->argument)
+{
+}
+
+int NumericNegate::EvaluateNumber(Closure& closure)
+{
+    return -value.Get(closure);
+}
+
+Result NumericNegate::Execute(Closure& closure)
+{
+    return ObjectHolder::Own(Runtime::Number(EvaluateNumber(closure)));
+}
+
+// TypedComparison
+//
+template <typename T>
+bool TypedComparison<T>::EvaluateBool(Closure& closure)
+{
+    if constexpr (std::is_same_v<T, Runtime::Number>)
+    {
+        int lhs = left.Get(closure);
+        return Compare(op, lhs, right.Get(closure));
+    }
+    else
+    {
+        auto lhs = Lhs()->Execute(closure);
+        auto rhs = Rhs()->Execute(closure);
+        return Compare(op, ValueOf<T>(lhs).GetValue(), ValueOf<T>(rhs).GetValue());
+    }
+}
+
+template class TypedComparison<Runtime::Number>;
+template class TypedComparison<Runtime::String>;
+
+// BoolNot
+//
+BoolNot::BoolNot(std::unique_ptr<Statement> argument)
+    : Not(std::move(argument)), value(this->argument)
+{
+}
+
+bool BoolNot::EvaluateBool(Closure& closure)
+{
+    return !value.Get(closure);
+}
+
+Result BoolNot::Execute(Closure& closure)
+{
+    return ObjectHolder::Own(Runtime::Bool(EvaluateBool(closure)));
+}
+
+// BoolLogic
+//
+template <typename Base>
+bool BoolLogic<Base>::EvaluateBool(Closure& closure)
+{
+    // Both operands are evaluated, as in Or and And
+    bool lhs = left.Get(closure);
+    bool rhs = right.Get(closure);
+    if constexpr (std::is_same_v<Base, Or>)
+        return lhs || rhs;
+    else
+        return lhs && rhs;
+}
+
+template class BoolLogic<Or>;
+template class BoolLogic<And>;
+
+// TypedIfElse
+//
+TypedIfElse::TypedIfElse(
+    std::unique_ptr<Statement> condition,
+    std::unique_ptr<Statement> if_body,
+    std::unique_ptr<Statement> else_body
+)
+    : IfElse(std::move(condition), std::move(if_body), std::move(else_body))
+    , test(Condition())
+{
+}
+
+Result TypedIfElse::Execute(Closure& closure)
+{
+    if (test.Get(closure))
+        return IfBody()->Execute(closure);
+    if (ElseBody())
+        return ElseBody()->Execute(closure);
+    return Result();
+}
+
+// Free
+//
+std::optional<CompareOp> GetCompareOp(const Comparison::Comparator& comparator)
+{
+    using Function = bool (*)(ObjectHolder, ObjectHolder);
+    auto fn = comparator.target<Function>();
+    if (!fn)
+        return std::nullopt;
+    if (*fn == &Runtime::Equal)
+        return CompareOp::Equal;
+    if (*fn == &Runtime::NotEqual)
+        return CompareOp::NotEqual;
+    if (*fn == &Runtime::Less)
+        return CompareOp::Less;
+    if (*fn == &Runtime::Greater)
+        return CompareOp::Greater;
+    if (*fn == &Runtime::LessOrEqual)
+        return CompareOp::LessOrEqual;
+    if (*fn == &Runtime::GreaterOrEqual)
+        return CompareOp::GreaterOrEqual;
+    return std::nullopt;
+}
+
+size_t SpecializeTypes(std::unique_ptr<Statement>& root)
+{
+    return TypeInference(*root).Run(root);
+}
+
+} /* namespace Ast */
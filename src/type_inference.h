@@ -0,0 +1,234 @@
+#pragma once
+
+#include "optimizer.h"
+#include "statement.h"
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+
+class TestRunner;
+
+namespace Ast {
+
+// Sets of the runtime types a node may give
+using TypeSet = unsigned;
+
+enum TypeBits : TypeSet {
+  NUMBER_TYPE = 1,
+  STRING_TYPE = 2,
+  BOOL_TYPE = 4,
+  NONE_TYPE = 8,
+  INSTANCE_TYPE = 16,
+  CLASS_TYPE = 32,
+  ANY_TYPE = 63,
+};
+
+// Nodes which compute a number or a bool without boxing it
+class NumericExpression {
+public:
+  virtual ~NumericExpression() = default;
+  virtual int EvaluateNumber(Runtime::Closure& closure) = 0;
+};
+
+class BoolExpression {
+public:
+  virtual ~BoolExpression() = default;
+  virtual bool EvaluateBool(Runtime::Closure& closure) = 0;
+};
+
+// A child proven to give a number.
+// Typed children are evaluated without boxing, constants are read once.
+// The slot is checked on every use, since later passes may replace the child
+class NumericOperand {
+public:
+  explicit NumericOperand(std::unique_ptr<Statement>& slot);
+  int Get(Runtime::Closure& closure);
+
+private:
+  void Resolve();
+
+  std::unique_ptr<Statement>* slot;
+  Statement* seen = nullptr;
+  NumericExpression* typed = nullptr;
+  const Runtime::Number* constant = nullptr;
+};
+
+class BoolOperand {
+public:
+  explicit BoolOperand(std::unique_ptr<Statement>& slot);
+  bool Get(Runtime::Closure& closure);
+
+private:
+  std::unique_ptr<Statement>* slot;
+  Statement* seen = nullptr;
+  BoolExpression* typed = nullptr;
+};
+
+// Specialized nodes keep the base classes of the nodes they replace,
+// so other passes and the stack evaluator treat them as the generic ones
+
+// Both operands are numbers
+template <typename Base>
+class NumericArithmetic : public Base, public NumericExpression {
+public:
+  NumericArithmetic(std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs)
+    : Base(std::move(lhs), std::move(rhs))
+    , left(this->lhs)
+    , right(this->rhs)
+  {
+  }
+
+  int EvaluateNumber(Runtime::Closure& closure) override;
+
+  Result Execute(Runtime::Closure& closure) override {
+    return ObjectHolder::Own(Runtime::Number(EvaluateNumber(closure)));
+  }
+
+private:
+  NumericOperand left, right;
+};
+
+using NumericAdd = NumericArithmetic<Add>;
+using NumericSub = NumericArithmetic<Sub>;
+using NumericMult = NumericArithmetic<Mult>;
+using NumericDiv = NumericArithmetic<Div>;
+
+// Both operands are strings
+class StringConcat : public Add {
+public:
+  using Add::Add;
+  Result Execute(Runtime::Closure& closure) override;
+};
+
+class NumericNegate : public Negate, public NumericExpression {
+public:
+  explicit NumericNegate(std::unique_ptr<Statement> argument);
+
+  int EvaluateNumber(Runtime::Closure& closure) override;
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  NumericOperand value;
+};
+
+enum class CompareOp {
+  Equal,
+  NotEqual,
+  Less,
+  Greater,
+  LessOrEqual,
+  GreaterOrEqual,
+};
+
+// The operation of a comparator made of Runtime::Equal and the others
+std::optional<CompareOp> GetCompareOp(const Comparison::Comparator& comparator);
+
+template <typename V>
+bool Compare(CompareOp op, const V& lhs, const V& rhs) {
+  switch (op) {
+    case CompareOp::Equal:
+      return lhs == rhs;
+    case CompareOp::NotEqual:
+      return lhs != rhs;
+    case CompareOp::Less:
+      return lhs < rhs;
+    case CompareOp::Greater:
+      return lhs > rhs;
+    case CompareOp::LessOrEqual:
+      return lhs <= rhs;
+    default:
+      return lhs >= rhs;
+  }
+}
+
+// Both operands are numbers or both are strings, T is the runtime type
+template <typename T>
+class TypedComparison : public Comparison, public BoolExpression {
+public:
+  TypedComparison(Comparator comparator, CompareOp op, std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs)
+    : Comparison(std::move(comparator), std::move(lhs), std::move(rhs))
+    , op(op)
+    , left(Lhs())
+    , right(Rhs())
+  {
+  }
+
+  CompareOp Op() const {
+    return op;
+  }
+
+  bool EvaluateBool(Runtime::Closure& closure) override;
+
+  Result Execute(Runtime::Closure& closure) override {
+    return ObjectHolder::Own(Runtime::Bool(EvaluateBool(closure)));
+  }
+
+private:
+  CompareOp op;
+  // Used for numbers only
+  NumericOperand left, right;
+};
+
+using NumericComparison = TypedComparison<Runtime::Number>;
+using StringComparison = TypedComparison<Runtime::String>;
+
+// Operands are bools
+class BoolNot : public Not, public BoolExpression {
+public:
+  explicit BoolNot(std::unique_ptr<Statement> argument);
+
+  bool EvaluateBool(Runtime::Closure& closure) override;
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  BoolOperand value;
+};
+
+template <typename Base>
+class BoolLogic : public Base, public BoolExpression {
+public:
+  BoolLogic(std::unique_ptr<Statement> lhs, std::unique_ptr<Statement> rhs)
+    : Base(std::move(lhs), std::move(rhs))
+    , left(this->lhs)
+    , right(this->rhs)
+  {
+  }
+
+  bool EvaluateBool(Runtime::Closure& closure) override;
+
+  Result Execute(Runtime::Closure& closure) override {
+    return ObjectHolder::Own(Runtime::Bool(EvaluateBool(closure)));
+  }
+
+private:
+  BoolOperand left, right;
+};
+
+using BoolOr = BoolLogic<Or>;
+using BoolAnd = BoolLogic<And>;
+
+// The condition is a bool, IsTrue is not called
+class TypedIfElse : public IfElse {
+public:
+  TypedIfElse(
+    std::unique_ptr<Statement> condition,
+    std::unique_ptr<Statement> if_body,
+    std::unique_ptr<Statement> else_body
+  );
+
+  Result Execute(Runtime::Closure& closure) override;
+
+private:
+  BoolOperand test;
+};
+
+// Infers the types of variables, fields of every class, method results and
+// expressions, then replaces the nodes whose operand types are proven with
+// the specialized ones. Method parameters are not typed, any value may be passed.
+// Returns the number of replaced nodes
+size_t SpecializeTypes(std::unique_ptr<Statement>& root);
+
+void RunTypeInferenceTests(TestRunner& tr);
+
+} /* namespace Ast */
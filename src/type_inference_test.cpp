@@ -0,0 +1,207 @@
+#include "type_inference.h"
+#include "interpreter.h"
+#include "lexer.h"
+#include "parse.h"
+#include "test_helpers.h"
+
+#include <test_runner.h>
+
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+namespace Ast {
+
+namespace {
+
+string Dump(Statement& program) {
+  ostringstream out;
+  DumpTree(program, out);
+  return out.str();
+}
+
+bool Contains(const string& text, const string& part) {
+  return text.find(part) != string::npos;
+}
+
+}
+
+void TestNumericCodeIsSpecialized() {
+  auto program = ParseProgramFromString(R"(
+x = 2
+y = x * 3 + 1
+z = -x
+print y, z, x < y, x / 2 - z
+)");
+  OptimizeProgram(program);
+  ASSERT_EQUAL(SpecializeTypes(program), 6u);
+
+  auto dump = Dump(*program);
+  ASSERT(Contains(dump, "NumericAdd"));
+  ASSERT(Contains(dump, "NumericMult"));
+  ASSERT(Contains(dump, "NumericNegate"));
+  ASSERT(Contains(dump, "NumericComparison <"));
+  ASSERT(Contains(dump, "NumericDiv"));
+  ASSERT(Contains(dump, "NumericSub"));
+  ASSERT_EQUAL(Execute(*program), "7 -2 True 3\n");
+}
+
+void TestFieldTypesAreInferredPerClass() {
+  auto program = ParseProgramFromString(R"(
+class Rect:
+  def __init__():
+    self.w = 3
+    self.h = 4
+
+  def area():
+    return self.w * self.h
+
+class Label:
+  def __init__():
+    self.w = 'wide'
+
+  def show():
+    return self.w + '!'
+
+r = Rect()
+l = Label()
+print r.area(), l.show(), r.area() + 1
+)");
+  SpecializeTypes(program);
+
+  auto dump = Dump(*program);
+  ASSERT(Contains(dump, "NumericMult"));
+  ASSERT(Contains(dump, "StringConcat"));
+  // area() is proven to return a number
+  ASSERT(Contains(dump, "NumericAdd"));
+  ASSERT_EQUAL(Execute(*program), "12 wide! 13\n");
+}
+
+void TestForeignWritesAreSeen() {
+  auto program = ParseProgramFromString(R"(
+class Rect:
+  def __init__():
+    self.w = 3
+    self.h = 4
+
+  def area():
+    return self.w * self.h
+
+r = Rect()
+r.h = 'tall'
+print r.w
+)");
+  SpecializeTypes(program);
+  ASSERT(!Contains(Dump(*program), "NumericMult"));
+}
+
+void TestParametersAreNotTyped() {
+  auto program = ParseProgramFromString(R"(
+class Twice:
+  def of(x):
+    return x + x
+
+t = Twice()
+print t.of(2), t.of('ab')
+)");
+  ASSERT_EQUAL(SpecializeTypes(program), 0u);
+  ASSERT_EQUAL(Execute(*program), "4 abab\n");
+}
+
+void TestMaybeNoneIsNotSpecialized() {
+  auto program = ParseProgramFromString(R"(
+class Maybe:
+  def get(flag):
+    if flag:
+      return 1
+
+  def field():
+    self.v = self.v
+    return self.v
+
+m = Maybe()
+x = m.get(True) + 1
+y = m.field()
+print x, y
+)");
+  ASSERT_EQUAL(SpecializeTypes(program), 0u);
+  ASSERT_EQUAL(Execute(*program), "2 None\n");
+}
+
+void TestBoolsAndConditionsAreSpecialized() {
+  auto program = ParseProgramFromString(R"(
+a = 1 < 2
+b = 'x' == 'y'
+if not a or b and a:
+  print 'no'
+else:
+  print 'yes'
+if a:
+  s = 'a'
+else:
+  s = 'b'
+print s + s
+)");
+  SpecializeTypes(program);
+
+  auto dump = Dump(*program);
+  ASSERT(Contains(dump, "StringComparison =="));
+  ASSERT(Contains(dump, "BoolNot"));
+  ASSERT(Contains(dump, "BoolOr"));
+  ASSERT(Contains(dump, "BoolAnd"));
+  ASSERT(Contains(dump, "TypedIfElse"));
+  ASSERT(Contains(dump, "StringConcat"));
+  ASSERT(!Contains(dump, "  IfElse"));
+  ASSERT_EQUAL(Execute(*program), "yes\naa\n");
+}
+
+void TestEnginesGiveSameOutput() {
+  const string program = R"(
+class Fib:
+  def __init__():
+    self.calls = 0
+
+  def of(n):
+    if n < 2:
+      return n
+    return self.of(n - 1) + self.of(n - 2)
+
+class Acc:
+  def __init__():
+    self.sum = 0
+    self.text = ''
+
+  def add(k):
+    self.sum = self.sum + k * 2
+    self.text = self.text + str(k)
+    return self.sum > 10
+
+f = Fib()
+a = Acc()
+print f.of(15), a.add(3), a.add(4), a.sum, a.text
+)";
+  for (bool infer : {false, true}) {
+    for (Engine engine : {Engine::Tree, Engine::Stack}) {
+      istringstream input(program);
+      ostringstream output;
+      RunOptions options;
+      options.infer_types = infer;
+      options.engine = engine;
+      RunMythonProgram(input, output, options);
+      ASSERT_EQUAL(output.str(), "610 False True 14 34\n");
+    }
+  }
+}
+
+void RunTypeInferenceTests(TestRunner& tr) {
+  RUN_TEST(tr, Ast::TestNumericCodeIsSpecialized);
+  RUN_TEST(tr, Ast::TestFieldTypesAreInferredPerClass);
+  RUN_TEST(tr, Ast::TestForeignWritesAreSeen);
+  RUN_TEST(tr, Ast::TestParametersAreNotTyped);
+  RUN_TEST(tr, Ast::TestMaybeNoneIsNotSpecialized);
+  RUN_TEST(tr, Ast::TestBoolsAndConditionsAreSpecialized);
+  RUN_TEST(tr, Ast::TestEnginesGiveSameOutput);
+}
+
+} /* namespace Ast */